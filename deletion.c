@@ -0,0 +1,84 @@
+#include <string.h>
+#include "deletion.h"
+#include "renderer.h"
+#include "heap.h"
+#include "log.h"
+
+void init_deletion_queue(deletion_queue_t *queue, VkDevice device) {
+  queue->device = device;
+  queue->capacity = DELETION_QUEUE_CAPACITY;
+  queue->deletions = halloc_type(deletion_t, queue->capacity);
+  queue->num_deletions = 0;
+}
+
+// Null handles are ignored, so callers needn't check whether an object was ever created
+void queue_deletion(deletion_queue_t *queue, VkObjectType type, uint64_t handle, uint64_t frame) {
+  if (!handle)
+    return;
+  if (queue->num_deletions == queue->capacity) {
+    deletion_t *deletions = halloc_type(deletion_t, queue->capacity * 2);
+    memcpy(deletions, queue->deletions, queue->num_deletions * sizeof (deletion_t));
+    hfree(queue->deletions);
+    queue->deletions = deletions;
+    queue->capacity *= 2;
+  }
+  deletion_t *deletion = &queue->deletions[queue->num_deletions++];
+  deletion->type = type;
+  deletion->handle = handle;
+  deletion->frame = frame;
+}
+
+void destroy_object(VkDevice device, const deletion_t *deletion) {
+  switch (deletion->type) {
+    case VK_OBJECT_TYPE_BUFFER:
+      vkDestroyBuffer(device, (VkBuffer)deletion->handle, NULL);
+      break;
+    case VK_OBJECT_TYPE_IMAGE:
+      vkDestroyImage(device, (VkImage)deletion->handle, NULL);
+      break;
+    case VK_OBJECT_TYPE_IMAGE_VIEW:
+      vkDestroyImageView(device, (VkImageView)deletion->handle, NULL);
+      break;
+    case VK_OBJECT_TYPE_DEVICE_MEMORY:
+      free_device_memory((VkDeviceMemory)deletion->handle);
+      break;
+    case VK_OBJECT_TYPE_FRAMEBUFFER:
+      vkDestroyFramebuffer(device, (VkFramebuffer)deletion->handle, NULL);
+      break;
+    case VK_OBJECT_TYPE_RENDER_PASS:
+      vkDestroyRenderPass(device, (VkRenderPass)deletion->handle, NULL);
+      break;
+    case VK_OBJECT_TYPE_PIPELINE:
+      vkDestroyPipeline(device, (VkPipeline)deletion->handle, NULL);
+      break;
+    case VK_OBJECT_TYPE_SAMPLER:
+      vkDestroySampler(device, (VkSampler)deletion->handle, NULL);
+      break;
+    case VK_OBJECT_TYPE_SWAPCHAIN_KHR:
+      vkDestroySwapchainKHR(device, (VkSwapchainKHR)deletion->handle, NULL);
+      break;
+    default:
+      log_console_error("Can't destroy deferred object of type %d", deletion->type);
+  }
+}
+
+// Destroy the objects whose frames are no later than completed, returning how many there were
+uint32_t release_deletions(deletion_queue_t *queue, uint64_t completed) {
+  uint32_t count;
+  for (count = 0; count < queue->num_deletions && queue->deletions[count].frame <= completed; count++)
+    destroy_object(queue->device, &queue->deletions[count]);
+  if (count) {
+    queue->num_deletions -= count;
+    memmove(queue->deletions, &queue->deletions[count], queue->num_deletions * sizeof (deletion_t));
+    LOG_DEBUG_INFO("Destroyed %d deferred objects up to frame %llu", count, completed);
+  }
+  return count;
+}
+
+// Destroys everything still queued, so the device must be idle
+void destroy_deletion_queue(deletion_queue_t *queue) {
+  release_deletions(queue, UINT64_MAX);
+  hfree(queue->deletions);
+  queue->deletions = NULL;
+  queue->capacity = 0;
+}
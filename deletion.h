@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+
+#define DELETION_QUEUE_CAPACITY 64 // Initial capacity, grows as required
+
+typedef struct {
+  VkObjectType type;
+  uint64_t handle; // Non-dispatchable handle, as in VkDebugUtilsObjectNameInfoEXT
+  uint64_t frame; // Latest frame that may use it
+} deletion_t;
+
+// Objects replaced while frames are in flight, destroyed in the order they were queued once the
+// frames that may use them have completed, so replacing them never idles the device. Frames are
+// queued in order, so the ready deletions are always at the front
+typedef struct {
+  VkDevice device;
+  deletion_t *deletions;
+  uint32_t num_deletions;
+  uint32_t capacity;
+} deletion_queue_t;
+
+void init_deletion_queue(deletion_queue_t *, VkDevice);
+void queue_deletion(deletion_queue_t *, VkObjectType, uint64_t, uint64_t);
+uint32_t release_deletions(deletion_queue_t *, uint64_t);
+void destroy_deletion_queue(deletion_queue_t *);
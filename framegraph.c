@@ -0,0 +1,635 @@
+#include <string.h>
+#include "framegraph.h"
+#include "renderer.h"
+#include "log.h"
+
+// How each FG_USAGE is synchronized, and the usage flags transient resources are created with
+typedef struct {
+  VkPipelineStageFlags2KHR stage;
+  VkAccessFlags2KHR access;
+  VkImageLayout layout;
+  bool reads;
+  bool writes;
+  bool attachment; // Only lives within a render pass
+  VkImageUsageFlags image_usage;
+  VkBufferUsageFlags buffer_usage;
+} fg_usage_info_t;
+
+// Indexed by FG_USAGE. The legacy stage and access flags have the same values as their
+// synchronization2 equivalents and, unlike those, are constant expressions in C
+const fg_usage_info_t fg_usages[] = {
+  {
+    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+    VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    false, true, true,
+    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, 0
+  },
+  {
+    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    true, true, true,
+    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 0
+  },
+  {
+    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+    VK_ACCESS_SHADER_READ_BIT,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    true, false, false,
+    VK_IMAGE_USAGE_SAMPLED_BIT, 0
+  },
+  {
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_ACCESS_SHADER_READ_BIT,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    true, false, false,
+    VK_IMAGE_USAGE_SAMPLED_BIT, 0
+  },
+  {
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_ACCESS_SHADER_READ_BIT,
+    VK_IMAGE_LAYOUT_GENERAL,
+    true, false, false,
+    VK_IMAGE_USAGE_STORAGE_BIT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+  },
+  {
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_ACCESS_SHADER_WRITE_BIT,
+    VK_IMAGE_LAYOUT_GENERAL,
+    false, true, false,
+    VK_IMAGE_USAGE_STORAGE_BIT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+  },
+  {
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    VK_IMAGE_LAYOUT_GENERAL,
+    true, true, false,
+    VK_IMAGE_USAGE_STORAGE_BIT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+  },
+  {
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    true, false, false,
+    VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+  },
+  {
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    false, true, false,
+    VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_BUFFER_USAGE_TRANSFER_DST_BIT
+  },
+  {
+    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+    VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+    VK_IMAGE_LAYOUT_UNDEFINED, // Buffers only
+    true, false, false,
+    0, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+  },
+  {
+    // The present engine waits on a semaphore, so nothing later in the queue is ordered after it
+    0,
+    0,
+    VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+    true, false, false,
+    0, 0
+  }
+};
+
+// Synchronization state of a resource while a frame is recorded
+typedef struct {
+  VkImageLayout layout;
+  VkPipelineStageFlags2KHR write_stages; // Of the last write or layout transition
+  VkAccessFlags2KHR write_access;
+  VkPipelineStageFlags2KHR read_stages; // Since then, which the next write waits for
+  VkPipelineStageFlags2KHR visible_stages; // Already synchronized with the last write
+  VkAccessFlags2KHR visible_access;
+} fg_track_t;
+
+// Barriers recorded together before a pass
+typedef struct {
+  VkImageMemoryBarrier2KHR images[FG_MAX_RESOURCES];
+  uint32_t num_images;
+  VkBufferMemoryBarrier2KHR buffers[FG_MAX_RESOURCES];
+  uint32_t num_buffers;
+} fg_batch_t;
+
+void fg_init(frame_graph_t *graph, VkDevice device, PFN_vkCmdPipelineBarrier2KHR pipeline_barrier2) {
+  memset(graph, 0, sizeof (frame_graph_t));
+  graph->device = device;
+  graph->pipeline_barrier2 = pipeline_barrier2;
+}
+
+uint32_t fg_add_resource(frame_graph_t *graph, const char *name, bool is_image, bool imported) {
+  if (graph->num_resources == FG_MAX_RESOURCES) {
+    LOG_DEBUG_ERROR("Frame graph resource limit reached adding %s", name);
+    return FG_NONE;
+  }
+  fg_resource_t *resource = &graph->resources[graph->num_resources];
+  memset(resource, 0, sizeof (fg_resource_t));
+  resource->name = name;
+  resource->is_image = is_image;
+  resource->imported = imported;
+  resource->block = FG_NONE;
+  resource->first_pass = FG_NONE;
+  return graph->num_resources++;
+}
+
+uint32_t fg_create_image(frame_graph_t *graph, const char *name, VkFormat format, VkExtent2D extent,
+                         VkSampleCountFlagBits samples, VkImageAspectFlags aspect) {
+  uint32_t index = fg_add_resource(graph, name, true, false);
+  if (index != FG_NONE) {
+    fg_resource_t *resource = &graph->resources[index];
+    resource->format = format;
+    resource->extent = extent;
+    resource->samples = samples;
+    resource->aspect = aspect;
+  }
+  return index;
+}
+
+uint32_t fg_create_buffer(frame_graph_t *graph, const char *name, VkDeviceSize size) {
+  uint32_t index = fg_add_resource(graph, name, false, false);
+  if (index != FG_NONE)
+    graph->resources[index].size = size;
+  return index;
+}
+
+// With initial, the resource is in that state at the start of each frame; otherwise it's
+// assumed to be as this frame leaves it, which suits resources only the graph uses
+uint32_t fg_import_image(frame_graph_t *graph, const char *name, VkImageAspectFlags aspect, const fg_state_t *initial) {
+  uint32_t index = fg_add_resource(graph, name, true, true);
+  if (index != FG_NONE) {
+    fg_resource_t *resource = &graph->resources[index];
+    resource->aspect = aspect;
+    resource->has_initial = initial != NULL;
+    if (initial)
+      resource->initial = *initial;
+  }
+  return index;
+}
+
+uint32_t fg_import_buffer(frame_graph_t *graph, const char *name) {
+  return fg_add_resource(graph, name, false, true);
+}
+
+// The resource is used after the frame, so it's left in final_usage's state
+void fg_export(frame_graph_t *graph, uint32_t resource, FG_USAGE final_usage) {
+  graph->resources[resource].exported = true;
+  graph->resources[resource].final_usage = final_usage;
+}
+
+uint32_t fg_add_pass(frame_graph_t *graph, const char *name, void (*record)(VkCommandBuffer, void *)) {
+  if (graph->num_passes == FG_MAX_PASSES) {
+    LOG_DEBUG_ERROR("Frame graph pass limit reached adding %s", name);
+    return FG_NONE;
+  }
+  fg_pass_t *pass = &graph->passes[graph->num_passes];
+  memset(pass, 0, sizeof (fg_pass_t));
+  pass->name = name;
+  pass->record = record;
+  pass->enabled = true;
+  return graph->num_passes++;
+}
+
+// Passes use resources in the order they were added, which is the order they're recorded in
+void fg_use(frame_graph_t *graph, uint32_t pass_index, uint32_t resource_index, FG_USAGE usage) {
+  fg_pass_t *pass = &graph->passes[pass_index];
+  if (pass->num_uses == FG_MAX_USES) {
+    LOG_DEBUG_ERROR("Frame graph pass %s uses too many resources", pass->name);
+    return;
+  }
+  pass->uses[pass->num_uses].resource = resource_index;
+  pass->uses[pass->num_uses].usage = usage;
+  pass->num_uses++;
+  fg_resource_t *resource = &graph->resources[resource_index];
+  if (resource->first_pass == FG_NONE)
+    resource->first_pass = pass_index;
+  resource->last_pass = pass_index;
+}
+
+// Disabled passes are skipped, and so are passes that only fed them
+void fg_enable_pass(frame_graph_t *graph, uint32_t pass, bool enabled) {
+  if (pass < graph->num_passes)
+    graph->passes[pass].enabled = enabled;
+}
+
+bool fg_lifetimes_overlap(const fg_resource_t *a, const fg_resource_t *b) {
+  return a->first_pass <= b->last_pass && b->first_pass <= a->last_pass;
+}
+
+// Put a transient in the first block of its kind whose memory type it can use and whose
+// resources are all dead while it's alive, or in a new block
+// Depth and colour attachments are tracked apart, with the frame graph's buffers as draw memory
+MEMORY_CATEGORY fg_memory_category(const fg_resource_t *resource) {
+  if (!resource->is_image)
+    return MEMORY_CATEGORY_DRAW;
+  return resource->aspect & VK_IMAGE_ASPECT_DEPTH_BIT ? MEMORY_CATEGORY_DEPTH : MEMORY_CATEGORY_COLOUR;
+}
+
+void fg_assign_block(frame_graph_t *graph, uint32_t index) {
+  fg_resource_t *resource = &graph->resources[index];
+  const VkMemoryRequirements *requirements = &resource->requirements;
+  uint32_t b;
+  for (b = 0; b < graph->num_blocks; b++) {
+    fg_block_t *block = &graph->blocks[b];
+    if (block->is_image != resource->is_image ||
+        find_memory_type(block->type_bits & requirements->memoryTypeBits,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) == VK_MAX_MEMORY_TYPES)
+      continue;
+    uint32_t i;
+    for (i = 0; i < graph->num_resources; i++)
+      if (graph->resources[i].block == b && fg_lifetimes_overlap(&graph->resources[i], resource))
+        break;
+    if (i == graph->num_resources)
+      break;
+  }
+  fg_block_t *block = &graph->blocks[b];
+  if (b == graph->num_blocks) {
+    graph->num_blocks++;
+    block->is_image = resource->is_image;
+    block->type_bits = requirements->memoryTypeBits;
+    block->category = fg_memory_category(resource);
+  }
+  else {
+    block->type_bits &= requirements->memoryTypeBits;
+    if (block->category != fg_memory_category(resource))
+      block->category = MEMORY_CATEGORY_ALIASED;
+  }
+  if (requirements->size > block->size)
+    block->size = requirements->size;
+  if (requirements->alignment > block->alignment)
+    block->alignment = requirements->alignment;
+  resource->block = b;
+}
+
+// Create the transient resources with the usage flags their uses need. Those only used as
+// attachments get lazily allocated memory of their own where there is any; the rest are placed,
+// largest first, in blocks shared by resources whose lifetimes don't overlap
+void fg_compile(frame_graph_t *graph) {
+  VkImageUsageFlags image_usage[FG_MAX_RESOURCES] = { 0 };
+  VkBufferUsageFlags buffer_usage[FG_MAX_RESOURCES] = { 0 };
+  bool attachment_only[FG_MAX_RESOURCES];
+  uint32_t i, j;
+  for (i = 0; i < graph->num_resources; i++)
+    attachment_only[i] = true;
+  for (i = 0; i < graph->num_passes; i++) {
+    const fg_pass_t *pass = &graph->passes[i];
+    for (j = 0; j < pass->num_uses; j++) {
+      const fg_usage_info_t *info = &fg_usages[pass->uses[j].usage];
+      image_usage[pass->uses[j].resource] |= info->image_usage;
+      buffer_usage[pass->uses[j].resource] |= info->buffer_usage;
+      attachment_only[pass->uses[j].resource] &= info->attachment;
+    }
+  }
+
+  uint32_t order[FG_MAX_RESOURCES], num_aliased = 0;
+  const VkFlags lazy_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+  for (i = 0; i < graph->num_resources; i++) {
+    fg_resource_t *resource = &graph->resources[i];
+    if (resource->imported || resource->first_pass == FG_NONE)
+      continue;
+    if (resource->is_image) {
+      VK_CALL(create_image(graph->device, resource->format, resource->extent.width, resource->extent.height,
+                           resource->samples, VK_IMAGE_TILING_OPTIMAL,
+                           attachment_only[i] ? image_usage[i] | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : image_usage[i],
+                           &resource->image));
+      vkGetImageMemoryRequirements(graph->device, resource->image, &resource->requirements);
+    }
+    else {
+      VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+      buffer_info.size = resource->size;
+      buffer_info.usage = buffer_usage[i];
+      VK_CALL(vkCreateBuffer(graph->device, &buffer_info, NULL, &resource->buffer));
+      vkGetBufferMemoryRequirements(graph->device, resource->buffer, &resource->requirements);
+    }
+    graph->transient_size += resource->requirements.size;
+    resource->lazy = resource->is_image && attachment_only[i] &&
+                     find_memory_type(resource->requirements.memoryTypeBits, lazy_flags) < VK_MAX_MEMORY_TYPES;
+    if (resource->lazy) {
+      alloc_device_memory(resource->requirements, lazy_flags, fg_memory_category(resource), &resource->memory);
+      VK_CALL(vkBindImageMemory(graph->device, resource->image, resource->memory, 0));
+      graph->allocated_size += resource->requirements.size;
+      graph->lazy_size += resource->requirements.size;
+      continue;
+    }
+    // Insertion sort, largest first, so smaller resources fill in around the big ones
+    for (j = num_aliased; j && graph->resources[order[j - 1]].requirements.size < resource->requirements.size; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+    num_aliased++;
+  }
+
+  for (i = 0; i < num_aliased; i++)
+    fg_assign_block(graph, order[i]);
+  for (i = 0; i < graph->num_blocks; i++) {
+    fg_block_t *block = &graph->blocks[i];
+    VkMemoryRequirements requirements = { block->size, block->alignment, block->type_bits };
+    alloc_device_memory(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, block->category, &block->memory);
+    graph->allocated_size += block->size;
+  }
+
+  for (i = 0; i < num_aliased; i++) {
+    fg_resource_t *resource = &graph->resources[order[i]];
+    VkDeviceMemory memory = graph->blocks[resource->block].memory;
+    if (resource->is_image)
+      VK_CALL(vkBindImageMemory(graph->device, resource->image, memory, 0));
+    else
+      VK_CALL(vkBindBufferMemory(graph->device, resource->buffer, memory, 0));
+  }
+  for (i = 0; i < graph->num_resources; i++) {
+    fg_resource_t *resource = &graph->resources[i];
+    if (resource->is_image && resource->image && !resource->imported)
+      VK_CALL(create_image_view(graph->device, resource->image, resource->format, resource->aspect, &resource->view));
+  }
+  graph->compiled = true;
+  LOG_DEBUG_INFO("Compiled frame graph: %d passes, %d resources, %llu bytes of transients in %llu bytes",
+                 graph->num_passes, graph->num_resources, graph->transient_size, graph->allocated_size);
+}
+
+// Imported resources are bound to their handles before each fg_execute
+void fg_bind_image(frame_graph_t *graph, uint32_t resource, VkImage image) {
+  graph->resources[resource].image = image;
+}
+
+void fg_bind_buffer(frame_graph_t *graph, uint32_t resource, VkBuffer buffer) {
+  graph->resources[resource].buffer = buffer;
+}
+
+VkImage fg_image(const frame_graph_t *graph, uint32_t resource) {
+  return resource < graph->num_resources ? graph->resources[resource].image : VK_NULL_HANDLE;
+}
+
+VkImageView fg_view(const frame_graph_t *graph, uint32_t resource) {
+  return resource < graph->num_resources ? graph->resources[resource].view : VK_NULL_HANDLE;
+}
+
+VkBuffer fg_buffer(const frame_graph_t *graph, uint32_t resource) {
+  return resource < graph->num_resources ? graph->resources[resource].buffer : VK_NULL_HANDLE;
+}
+
+// Walk back from the exported resources: a pass is live if it's enabled and writes something a
+// later live pass reads or that's exported. Writes that don't read cut off earlier writers
+void fg_cull(frame_graph_t *graph) {
+  bool needed[FG_MAX_RESOURCES];
+  uint32_t i, j;
+  for (i = 0; i < graph->num_resources; i++)
+    needed[i] = graph->resources[i].exported;
+  graph->num_culled = 0;
+  for (i = graph->num_passes; i--;) {
+    fg_pass_t *pass = &graph->passes[i];
+    pass->live = false;
+    if (!pass->enabled)
+      continue;
+    for (j = 0; j < pass->num_uses; j++)
+      if (fg_usages[pass->uses[j].usage].writes && needed[pass->uses[j].resource])
+        pass->live = true;
+    if (!pass->live) {
+      graph->num_culled++;
+      continue;
+    }
+    for (j = 0; j < pass->num_uses; j++)
+      if (!fg_usages[pass->uses[j].usage].reads)
+        needed[pass->uses[j].resource] = false;
+    for (j = 0; j < pass->num_uses; j++)
+      if (fg_usages[pass->uses[j].usage].reads)
+        needed[pass->uses[j].resource] = true;
+  }
+}
+
+// Depth formats with stencil have to transition both aspects together
+VkImageAspectFlags fg_barrier_aspect(const fg_resource_t *resource) {
+  switch (resource->format) {
+  case VK_FORMAT_D16_UNORM_S8_UINT:
+  case VK_FORMAT_D24_UNORM_S8_UINT:
+  case VK_FORMAT_D32_SFLOAT_S8_UINT:
+    return resource->aspect | VK_IMAGE_ASPECT_STENCIL_BIT;
+  default:
+    return resource->aspect;
+  }
+}
+
+// Where a resource starts the frame. Transients start undefined once everything else that used
+// their memory, last frame or earlier in this one, is done with it
+void fg_initial_track(const frame_graph_t *graph, uint32_t index, fg_track_t *track) {
+  const fg_resource_t *resource = &graph->resources[index];
+  memset(track, 0, sizeof (fg_track_t));
+  uint32_t i, j;
+  if (resource->has_initial) {
+    track->layout = resource->initial.layout;
+    track->write_stages = resource->initial.stage;
+    track->write_access = resource->initial.access;
+    return;
+  }
+  if (resource->imported) {
+    // Left as this frame's last live use leaves it; a reader passes on its writer's dependency
+    for (i = graph->num_passes; i--;) {
+      const fg_pass_t *pass = &graph->passes[i];
+      if (!pass->live)
+        continue;
+      for (j = 0; j < pass->num_uses; j++) {
+        if (pass->uses[j].resource != index)
+          continue;
+        const fg_usage_info_t *info = &fg_usages[pass->uses[j].usage];
+        track->layout = info->layout;
+        track->write_stages = info->stage;
+        if (info->writes)
+          track->write_access = info->access;
+        else {
+          track->visible_stages = info->stage;
+          track->visible_access = info->access;
+        }
+        return;
+      }
+    }
+    return;
+  }
+  track->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+  for (i = 0; i < graph->num_resources; i++) {
+    const fg_resource_t *other = &graph->resources[i];
+    if (i != index && (resource->block == FG_NONE || other->block != resource->block))
+      continue;
+    for (j = 0; j < graph->num_passes; j++) {
+      const fg_pass_t *pass = &graph->passes[j];
+      for (uint32_t k = 0; k < pass->num_uses; k++) {
+        if (pass->uses[k].resource != i)
+          continue;
+        const fg_usage_info_t *info = &fg_usages[pass->uses[k].usage];
+        track->write_stages |= info->stage;
+        if (info->writes)
+          track->write_access |= info->access;
+      }
+    }
+  }
+}
+
+// Add the barrier, if any, needed before resource is used with usage
+void fg_transition(const frame_graph_t *graph, uint32_t index, FG_USAGE usage, fg_track_t *track, fg_batch_t *batch) {
+  const fg_resource_t *resource = &graph->resources[index];
+  const fg_usage_info_t *info = &fg_usages[usage];
+  bool layout_change = resource->is_image && track->layout != info->layout;
+  VkPipelineStageFlags2KHR src_stages;
+  VkAccessFlags2KHR src_access = track->write_access;
+  if (layout_change || info->writes) {
+    // Writes, and layout transitions, wait for earlier reads as well as the last write
+    src_stages = track->write_stages | track->read_stages;
+    track->write_stages = info->stage;
+    track->write_access = info->writes ? info->access : 0;
+    track->read_stages = 0;
+    track->visible_stages = info->stage;
+    track->visible_access = info->access;
+  }
+  else if ((info->stage & ~track->visible_stages) || (info->access & ~track->visible_access)) {
+    src_stages = track->write_stages;
+    track->read_stages |= info->stage;
+    track->visible_stages |= info->stage;
+    track->visible_access |= info->access;
+  }
+  else {
+    track->read_stages |= info->stage;
+    return;
+  }
+
+  if (resource->is_image) {
+    VkImageMemoryBarrier2KHR *barrier = &batch->images[batch->num_images++];
+    memset(barrier, 0, sizeof (VkImageMemoryBarrier2KHR));
+    barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+    barrier->srcStageMask = src_stages;
+    barrier->srcAccessMask = src_access;
+    barrier->dstStageMask = info->stage;
+    barrier->dstAccessMask = info->access;
+    barrier->oldLayout = track->layout;
+    barrier->newLayout = info->layout;
+    barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->image = resource->image;
+    barrier->subresourceRange.aspectMask = fg_barrier_aspect(resource);
+    barrier->subresourceRange.levelCount = 1;
+    barrier->subresourceRange.layerCount = 1;
+    track->layout = info->layout;
+  }
+  else {
+    VkBufferMemoryBarrier2KHR *barrier = &batch->buffers[batch->num_buffers++];
+    memset(barrier, 0, sizeof (VkBufferMemoryBarrier2KHR));
+    barrier->sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2_KHR;
+    barrier->srcStageMask = src_stages;
+    barrier->srcAccessMask = src_access;
+    barrier->dstStageMask = info->stage;
+    barrier->dstAccessMask = info->access;
+    barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->buffer = resource->buffer;
+    barrier->size = VK_WHOLE_SIZE;
+  }
+}
+
+// One vkCmdPipelineBarrier2 for the batch. Without synchronization2 it's a vkCmdPipelineBarrier
+// on the union of the stages, since the legacy flags share the new flags' low bits
+void fg_flush(frame_graph_t *graph, VkCommandBuffer command_buffer, fg_batch_t *batch) {
+  if (!batch->num_images && !batch->num_buffers)
+    return;
+  graph->num_barriers += batch->num_images + batch->num_buffers;
+  if (graph->pipeline_barrier2) {
+    VkDependencyInfoKHR dependency_info = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR };
+    dependency_info.bufferMemoryBarrierCount = batch->num_buffers;
+    dependency_info.pBufferMemoryBarriers = batch->buffers;
+    dependency_info.imageMemoryBarrierCount = batch->num_images;
+    dependency_info.pImageMemoryBarriers = batch->images;
+    graph->pipeline_barrier2(command_buffer, &dependency_info);
+  }
+  else {
+    VkImageMemoryBarrier image_barriers[FG_MAX_RESOURCES];
+    VkBufferMemoryBarrier buffer_barriers[FG_MAX_RESOURCES];
+    VkPipelineStageFlags src_stages = 0, dst_stages = 0;
+    uint32_t i;
+    for (i = 0; i < batch->num_images; i++) {
+      const VkImageMemoryBarrier2KHR *barrier = &batch->images[i];
+      VkImageMemoryBarrier *legacy = &image_barriers[i];
+      legacy->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      legacy->pNext = NULL;
+      legacy->srcAccessMask = (VkAccessFlags)barrier->srcAccessMask;
+      legacy->dstAccessMask = (VkAccessFlags)barrier->dstAccessMask;
+      legacy->oldLayout = barrier->oldLayout;
+      legacy->newLayout = barrier->newLayout;
+      legacy->srcQueueFamilyIndex = barrier->srcQueueFamilyIndex;
+      legacy->dstQueueFamilyIndex = barrier->dstQueueFamilyIndex;
+      legacy->image = barrier->image;
+      legacy->subresourceRange = barrier->subresourceRange;
+      src_stages |= (VkPipelineStageFlags)barrier->srcStageMask;
+      dst_stages |= (VkPipelineStageFlags)barrier->dstStageMask;
+    }
+    for (i = 0; i < batch->num_buffers; i++) {
+      const VkBufferMemoryBarrier2KHR *barrier = &batch->buffers[i];
+      VkBufferMemoryBarrier *legacy = &buffer_barriers[i];
+      legacy->sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+      legacy->pNext = NULL;
+      legacy->srcAccessMask = (VkAccessFlags)barrier->srcAccessMask;
+      legacy->dstAccessMask = (VkAccessFlags)barrier->dstAccessMask;
+      legacy->srcQueueFamilyIndex = barrier->srcQueueFamilyIndex;
+      legacy->dstQueueFamilyIndex = barrier->dstQueueFamilyIndex;
+      legacy->buffer = barrier->buffer;
+      legacy->offset = barrier->offset;
+      legacy->size = barrier->size;
+      src_stages |= (VkPipelineStageFlags)barrier->srcStageMask;
+      dst_stages |= (VkPipelineStageFlags)barrier->dstStageMask;
+    }
+    vkCmdPipelineBarrier(
+      command_buffer,
+      src_stages ? src_stages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      dst_stages ? dst_stages : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      0, 0, NULL, batch->num_buffers, buffer_barriers, batch->num_images, image_barriers
+    );
+  }
+  batch->num_images = 0;
+  batch->num_buffers = 0;
+}
+
+// Record the live passes, each after one batch of barriers for the resources it uses, then
+// leave the exported resources in their final state
+void fg_execute(frame_graph_t *graph, VkCommandBuffer command_buffer, void *context) {
+  fg_track_t tracks[FG_MAX_RESOURCES];
+  fg_batch_t batch;
+  uint32_t i, j;
+  fg_cull(graph);
+  graph->num_barriers = 0;
+  batch.num_images = 0;
+  batch.num_buffers = 0;
+  for (i = 0; i < graph->num_resources; i++)
+    fg_initial_track(graph, i, &tracks[i]);
+
+  for (i = 0; i < graph->num_passes; i++) {
+    const fg_pass_t *pass = &graph->passes[i];
+    if (!pass->live)
+      continue;
+    for (j = 0; j < pass->num_uses; j++)
+      fg_transition(graph, pass->uses[j].resource, pass->uses[j].usage, &tracks[pass->uses[j].resource], &batch);
+    fg_flush(graph, command_buffer, &batch);
+    pass->record(command_buffer, context);
+  }
+
+  for (i = 0; i < graph->num_resources; i++)
+    if (graph->resources[i].exported)
+      fg_transition(graph, i, graph->resources[i].final_usage, &tracks[i], &batch);
+  fg_flush(graph, command_buffer, &batch);
+}
+
+// Frames in flight may still be using the transient resources, so they're destroyed once those
+// frames complete and the graph can be declared and compiled again straight away
+void fg_destroy(frame_graph_t *graph) {
+  uint32_t i;
+  for (i = 0; i < graph->num_resources; i++) {
+    fg_resource_t *resource = &graph->resources[i];
+    if (resource->imported)
+      continue;
+    defer_destroy(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)resource->view);
+    defer_destroy(VK_OBJECT_TYPE_IMAGE, (uint64_t)resource->image);
+    defer_destroy(VK_OBJECT_TYPE_BUFFER, (uint64_t)resource->buffer);
+    defer_destroy(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)resource->memory);
+  }
+  for (i = 0; i < graph->num_blocks; i++)
+    defer_destroy(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)graph->blocks[i].memory);
+  LOG_DEBUG_INFO("Retired frame graph: %d resources, %d memory blocks", graph->num_resources, graph->num_blocks);
+  fg_init(graph, graph->device, graph->pipeline_barrier2);
+}
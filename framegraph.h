@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "gpumem.h"
+
+#define FG_MAX_RESOURCES 16
+#define FG_MAX_PASSES 16
+#define FG_MAX_USES 8 // Per pass
+#define FG_NONE UINT32_MAX
+
+// How a pass uses a resource, which decides its layout and the barriers around the pass
+typedef enum {
+  FG_USAGE_COLOUR_ATTACHMENT,
+  FG_USAGE_DEPTH_ATTACHMENT,
+  FG_USAGE_FRAGMENT_SAMPLED,
+  FG_USAGE_COMPUTE_SAMPLED,
+  FG_USAGE_COMPUTE_READ,
+  FG_USAGE_COMPUTE_WRITE,
+  FG_USAGE_COMPUTE_READ_WRITE,
+  FG_USAGE_TRANSFER_SRC,
+  FG_USAGE_TRANSFER_DST,
+  FG_USAGE_INDIRECT,
+  FG_USAGE_PRESENT,
+  FG_USAGE_COUNT
+} FG_USAGE;
+
+typedef struct {
+  VkPipelineStageFlags2KHR stage;
+  VkAccessFlags2KHR access;
+  VkImageLayout layout;
+} fg_state_t;
+
+typedef struct {
+  const char *name;
+  bool is_image;
+  bool imported; // Handles are bound before each fg_execute, otherwise the graph creates them
+  bool exported; // Used after the frame, so its writers are never culled
+  FG_USAGE final_usage; // Of an exported resource, after the last pass
+  bool has_initial; // Otherwise the state it's left in by the previous frame
+  fg_state_t initial;
+  VkFormat format;
+  VkExtent2D extent;
+  VkSampleCountFlagBits samples;
+  VkImageAspectFlags aspect;
+  VkDeviceSize size; // Buffers
+  VkImage image;
+  VkImageView view;
+  VkBuffer buffer;
+  VkMemoryRequirements requirements;
+  VkDeviceMemory memory; // Its own lazily allocated memory, otherwise it's in a shared block
+  bool lazy;
+  uint32_t block; // Shared with other transients whose lifetimes don't overlap, or FG_NONE
+  uint32_t first_pass; // Lifetime over all declared passes, so aliasing doesn't change as
+  uint32_t last_pass;  // passes are enabled and disabled
+} fg_resource_t;
+
+typedef struct {
+  uint32_t resource;
+  FG_USAGE usage;
+} fg_use_t;
+
+typedef struct {
+  const char *name;
+  void (*record)(VkCommandBuffer, void *); // Called with fg_execute's context
+  fg_use_t uses[FG_MAX_USES];
+  uint32_t num_uses;
+  bool enabled;
+  bool live; // Enabled and contributes to an exported resource, set by fg_execute
+} fg_pass_t;
+
+// Device memory shared by transient resources
+typedef struct {
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  VkDeviceSize alignment;
+  uint32_t type_bits;
+  bool is_image; // Buffers and images are kept apart
+  MEMORY_CATEGORY category; // Of its resources, or MEMORY_CATEGORY_ALIASED if they differ
+} fg_block_t;
+
+// Passes declare the resources they read and write. Compiling creates the transient resources,
+// aliasing the memory of those whose lifetimes don't overlap; executing culls passes whose
+// writes are never used and records the rest with batched barriers between them
+typedef struct {
+  VkDevice device;
+  PFN_vkCmdPipelineBarrier2KHR pipeline_barrier2; // Without synchronization2, vkCmdPipelineBarrier
+  fg_resource_t resources[FG_MAX_RESOURCES];
+  uint32_t num_resources;
+  fg_pass_t passes[FG_MAX_PASSES];
+  uint32_t num_passes;
+  fg_block_t blocks[FG_MAX_RESOURCES];
+  uint32_t num_blocks;
+  bool compiled;
+  VkDeviceSize transient_size; // Transient memory needed without aliasing
+  VkDeviceSize allocated_size; // Transient memory allocated
+  VkDeviceSize lazy_size; // Of that, lazily allocated and possibly never backed
+  uint32_t num_culled; // By the last fg_execute
+  uint32_t num_barriers; // Recorded by the last fg_execute
+} frame_graph_t;
+
+void fg_init(frame_graph_t *, VkDevice, PFN_vkCmdPipelineBarrier2KHR);
+uint32_t fg_create_image(frame_graph_t *, const char *, VkFormat, VkExtent2D, VkSampleCountFlagBits, VkImageAspectFlags);
+uint32_t fg_create_buffer(frame_graph_t *, const char *, VkDeviceSize);
+uint32_t fg_import_image(frame_graph_t *, const char *, VkImageAspectFlags, const fg_state_t *);
+uint32_t fg_import_buffer(frame_graph_t *, const char *);
+void fg_export(frame_graph_t *, uint32_t, FG_USAGE);
+uint32_t fg_add_pass(frame_graph_t *, const char *, void (*)(VkCommandBuffer, void *));
+void fg_use(frame_graph_t *, uint32_t, uint32_t, FG_USAGE);
+void fg_enable_pass(frame_graph_t *, uint32_t, bool);
+void fg_compile(frame_graph_t *);
+void fg_bind_image(frame_graph_t *, uint32_t, VkImage);
+void fg_bind_buffer(frame_graph_t *, uint32_t, VkBuffer);
+VkImage fg_image(const frame_graph_t *, uint32_t);
+VkImageView fg_view(const frame_graph_t *, uint32_t);
+VkBuffer fg_buffer(const frame_graph_t *, uint32_t);
+void fg_execute(frame_graph_t *, VkCommandBuffer, void *);
+void fg_destroy(frame_graph_t *);
@@ -0,0 +1,420 @@
+#include <stdlib.h>
+#include <string.h>
+#include "gltf.h"
+#include "heap.h"
+#include "log.h"
+
+const char *GLTF_ERRORS[] = {
+  "OK",
+  "Could not open model file",
+  "Could not map model file",
+  "Invalid GLB signature",
+  "Invalid GLB chunk",
+  "Invalid JSON",
+  "Unsupported glTF feature",
+  "Accessor out of range"
+};
+
+/* Minimal JSON tokenizer - just enough structure to walk the glTF document in place */
+
+typedef enum {
+  JSON_OBJECT,
+  JSON_ARRAY,
+  JSON_STRING,
+  JSON_PRIMITIVE
+} JSON_TYPE;
+
+typedef struct {
+  JSON_TYPE type;
+  uint32_t start;
+  uint32_t end;
+  uint32_t size; // Children; an object's keys and values are both counted
+  uint32_t skip; // Index of the next token after this one's descendants
+  int parent;
+} json_token_t;
+
+typedef struct {
+  const char *js;
+  json_token_t *tokens;
+  uint32_t num_tokens;
+} json_t;
+
+json_token_t *json_push(json_t *json, JSON_TYPE type, uint32_t start, int parent) {
+  json_token_t *token = &json->tokens[json->num_tokens];
+  token->type = type;
+  token->start = start;
+  token->end = start;
+  token->size = 0;
+  token->parent = parent;
+  if (parent >= 0)
+    json->tokens[parent].size++;
+  json->num_tokens++;
+  token->skip = json->num_tokens;
+  return token;
+}
+
+// Tokens are a pre-order flattening of the document; every token starts at a different
+// character, so length + 1 tokens always suffice
+bool json_parse(json_t *json, const char *js, uint32_t length) {
+  json->js = js;
+  json->tokens = halloc_type(json_token_t, (size_t)length + 1);
+  json->num_tokens = 0;
+  int parent = -1;
+  for (uint32_t pos = 0; pos < length; pos++) {
+    char c = js[pos];
+    switch (c) {
+      case '{':
+      case '[':
+        json_push(json, c == '{' ? JSON_OBJECT : JSON_ARRAY, pos, parent);
+        parent = json->num_tokens - 1;
+        break;
+      case '}':
+      case ']':
+        if (parent < 0 || json->tokens[parent].type != (c == '}' ? JSON_OBJECT : JSON_ARRAY))
+          return false;
+        json->tokens[parent].end = pos + 1;
+        json->tokens[parent].skip = json->num_tokens;
+        parent = json->tokens[parent].parent;
+        break;
+      case '"': {
+        json_token_t *token = json_push(json, JSON_STRING, pos + 1, parent);
+        for (pos++; pos < length && js[pos] != '"'; pos++)
+          if (js[pos] == '\\')
+            pos++;
+        if (pos >= length)
+          return false;
+        token->end = pos;
+        break;
+      }
+      case ' ': case '\t': case '\r': case '\n': case ':': case ',': case '\0':
+        break;
+      default: {
+        json_token_t *token = json_push(json, JSON_PRIMITIVE, pos, parent);
+        while (pos < length && !strchr(" \t\r\n:,]}", js[pos]))
+          pos++;
+        token->end = pos--;
+        break;
+      }
+    }
+  }
+  return parent == -1 && json->num_tokens && json->tokens[0].type == JSON_OBJECT;
+}
+
+// Value of key in object, or -1
+int json_key(json_t *json, int object, const char *key) {
+  if (object < 0 || json->tokens[object].type != JSON_OBJECT)
+    return -1;
+  size_t length = strlen(key);
+  uint32_t i = object + 1;
+  for (uint32_t n = 0; n < json->tokens[object].size / 2; n++) {
+    json_token_t *name = &json->tokens[i];
+    if (name->end - name->start == length && !strncmp(json->js + name->start, key, length))
+      return i + 1;
+    i = json->tokens[i + 1].skip;
+  }
+  return -1;
+}
+
+// Element of array, or -1
+int json_index(json_t *json, int array, uint32_t index) {
+  if (array < 0 || json->tokens[array].type != JSON_ARRAY || index >= json->tokens[array].size)
+    return -1;
+  uint32_t i = array + 1;
+  while (index--)
+    i = json->tokens[i].skip;
+  return i;
+}
+
+uint32_t json_uint(json_t *json, int token, uint32_t default_value) {
+  if (token < 0 || json->tokens[token].type != JSON_PRIMITIVE)
+    return default_value;
+  return strtoul(json->js + json->tokens[token].start, NULL, 10);
+}
+
+bool json_equals(json_t *json, int token, const char *value) {
+  return token >= 0 &&
+         json->tokens[token].end - json->tokens[token].start == strlen(value) &&
+         !strncmp(json->js + json->tokens[token].start, value, strlen(value));
+}
+
+/* glTF */
+
+uint32_t component_size(uint32_t component_type) {
+  switch (component_type) {
+    case GLTF_BYTE:
+    case GLTF_UNSIGNED_BYTE:
+      return 1;
+    case GLTF_SHORT:
+    case GLTF_UNSIGNED_SHORT:
+      return 2;
+    case GLTF_UNSIGNED_INT:
+    case GLTF_FLOAT:
+      return 4;
+  }
+  return 0;
+}
+
+uint32_t num_components(json_t *json, int type) {
+  const char *types[] = { "SCALAR", "VEC2", "VEC3", "VEC4" };
+  for (uint32_t i = 0; i < 4; i++)
+    if (json_equals(json, type, types[i]))
+      return i + 1;
+  return 0;
+}
+
+// Resolve an accessor to its bytes in the BIN chunk, checking it lies within its buffer view
+GLTF_ERROR parse_accessor(json_t *json, uint32_t index, const uint8_t *bin, uint32_t bin_length,
+                          gltf_accessor_t *accessor) {
+  int token = json_index(json, json_key(json, 0, "accessors"), index);
+  if (token < 0)
+    return GE_JSON;
+  uint32_t view_index = json_uint(json, json_key(json, token, "bufferView"), UINT32_MAX);
+  if (view_index == UINT32_MAX || json_key(json, token, "sparse") >= 0)
+    return GE_UNSUPPORTED;
+  int view = json_index(json, json_key(json, 0, "bufferViews"), view_index);
+  if (view < 0)
+    return GE_JSON;
+  if (json_uint(json, json_key(json, view, "buffer"), 0))
+    return GE_UNSUPPORTED; // Only the GLB's own BIN chunk
+
+  accessor->count = json_uint(json, json_key(json, token, "count"), 0);
+  accessor->component_type = json_uint(json, json_key(json, token, "componentType"), 0);
+  accessor->num_components = num_components(json, json_key(json, token, "type"));
+  accessor->normalized = json_equals(json, json_key(json, token, "normalized"), "true");
+  uint32_t element_size = component_size(accessor->component_type) * accessor->num_components;
+  if (!element_size)
+    return GE_UNSUPPORTED;
+  accessor->stride = json_uint(json, json_key(json, view, "byteStride"), element_size);
+
+  uint64_t view_offset = json_uint(json, json_key(json, view, "byteOffset"), 0),
+           view_length = json_uint(json, json_key(json, view, "byteLength"), 0),
+           offset = json_uint(json, json_key(json, token, "byteOffset"), 0);
+  if (view_offset + view_length > bin_length ||
+      (accessor->count && offset + (uint64_t)accessor->stride * (accessor->count - 1) + element_size > view_length))
+    return GE_ACCESSOR;
+  accessor->data = bin + view_offset + offset;
+  return GE_OK;
+}
+
+// Every index must name one of the primitive's vertices, or optimizing the mesh writes out of
+// bounds and the GPU reads past the vertex buffer
+bool indices_in_range(const gltf_accessor_t *accessor, uint32_t num_vertices) {
+  for (uint32_t i = 0; i < accessor->count; i++) {
+    const uint8_t *element = accessor->data + (size_t)accessor->stride * i;
+    uint32_t index;
+    switch (accessor->component_type) {
+      case GLTF_UNSIGNED_BYTE:
+        index = *element;
+        break;
+      case GLTF_UNSIGNED_SHORT:
+        index = *(const uint16_t *)element;
+        break;
+      default:
+        index = *(const uint32_t *)element;
+        break;
+    }
+    if (index >= num_vertices)
+      return false;
+  }
+  return true;
+}
+
+GLTF_ERROR parse_primitive(json_t *json, int token, const uint8_t *bin, uint32_t bin_length,
+                           gltf_primitive_t *primitive) {
+  GLTF_ERROR ge;
+  int attributes = json_key(json, token, "attributes");
+  uint32_t position = json_uint(json, json_key(json, attributes, "POSITION"), UINT32_MAX),
+           colour = json_uint(json, json_key(json, attributes, "COLOR_0"), UINT32_MAX),
+           texel = json_uint(json, json_key(json, attributes, "TEXCOORD_0"), UINT32_MAX),
+           indices = json_uint(json, json_key(json, token, "indices"), UINT32_MAX);
+  memset(primitive, 0, sizeof (gltf_primitive_t));
+  if (position == UINT32_MAX)
+    return GE_UNSUPPORTED;
+  if ((ge = parse_accessor(json, position, bin, bin_length, &primitive->position)))
+    return ge;
+  if (primitive->position.component_type != GLTF_FLOAT || primitive->position.num_components != 3)
+    return GE_UNSUPPORTED;
+  if (!primitive->position.count)
+    return GE_ACCESSOR;
+  // Vertex attributes are read at every position, so each must have as many elements
+  if (colour != UINT32_MAX && (ge = parse_accessor(json, colour, bin, bin_length, &primitive->colour)))
+    return ge;
+  if (colour != UINT32_MAX && primitive->colour.count != primitive->position.count)
+    return GE_ACCESSOR;
+  if (texel != UINT32_MAX && (ge = parse_accessor(json, texel, bin, bin_length, &primitive->texel)))
+    return ge;
+  if (texel != UINT32_MAX && primitive->texel.count != primitive->position.count)
+    return GE_ACCESSOR;
+  primitive->num_indices = primitive->position.count;
+  if (indices != UINT32_MAX) {
+    if ((ge = parse_accessor(json, indices, bin, bin_length, &primitive->indices)))
+      return ge;
+    uint32_t type = primitive->indices.component_type;
+    if (primitive->indices.num_components != 1 ||
+        (type != GLTF_UNSIGNED_BYTE && type != GLTF_UNSIGNED_SHORT && type != GLTF_UNSIGNED_INT))
+      return GE_UNSUPPORTED;
+    if (!indices_in_range(&primitive->indices, primitive->position.count))
+      return GE_ACCESSOR;
+    primitive->num_indices = primitive->indices.count;
+  }
+  if (!primitive->num_indices || primitive->num_indices % 3)
+    return GE_ACCESSOR;
+  return GE_OK;
+}
+
+GLTF_ERROR close_model(model_t *model, GLTF_ERROR ge) {
+  destroy_model(model);
+  return ge;
+}
+
+GLTF_ERROR load_glb(const char *path, model_t *model) {
+  memset(model, 0, sizeof (model_t));
+  model->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (model->file == INVALID_HANDLE_VALUE) {
+    model->file = NULL;
+    return GE_FILE_OPEN;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(model->file, &size) || size.QuadPart < (LONGLONG)(sizeof (glb_header_t) + sizeof (glb_chunk_t)) ||
+      size.QuadPart > UINT32_MAX)
+    return close_model(model, GE_SIGNATURE);
+  if (!(model->mapping = CreateFileMappingA(model->file, NULL, PAGE_READONLY, 0, 0, NULL)) ||
+      !(model->view = (const uint8_t *)MapViewOfFile(model->mapping, FILE_MAP_READ, 0, 0, 0)))
+    return close_model(model, GE_FILE_MAP);
+
+  // Header, then a JSON chunk and an optional BIN chunk
+  const glb_header_t *header = (const glb_header_t *)model->view;
+  if (header->magic != GLB_MAGIC || header->version != GLB_VERSION || header->length > size.QuadPart)
+    return close_model(model, GE_SIGNATURE);
+  const glb_chunk_t *json_chunk = (const glb_chunk_t *)(header + 1);
+  // In 64 bits, so a crafted chunk length can't wrap past the checks
+  uint64_t json_end = sizeof (glb_header_t) + sizeof (glb_chunk_t) + (uint64_t)json_chunk->length;
+  if (json_chunk->type != GLB_CHUNK_JSON || json_end > header->length)
+    return close_model(model, GE_CHUNK);
+  const uint8_t *bin = NULL;
+  uint32_t bin_length = 0;
+  if (json_end + sizeof (glb_chunk_t) <= header->length) {
+    const glb_chunk_t *bin_chunk = (const glb_chunk_t *)(model->view + json_end);
+    if (bin_chunk->type != GLB_CHUNK_BIN ||
+        json_end + sizeof (glb_chunk_t) + (uint64_t)bin_chunk->length > header->length)
+      return close_model(model, GE_CHUNK);
+    bin = (const uint8_t *)(bin_chunk + 1);
+    bin_length = bin_chunk->length;
+  }
+
+  json_t json;
+  if (!json_parse(&json, (const char *)(json_chunk + 1), json_chunk->length)) {
+    hfree(json.tokens);
+    return close_model(model, GE_JSON);
+  }
+
+  // Only triangle lists are kept
+  GLTF_ERROR ge = GE_OK;
+  int meshes = json_key(&json, 0, "meshes");
+  model->num_meshes = meshes >= 0 ? json.tokens[meshes].size : 0;
+  for (uint32_t i = 0; i < model->num_meshes && !ge; i++) {
+    int primitives = json_key(&json, json_index(&json, meshes, i), "primitives");
+    if (primitives < 0 || json.tokens[primitives].type != JSON_ARRAY)
+      ge = GE_JSON;
+    else
+      model->num_primitives += json.tokens[primitives].size;
+  }
+  if (!ge && !model->num_primitives)
+    ge = GE_UNSUPPORTED;
+  if (!ge)
+    model->primitives = halloc_type(gltf_primitive_t, model->num_primitives);
+  model->num_primitives = 0;
+  for (uint32_t i = 0; i < model->num_meshes && !ge; i++) {
+    int primitives = json_key(&json, json_index(&json, meshes, i), "primitives");
+    for (uint32_t j = 0; j < json.tokens[primitives].size && !ge; j++) {
+      int token = json_index(&json, primitives, j);
+      if (json_uint(&json, json_key(&json, token, "mode"), GLTF_MODE_TRIANGLES) != GLTF_MODE_TRIANGLES)
+        continue;
+      gltf_primitive_t *primitive = &model->primitives[model->num_primitives];
+      if (!(ge = parse_primitive(&json, token, bin, bin_length, primitive))) {
+        primitive->mesh = i;
+        model->num_vertices += primitive->position.count;
+        model->num_indices += primitive->num_indices;
+        model->num_primitives++;
+      }
+    }
+  }
+  hfree(json.tokens);
+  if (ge)
+    return close_model(model, ge);
+
+  LOG_DEBUG_INFO("Mapped %s: %d meshes, %d primitives, %d vertices, %d indices",
+                 path, model->num_meshes, model->num_primitives, model->num_vertices, model->num_indices);
+  return GE_OK;
+}
+
+// Read up to n components of an element as floats, normalizing integer components when flagged.
+// Components the accessor doesn't have are left untouched.
+void read_accessor(const gltf_accessor_t *accessor, uint32_t index, float *values, uint32_t n) {
+  const uint8_t *element = accessor->data + (size_t)accessor->stride * index;
+  if (n > accessor->num_components)
+    n = accessor->num_components;
+  for (uint32_t i = 0; i < n; i++) {
+    switch (accessor->component_type) {
+      case GLTF_FLOAT:
+        values[i] = ((const float *)element)[i];
+        break;
+      case GLTF_UNSIGNED_BYTE:
+        values[i] = element[i] / (accessor->normalized ? 255.0f : 1.0f);
+        break;
+      case GLTF_UNSIGNED_SHORT:
+        values[i] = ((const uint16_t *)element)[i] / (accessor->normalized ? 65535.0f : 1.0f);
+        break;
+      case GLTF_BYTE:
+        values[i] = ((const int8_t *)element)[i] / (accessor->normalized ? 127.0f : 1.0f);
+        break;
+      case GLTF_SHORT:
+        values[i] = ((const int16_t *)element)[i] / (accessor->normalized ? 32767.0f : 1.0f);
+        break;
+      case GLTF_UNSIGNED_INT:
+        values[i] = (float)((const uint32_t *)element)[i];
+        break;
+    }
+  }
+}
+
+// Write a primitive's indices as 32 bits, offset by base_vertex. Tightly packed 32-bit
+// indices of the first primitive are copied straight from the mapping.
+void copy_indices(const gltf_primitive_t *primitive, uint32_t base_vertex, uint32_t *indices) {
+  const gltf_accessor_t *accessor = &primitive->indices;
+  if (!accessor->count) {
+    for (uint32_t i = 0; i < primitive->num_indices; i++)
+      indices[i] = base_vertex + i;
+  }
+  else if (accessor->component_type == GLTF_UNSIGNED_INT && accessor->stride == sizeof (uint32_t) && !base_vertex)
+    memcpy(indices, accessor->data, sizeof (uint32_t) * accessor->count);
+  else {
+    for (uint32_t i = 0; i < accessor->count; i++) {
+      const uint8_t *element = accessor->data + (size_t)accessor->stride * i;
+      switch (accessor->component_type) {
+        case GLTF_UNSIGNED_BYTE:
+          indices[i] = base_vertex + *element;
+          break;
+        case GLTF_UNSIGNED_SHORT:
+          indices[i] = base_vertex + *(const uint16_t *)element;
+          break;
+        default:
+          indices[i] = base_vertex + *(const uint32_t *)element;
+          break;
+      }
+    }
+  }
+}
+
+void destroy_model(model_t *model) {
+  if (model->primitives)
+    hfree(model->primitives);
+  if (model->view)
+    UnmapViewOfFile(model->view);
+  if (model->mapping)
+    CloseHandle(model->mapping);
+  if (model->file)
+    CloseHandle(model->file);
+  memset(model, 0, sizeof (model_t));
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <windows.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+  GE_OK,
+  GE_FILE_OPEN,
+  GE_FILE_MAP,
+  GE_SIGNATURE,
+  GE_CHUNK,
+  GE_JSON,
+  GE_UNSUPPORTED,
+  GE_ACCESSOR
+} GLTF_ERROR;
+const char *GLTF_ERRORS[];
+
+/* Binary glTF 2.0 */
+
+#define GLB_MAGIC 0x46546C67 // "glTF"
+#define GLB_VERSION 2
+#define GLB_CHUNK_JSON 0x4E4F534A // "JSON"
+#define GLB_CHUNK_BIN 0x004E4942 // "BIN\0"
+
+// Accessor component types
+#define GLTF_BYTE 5120
+#define GLTF_UNSIGNED_BYTE 5121
+#define GLTF_SHORT 5122
+#define GLTF_UNSIGNED_SHORT 5123
+#define GLTF_UNSIGNED_INT 5125
+#define GLTF_FLOAT 5126
+
+#define GLTF_MODE_TRIANGLES 4
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t length;
+} glb_header_t;
+
+typedef struct {
+  uint32_t length;
+  uint32_t type;
+} glb_chunk_t;
+
+// A typed view of elements in the mapped BIN chunk; count is 0 for absent attributes
+typedef struct {
+  const uint8_t *data;
+  uint32_t count;
+  uint32_t stride;
+  uint32_t component_type;
+  uint32_t num_components;
+  bool normalized;
+} gltf_accessor_t;
+
+typedef struct {
+  uint32_t mesh;
+  gltf_accessor_t position;
+  gltf_accessor_t colour;
+  gltf_accessor_t texel;
+  gltf_accessor_t indices; // Absent for non-indexed primitives
+  uint32_t num_indices;
+} gltf_primitive_t;
+
+// Triangle primitives of every mesh in a memory-mapped GLB file. Accessors point straight
+// into the mapping, which stays open until destroy_model().
+typedef struct {
+  HANDLE file;
+  HANDLE mapping;
+  const uint8_t *view;
+  uint32_t num_meshes;
+  uint32_t num_primitives;
+  gltf_primitive_t *primitives;
+  uint32_t num_vertices; // Across all primitives
+  uint32_t num_indices;
+} model_t;
+
+GLTF_ERROR load_glb(const char *, model_t *);
+void read_accessor(const gltf_accessor_t *, uint32_t, float *, uint32_t);
+void copy_indices(const gltf_primitive_t *, uint32_t, uint32_t *);
+void destroy_model(model_t *);
@@ -0,0 +1,160 @@
+#include <string.h>
+#include "gpumem.h"
+#include "heap.h"
+
+// Indexed by MEMORY_CATEGORY, used as JSON keys
+const char *MEMORY_CATEGORY_NAMES[] = {
+  "vertex",
+  "index",
+  "uniform",
+  "draw",
+  "texture",
+  "staging",
+  "depth",
+  "colour",
+  "aliased",
+  "swapchain"
+};
+
+void add_memory_usage(memory_usage_t *usage, VkDeviceSize size) {
+  usage->size += size;
+  usage->count++;
+  if (usage->size > usage->peak)
+    usage->peak = usage->size;
+}
+
+void remove_memory_usage(memory_usage_t *usage, VkDeviceSize size) {
+  usage->size -= size;
+  usage->count--;
+}
+
+void add_allocation_usage(memory_tracker_t *tracker, const memory_allocation_t *allocation) {
+  add_memory_usage(&tracker->categories[allocation->category], allocation->size);
+  add_memory_usage(&tracker->heaps[allocation->heap], allocation->size);
+  add_memory_usage(&tracker->total, allocation->size);
+}
+
+void remove_allocation_usage(memory_tracker_t *tracker, const memory_allocation_t *allocation) {
+  remove_memory_usage(&tracker->categories[allocation->category], allocation->size);
+  remove_memory_usage(&tracker->heaps[allocation->heap], allocation->size);
+  remove_memory_usage(&tracker->total, allocation->size);
+}
+
+void init_memory_tracker(memory_tracker_t *tracker, VkPhysicalDevice physical_device, bool memory_budget) {
+  memset(tracker, 0, sizeof (memory_tracker_t));
+  tracker->physical_device = physical_device;
+  tracker->memory_budget = memory_budget;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &tracker->properties);
+  tracker->capacity = MEMORY_TRACKER_CAPACITY;
+  tracker->allocations = halloc_type(memory_allocation_t, tracker->capacity);
+  InitializeCriticalSection(&tracker->lock);
+}
+
+void track_memory_alloc(memory_tracker_t *tracker, VkDeviceMemory memory, VkDeviceSize size,
+                        uint32_t memory_type, MEMORY_CATEGORY category) {
+  EnterCriticalSection(&tracker->lock);
+  if (tracker->num_allocations == tracker->capacity) {
+    memory_allocation_t *allocations = halloc_type(memory_allocation_t, tracker->capacity * 2);
+    memcpy(allocations, tracker->allocations, tracker->num_allocations * sizeof (memory_allocation_t));
+    hfree(tracker->allocations);
+    tracker->allocations = allocations;
+    tracker->capacity *= 2;
+  }
+  memory_allocation_t *allocation = &tracker->allocations[tracker->num_allocations++];
+  allocation->memory = memory;
+  allocation->size = size;
+  allocation->heap = tracker->properties.memoryTypes[memory_type].heapIndex;
+  allocation->category = category;
+  add_allocation_usage(tracker, allocation);
+  LeaveCriticalSection(&tracker->lock);
+}
+
+void track_memory_failure(memory_tracker_t *tracker) {
+  InterlockedIncrement((volatile LONG *)&tracker->num_failures);
+}
+
+// Allocations are few enough, and freed rarely enough, for a linear search
+void track_memory_free(memory_tracker_t *tracker, VkDeviceMemory memory) {
+  EnterCriticalSection(&tracker->lock);
+  for (uint32_t i = 0; i < tracker->num_allocations; i++) {
+    if (tracker->allocations[i].memory == memory) {
+      remove_allocation_usage(tracker, &tracker->allocations[i]);
+      tracker->allocations[i] = tracker->allocations[--tracker->num_allocations];
+      break;
+    }
+  }
+  LeaveCriticalSection(&tracker->lock);
+}
+
+// Replaces the estimate of memory the driver allocates itself for the category, 0 for none
+void track_external_memory(memory_tracker_t *tracker, MEMORY_CATEGORY category, uint32_t heap, VkDeviceSize size) {
+  EnterCriticalSection(&tracker->lock);
+  memory_allocation_t *external = &tracker->external[category];
+  if (external->size)
+    remove_allocation_usage(tracker, external);
+  external->size = size;
+  external->heap = heap;
+  external->category = category;
+  if (size)
+    add_allocation_usage(tracker, external);
+  LeaveCriticalSection(&tracker->lock);
+}
+
+void get_memory_stats(memory_tracker_t *tracker, memory_stats_t *stats) {
+  memset(stats, 0, sizeof (memory_stats_t));
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT };
+  if (tracker->memory_budget) {
+    VkPhysicalDeviceMemoryProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2 };
+    properties2.pNext = &budget_properties;
+    vkGetPhysicalDeviceMemoryProperties2(tracker->physical_device, &properties2);
+  }
+
+  EnterCriticalSection(&tracker->lock);
+  memcpy(stats->categories, tracker->categories, sizeof stats->categories);
+  stats->total = tracker->total;
+  stats->num_heaps = tracker->properties.memoryHeapCount;
+  for (uint32_t i = 0; i < stats->num_heaps; i++) {
+    memory_heap_stats_t *heap = &stats->heaps[i];
+    heap->size = tracker->properties.memoryHeaps[i].size;
+    heap->device_local = tracker->properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+    heap->tracked = tracker->heaps[i];
+    heap->budget = tracker->memory_budget ? budget_properties.heapBudget[i] : heap->size;
+    heap->usage = tracker->memory_budget ? budget_properties.heapUsage[i] : heap->tracked.size;
+  }
+  stats->memory_budget = tracker->memory_budget;
+  stats->num_failures = tracker->num_failures;
+  LeaveCriticalSection(&tracker->lock);
+}
+
+void write_memory_usage_json(FILE *fp, const memory_usage_t *usage) {
+  fprintf(fp, "{ \"size\": %llu, \"peak\": %llu, \"count\": %u }", usage->size, usage->peak, usage->count);
+}
+
+// Sizes are in bytes
+void write_memory_json(memory_tracker_t *tracker, FILE *fp) {
+  memory_stats_t stats;
+  get_memory_stats(tracker, &stats);
+  fprintf(fp, "{\n  \"total\": ");
+  write_memory_usage_json(fp, &stats.total);
+  fprintf(fp, ",\n  \"categories\": {\n");
+  for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+    fprintf(fp, "    \"%s\": ", MEMORY_CATEGORY_NAMES[i]);
+    write_memory_usage_json(fp, &stats.categories[i]);
+    fprintf(fp, i + 1 < MEMORY_CATEGORY_COUNT ? ",\n" : "\n");
+  }
+  fprintf(fp, "  },\n  \"memory_budget\": %s,\n  \"heaps\": [\n", stats.memory_budget ? "true" : "false");
+  for (uint32_t i = 0; i < stats.num_heaps; i++) {
+    const memory_heap_stats_t *heap = &stats.heaps[i];
+    fprintf(fp, "    { \"size\": %llu, \"device_local\": %s, \"budget\": %llu, \"usage\": %llu, \"tracked\": ",
+            heap->size, heap->device_local ? "true" : "false", heap->budget, heap->usage);
+    write_memory_usage_json(fp, &heap->tracked);
+    fprintf(fp, i + 1 < stats.num_heaps ? " },\n" : " }\n");
+  }
+  fprintf(fp, "  ],\n  \"failures\": %u\n}\n", stats.num_failures);
+}
+
+void destroy_memory_tracker(memory_tracker_t *tracker) {
+  DeleteCriticalSection(&tracker->lock);
+  hfree(tracker->allocations);
+  memset(tracker, 0, sizeof (memory_tracker_t));
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <windows.h>
+#include <vulkan/vulkan.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MEMORY_TRACKER_CAPACITY 64 // Initial allocation table capacity, grows as required
+
+// What device memory is used for, given to alloc_device_memory
+typedef enum {
+  MEMORY_CATEGORY_VERTEX,
+  MEMORY_CATEGORY_INDEX,
+  MEMORY_CATEGORY_UNIFORM,
+  MEMORY_CATEGORY_DRAW, // Instance, indirect draw and LOD buffers
+  MEMORY_CATEGORY_TEXTURE,
+  MEMORY_CATEGORY_STAGING,
+  MEMORY_CATEGORY_DEPTH,
+  MEMORY_CATEGORY_COLOUR, // Multisampled scene and post-process images
+  MEMORY_CATEGORY_ALIASED, // Frame graph blocks shared by transient resources of different categories
+  MEMORY_CATEGORY_SWAPCHAIN, // Allocated by the driver, so estimated from the images' extent
+  MEMORY_CATEGORY_COUNT
+} MEMORY_CATEGORY;
+
+extern const char *MEMORY_CATEGORY_NAMES[];
+
+typedef struct {
+  VkDeviceSize size;
+  VkDeviceSize peak; // High-water mark of size
+  uint32_t count; // Live allocations
+} memory_usage_t;
+
+typedef struct {
+  VkDeviceSize size;
+  bool device_local;
+  memory_usage_t tracked;
+  VkDeviceSize budget; // From VK_EXT_memory_budget, otherwise the heap size
+  VkDeviceSize usage; // By the whole process, from VK_EXT_memory_budget, otherwise tracked.size
+} memory_heap_stats_t;
+
+typedef struct {
+  memory_usage_t categories[MEMORY_CATEGORY_COUNT];
+  memory_usage_t total;
+  memory_heap_stats_t heaps[VK_MAX_MEMORY_HEAPS];
+  uint32_t num_heaps;
+  bool memory_budget; // Heap budgets and usage come from VK_EXT_memory_budget
+  uint32_t num_failures; // Allocations that returned an error
+} memory_stats_t;
+
+typedef struct {
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  uint32_t heap;
+  MEMORY_CATEGORY category;
+} memory_allocation_t;
+
+// Live device memory by category and heap. Allocations are looked up by handle when freed, so
+// callers only need to say what memory is for when allocating it
+typedef struct {
+  VkPhysicalDevice physical_device;
+  VkPhysicalDeviceMemoryProperties properties;
+  bool memory_budget;
+  CRITICAL_SECTION lock; // Allocations may be made from worker threads
+  memory_allocation_t *allocations;
+  uint32_t num_allocations;
+  uint32_t capacity;
+  memory_usage_t categories[MEMORY_CATEGORY_COUNT];
+  memory_usage_t heaps[VK_MAX_MEMORY_HEAPS];
+  memory_usage_t total;
+  memory_allocation_t external[MEMORY_CATEGORY_COUNT]; // Estimated driver-owned memory, per category
+  uint32_t num_failures;
+} memory_tracker_t;
+
+void init_memory_tracker(memory_tracker_t *, VkPhysicalDevice, bool);
+void track_memory_alloc(memory_tracker_t *, VkDeviceMemory, VkDeviceSize, uint32_t, MEMORY_CATEGORY);
+void track_memory_failure(memory_tracker_t *);
+void track_memory_free(memory_tracker_t *, VkDeviceMemory);
+void track_external_memory(memory_tracker_t *, MEMORY_CATEGORY, uint32_t, VkDeviceSize);
+void get_memory_stats(memory_tracker_t *, memory_stats_t *);
+void write_memory_json(memory_tracker_t *, FILE *);
+void destroy_memory_tracker(memory_tracker_t *);
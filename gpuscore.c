@@ -0,0 +1,233 @@
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include "gpuscore.h"
+#include "log.h"
+
+// Indexed by VkPhysicalDeviceType
+const uint32_t gpu_type_ranks[] = {
+  1, // Other
+  3, // Integrated
+  4, // Discrete
+  2, // Virtual
+  0  // CPU, a software ICD
+};
+
+// Device local memory counts most, then features, then limits that bound what can be drawn
+void score_gpu(VkPhysicalDevice physical_device, const VkPhysicalDeviceProperties *properties,
+               uint32_t support, gpu_score_t *score) {
+  memset(score, 0, sizeof (gpu_score_t));
+  score->type = properties->deviceType;
+  score->driver_version = properties->driverVersion;
+  VkPhysicalDeviceIDProperties id_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES };
+  VkPhysicalDeviceProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+  properties2.pNext = &id_properties;
+  vkGetPhysicalDeviceProperties2(physical_device, &properties2);
+  memcpy(score->uuid, id_properties.deviceUUID, VK_UUID_SIZE);
+
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+  for (uint32_t i = 0; i < memory_properties.memoryHeapCount; i++)
+    if (memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT &&
+        memory_properties.memoryHeaps[i].size > score->device_local_size)
+      score->device_local_size = memory_properties.memoryHeaps[i].size;
+
+  uint32_t num_features = 0;
+  for (; support; support &= support - 1)
+    num_features++;
+  score->score = score->device_local_size / 1073741824.0f * 100.0f +
+                 num_features * 10.0f +
+                 properties->limits.maxImageDimension2D / 1024.0f +
+                 properties->limits.maxComputeSharedMemorySize / 16384.0f;
+}
+
+// 32 lower case hex digits
+void format_gpu_uuid(const uint8_t *uuid, char *text) {
+  for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+    snprintf(&text[2 * i], 3, "%02x", uuid[i]);
+}
+
+// The selector is either the device's UUID, with or without dashes, or part of its name
+bool match_gpu(const char *name, const gpu_score_t *score, const char *selector) {
+  char uuid[GPU_UUID_STRLEN], digits[GPU_UUID_STRLEN];
+  format_gpu_uuid(score->uuid, uuid);
+  uint32_t num_digits = 0;
+  for (const char *c = selector; *c && num_digits < GPU_UUID_STRLEN - 1; c++)
+    if (*c != '-')
+      digits[num_digits++] = (char)tolower(*c);
+  digits[num_digits] = 0;
+  if (!strcmp(uuid, digits))
+    return true;
+
+  size_t length = strlen(selector);
+  for (const char *c = name; *c; c++)
+    if (!_strnicmp(c, selector, length))
+      return true;
+  return false;
+}
+
+float read_cached_bandwidth(const gpu_score_t *score) {
+  FILE *fp;
+  if (fopen_s(&fp, GPU_BENCHMARK_CACHE_PATH, "r"))
+    return 0.0f;
+  char uuid[GPU_UUID_STRLEN], line_uuid[GPU_UUID_STRLEN];
+  format_gpu_uuid(score->uuid, uuid);
+  uint32_t driver_version;
+  float bandwidth, cached = 0.0f;
+  // Later lines supersede earlier ones
+  while (fscanf_s(fp, "%32s %u %f", line_uuid, (unsigned)sizeof line_uuid, &driver_version, &bandwidth) == 3)
+    if (!strcmp(line_uuid, uuid) && driver_version == score->driver_version)
+      cached = bandwidth;
+  fclose(fp);
+  return cached;
+}
+
+void write_cached_bandwidth(const gpu_score_t *score) {
+  FILE *fp;
+  if (fopen_s(&fp, GPU_BENCHMARK_CACHE_PATH, "a")) {
+    LOG_DEBUG_WARNING("Could not open GPU benchmark cache '%s'", GPU_BENCHMARK_CACHE_PATH);
+    return;
+  }
+  char uuid[GPU_UUID_STRLEN];
+  format_gpu_uuid(score->uuid, uuid);
+  fprintf(fp, "%s %u %.3f\n", uuid, score->driver_version, score->bandwidth);
+  fclose(fp);
+}
+
+uint32_t find_benchmark_memory_type(const VkPhysicalDeviceMemoryProperties *properties, uint32_t type_bits) {
+  uint32_t fallback = UINT32_MAX;
+  for (uint32_t i = 0; i < properties->memoryTypeCount; i++) {
+    if (!(type_bits & 1 << i))
+      continue;
+    if (properties->memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+      return i;
+    if (fallback == UINT32_MAX)
+      fallback = i;
+  }
+  return fallback;
+}
+
+// GB/s read and written by GPU_BENCHMARK_COPIES buffer copies on a device of its own, timed after
+// a warm-up submission of the same commands, or 0 if anything fails
+float run_gpu_benchmark(VkPhysicalDevice physical_device, uint32_t queue_family) {
+  VkDevice device = VK_NULL_HANDLE;
+  VkBuffer buffers[2] = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+  VkDeviceMemory memory[2] = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+  VkCommandPool command_pool = VK_NULL_HANDLE;
+  VkFence fence = VK_NULL_HANDLE;
+  float bandwidth = 0.0f;
+
+  const float priority = 1.0f;
+  VkDeviceQueueCreateInfo queue_info = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
+  queue_info.queueFamilyIndex = queue_family;
+  queue_info.queueCount = 1;
+  queue_info.pQueuePriorities = &priority;
+  VkDeviceCreateInfo device_info = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
+  device_info.queueCreateInfoCount = 1;
+  device_info.pQueueCreateInfos = &queue_info;
+  if (vkCreateDevice(physical_device, &device_info, NULL, &device))
+    return 0.0f;
+  VkQueue queue;
+  vkGetDeviceQueue(device, queue_family, 0, &queue);
+
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+  VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+  buffer_info.size = GPU_BENCHMARK_SIZE;
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  for (uint32_t i = 0; i < 2; i++) {
+    if (vkCreateBuffer(device, &buffer_info, NULL, &buffers[i]))
+      goto cleanup;
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffers[i], &requirements);
+    VkMemoryAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+    allocate_info.allocationSize = requirements.size;
+    allocate_info.memoryTypeIndex = find_benchmark_memory_type(&memory_properties, requirements.memoryTypeBits);
+    if (allocate_info.memoryTypeIndex == UINT32_MAX ||
+        vkAllocateMemory(device, &allocate_info, NULL, &memory[i]) ||
+        vkBindBufferMemory(device, buffers[i], memory[i], 0))
+      goto cleanup;
+  }
+
+  VkCommandPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+  pool_info.queueFamilyIndex = queue_family;
+  if (vkCreateCommandPool(device, &pool_info, NULL, &command_pool))
+    goto cleanup;
+  VkCommandBuffer command_buffer;
+  VkCommandBufferAllocateInfo command_buffer_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+  command_buffer_info.commandPool = command_pool;
+  command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  command_buffer_info.commandBufferCount = 1;
+  if (vkAllocateCommandBuffers(device, &command_buffer_info, &command_buffer))
+    goto cleanup;
+
+  // Copy back and forth, each copy waiting on the one before
+  VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+  vkBeginCommandBuffer(command_buffer, &begin_info);
+  const VkBufferCopy region = { 0, 0, GPU_BENCHMARK_SIZE };
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdFillBuffer(command_buffer, buffers[0], 0, VK_WHOLE_SIZE, 0);
+  for (uint32_t i = 0; i < GPU_BENCHMARK_COPIES; i++) {
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+    vkCmdCopyBuffer(command_buffer, buffers[i & 1], buffers[~i & 1], 1, &region);
+  }
+  if (vkEndCommandBuffer(command_buffer))
+    goto cleanup;
+
+  VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+  if (vkCreateFence(device, &fence_info, NULL, &fence))
+    goto cleanup;
+  VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &command_buffer;
+  LARGE_INTEGER frequency, start, end;
+  QueryPerformanceFrequency(&frequency);
+  for (uint32_t run = 0; run < 2; run++) {
+    QueryPerformanceCounter(&start);
+    if (vkQueueSubmit(queue, 1, &submit_info, fence) ||
+        vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX))
+      goto cleanup;
+    QueryPerformanceCounter(&end);
+    vkResetFences(device, 1, &fence);
+  }
+  double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+  if (seconds > 0.0)
+    bandwidth = (float)(2.0 * GPU_BENCHMARK_SIZE * GPU_BENCHMARK_COPIES / seconds / 1e9);
+
+cleanup:
+  vkDeviceWaitIdle(device);
+  vkDestroyFence(device, fence, NULL);
+  vkDestroyCommandPool(device, command_pool, NULL);
+  for (uint32_t i = 0; i < 2; i++) {
+    vkDestroyBuffer(device, buffers[i], NULL);
+    vkFreeMemory(device, memory[i], NULL);
+  }
+  vkDestroyDevice(device, NULL);
+  return bandwidth;
+}
+
+// Sets the score's bandwidth from the cache, or runs the micro-benchmark and caches its result
+void benchmark_gpu(VkPhysicalDevice physical_device, uint32_t queue_family, gpu_score_t *score) {
+  score->bandwidth = read_cached_bandwidth(score);
+  if (score->bandwidth > 0.0f)
+    return;
+  score->bandwidth = run_gpu_benchmark(physical_device, queue_family);
+  if (score->bandwidth > 0.0f)
+    write_cached_bandwidth(score);
+}
+
+// Positive if a is the better device
+int compare_gpus(const gpu_score_t *a, const gpu_score_t *b) {
+  uint32_t rank_a = a->type <= VK_PHYSICAL_DEVICE_TYPE_CPU ? gpu_type_ranks[a->type] : 0,
+           rank_b = b->type <= VK_PHYSICAL_DEVICE_TYPE_CPU ? gpu_type_ranks[b->type] : 0;
+  if (rank_a != rank_b)
+    return rank_a > rank_b ? 1 : -1;
+  if (a->bandwidth > 0.0f && b->bandwidth > 0.0f && a->bandwidth != b->bandwidth)
+    return a->bandwidth > b->bandwidth ? 1 : -1;
+  if (a->score != b->score)
+    return a->score > b->score ? 1 : -1;
+  return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <windows.h>
+#include <vulkan/vulkan.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GPU_BENCHMARK_CACHE_PATH "gpu_benchmark.cache"
+#define GPU_BENCHMARK_SIZE (64 << 20) // Bytes in each of the two buffers copied between
+#define GPU_BENCHMARK_COPIES 16
+#define GPU_UUID_STRLEN (2 * VK_UUID_SIZE + 1)
+
+// How a physical device that meets the renderer's requirements compares with the others. Device
+// type decides first, so a software ICD never wins over hardware; then the micro-benchmark's
+// bandwidth when both devices have one, then score
+typedef struct {
+  VkPhysicalDeviceType type;
+  uint8_t uuid[VK_UUID_SIZE];
+  uint32_t driver_version; // Benchmark results are cached per device and driver
+  VkDeviceSize device_local_size; // Largest device local heap
+  float score; // From device local memory, supported features and limits
+  float bandwidth; // GB/s copied by the micro-benchmark, 0 if it wasn't run
+} gpu_score_t;
+
+void score_gpu(VkPhysicalDevice, const VkPhysicalDeviceProperties *, uint32_t, gpu_score_t *);
+void format_gpu_uuid(const uint8_t *, char *);
+bool match_gpu(const char *, const gpu_score_t *, const char *);
+void benchmark_gpu(VkPhysicalDevice, uint32_t, gpu_score_t *);
+int compare_gpus(const gpu_score_t *, const gpu_score_t *);
@@ -1,7 +1,21 @@
 #include "heap.h"
 #include "assert.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <windows.h>
 #include <malloc.h>
 #include <memory.h>
+#include "log.h"
+
+#ifdef _DEBUG
+#define ARENA_HEADER_SIZE HEAP_ALIGNMENT // Holds the allocation's size, so its guard can be found
+#else
+#define ARENA_HEADER_SIZE 0
+#endif
+#define ALIGN(s) (((s) + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1))
+
+__declspec(thread) arena_t *thread_scratch_arena;
+arena_t *volatile scratch_arenas; // Every thread's scratch arena, pushed without a lock
 
 void *halloc(const size_t size) {
   assert(size);
@@ -19,3 +33,175 @@ void hfree(void *mem) {
   assert(mem);
   free(mem);
 }
+
+// Returns whether the guard after size bytes at mem is intact
+bool check_guard(const uint8_t *mem, size_t size, size_t guard_size) {
+  for (size_t i = 0; i < guard_size; i++) {
+    if (mem[size + i] != HEAP_GUARD_BYTE) {
+      log_console_error("Heap allocation of %zu bytes at %p was written past its end", size, mem);
+      assert(!"Heap guard overwritten");
+      return false;
+    }
+  }
+  return true;
+}
+
+void create_arena(arena_t *arena, size_t size) {
+  arena->base = (uint8_t *)halloc(size);
+  arena->size = size;
+  arena->used = 0;
+  arena->next = NULL;
+#ifdef _DEBUG
+  memset(arena->base, HEAP_FREED_BYTE, size);
+#endif
+}
+
+// Aligned to HEAP_ALIGNMENT. Running out is a bug, so it ends the process in every build rather
+// than returning NULL to callers that don't check
+void *arena_alloc(arena_t *arena, size_t size) {
+  size_t total = ALIGN(ARENA_HEADER_SIZE + size + HEAP_GUARD_SIZE);
+  size_t offset = (size_t)InterlockedExchangeAdd64(&arena->used, total);
+  if (offset + total > arena->size) {
+    log_console_fatal("Arena of %zu bytes exhausted allocating %zu bytes", arena->size, size);
+    assert(!"Arena exhausted");
+    abort();
+  }
+  uint8_t *mem = arena->base + offset + ARENA_HEADER_SIZE;
+#ifdef _DEBUG
+  *(size_t *)(mem - ARENA_HEADER_SIZE) = size;
+  memset(mem, HEAP_FILL_BYTE, size);
+  memset(mem + size, HEAP_GUARD_BYTE, total - ARENA_HEADER_SIZE - size);
+#endif
+  return mem;
+}
+
+void *arena_alloc_clear(arena_t *arena, size_t size) {
+  void *mem = arena_alloc(arena, size);
+  if (mem)
+    memset(mem, 0, size);
+  return mem;
+}
+
+size_t arena_mark(const arena_t *arena) {
+  return (size_t)arena->used;
+}
+
+// Releases everything allocated since the mark, checking the guards of debug builds
+void arena_reset(arena_t *arena, size_t mark) {
+#ifdef _DEBUG
+  size_t used = (size_t)arena->used < arena->size ? (size_t)arena->used : arena->size;
+  for (size_t offset = mark; offset < used;) {
+    size_t size = *(size_t *)(arena->base + offset);
+    size_t total = ALIGN(ARENA_HEADER_SIZE + size + HEAP_GUARD_SIZE);
+    check_guard(arena->base + offset + ARENA_HEADER_SIZE, size, total - ARENA_HEADER_SIZE - size);
+    offset += total;
+  }
+  if (used > mark)
+    memset(arena->base + mark, HEAP_FREED_BYTE, used - mark);
+#endif
+  arena->used = mark;
+}
+
+void destroy_arena(arena_t *arena) {
+  arena_reset(arena, 0);
+  hfree(arena->base);
+  arena->base = NULL;
+  arena->size = 0;
+}
+
+// This thread's arena for arrays released before their function returns: take a mark, allocate,
+// and reset to the mark on every return
+arena_t *scratch_arena() {
+  if (!thread_scratch_arena) {
+    arena_t *arena = halloc_type(arena_t, 1);
+    create_arena(arena, SCRATCH_ARENA_SIZE);
+    do
+      arena->next = scratch_arenas;
+    while (InterlockedCompareExchangePointer((PVOID volatile *)&scratch_arenas, arena, arena->next) != arena->next);
+    thread_scratch_arena = arena;
+  }
+  return thread_scratch_arena;
+}
+
+// Every other thread must have exited
+void destroy_scratch_arenas() {
+  while (scratch_arenas) {
+    arena_t *next = scratch_arenas->next;
+    destroy_arena(scratch_arenas);
+    hfree(scratch_arenas);
+    scratch_arenas = next;
+  }
+  thread_scratch_arena = NULL;
+}
+
+void create_block_pool(block_pool_t *pool, size_t size, uint32_t num_blocks) {
+  pool->block_size = ALIGN((size > sizeof (void *) ? size : sizeof (void *)) + HEAP_GUARD_SIZE);
+  pool->num_blocks = num_blocks;
+  pool->base = (uint8_t *)halloc(pool->block_size * num_blocks);
+  pool->free_list = NULL;
+  for (uint32_t i = num_blocks; i-- > 0;) {
+    void **block = (void **)(pool->base + i * pool->block_size);
+#ifdef _DEBUG
+    memset(block, HEAP_FREED_BYTE, pool->block_size);
+#endif
+    *block = pool->free_list;
+    pool->free_list = block;
+  }
+  pool->num_free = num_blocks;
+}
+
+// Like arena_alloc, running out ends the process
+void *pool_alloc(block_pool_t *pool) {
+  if (!pool->free_list) {
+    log_console_fatal("All %d blocks of %zu bytes in use", pool->num_blocks, pool->block_size);
+    assert(!"Block pool exhausted");
+    abort();
+  }
+  uint8_t *block = (uint8_t *)pool->free_list;
+  pool->free_list = *(void **)block;
+  pool->num_free--;
+#ifdef _DEBUG
+  // Freed blocks stay poisoned, except for the free list link
+  for (size_t i = sizeof (void *); i < pool->block_size; i++) {
+    if (block[i] != HEAP_FREED_BYTE) {
+      log_console_error("Pool block at %p was written after it was freed", block);
+      break;
+    }
+  }
+  memset(block, HEAP_FILL_BYTE, pool->block_size - HEAP_GUARD_SIZE);
+  memset(block + pool->block_size - HEAP_GUARD_SIZE, HEAP_GUARD_BYTE, HEAP_GUARD_SIZE);
+#endif
+  return block;
+}
+
+void pool_free(block_pool_t *pool, void *mem) {
+  uint8_t *block = (uint8_t *)mem;
+  size_t offset = block - pool->base;
+  if (block < pool->base || offset >= pool->block_size * pool->num_blocks || offset % pool->block_size) {
+    log_console_error("Freed %p, which isn't a block of the pool at %p", mem, pool->base);
+    assert(!"Not a pool block");
+    return;
+  }
+#ifdef _DEBUG
+  for (void *free_block = pool->free_list; free_block; free_block = *(void **)free_block) {
+    if (free_block == mem) {
+      log_console_error("Pool block at %p freed twice", mem);
+      assert(!"Pool block freed twice");
+      return;
+    }
+  }
+  check_guard(block, pool->block_size - HEAP_GUARD_SIZE, HEAP_GUARD_SIZE);
+  memset(block, HEAP_FREED_BYTE, pool->block_size);
+#endif
+  *(void **)block = pool->free_list;
+  pool->free_list = block;
+  pool->num_free++;
+}
+
+void destroy_block_pool(block_pool_t *pool) {
+  if (pool->num_free != pool->num_blocks)
+    log_console_warning("%d pool blocks of %zu bytes were not freed", pool->num_blocks - pool->num_free, pool->block_size);
+  hfree(pool->base);
+  pool->base = NULL;
+  pool->free_list = NULL;
+}
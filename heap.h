@@ -1,8 +1,56 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define halloc_type(t, c) (t *)halloc(sizeof (t) * (c))
 #define halloc_clear_type(t, c) halloc_clear(sizeof (t) * (c))
+#define arena_alloc_type(a, t, c) (t *)arena_alloc(a, sizeof (t) * (c))
+#define arena_alloc_clear_type(a, t, c) (t *)arena_alloc_clear(a, sizeof (t) * (c))
+
+#define HEAP_ALIGNMENT 16
+#define SCRATCH_ARENA_SIZE (1 << 20) // Each thread's, for arrays released before their function returns
+#ifdef _DEBUG
+#define HEAP_GUARD_SIZE 16 // After each arena allocation and pool block, checked when they're released
+#else
+#define HEAP_GUARD_SIZE 0
+#endif
+#define HEAP_FILL_BYTE 0xCD // Debug fill of memory allocated but not yet written
+#define HEAP_FREED_BYTE 0xDD // Debug fill of memory released
+#define HEAP_GUARD_BYTE 0xFD
+
+// Allocations bumped from one block, released together by resetting to an earlier mark.
+// Allocating is thread-safe; marking and resetting are not
+typedef struct arena_s {
+  uint8_t *base;
+  size_t size;
+  volatile long long used;
+  struct arena_s *next; // Scratch arenas, one per thread
+} arena_t;
+
+// Fixed size blocks on a free list, for a single thread
+typedef struct {
+  uint8_t *base;
+  size_t block_size; // Including the debug guard
+  uint32_t num_blocks;
+  void *free_list;
+  uint32_t num_free;
+} block_pool_t;
 
 void *halloc(const size_t);
 void *halloc_clear(const size_t);
 void hfree(void *);
+
+void create_arena(arena_t *, size_t);
+void *arena_alloc(arena_t *, size_t);
+void *arena_alloc_clear(arena_t *, size_t);
+size_t arena_mark(const arena_t *);
+void arena_reset(arena_t *, size_t);
+void destroy_arena(arena_t *);
+arena_t *scratch_arena();
+void destroy_scratch_arenas();
+
+void create_block_pool(block_pool_t *, size_t, uint32_t);
+void *pool_alloc(block_pool_t *);
+void pool_free(block_pool_t *, void *);
+void destroy_block_pool(block_pool_t *);
@@ -0,0 +1,89 @@
+#include <stdarg.h>
+#include "initgraph.h"
+#include "log.h"
+#include "profiler.h"
+
+// Takes the number of dependencies followed by their indices, returning the new step's index.
+// The graph must start zeroed
+uint32_t add_init_step(init_graph_t *graph, const char *name, void (*create)(), void (*destroy)(),
+                       uint32_t num_dependencies, ...) {
+  uint32_t index = graph->num_steps++;
+  init_step_t *step = &graph->steps[index];
+  step->name = name;
+  step->create = create;
+  step->destroy = destroy;
+  step->num_dependencies = num_dependencies;
+  step->graph = graph;
+  va_list va;
+  va_start(va, num_dependencies);
+  for (uint32_t i = 0; i < num_dependencies; i++)
+    step->dependencies[i] = va_arg(va, uint32_t);
+  va_end(va);
+  return index;
+}
+
+void run_init_step(void *data) {
+  init_step_t *step = (init_step_t *)data;
+  init_graph_t *graph = step->graph;
+  if (!graph->failed || !graph->failed()) {
+    LARGE_INTEGER start, end, frequency;
+    QueryPerformanceCounter(&start);
+    PROFILE_BEGIN(zone, step->name);
+    step->create();
+    PROFILE_END(zone);
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&frequency);
+    step->ms = (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+    step->created = true;
+    LOG_DEBUG_INFO("Init step %s took %.3f ms", step->name, step->ms);
+  }
+
+  // Submit the dependents this was the last dependency of
+  uint32_t index = (uint32_t)(step - graph->steps);
+  init_step_t *ready[INIT_MAX_STEPS];
+  uint32_t num_ready = 0;
+  EnterCriticalSection(&graph->lock);
+  graph->order[graph->num_completed++] = index;
+  for (uint32_t i = index + 1; i < graph->num_steps; i++) {
+    init_step_t *dependent = &graph->steps[i];
+    for (uint32_t j = 0; j < dependent->num_dependencies; j++)
+      if (dependent->dependencies[j] == index && !--dependent->remaining)
+        ready[num_ready++] = dependent;
+  }
+  // Woken under the lock, since once the last step completes the graph may go out of scope
+  WakeConditionVariable(&graph->step_done);
+  LeaveCriticalSection(&graph->lock);
+  for (uint32_t i = 0; i < num_ready; i++)
+    submit_task(graph->pool, run_init_step, ready[i]);
+}
+
+// Blocks until every step has completed or been skipped. The steps must not wait on the pool,
+// since they run on it
+void run_init_graph(init_graph_t *graph, task_pool_t *pool, bool (*failed)()) {
+  LARGE_INTEGER start, end, frequency;
+  QueryPerformanceCounter(&start);
+  graph->pool = pool;
+  graph->failed = failed;
+  graph->num_completed = 0;
+  InitializeCriticalSection(&graph->lock);
+  InitializeConditionVariable(&graph->step_done);
+  for (uint32_t i = 0; i < graph->num_steps; i++)
+    graph->steps[i].remaining = graph->steps[i].num_dependencies;
+  PROFILE_BEGIN(zone, "run_init_graph");
+  EnterCriticalSection(&graph->lock);
+  for (uint32_t i = 0; i < graph->num_steps; i++)
+    if (!graph->steps[i].num_dependencies)
+      submit_task(pool, run_init_step, &graph->steps[i]);
+  while (graph->num_completed < graph->num_steps)
+    SleepConditionVariableCS(&graph->step_done, &graph->lock, INFINITE);
+  LeaveCriticalSection(&graph->lock);
+  DeleteCriticalSection(&graph->lock);
+  PROFILE_END(zone);
+
+  QueryPerformanceCounter(&end);
+  QueryPerformanceFrequency(&frequency);
+  graph->ms = (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+  graph->work_ms = 0.0;
+  for (uint32_t i = 0; i < graph->num_steps; i++)
+    graph->work_ms += graph->steps[i].ms;
+}
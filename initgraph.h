@@ -0,0 +1,42 @@
+#pragma once
+
+#include <windows.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "tasks.h"
+
+#define INIT_MAX_STEPS 32
+#define INIT_MAX_DEPENDENCIES 8
+
+typedef struct init_graph_s init_graph_t;
+
+typedef struct {
+  const char *name;
+  void (*create)();
+  void (*destroy)(); // May be NULL
+  uint32_t dependencies[INIT_MAX_DEPENDENCIES]; // Indices of earlier steps
+  uint32_t num_dependencies;
+  uint32_t remaining; // Dependencies not yet complete, guarded by the graph lock
+  bool created; // Its create ran, so its destroy is due at teardown
+  double ms;
+  init_graph_t *graph;
+} init_step_t;
+
+// Initialization steps run on the task pool as soon as the steps they depend on are complete.
+// Steps only ever depend on earlier ones, so the graph can't have cycles. Each step completes after
+// its dependencies, so destroying in reverse completion order destroys dependents first
+struct init_graph_s {
+  init_step_t steps[INIT_MAX_STEPS];
+  uint32_t num_steps;
+  uint32_t order[INIT_MAX_STEPS]; // Steps in the order they completed
+  uint32_t num_completed; // Guarded by the lock
+  bool (*failed)(); // Once true, the steps still to start are skipped
+  task_pool_t *pool;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE step_done;
+  double ms; // From the start of the run until the last step completed
+  double work_ms; // Total of the steps' times
+};
+
+uint32_t add_init_step(init_graph_t *, const char *, void (*)(), void (*)(), uint32_t, ...);
+void run_init_graph(init_graph_t *, task_pool_t *, bool (*)());
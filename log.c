@@ -1,55 +1,366 @@
 #include "log.h"
-#include <windows.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
 #include <time.h>
+#include "heap.h"
 
-void write_log(const char *type, const char *msg, va_list va) {
-  time_t timestamp;
-  GetSystemTimeAsFileTime((FILETIME *)&timestamp);
-  timestamp -= 116444736000000000i64; // 1 Jan 1601 to 1 Jan 1970
+// A conversion specification in a printf format
+typedef struct {
+  char text[32]; // From the % to the conversion, NUL terminated
+  uint32_t num_stars; // Width and precision taken from int arguments
+  bool wide; // 64-bit integer argument
+  char conversion;
+} log_spec_t;
+
+const char *LOG_LEVEL_NAMES[] = { "INFO", "WARN", "ERROR", "FATAL" };
+
+LOG_LEVEL log_level = LOG_LEVEL_INFO;
+log_sink_t sinks[LOG_MAX_SINKS];
+void *sink_data[LOG_MAX_SINKS];
+uint32_t num_sinks;
+volatile bool log_running;
+HANDLE log_thread_handle;
+HANDLE log_wake;
+__declspec(thread) log_buffer_t *thread_log_buffer;
+log_buffer_t *volatile log_buffers; // Every thread's buffer, pushed without a lock
+
+// Parses the specification at the %, returning the character after it
+const char *parse_spec(const char *p, log_spec_t *spec) {
+  const char *start = p++;
+  spec->num_stars = 0;
+  spec->wide = false;
+  while (*p && strchr("-+ #0", *p))
+    p++;
+  for (bool precision = false;; precision = true) {
+    if (*p == '*') {
+      spec->num_stars++;
+      p++;
+    }
+    else
+      while (*p >= '0' && *p <= '9')
+        p++;
+    if (precision || *p != '.')
+      break;
+    p++;
+  }
+  if (!strncmp(p, "I64", 3)) {
+    spec->wide = true;
+    p += 3;
+  }
+  else if (!strncmp(p, "I32", 3))
+    p += 3;
+  else if (!strncmp(p, "ll", 2) || !strncmp(p, "hh", 2)) {
+    spec->wide = *p == 'l';
+    p += 2;
+  }
+  else if (*p && strchr("IzjtlhLw", *p)) {
+    spec->wide = strchr("Izjt", *p) != NULL; // long is 32 bits on Windows
+    p++;
+  }
+  spec->conversion = *p;
+  if (*p)
+    p++;
+  size_t length = p - start < sizeof spec->text - 1 ? p - start : sizeof spec->text - 1;
+  memcpy(spec->text, start, length);
+  spec->text[length] = '\0';
+  return p;
+}
+
+// Copies the arguments the format consumes, returning the bytes written
+uint32_t capture_args(const char *format, va_list va, uint8_t *out, uint32_t capacity) {
+  uint32_t size = 0;
+  log_spec_t spec;
+  for (const char *p = format; *p;) {
+    if (*p != '%') {
+      p++;
+      continue;
+    }
+    p = parse_spec(p, &spec);
+    for (uint32_t i = 0; i < spec.num_stars && size + 8 <= capacity; i++, size += 8)
+      *(int64_t *)&out[size] = va_arg(va, int);
+    if (size + 8 > capacity)
+      break;
+    switch (spec.conversion) {
+      case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+        *(int64_t *)&out[size] = spec.wide ? va_arg(va, int64_t) : va_arg(va, int);
+        size += 8;
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        *(double *)&out[size] = va_arg(va, double);
+        size += 8;
+        break;
+      case 'p':
+        *(void **)&out[size] = va_arg(va, void *);
+        size += 8;
+        break;
+      case 's': {
+        const char *s = va_arg(va, const char *);
+        if (!s)
+          s = "(null)";
+        // Room for at least the terminator after the length
+        if (size + 16 > capacity)
+          return size;
+        uint32_t length = (uint32_t)strlen(s);
+        uint32_t max_length = ((capacity - size - 8) & ~7) - 1;
+        if (length > max_length)
+          length = max_length;
+        *(uint32_t *)&out[size] = length;
+        memcpy(&out[size + 8], s, length);
+        out[size + 8 + length] = '\0';
+        size += 8 + ((length + 8) & ~7);
+        break;
+      }
+    }
+  }
+  return size;
+}
+
+// Appends to the line, truncating at its end
+void append_line(char *line, size_t *length, const char *format, ...) {
+  if (*length >= LOG_MAX_LINE - 1)
+    return;
+  va_list va;
+  va_start(va, format);
+  int n = vsnprintf(line + *length, LOG_MAX_LINE - *length, format, va);
+  va_end(va);
+  if (n > 0)
+    *length = *length + n < LOG_MAX_LINE - 1 ? *length + n : LOG_MAX_LINE - 1;
+}
+
+// Formats one captured argument with its specification
+const uint8_t *append_arg(char *line, size_t *length, const log_spec_t *spec, const uint8_t *arg) {
+  int stars[2] = { 0 };
+  for (uint32_t i = 0; i < spec->num_stars; i++, arg += 8)
+    stars[i] = (int)*(int64_t *)arg;
+  const char *text = spec->text;
+  switch (spec->conversion) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c': {
+      int64_t value = *(int64_t *)arg;
+      if (spec->wide)
+        switch (spec->num_stars) {
+          case 0: append_line(line, length, text, value); break;
+          case 1: append_line(line, length, text, stars[0], value); break;
+          default: append_line(line, length, text, stars[0], stars[1], value);
+        }
+      else
+        switch (spec->num_stars) {
+          case 0: append_line(line, length, text, (int)value); break;
+          case 1: append_line(line, length, text, stars[0], (int)value); break;
+          default: append_line(line, length, text, stars[0], stars[1], (int)value);
+        }
+      return arg + 8;
+    }
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+      double value = *(double *)arg;
+      switch (spec->num_stars) {
+        case 0: append_line(line, length, text, value); break;
+        case 1: append_line(line, length, text, stars[0], value); break;
+        default: append_line(line, length, text, stars[0], stars[1], value);
+      }
+      return arg + 8;
+    }
+    case 'p':
+      append_line(line, length, text, *(void **)arg);
+      return arg + 8;
+    case 's': {
+      uint32_t string_length = *(uint32_t *)arg;
+      const char *value = (const char *)arg + 8;
+      switch (spec->num_stars) {
+        case 0: append_line(line, length, text, value); break;
+        case 1: append_line(line, length, text, stars[0], value); break;
+        default: append_line(line, length, text, stars[0], stars[1], value);
+      }
+      return arg + 8 + ((string_length + 8) & ~7);
+    }
+    case '%':
+      append_line(line, length, "%%");
+      return arg;
+    default:
+      append_line(line, length, "%s", text);
+      return arg;
+  }
+}
+
+void emit_record(const log_record_t *record) {
   struct timespec ts = {
-    (time_t)(timestamp / 10000000i64),
-    (time_t)(timestamp % 10000000i64 * 100)
+    (time_t)((record->time - 116444736000000000i64) / 10000000i64), // 1 Jan 1601 to 1 Jan 1970
+    (long)(record->time % 10000000i64 * 100)
   };
   struct tm t;
   localtime_s(&t, &ts.tv_sec);
   char dt_str[DT_STRLEN];
   strftime(dt_str, DT_STRLEN, "%Y-%m-%d %H:%M:%S", &t);
-  int ms = (int)(ts.tv_nsec / 1.0e6);
-  // Log to system console
-  int format_size = _scprintf("[%s.%03d] %5s %s\n", dt_str, ms, type, msg) + 1;
-  char *format = _alloca(format_size);
-  snprintf(format, format_size, "[%s.%03d] %5s %s\n", dt_str, ms, type, msg);
-  // NB If format is invalid (e.g. %l instead of %ld) _vscprintf throws an
-  // exception when it tries to find the length of the corresponding argument
-  int buffer_size = _vscprintf(format, va) + 1;
-  char *buffer = format;
-  if (buffer_size > format_size)
-    buffer = _alloca(buffer_size);
-  vsnprintf(buffer, buffer_size, format, va);
-  OutputDebugString(buffer);
-}
-
-void log_console_info(const char *msg, ...) {
-  VA_BEG
-    write_log("INFO", msg, va);
-  VA_END
+  char line[LOG_MAX_LINE];
+  size_t length = 0;
+  append_line(line, &length, "[%s.%03d] %5s ", dt_str, (int)(ts.tv_nsec / 1000000), LOG_LEVEL_NAMES[record->level]);
+  const uint8_t *arg = (const uint8_t *)(record + 1);
+  const uint8_t *end = (const uint8_t *)record + record->size;
+  log_spec_t spec;
+  for (const char *p = record->format; *p;) {
+    const char *literal = p;
+    while (*p && *p != '%')
+      p++;
+    append_line(line, &length, "%.*s", (int)(p - literal), literal);
+    if (!*p)
+      break;
+    p = parse_spec(p, &spec);
+    if (spec.conversion != '%' && arg + 8 * (spec.num_stars + 1) > end)
+      break; // Arguments truncated
+    arg = append_arg(line, &length, &spec, arg);
+  }
+  if (length > LOG_MAX_LINE - 2)
+    length = LOG_MAX_LINE - 2; // Keep the newline of a truncated line
+  line[length++] = '\n';
+  line[length] = '\0';
+  if (!num_sinks)
+    log_to_debugger(record->level, line, NULL);
+  for (uint32_t i = 0; i < num_sinks; i++)
+    sinks[i](record->level, line, sink_data[i]);
 }
 
-void log_console_warning(const char *msg, ...) {
-  VA_BEG
-    write_log("WARN", msg, va);
-  VA_END
+log_buffer_t *get_log_buffer() {
+  if (!thread_log_buffer) {
+    log_buffer_t *buffer = halloc_type(log_buffer_t, 1);
+    buffer->head = 0;
+    buffer->tail = 0;
+    do
+      buffer->next = log_buffers;
+    while (InterlockedCompareExchangePointer((PVOID volatile *)&log_buffers, buffer, buffer->next) != buffer->next);
+    thread_log_buffer = buffer;
+  }
+  return thread_log_buffer;
 }
 
-void log_console_error(const char *msg, ...) {
-  VA_BEG
-    write_log("ERROR", msg, va);
-  VA_END
+// A record that doesn't fit before the end of the ring starts over at the beginning, waiting
+// for the log thread to make room if necessary
+void push_record(log_buffer_t *buffer, const log_record_t *record) {
+  LONG64 head = buffer->head;
+  uint32_t offset = head & (LOG_BUFFER_SIZE - 1);
+  uint32_t skip = LOG_BUFFER_SIZE - offset < record->size ? LOG_BUFFER_SIZE - offset : 0;
+  while (head + skip + record->size - ReadAcquire64(&buffer->tail) > LOG_BUFFER_SIZE) {
+    SetEvent(log_wake);
+    SwitchToThread();
+  }
+  if (skip) {
+    // Too short for a record header, the log thread skips it anyway
+    if (skip >= sizeof (log_record_t)) {
+      log_record_t *padding = (log_record_t *)&buffer->data[offset];
+      padding->size = skip;
+      padding->format = NULL;
+    }
+    head += skip;
+    offset = 0;
+  }
+  memcpy(&buffer->data[offset], record, record->size);
+  WriteRelease64(&buffer->head, head + record->size);
+}
+
+void drain_log_buffer(log_buffer_t *buffer) {
+  LONG64 head = ReadAcquire64(&buffer->head);
+  LONG64 tail = buffer->tail;
+  while (tail < head) {
+    uint32_t offset = tail & (LOG_BUFFER_SIZE - 1);
+    if (LOG_BUFFER_SIZE - offset < sizeof (log_record_t))
+      tail += LOG_BUFFER_SIZE - offset;
+    else {
+      const log_record_t *record = (const log_record_t *)&buffer->data[offset];
+      if (record->format)
+        emit_record(record);
+      tail += record->size;
+    }
+    WriteRelease64(&buffer->tail, tail);
+  }
 }
 
-void log_console_fatal(const char *msg, ...) {
+void drain_log_buffers() {
+  for (log_buffer_t *buffer = log_buffers; buffer; buffer = buffer->next)
+    drain_log_buffer(buffer);
+}
+
+DWORD WINAPI log_thread(LPVOID param) {
+  while (log_running) {
+    WaitForSingleObject(log_wake, LOG_FLUSH_MS);
+    drain_log_buffers();
+  }
+  drain_log_buffers();
+  return 0;
+}
+
+// Only the arguments are copied on the calling thread. Formatting and writing to the sinks are
+// left to the log thread, or done here if it isn't running. Errors are flushed before returning
+void write_log(LOG_LEVEL level, const char *msg, ...) {
+  uint64_t record_data[LOG_MAX_RECORD / sizeof (uint64_t)];
+  log_record_t *record = (log_record_t *)record_data;
+  record->level = level;
+  record->format = msg;
+  GetSystemTimeAsFileTime((FILETIME *)&record->time);
   VA_BEG
-    write_log("FATAL", msg, va);
+    record->size = sizeof (log_record_t) +
+                   capture_args(msg, va, (uint8_t *)(record + 1), LOG_MAX_RECORD - sizeof (log_record_t));
   VA_END
+  if (!log_running) {
+    emit_record(record);
+    return;
+  }
+  push_record(get_log_buffer(), record);
+  if (level >= LOG_LEVEL_ERROR)
+    flush_log();
+}
+
+// Sinks are added before the log starts
+void add_log_sink(log_sink_t sink, void *data) {
+  if (num_sinks == LOG_MAX_SINKS)
+    return;
+  sinks[num_sinks] = sink;
+  sink_data[num_sinks++] = data;
+}
+
+void log_to_debugger(LOG_LEVEL level, const char *line, void *data) {
+  OutputDebugString(line);
+}
+
+void log_to_stderr(LOG_LEVEL level, const char *line, void *data) {
+  fputs(line, stderr);
+}
+
+// data is the FILE
+void log_to_file(LOG_LEVEL level, const char *line, void *data) {
+  fputs(line, (FILE *)data);
+  if (level >= LOG_LEVEL_ERROR)
+    fflush((FILE *)data);
+}
+
+void start_log() {
+  log_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+  log_running = true;
+  log_thread_handle = CreateThread(NULL, 0, log_thread, NULL, 0, NULL);
+}
+
+// Waits until the log thread has written everything this thread logged
+void flush_log() {
+  log_buffer_t *buffer = thread_log_buffer;
+  if (!log_running || !buffer)
+    return;
+  LONG64 head = buffer->head;
+  SetEvent(log_wake);
+  while (ReadAcquire64(&buffer->tail) < head)
+    SwitchToThread();
+}
+
+// Every other thread must have stopped logging
+void stop_log() {
+  if (!log_running)
+    return;
+  log_running = false;
+  SetEvent(log_wake);
+  WaitForSingleObject(log_thread_handle, INFINITE);
+  CloseHandle(log_thread_handle);
+  CloseHandle(log_wake);
+  while (log_buffers) {
+    log_buffer_t *next = log_buffers->next;
+    hfree(log_buffers);
+    log_buffers = next;
+  }
+  thread_log_buffer = NULL;
 }
@@ -1,12 +1,57 @@
 #pragma once
 
+#include <windows.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #define VA_BEG va_list va;va_start(va,msg);
 #define VA_RST va_end(va);va_start(va,msg);
 #define VA_END va_end(va);
 #define MAX_STRLEN 1024
 #define DT_STRLEN 20
+#define LOG_BUFFER_SIZE (64 << 10) // Bytes in each thread's ring, a power of 2
+#define LOG_MAX_RECORD 4096 // Bytes of a message and its arguments, longer strings are truncated
+#define LOG_MAX_LINE 8192
+#define LOG_FLUSH_MS 10 // Longest a message waits for the log thread
+#define LOG_MAX_SINKS 4
+
+typedef enum {
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARNING,
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_FATAL,
+  LOG_LEVEL_NONE
+} LOG_LEVEL;
+
+// Called on the log thread with each formatted line, newline included
+typedef void (*log_sink_t)(LOG_LEVEL, const char *, void *);
+
+// A message as the logging thread left it: the format, which must outlive the log, and its
+// arguments, each 8 bytes, or for strings a length and the characters, padded to 8 bytes
+typedef struct {
+  uint32_t size; // Including the arguments, a multiple of 8
+  LOG_LEVEL level;
+  const char *format; // NULL pads the rest of the ring
+  int64_t time; // FILETIME
+} log_record_t;
+
+// Written only by its thread and read only by the log thread, so neither takes a lock.
+// Positions count bytes ever written and read; a record never wraps
+typedef struct log_buffer_s {
+  uint8_t data[LOG_BUFFER_SIZE];
+  volatile LONG64 head;
+  volatile LONG64 tail;
+  struct log_buffer_s *next;
+} log_buffer_t;
+
+extern LOG_LEVEL log_level;
+
+// Messages below log_level are dropped before their arguments are evaluated
+#define LOG_AT(level, ...) ((level) >= log_level ? write_log(level, __VA_ARGS__) : (void)0)
+#define log_console_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_console_warning(...) LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_console_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_console_fatal(...) LOG_AT(LOG_LEVEL_FATAL, __VA_ARGS__)
 
 #ifdef _DEBUG
 #define LOG_DEBUG_INFO(...) log_console_info(__VA_ARGS__)
@@ -20,7 +65,11 @@
 #define LOG_DEBUG_FATAL(...)
 #endif
 
-void log_console_info(const char *, ...);
-void log_console_warning(const char *, ...);
-void log_console_error(const char *, ...);
-void log_console_fatal(const char *, ...);
+void write_log(LOG_LEVEL, const char *, ...);
+void add_log_sink(log_sink_t, void *);
+void log_to_debugger(LOG_LEVEL, const char *, void *);
+void log_to_stderr(LOG_LEVEL, const char *, void *);
+void log_to_file(LOG_LEVEL, const char *, void *);
+void start_log();
+void flush_log();
+void stop_log();
@@ -1,13 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "window.h"
 #include "renderer.h"
 #include "log.h"
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR pCmdLine, int nCmdShow) {
-  image_t image = { 0 };
-  IMAGE_ERROR ie = load_png("VulkanDemo.png", &image);
-  if (ie) {
-    LOG_DEBUG_ERROR("Could not load PNG: %s", IMAGE_ERRORS[ie]);
-    return ie;
+  // Command line: [-model <path.glb>] [-optimize] [-lod] [-packed] [-instances <n>] [-benchmark [aa]] [-threaded]
+  //               [-latency low|balanced|throughput] [-aa msaa|fxaa] [-samples <n>] [-sample-shading <rate>]
+  //               [-bindless] [-texture-budget <MB>] [-gpu <name|UUID>] [-gpu-bench]
+  //               [-log <path>] [-log-level info|warning|error|none]
+  //               [-validation verbose|info|warning|error]
+  FILE *log_file = NULL;
+  const char *arg = strstr(pCmdLine, "-log ");
+  if (arg) {
+    char path[MAX_PATH] = { 0 };
+    sscanf_s(arg + strlen("-log "), "%259s", path, (unsigned)sizeof path);
+    if (!fopen_s(&log_file, path, "w"))
+      add_log_sink(log_to_file, log_file);
+  }
+  // A GUI process only has standard error when it's redirected
+  if (GetStdHandle(STD_ERROR_HANDLE))
+    add_log_sink(log_to_stderr, NULL);
+  add_log_sink(log_to_debugger, NULL);
+  arg = strstr(pCmdLine, "-log-level ");
+  if (arg) {
+    arg += strlen("-log-level ");
+    if (!strncmp(arg, "warning", strlen("warning")))
+      log_level = LOG_LEVEL_WARNING;
+    else if (!strncmp(arg, "error", strlen("error")))
+      log_level = LOG_LEVEL_ERROR;
+    else if (!strncmp(arg, "none", strlen("none")))
+      log_level = LOG_LEVEL_NONE;
+  }
+  start_log();
+
+  model_t model = { 0 };
+  arg = strstr(pCmdLine, "-model ");
+  if (arg) {
+    char path[MAX_PATH] = { 0 };
+    sscanf_s(arg + strlen("-model "), "%259s", path, (unsigned)sizeof path);
+    GLTF_ERROR ge = load_glb(path, &model);
+    if (ge) {
+      LOG_DEBUG_ERROR("Could not load model: %s", GLTF_ERRORS[ge]);
+      stop_log();
+      if (log_file)
+        fclose(log_file);
+      return ge;
+    }
+    vk_env.model = &model;
   }
 
   window_t window = { hInstance };
@@ -17,10 +58,74 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR pCmdLine,
   window.on_destroy = cleanup_vulkan;
   window.on_size = resize;
   window.on_move = move;
+  window.on_report = report_memory;
+  window.on_validation = cycle_validation_severity;
   window.on_paint = render;
   vk_env.window = &window;
+  // Decoded while the renderer initializes
+  image_t image = { 0 };
   vk_env.image = &image;
 
+  arg = strstr(pCmdLine, "-instances ");
+  if (arg)
+    vk_env.num_instances = strtoul(arg + strlen("-instances "), NULL, 10);
+  vk_env.optimize_mesh = strstr(pCmdLine, "-optimize") != NULL;
+  vk_env.build_lods = strstr(pCmdLine, "-lod") != NULL;
+  if (strstr(pCmdLine, "-packed"))
+    vk_env.vertex_format = VERTEX_FORMAT_PACKED;
+  arg = strstr(pCmdLine, "-benchmark");
+  vk_env.run_benchmark = arg != NULL;
+  vk_env.benchmark.aa = arg && !strncmp(arg + strlen("-benchmark"), " aa", strlen(" aa"));
+  vk_env.threaded_recording = strstr(pCmdLine, "-threaded") != NULL;
+  vk_env.latency_mode = LATENCY_MODE_BALANCED;
+  arg = strstr(pCmdLine, "-latency ");
+  if (arg) {
+    arg += strlen("-latency ");
+    if (!strncmp(arg, "low", strlen("low")))
+      vk_env.latency_mode = LATENCY_MODE_LOW;
+    else if (!strncmp(arg, "throughput", strlen("throughput")))
+      vk_env.latency_mode = LATENCY_MODE_THROUGHPUT;
+  }
+  vk_env.aa.mode = AA_MODE_MSAA;
+  arg = strstr(pCmdLine, "-aa ");
+  if (arg && !strncmp(arg + strlen("-aa "), "fxaa", strlen("fxaa")))
+    vk_env.aa.mode = AA_MODE_FXAA;
+  vk_env.aa.samples = NUM_AA_SAMPLES;
+  arg = strstr(pCmdLine, "-samples ");
+  if (arg)
+    vk_env.aa.samples = strtoul(arg + strlen("-samples "), NULL, 10);
+  vk_env.aa.min_sample_shading = MIN_SAMPLE_SHADING;
+  arg = strstr(pCmdLine, "-sample-shading ");
+  if (arg)
+    vk_env.aa.min_sample_shading = strtof(arg + strlen("-sample-shading "), NULL);
+  CLAMP(vk_env.aa.min_sample_shading, 0.0f, 1.0f);
+  vk_env.bindless.enabled = strstr(pCmdLine, "-bindless") != NULL;
+  vk_env.texture_budget = TEXTURE_BUDGET_MB;
+  arg = strstr(pCmdLine, "-texture-budget ");
+  if (arg)
+    vk_env.texture_budget = strtoul(arg + strlen("-texture-budget "), NULL, 10);
+  vk_env.texture_budget <<= 20;
+  // A quoted selector may contain spaces, e.g. -gpu "RTX 4090"
+  arg = strstr(pCmdLine, "-gpu ");
+  if (arg) {
+    arg += strlen("-gpu ");
+    if (*arg == '"')
+      sscanf_s(arg + 1, "%255[^\"]", vk_env.gpu_selector, (unsigned)sizeof vk_env.gpu_selector);
+    else
+      sscanf_s(arg, "%255s", vk_env.gpu_selector, (unsigned)sizeof vk_env.gpu_selector);
+  }
+  vk_env.benchmark_gpus = strstr(pCmdLine, "-gpu-bench") != NULL;
+  arg = strstr(pCmdLine, "-validation ");
+  if (arg) {
+    arg += strlen("-validation ");
+    if (!strncmp(arg, "info", strlen("info")))
+      vk_env.validation_severity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT;
+    else if (!strncmp(arg, "warning", strlen("warning")))
+      vk_env.validation_severity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT;
+    else if (!strncmp(arg, "error", strlen("error")))
+      vk_env.validation_severity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+  }
+
   int rc = E_FAIL;
   if (create_window(&window) == WE_OK) {
     MSG msg = { 0 };
@@ -29,13 +134,24 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR pCmdLine,
         TranslateMessage(&msg);
         DispatchMessage(&msg);
       }
-      else
-        render();
+      else {
+        // Keep handling input until the frame pacer says to start the next frame
+        DWORD delay = pace_frame();
+        if (delay)
+          MsgWaitForMultipleObjects(0, NULL, FALSE, delay, QS_ALLINPUT);
+        else
+          render();
+      }
     }
     rc = (int)msg.wParam;
   }
 
   cleanup_window(&window);
-  destroy_image(&image);
+  destroy_model(&model);
+  stop_log();
+  if (log_file)
+    fclose(log_file);
+  // The worker and log threads have exited
+  destroy_scratch_arenas();
   return rc;
 }
@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mesh.h"
+#include "heap.h"
+#include "log.h"
+
+// FNV-1a over the vertex's bytes; vertex_t has no padding, so equal vertices hash equally
+uint32_t hash_vertex(const vertex_t *vertex) {
+  const uint8_t *bytes = (const uint8_t *)vertex;
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < sizeof (vertex_t); i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+  return hash;
+}
+
+// Merge bitwise identical vertices, returning how many were removed
+uint32_t dedup_vertices(mesh_t *mesh) {
+  uint32_t table_size = 1;
+  while (table_size < mesh->num_vertices * 2)
+    table_size <<= 1;
+  uint32_t *table = halloc_type(uint32_t, table_size);
+  memset(table, 0xff, sizeof (uint32_t) * table_size);
+  uint32_t *remap = halloc_type(uint32_t, mesh->num_vertices);
+
+  // Open addressing with linear probing; unique vertices are compacted to the front as found
+  uint32_t num_unique = 0;
+  for (uint32_t i = 0; i < mesh->num_vertices; i++) {
+    const vertex_t *vertex = &mesh->vertices[i];
+    uint32_t slot = hash_vertex(vertex) & (table_size - 1);
+    while (table[slot] != UINT32_MAX && memcmp(&mesh->vertices[table[slot]], vertex, sizeof (vertex_t)))
+      slot = (slot + 1) & (table_size - 1);
+    if (table[slot] == UINT32_MAX) {
+      mesh->vertices[num_unique] = *vertex;
+      table[slot] = num_unique++;
+    }
+    remap[i] = table[slot];
+  }
+  for (uint32_t i = 0; i < mesh->num_indices; i++)
+    mesh->indices[i] = remap[mesh->indices[i]];
+
+  uint32_t removed = mesh->num_vertices - num_unique;
+  mesh->num_vertices = num_unique;
+  hfree(remap);
+  hfree(table);
+  return removed;
+}
+
+void build_adjacency(const mesh_t *mesh, adjacency_t *adjacency) {
+  adjacency->offsets = halloc_clear_type(uint32_t, mesh->num_vertices + 1);
+  adjacency->triangles = halloc_type(uint32_t, mesh->num_indices);
+  for (uint32_t i = 0; i < mesh->num_indices; i++)
+    adjacency->offsets[mesh->indices[i] + 1]++;
+  for (uint32_t v = 0; v < mesh->num_vertices; v++)
+    adjacency->offsets[v + 1] += adjacency->offsets[v];
+  uint32_t *fill = halloc_type(uint32_t, mesh->num_vertices);
+  memcpy(fill, adjacency->offsets, sizeof (uint32_t) * mesh->num_vertices);
+  for (uint32_t i = 0; i < mesh->num_indices; i++)
+    adjacency->triangles[fill[mesh->indices[i]]++] = i / 3;
+  hfree(fill);
+}
+
+void destroy_adjacency(adjacency_t *adjacency) {
+  hfree(adjacency->offsets);
+  hfree(adjacency->triangles);
+}
+
+// Tipsify (Sander, Nehab & Barczak 2007): fan around the current vertex, then move to the
+// candidate that stays in the cache longest, falling back to recently used dead ends
+void optimize_vertex_cache(mesh_t *mesh, uint32_t cache_size) {
+  uint32_t num_triangles = mesh->num_indices / 3;
+  adjacency_t adjacency;
+  build_adjacency(mesh, &adjacency);
+  uint32_t *live = halloc_type(uint32_t, mesh->num_vertices),
+           *stamps = halloc_clear_type(uint32_t, mesh->num_vertices),
+           *dead_ends = halloc_type(uint32_t, mesh->num_indices),
+           *candidates = halloc_type(uint32_t, mesh->num_indices),
+           *output = halloc_type(uint32_t, mesh->num_indices);
+  uint8_t *emitted = halloc_clear_type(uint8_t, num_triangles);
+  for (uint32_t v = 0; v < mesh->num_vertices; v++)
+    live[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+
+  uint32_t time = cache_size + 1,
+           num_dead_ends = 0,
+           num_output = 0,
+           cursor = 0;
+  int fanning = mesh->num_vertices ? 0 : -1;
+  while (fanning >= 0) {
+    uint32_t num_candidates = 0;
+    for (uint32_t i = adjacency.offsets[fanning]; i < adjacency.offsets[fanning + 1]; i++) {
+      uint32_t triangle = adjacency.triangles[i];
+      if (emitted[triangle])
+        continue;
+      for (uint32_t j = 0; j < 3; j++) {
+        uint32_t v = mesh->indices[triangle * 3 + j];
+        output[num_output++] = v;
+        dead_ends[num_dead_ends++] = v;
+        candidates[num_candidates++] = v;
+        live[v]--;
+        if (time - stamps[v] > cache_size)
+          stamps[v] = time++;
+      }
+      emitted[triangle] = 1;
+    }
+
+    // Prefer a candidate whose remaining triangles can all be emitted before it's evicted
+    int best = -1, best_priority = -1;
+    for (uint32_t i = 0; i < num_candidates; i++) {
+      uint32_t v = candidates[i];
+      if (!live[v])
+        continue;
+      int priority = 0;
+      if (time - stamps[v] + 2 * live[v] <= cache_size)
+        priority = time - stamps[v];
+      if (priority > best_priority) {
+        best_priority = priority;
+        best = v;
+      }
+    }
+    // Dead end: most recent vertex with triangles left, else the next one in index order
+    while (best < 0 && num_dead_ends) {
+      uint32_t v = dead_ends[--num_dead_ends];
+      if (live[v])
+        best = v;
+    }
+    while (best < 0 && cursor < mesh->num_vertices) {
+      if (live[cursor])
+        best = cursor;
+      cursor++;
+    }
+    fanning = best;
+  }
+  memcpy(mesh->indices, output, sizeof (uint32_t) * num_output);
+
+  hfree(emitted);
+  hfree(output);
+  hfree(candidates);
+  hfree(dead_ends);
+  hfree(stamps);
+  hfree(live);
+  destroy_adjacency(&adjacency);
+}
+
+typedef struct {
+  float score;
+  uint32_t first; // Index of the first triangle
+  uint32_t count;
+} cluster_t;
+
+// Descending by score
+int compare_clusters(const void *a, const void *b) {
+  float sa = ((const cluster_t *)a)->score,
+        sb = ((const cluster_t *)b)->score;
+  return (sa < sb) - (sa > sb);
+}
+
+// Sander et al.'s linear-speed overdraw ordering: split the cache-ordered triangles into
+// clusters at hard boundaries (a triangle missing on all three vertices), so reordering
+// clusters costs no cache efficiency, then draw clusters facing outwards from the mesh
+// centre first, since they're likely to occlude the rest
+void optimize_overdraw(mesh_t *mesh, uint32_t cache_size) {
+  uint32_t num_triangles = mesh->num_indices / 3;
+  if (!num_triangles)
+    return;
+  cluster_t *clusters = halloc_type(cluster_t, num_triangles);
+  uint32_t *stamps = halloc_clear_type(uint32_t, mesh->num_vertices);
+  uint32_t num_clusters = 0,
+           time = cache_size + 1;
+  for (uint32_t t = 0; t < num_triangles; t++) {
+    uint32_t misses = 0;
+    for (uint32_t j = 0; j < 3; j++) {
+      uint32_t v = mesh->indices[t * 3 + j];
+      if (time - stamps[v] > cache_size) {
+        stamps[v] = time++;
+        misses++;
+      }
+    }
+    if (!t || misses == 3) {
+      clusters[num_clusters].first = t;
+      clusters[num_clusters].count = 0;
+      num_clusters++;
+    }
+    clusters[num_clusters - 1].count++;
+  }
+
+  vec3_t centre = { 0.0f, 0.0f, 0.0f };
+  for (uint32_t v = 0; v < mesh->num_vertices; v++) {
+    centre.x += mesh->vertices[v].position.x;
+    centre.y += mesh->vertices[v].position.y;
+    centre.z += mesh->vertices[v].position.z;
+  }
+  centre.x /= mesh->num_vertices;
+  centre.y /= mesh->num_vertices;
+  centre.z /= mesh->num_vertices;
+
+  // Score is the area-weighted cluster normal dotted with the cluster centroid's offset from the centre
+  for (uint32_t c = 0; c < num_clusters; c++) {
+    vec3_t normal = { 0.0f, 0.0f, 0.0f },
+           centroid = { 0.0f, 0.0f, 0.0f };
+    for (uint32_t t = clusters[c].first; t < clusters[c].first + clusters[c].count; t++) {
+      const vec3_t *p0 = &mesh->vertices[mesh->indices[t * 3]].position,
+                   *p1 = &mesh->vertices[mesh->indices[t * 3 + 1]].position,
+                   *p2 = &mesh->vertices[mesh->indices[t * 3 + 2]].position;
+      vec3_t e1 = { p1->x - p0->x, p1->y - p0->y, p1->z - p0->z },
+             e2 = { p2->x - p0->x, p2->y - p0->y, p2->z - p0->z };
+      normal.x += e1.y * e2.z - e1.z * e2.y;
+      normal.y += e1.z * e2.x - e1.x * e2.z;
+      normal.z += e1.x * e2.y - e1.y * e2.x;
+      centroid.x += (p0->x + p1->x + p2->x) / 3.0f;
+      centroid.y += (p0->y + p1->y + p2->y) / 3.0f;
+      centroid.z += (p0->z + p1->z + p2->z) / 3.0f;
+    }
+    float inv_count = 1.0f / clusters[c].count;
+    clusters[c].score = (centroid.x * inv_count - centre.x) * normal.x +
+                        (centroid.y * inv_count - centre.y) * normal.y +
+                        (centroid.z * inv_count - centre.z) * normal.z;
+  }
+  qsort(clusters, num_clusters, sizeof (cluster_t), compare_clusters);
+
+  uint32_t *output = halloc_type(uint32_t, mesh->num_indices),
+           num_output = 0;
+  for (uint32_t c = 0; c < num_clusters; c++) {
+    memcpy(&output[num_output], &mesh->indices[clusters[c].first * 3], sizeof (uint32_t) * 3 * clusters[c].count);
+    num_output += 3 * clusters[c].count;
+  }
+  memcpy(mesh->indices, output, sizeof (uint32_t) * num_output);
+
+  hfree(output);
+  hfree(stamps);
+  hfree(clusters);
+}
+
+// Renumber vertices in order of first use so fetches walk the vertex buffer linearly.
+// Unreferenced vertices are dropped.
+void optimize_vertex_fetch(mesh_t *mesh) {
+  uint32_t *remap = halloc_type(uint32_t, mesh->num_vertices);
+  memset(remap, 0xff, sizeof (uint32_t) * mesh->num_vertices);
+  vertex_t *vertices = halloc_type(vertex_t, mesh->num_vertices);
+  uint32_t num_vertices = 0;
+  for (uint32_t i = 0; i < mesh->num_indices; i++) {
+    uint32_t v = mesh->indices[i];
+    if (remap[v] == UINT32_MAX) {
+      vertices[num_vertices] = mesh->vertices[v];
+      remap[v] = num_vertices++;
+    }
+    mesh->indices[i] = remap[v];
+  }
+  memcpy(mesh->vertices, vertices, sizeof (vertex_t) * num_vertices);
+  mesh->num_vertices = num_vertices;
+  hfree(vertices);
+  hfree(remap);
+}
+
+vertex_cache_stats_t analyze_vertex_cache(const mesh_t *mesh, uint32_t cache_size) {
+  vertex_cache_stats_t stats = { 0.0f, 0.0f };
+  uint32_t *stamps = halloc_clear_type(uint32_t, mesh->num_vertices);
+  uint32_t time = cache_size + 1,
+           misses = 0,
+           num_referenced = 0;
+  for (uint32_t i = 0; i < mesh->num_indices; i++) {
+    uint32_t v = mesh->indices[i];
+    if (!stamps[v])
+      num_referenced++;
+    if (time - stamps[v] > cache_size) {
+      stamps[v] = time++;
+      misses++;
+    }
+  }
+  if (mesh->num_indices)
+    stats.acmr = (float)misses / (mesh->num_indices / 3);
+  if (num_referenced)
+    stats.atvr = (float)misses / num_referenced;
+  hfree(stamps);
+  return stats;
+}
+
+// Full pipeline, in the order each step expects its input
+void optimize_mesh(mesh_t *mesh) {
+  if (!mesh->num_vertices || !mesh->num_indices)
+    return;
+  vertex_cache_stats_t before = analyze_vertex_cache(mesh, VERTEX_CACHE_SIZE);
+  uint32_t duplicates = dedup_vertices(mesh);
+  optimize_vertex_cache(mesh, VERTEX_CACHE_SIZE);
+  optimize_overdraw(mesh, VERTEX_CACHE_SIZE);
+  optimize_vertex_fetch(mesh);
+  vertex_cache_stats_t after = analyze_vertex_cache(mesh, VERTEX_CACHE_SIZE);
+  log_console_info("Optimized mesh: %d duplicate vertices removed, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f",
+                   duplicates, before.acmr, after.acmr, before.atvr, after.atvr);
+}
+
+// Round to nearest even; overflow saturates to infinity and values too small for a
+// half's subnormals flush to zero
+uint16_t float_to_half(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  uint32_t sign = (bits >> 16) & 0x8000,
+           mantissa = bits & 0x7fffff;
+  int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+  if (((bits >> 23) & 0xff) == 0xff) // Inf or NaN
+    return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  if (exponent >= 31)
+    return (uint16_t)(sign | 0x7c00);
+  if (exponent <= 0) {
+    if (exponent < -10)
+      return (uint16_t)sign;
+    mantissa |= 0x800000;
+    uint32_t shift = 14 - exponent,
+             half = mantissa >> shift,
+             remainder = mantissa & ((1u << shift) - 1),
+             halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+      half++;
+    return (uint16_t)(sign | half);
+  }
+  uint32_t half = sign | (exponent << 10) | (mantissa >> 13),
+           remainder = mantissa & 0x1fff;
+  // Carrying into the exponent is correct, up to and including infinity
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+    half++;
+  return (uint16_t)half;
+}
+
+void compute_quantization(const vertex_t *vertices, uint32_t num_vertices, quantization_t *quantization) {
+  vec3_t min = { 0.0f, 0.0f, 0.0f },
+         max = { 0.0f, 0.0f, 0.0f };
+  if (num_vertices)
+    min = max = vertices[0].position;
+  for (uint32_t i = 1; i < num_vertices; i++) {
+    const vec3_t *p = &vertices[i].position;
+    if (p->x < min.x) min.x = p->x;
+    if (p->y < min.y) min.y = p->y;
+    if (p->z < min.z) min.z = p->z;
+    if (p->x > max.x) max.x = p->x;
+    if (p->y > max.y) max.y = p->y;
+    if (p->z > max.z) max.z = p->z;
+  }
+  quantization->centre[0] = (min.x + max.x) / 2.0f;
+  quantization->centre[1] = (min.y + max.y) / 2.0f;
+  quantization->centre[2] = (min.z + max.z) / 2.0f;
+  quantization->centre[3] = 0.0f;
+  // Flat axes keep a non-zero extent so quantizing them doesn't divide by zero
+  quantization->extent[0] = max.x > min.x ? (max.x - min.x) / 2.0f : 1.0f;
+  quantization->extent[1] = max.y > min.y ? (max.y - min.y) / 2.0f : 1.0f;
+  quantization->extent[2] = max.z > min.z ? (max.z - min.z) / 2.0f : 1.0f;
+  quantization->extent[3] = 1.0f;
+}
+
+int16_t quantize_snorm16(float value) {
+  if (value > 1.0f)
+    value = 1.0f;
+  else if (value < -1.0f)
+    value = -1.0f;
+  return (int16_t)(value * 32767.0f + (value >= 0.0f ? 0.5f : -0.5f));
+}
+
+uint8_t quantize_unorm8(float value) {
+  if (value > 1.0f)
+    value = 1.0f;
+  else if (value < 0.0f)
+    value = 0.0f;
+  return (uint8_t)(value * 255.0f + 0.5f);
+}
+
+void quantize_vertices(const vertex_t *vertices, uint32_t num_vertices, const quantization_t *quantization,
+                       packed_vertex_t *packed) {
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    const vertex_t *vertex = &vertices[i];
+    packed_vertex_t p;
+    p.position[0] = quantize_snorm16((vertex->position.x - quantization->centre[0]) / quantization->extent[0]);
+    p.position[1] = quantize_snorm16((vertex->position.y - quantization->centre[1]) / quantization->extent[1]);
+    p.position[2] = quantize_snorm16((vertex->position.z - quantization->centre[2]) / quantization->extent[2]);
+    p.position[3] = 0;
+    p.colour[0] = quantize_unorm8(vertex->colour.x);
+    p.colour[1] = quantize_unorm8(vertex->colour.y);
+    p.colour[2] = quantize_unorm8(vertex->colour.z);
+    p.colour[3] = 255;
+    p.uv[0] = float_to_half(vertex->uv.x);
+    p.uv[1] = float_to_half(vertex->uv.y);
+    packed[i] = p; // One write per vertex, as the destination is usually mapped device memory
+  }
+}
+
+void destroy_mesh(mesh_t *mesh) {
+  if (mesh->vertices)
+    hfree(mesh->vertices);
+  if (mesh->indices)
+    hfree(mesh->indices);
+  mesh->vertices = NULL;
+  mesh->indices = NULL;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include "maths.h"
+
+#define VERTEX_CACHE_SIZE 16 // Post-transform cache entries simulated when ordering triangles
+
+typedef struct {
+  vec3_t position;
+  vec3_t colour;
+  vec2_t uv;
+} vertex_t;
+
+// Packed vertex - 16 bytes. Position is snorm16 within the mesh's bounding box, w unused.
+typedef struct {
+  int16_t position[4];
+  uint8_t colour[4]; // unorm8, alpha unused
+  uint16_t uv[2]; // Half floats
+} packed_vertex_t;
+
+// Maps snorm16 positions back to mesh space: position = centre + snorm * extent.
+// vec4s so it can be pushed to the vertex shader as is.
+typedef struct {
+  float centre[4];
+  float extent[4];
+} quantization_t;
+
+// Indexed triangle list in heap memory
+typedef struct {
+  vertex_t *vertices;
+  uint32_t num_vertices;
+  uint32_t *indices;
+  uint32_t num_indices;
+} mesh_t;
+
+// Triangles using each vertex, as offsets into a flat list
+typedef struct {
+  uint32_t *offsets; // num_vertices + 1
+  uint32_t *triangles;
+} adjacency_t;
+
+// Post-transform cache statistics from a FIFO cache simulation
+typedef struct {
+  float acmr; // Average cache miss ratio - vertex shader invocations per triangle
+  float atvr; // Average transformed vertex ratio - invocations per unique vertex
+} vertex_cache_stats_t;
+
+void build_adjacency(const mesh_t *, adjacency_t *);
+void destroy_adjacency(adjacency_t *);
+uint32_t dedup_vertices(mesh_t *);
+void optimize_vertex_cache(mesh_t *, uint32_t);
+void optimize_overdraw(mesh_t *, uint32_t);
+void optimize_vertex_fetch(mesh_t *);
+vertex_cache_stats_t analyze_vertex_cache(const mesh_t *, uint32_t);
+void optimize_mesh(mesh_t *);
+uint16_t float_to_half(float);
+void compute_quantization(const vertex_t *, uint32_t, quantization_t *);
+void quantize_vertices(const vertex_t *, uint32_t, const quantization_t *, packed_vertex_t *);
+void destroy_mesh(mesh_t *);
@@ -0,0 +1,137 @@
+#include <string.h>
+#include <math.h>
+#include "meshlet.h"
+#include "heap.h"
+
+// Bounding sphere about the centre of the meshlet's bounding box, and the cone of its normals
+void compute_meshlet_bounds(const mesh_t *mesh, const meshlet_data_t *data, meshlet_t *meshlet) {
+  const uint32_t *vertices = &data->vertices[meshlet->vertex_offset];
+  vec3_t min = mesh->vertices[vertices[0]].position,
+         max = min;
+  for (uint32_t i = 1; i < meshlet->vertex_count; i++) {
+    const vec3_t *p = &mesh->vertices[vertices[i]].position;
+    min.x = fminf(min.x, p->x); min.y = fminf(min.y, p->y); min.z = fminf(min.z, p->z);
+    max.x = fmaxf(max.x, p->x); max.y = fmaxf(max.y, p->y); max.z = fmaxf(max.z, p->z);
+  }
+  meshlet->centre[0] = (min.x + max.x) / 2.0f;
+  meshlet->centre[1] = (min.y + max.y) / 2.0f;
+  meshlet->centre[2] = (min.z + max.z) / 2.0f;
+  float radius_squared = 0.0f;
+  for (uint32_t i = 0; i < meshlet->vertex_count; i++) {
+    const vec3_t *p = &mesh->vertices[vertices[i]].position;
+    float dx = p->x - meshlet->centre[0],
+          dy = p->y - meshlet->centre[1],
+          dz = p->z - meshlet->centre[2];
+    radius_squared = fmaxf(radius_squared, dx * dx + dy * dy + dz * dz);
+  }
+  meshlet->radius = sqrtf(radius_squared);
+
+  // Unit normals, summed for the axis and then checked for their spread about it
+  vec3_t *normals = halloc_type(vec3_t, meshlet->triangle_count);
+  vec3_t axis = { 0.0f, 0.0f, 0.0f };
+  const uint8_t *triangles = &data->triangles[meshlet->triangle_offset * 3];
+  for (uint32_t t = 0; t < meshlet->triangle_count; t++) {
+    const vec3_t *p0 = &mesh->vertices[vertices[triangles[t * 3]]].position,
+                 *p1 = &mesh->vertices[vertices[triangles[t * 3 + 1]]].position,
+                 *p2 = &mesh->vertices[vertices[triangles[t * 3 + 2]]].position;
+    vec3_t e1 = { p1->x - p0->x, p1->y - p0->y, p1->z - p0->z },
+           e2 = { p2->x - p0->x, p2->y - p0->y, p2->z - p0->z },
+           n = { e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x };
+    float length = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+    if (length > 0.0f) {
+      n.x /= length; n.y /= length; n.z /= length;
+    }
+    normals[t] = n;
+    axis.x += n.x; axis.y += n.y; axis.z += n.z;
+  }
+  float length = sqrtf(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+  float min_dot = -1.0f;
+  if (length > 0.0f) {
+    axis.x /= length; axis.y /= length; axis.z /= length;
+    min_dot = 1.0f;
+    for (uint32_t t = 0; t < meshlet->triangle_count; t++) {
+      const vec3_t *n = &normals[t];
+      if (n->x || n->y || n->z)
+        min_dot = fminf(min_dot, n->x * axis.x + n->y * axis.y + n->z * axis.z);
+    }
+  }
+  hfree(normals);
+  meshlet->cone_axis[0] = axis.x;
+  meshlet->cone_axis[1] = axis.y;
+  meshlet->cone_axis[2] = axis.z;
+  // Normals spread close to a hemisphere or wider can't be culled as a whole
+  meshlet->cone_cutoff = min_dot <= 0.1f ? 1.0f : sqrtf(1.0f - min_dot * min_dot);
+}
+
+// Split index_count indices from first_index into meshlets in triangle order, starting a new
+// meshlet whenever the next triangle would overflow either limit. Cache-optimized input gives
+// well-filled, spatially coherent meshlets. Returns the number of meshlets.
+uint32_t build_meshlets(const mesh_t *mesh, uint32_t first_index, uint32_t index_count, meshlet_data_t *data) {
+  uint32_t num_triangles = index_count / 3;
+  // Worst case is a meshlet per triangle
+  data->meshlets = halloc_type(meshlet_t, num_triangles);
+  data->vertices = halloc_type(uint32_t, index_count);
+  data->triangles = halloc_type(uint8_t, index_count);
+  data->num_meshlets = 0;
+  uint8_t *local = halloc_type(uint8_t, mesh->num_vertices); // Vertex's slot in the current meshlet
+  memset(local, 0xff, mesh->num_vertices);
+
+  const uint32_t *indices = &mesh->indices[first_index];
+  meshlet_t *meshlet = NULL;
+  uint32_t num_vertices = 0,
+           num_local_triangles = 0;
+  for (uint32_t t = 0; t < num_triangles; t++) {
+    const uint32_t *triangle = &indices[t * 3];
+    uint32_t new_vertices = 0;
+    for (uint32_t j = 0; j < 3; j++)
+      new_vertices += local[triangle[j]] == 0xff &&
+                      (j < 1 || triangle[j] != triangle[0]) &&
+                      (j < 2 || triangle[j] != triangle[1]);
+    if (!meshlet ||
+        meshlet->vertex_count + new_vertices > MESHLET_MAX_VERTICES ||
+        meshlet->triangle_count == MESHLET_MAX_TRIANGLES) {
+      if (meshlet) {
+        compute_meshlet_bounds(mesh, data, meshlet);
+        for (uint32_t i = 0; i < meshlet->vertex_count; i++)
+          local[data->vertices[meshlet->vertex_offset + i]] = 0xff;
+      }
+      meshlet = &data->meshlets[data->num_meshlets++];
+      meshlet->vertex_offset = num_vertices;
+      meshlet->triangle_offset = num_local_triangles;
+      meshlet->vertex_count = 0;
+      meshlet->triangle_count = 0;
+    }
+    for (uint32_t j = 0; j < 3; j++) {
+      uint32_t v = triangle[j];
+      if (local[v] == 0xff) {
+        local[v] = (uint8_t)meshlet->vertex_count++;
+        data->vertices[num_vertices++] = v;
+      }
+      data->triangles[num_local_triangles * 3 + j] = local[v];
+    }
+    meshlet->triangle_count++;
+    num_local_triangles++;
+  }
+  if (meshlet)
+    compute_meshlet_bounds(mesh, data, meshlet);
+
+  hfree(local);
+  return data->num_meshlets;
+}
+
+// Conservative: true only if every triangle in the meshlet faces away from the camera
+bool meshlet_backfacing(const meshlet_t *meshlet, const vec3_t *camera) {
+  float dx = meshlet->centre[0] - camera->x,
+        dy = meshlet->centre[1] - camera->y,
+        dz = meshlet->centre[2] - camera->z;
+  float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+  return dx * meshlet->cone_axis[0] + dy * meshlet->cone_axis[1] + dz * meshlet->cone_axis[2] >=
+         meshlet->cone_cutoff * distance + meshlet->radius;
+}
+
+void destroy_meshlets(meshlet_data_t *data) {
+  hfree(data->meshlets);
+  hfree(data->vertices);
+  hfree(data->triangles);
+  memset(data, 0, sizeof (meshlet_data_t));
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include "mesh.h"
+
+// Common mesh shader limits; 124 triangles keeps the local index data a multiple of 4 bytes
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+// A cluster of triangles with bounds for culling it as a whole
+typedef struct {
+  uint32_t vertex_offset; // Into meshlet_data_t.vertices
+  uint32_t triangle_offset; // Into meshlet_data_t.triangles, 3 local indices each
+  uint32_t vertex_count;
+  uint32_t triangle_count;
+  float centre[3]; // Bounding sphere
+  float radius;
+  float cone_axis[3]; // Average facing direction of the triangles
+  float cone_cutoff; // Sine of the normals' spread about the axis; 1 disables cone culling
+} meshlet_t;
+
+typedef struct {
+  meshlet_t *meshlets;
+  uint32_t num_meshlets;
+  uint32_t *vertices; // Mesh vertex indices
+  uint8_t *triangles; // Indices into each meshlet's vertices
+} meshlet_data_t;
+
+uint32_t build_meshlets(const mesh_t *, uint32_t, uint32_t, meshlet_data_t *);
+bool meshlet_backfacing(const meshlet_t *, const vec3_t *);
+void destroy_meshlets(meshlet_data_t *);
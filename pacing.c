@@ -0,0 +1,72 @@
+#include <string.h>
+#include "pacing.h"
+#include "log.h"
+
+double pacer_ms(const pacer_t *pacer, LARGE_INTEGER from, LARGE_INTEGER to) {
+  return (to.QuadPart - from.QuadPart) * 1000.0 / pacer->frequency.QuadPart;
+}
+
+void init_pacer(pacer_t *pacer, bool paced) {
+  memset(pacer, 0, sizeof (pacer_t));
+  pacer->paced = paced;
+  QueryPerformanceFrequency(&pacer->frequency);
+}
+
+// The frame about to be recorded reads the input handled so far
+void pacer_begin_frame(pacer_t *pacer, uint64_t id) {
+  QueryPerformanceCounter(&pacer->starts[id % PACING_HISTORY]);
+}
+
+// Frame id finished on the GPU at done and, when known, became visible at presented. Latency is
+// measured to the present if there is one, otherwise to GPU completion
+void pacer_end_frame(pacer_t *pacer, uint64_t id, LARGE_INTEGER done, const LARGE_INTEGER *presented) {
+  if (id <= pacer->observed_id)
+    return;
+  bool consecutive = id == pacer->observed_id + 1;
+  pacer->observed_id = id;
+  LARGE_INTEGER start = pacer->starts[id % PACING_HISTORY];
+  double latency = pacer_ms(pacer, start, presented ? *presented : done);
+  pacer->latency_sum_ms += latency;
+  if (latency > pacer->latency_max_ms)
+    pacer->latency_max_ms = latency;
+  if (++pacer->latency_count == LATENCY_REPORT_FRAMES) {
+    log_console_info("Latency: %.2f ms average, %.2f ms max from input to %s over %d frames",
+                     pacer->latency_sum_ms / pacer->latency_count, pacer->latency_max_ms,
+                     presented ? "present" : "GPU completion", pacer->latency_count);
+    pacer->latency_sum_ms = 0.0;
+    pacer->latency_max_ms = 0.0;
+    pacer->latency_count = 0;
+  }
+
+  double work = pacer_ms(pacer, start, done);
+  pacer->work_ms = pacer->work_ms ? pacer->work_ms + (work - pacer->work_ms) * PACING_SMOOTHING : work;
+  if (!pacer->paced || !presented) {
+    // Without present timing there's no refresh to aim for
+    pacer->has_target = false;
+    return;
+  }
+  if (consecutive && pacer->last_present.QuadPart) {
+    double interval = pacer_ms(pacer, pacer->last_present, *presented);
+    if (interval < PACING_MAX_INTERVAL_MS)
+      pacer->interval_ms = pacer->interval_ms
+                         ? pacer->interval_ms + (interval - pacer->interval_ms) * PACING_SMOOTHING
+                         : interval;
+  }
+  pacer->last_present = *presented;
+  // Start late enough that the frame is done just in time for the refresh after this one
+  double delay = pacer->interval_ms - pacer->work_ms - PACING_MARGIN_MS;
+  pacer->has_target = pacer->interval_ms && delay > 0.0;
+  if (pacer->has_target)
+    pacer->target.QuadPart = presented->QuadPart + (LONGLONG)(delay * pacer->frequency.QuadPart / 1000.0);
+}
+
+// Whole milliseconds to wait before starting the next frame, rounded down so the frame never
+// starts late
+DWORD pacer_delay_ms(const pacer_t *pacer) {
+  if (!pacer->has_target)
+    return 0;
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  double delay = pacer_ms(pacer, now, pacer->target);
+  return delay >= 1.0 ? (DWORD)delay : 0;
+}
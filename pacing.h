@@ -0,0 +1,33 @@
+#pragma once
+
+#include <windows.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PACING_HISTORY 16 // Frames whose start times are kept, more than can ever be in flight
+#define PACING_SMOOTHING 0.1 // Weight of the newest sample in the moving averages
+#define PACING_MARGIN_MS 1.5 // Slack left between the predicted finish and the display's deadline
+#define PACING_MAX_INTERVAL_MS 100.0 // Longer gaps between presents are stalls, not refresh intervals
+#define LATENCY_REPORT_FRAMES 300
+
+// Delays the start of each frame so it finishes just before the next refresh, sampling input
+// as late as possible. Frames are identified by their present id
+typedef struct {
+  bool paced; // Otherwise only latency is measured
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER starts[PACING_HISTORY]; // When each frame sampled its input
+  uint64_t observed_id; // Latest frame whose completion has been seen
+  LARGE_INTEGER last_present;
+  double interval_ms; // Average time between presents, the refresh interval when paced
+  double work_ms; // Average time from a frame's start until the GPU finishes it
+  LARGE_INTEGER target; // When the next frame should start
+  bool has_target;
+  double latency_sum_ms;
+  double latency_max_ms;
+  uint32_t latency_count;
+} pacer_t;
+
+void init_pacer(pacer_t *, bool);
+void pacer_begin_frame(pacer_t *, uint64_t);
+void pacer_end_frame(pacer_t *, uint64_t, LARGE_INTEGER, const LARGE_INTEGER *);
+DWORD pacer_delay_ms(const pacer_t *);
@@ -0,0 +1,185 @@
+#include "pipeline.h"
+#include "renderer.h"
+#include "log.h"
+
+VkResult compile_compute_pipeline(pipeline_t *pipeline) {
+  VkComputePipelineCreateInfo create_info = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+  create_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  create_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  create_info.stage.module = pipeline->desc.compute_shader;
+  create_info.stage.pName = SHADER_ENTRY_POINT_NAME;
+  create_info.layout = pipeline->desc.layout;
+  VkPipelineCreationFeedbackEXT stage_feedback;
+  VkPipelineCreationFeedbackCreateInfoEXT feedback_info = { VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT };
+  feedback_info.pPipelineCreationFeedback = &pipeline->feedback;
+  feedback_info.pipelineStageCreationFeedbackCount = 1;
+  feedback_info.pPipelineStageCreationFeedbacks = &stage_feedback;
+  if (pipeline->desc.creation_feedback)
+    create_info.pNext = &feedback_info;
+  return vkCreateComputePipelines(pipeline->device, pipeline->cache, 1, &create_info, NULL, &pipeline->pipeline);
+}
+
+VkResult compile_graphics_pipeline(pipeline_t *pipeline) {
+  const pipeline_desc_t *desc = &pipeline->desc;
+
+  // Shader stages
+  VkPipelineShaderStageCreateInfo shader_stages[] = {
+    { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO },
+    { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO }
+  };
+  shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  shader_stages[0].module = desc->vertex_shader;
+  shader_stages[0].pName = SHADER_ENTRY_POINT_NAME;
+  shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  shader_stages[1].module = desc->fragment_shader;
+  shader_stages[1].pName = SHADER_ENTRY_POINT_NAME;
+
+  // Vertex input state
+  VkPipelineVertexInputStateCreateInfo vertex_input_state = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+  vertex_input_state.vertexBindingDescriptionCount = desc->num_bindings;
+  vertex_input_state.pVertexBindingDescriptions = desc->bindings;
+  vertex_input_state.vertexAttributeDescriptionCount = desc->num_attributes;
+  vertex_input_state.pVertexAttributeDescriptions = desc->attributes;
+
+  // Input assembly state
+  VkPipelineInputAssemblyStateCreateInfo input_assembly_state = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+  input_assembly_state.topology = desc->topology;
+
+  // Viewport state (dynamic)
+  VkPipelineViewportStateCreateInfo viewport_state = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+  viewport_state.viewportCount = 1;
+  viewport_state.scissorCount = 1;
+
+  // Rasterization state
+  VkPipelineRasterizationStateCreateInfo rasterization_state = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+  rasterization_state.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterization_state.cullMode = desc->cull_mode;
+  rasterization_state.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  rasterization_state.depthBiasEnable = VK_FALSE;
+  rasterization_state.lineWidth = 1.0f;
+
+  // Multisample state
+  VkPipelineMultisampleStateCreateInfo multisample_state = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+  multisample_state.rasterizationSamples = desc->samples;
+  if (desc->min_sample_shading > 0.0f) {
+    multisample_state.sampleShadingEnable = VK_TRUE;
+    multisample_state.minSampleShading = desc->min_sample_shading;
+  }
+
+  // Depth stencil
+  VkPipelineDepthStencilStateCreateInfo depth_stencil_state = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+  depth_stencil_state.depthTestEnable = desc->depth_test;
+  depth_stencil_state.depthWriteEnable = desc->depth_test;
+  depth_stencil_state.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+  depth_stencil_state.depthBoundsTestEnable = VK_FALSE;
+  depth_stencil_state.stencilTestEnable = VK_FALSE;
+  depth_stencil_state.front.failOp = VK_STENCIL_OP_KEEP;
+  depth_stencil_state.front.passOp = VK_STENCIL_OP_KEEP;
+  depth_stencil_state.front.depthFailOp = VK_STENCIL_OP_KEEP;
+  depth_stencil_state.front.compareOp = VK_COMPARE_OP_ALWAYS;
+  depth_stencil_state.front.compareMask = 0;
+  depth_stencil_state.front.writeMask = UINT32_MAX; // 0xffffffff;
+  depth_stencil_state.front.reference = 0;
+  depth_stencil_state.back = depth_stencil_state.front;
+  depth_stencil_state.minDepthBounds = 0.0f;
+  depth_stencil_state.maxDepthBounds = 1.0f;
+
+  // Colour blending
+  VkPipelineColorBlendAttachmentState colour_blend_attachment_state = { 0 };
+  colour_blend_attachment_state.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
+                                                 VK_COLOR_COMPONENT_G_BIT |
+                                                 VK_COLOR_COMPONENT_B_BIT |
+                                                 VK_COLOR_COMPONENT_A_BIT;
+  VkPipelineColorBlendStateCreateInfo colour_blend_state = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+  colour_blend_state.attachmentCount = 1;
+  colour_blend_state.pAttachments = &colour_blend_attachment_state;
+
+  // Dynamic states
+  const VkDynamicState dynamic_states[] = {
+    VK_DYNAMIC_STATE_VIEWPORT,
+    VK_DYNAMIC_STATE_SCISSOR
+  };
+  VkPipelineDynamicStateCreateInfo dynamic_state = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+  dynamic_state.dynamicStateCount = ARRAY_COUNT(dynamic_states);
+  dynamic_state.pDynamicStates = dynamic_states;
+
+  VkGraphicsPipelineCreateInfo create_info = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+  create_info.stageCount = ARRAY_COUNT(shader_stages);
+  create_info.pStages = shader_stages;
+  create_info.pVertexInputState = &vertex_input_state;
+  create_info.pInputAssemblyState = &input_assembly_state;
+  create_info.pViewportState = &viewport_state;
+  create_info.pRasterizationState = &rasterization_state;
+  create_info.pMultisampleState = &multisample_state;
+  create_info.pDepthStencilState = &depth_stencil_state;
+  create_info.pColorBlendState = &colour_blend_state;
+  create_info.pDynamicState = &dynamic_state;
+  create_info.layout = desc->layout;
+  create_info.renderPass = desc->render_pass;
+  VkPipelineCreationFeedbackEXT stage_feedback[ARRAY_COUNT(shader_stages)];
+  VkPipelineCreationFeedbackCreateInfoEXT feedback_info = { VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT };
+  feedback_info.pPipelineCreationFeedback = &pipeline->feedback;
+  feedback_info.pipelineStageCreationFeedbackCount = ARRAY_COUNT(shader_stages);
+  feedback_info.pPipelineStageCreationFeedbacks = stage_feedback;
+  if (desc->creation_feedback)
+    create_info.pNext = &feedback_info;
+  return vkCreateGraphicsPipelines(pipeline->device, pipeline->cache, 1, &create_info, NULL, &pipeline->pipeline);
+}
+
+void compile_pipeline(void *data) {
+  pipeline_t *pipeline = (pipeline_t *)data;
+  LARGE_INTEGER start, end, frequency;
+  QueryPerformanceCounter(&start);
+
+  // The pipeline cache is internally synchronized, so workers can share it
+  VkResult result = pipeline->desc.compute_shader
+                  ? compile_compute_pipeline(pipeline)
+                  : compile_graphics_pipeline(pipeline);
+
+  QueryPerformanceCounter(&end);
+  QueryPerformanceFrequency(&frequency);
+  pipeline->build_ms = (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+  if (result) {
+    LOG_DEBUG_ERROR("Pipeline compilation failed - VkResult: %d", result);
+    InterlockedExchange(&pipeline->state, PIPELINE_FAILED);
+    return;
+  }
+  InterlockedExchange(&pipeline->state, PIPELINE_READY);
+  if (pipeline->on_ready)
+    pipeline->on_ready(pipeline);
+}
+
+// Queue pipelines for compilation on the task pool; each becomes usable when pipeline_ready() returns true
+void build_pipelines(task_pool_t *pool, VkDevice device, VkPipelineCache cache, pipeline_t *pipelines, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    pipelines[i].pipeline = VK_NULL_HANDLE;
+    pipelines[i].state = PIPELINE_PENDING;
+    pipelines[i].device = device;
+    pipelines[i].cache = cache;
+    pipelines[i].feedback.flags = 0;
+    pipelines[i].pool = pool;
+    submit_group_task(pool, &pipelines[i].group, compile_pipeline, &pipelines[i]);
+  }
+  LOG_DEBUG_INFO("Queued %d pipelines for compilation", count);
+}
+
+bool pipeline_ready(pipeline_t *pipeline) {
+  return InterlockedCompareExchange(&pipeline->state, PIPELINE_READY, PIPELINE_READY) == PIPELINE_READY;
+}
+
+// Wait for just these pipelines' compilation, whether or not it succeeded
+void wait_pipelines(pipeline_t *pipelines, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++)
+    if (pipelines[i].pool)
+      wait_task_group(pipelines[i].pool, &pipelines[i].group);
+}
+
+// Pipelines must no longer be compiling (see wait_pipelines)
+void destroy_pipelines(pipeline_t *pipelines, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (pipelines[i].pipeline)
+      vkDestroyPipeline(pipelines[i].device, pipelines[i].pipeline, NULL);
+    pipelines[i].pipeline = VK_NULL_HANDLE;
+  }
+  LOG_DEBUG_INFO("Destroyed %d pipelines", count);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <windows.h>
+#include <stdbool.h>
+#include "tasks.h"
+
+#define PIPELINE_MAX_BINDINGS 4
+#define PIPELINE_MAX_ATTRIBUTES 16
+
+typedef enum {
+  PIPELINE_PENDING,
+  PIPELINE_READY,
+  PIPELINE_FAILED
+} PIPELINE_STATE;
+
+// Everything needed to build a pipeline, copied by value so it can be compiled on any thread.
+// Setting compute_shader builds a compute pipeline and only layout is used besides.
+typedef struct {
+  VkShaderModule compute_shader;
+  VkShaderModule vertex_shader;
+  VkShaderModule fragment_shader;
+  uint32_t num_bindings;
+  VkVertexInputBindingDescription bindings[PIPELINE_MAX_BINDINGS];
+  uint32_t num_attributes;
+  VkVertexInputAttributeDescription attributes[PIPELINE_MAX_ATTRIBUTES];
+  VkPrimitiveTopology topology;
+  VkCullModeFlags cull_mode;
+  VkSampleCountFlagBits samples;
+  float min_sample_shading; // 0 disables sample shading
+  bool depth_test;
+  VkPipelineLayout layout;
+  VkRenderPass render_pass;
+  bool creation_feedback; // Chain VK_EXT_pipeline_creation_feedback to learn whether the cache hit
+} pipeline_desc_t;
+
+typedef struct pipeline_s pipeline_t;
+typedef struct pipeline_s {
+  pipeline_desc_t desc;
+  VkPipeline pipeline;
+  volatile LONG state; // PIPELINE_STATE
+  double build_ms;
+  VkPipelineCreationFeedbackEXT feedback; // Of the whole pipeline, with desc.creation_feedback
+  VkDevice device;
+  VkPipelineCache cache;
+  void (*on_ready)(pipeline_t *); // Called on the worker thread once built
+  task_pool_t *pool;
+  task_group_t group; // The compilation, so it can be waited on apart from other tasks
+} pipeline_t;
+
+void build_pipelines(task_pool_t *, VkDevice, VkPipelineCache, pipeline_t *, uint32_t);
+bool pipeline_ready(pipeline_t *);
+void wait_pipelines(pipeline_t *, uint32_t);
+void destroy_pipelines(pipeline_t *, uint32_t);
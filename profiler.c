@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <stdio.h>
+#include "profiler.h"
+#include "heap.h"
+#include "log.h"
+
+#ifdef PROFILE
+
+__declspec(thread) profile_buffer_t *thread_buffer;
+profile_buffer_t *volatile buffers; // Every thread's buffer, pushed without a lock
+volatile LONG profiling_finished; // Set once the trace is written and the buffers freed
+
+profile_buffer_t *get_thread_buffer() {
+  if (!thread_buffer) {
+    profile_buffer_t *buffer = halloc_type(profile_buffer_t, 1);
+    buffer->num_zones = 0;
+    buffer->thread_id = GetCurrentThreadId();
+    do
+      buffer->next = buffers;
+    while (InterlockedCompareExchangePointer((PVOID volatile *)&buffers, buffer, buffer->next) != buffer->next);
+    thread_buffer = buffer;
+  }
+  return thread_buffer;
+}
+
+profile_zone_t begin_profile_zone(const char *name) {
+  profile_zone_t zone = { name };
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  zone.start = counter.QuadPart;
+  return zone;
+}
+
+void end_profile_zone(profile_zone_t *zone) {
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  zone->end = counter.QuadPart;
+  // Any thread's buffer may have been freed, and this one would never be written
+  assert(!profiling_finished);
+  if (profiling_finished)
+    return;
+  profile_buffer_t *buffer = get_thread_buffer();
+  buffer->zones[buffer->num_zones++ & (PROFILE_THREAD_ZONES - 1)] = *zone;
+}
+
+// Split so the product can't overflow
+int64_t ticks_to_ns(int64_t ticks, int64_t frequency) {
+  return ticks / frequency * 1000000000 + ticks % frequency * 1000000000 / frequency;
+}
+
+// Writes the zones as Chrome trace complete events, which Perfetto also reads, then frees the
+// buffers. Other threads must have stopped recording; zones ended afterwards assert
+void write_profile_trace(const char *path) {
+  FILE *fp;
+  if (fopen_s(&fp, path, "w")) {
+    log_console_error("Could not write profile trace to %s", path);
+    return;
+  }
+  InterlockedExchange(&profiling_finished, 1);
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  // Times are relative to the earliest zone kept
+  int64_t origin = INT64_MAX;
+  for (profile_buffer_t *buffer = buffers; buffer; buffer = buffer->next) {
+    uint64_t num_zones = buffer->num_zones < PROFILE_THREAD_ZONES ? buffer->num_zones : PROFILE_THREAD_ZONES;
+    for (uint64_t i = 0; i < num_zones; i++)
+      if (buffer->zones[i].start < origin)
+        origin = buffer->zones[i].start;
+  }
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+  uint64_t total = 0;
+  profile_buffer_t *buffer = buffers;
+  while (buffer) {
+    uint64_t first = buffer->num_zones > PROFILE_THREAD_ZONES ? buffer->num_zones - PROFILE_THREAD_ZONES : 0;
+    for (uint64_t i = first; i < buffer->num_zones; i++) {
+      const profile_zone_t *zone = &buffer->zones[i & (PROFILE_THREAD_ZONES - 1)];
+      int64_t start = ticks_to_ns(zone->start - origin, frequency.QuadPart);
+      int64_t duration = ticks_to_ns(zone->end - zone->start, frequency.QuadPart);
+      fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld}",
+              total++ ? ",\n" : "", zone->name, buffer->thread_id, start / 1000, start % 1000,
+              duration / 1000, duration % 1000);
+    }
+    profile_buffer_t *next = buffer->next;
+    hfree(buffer);
+    buffer = next;
+  }
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  fclose(fp);
+  buffers = NULL;
+  thread_buffer = NULL;
+  log_console_info("Wrote %llu profile zones to %s", total, path);
+}
+
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#define PROFILE_TRACE_PATH "trace.json"
+#define PROFILE_THREAD_ZONES 65536 // Most recent zones kept per thread, a power of 2
+
+// Zones time the code between PROFILE_BEGIN and PROFILE_END in the same scope, nesting by time
+// on each thread. Names must be string literals, or otherwise outlive the profiler. Defining
+// PROFILE builds them in, otherwise they compile away entirely
+#ifdef PROFILE
+#define PROFILE_BEGIN(zone, name) profile_zone_t zone = begin_profile_zone(name)
+#define PROFILE_END(zone) end_profile_zone(&zone)
+#define PROFILE_WRITE(path) write_profile_trace(path)
+#else
+#define PROFILE_BEGIN(zone, name)
+#define PROFILE_END(zone)
+#define PROFILE_WRITE(path)
+#endif
+
+typedef struct {
+  const char *name;
+  int64_t start; // Performance counter ticks
+  int64_t end;
+} profile_zone_t;
+
+// Written only by its thread, so recording takes no locks. Once full, the oldest zones are
+// overwritten
+typedef struct profile_buffer_s {
+  profile_zone_t zones[PROFILE_THREAD_ZONES];
+  uint64_t num_zones; // Ever recorded, the next is written at num_zones % PROFILE_THREAD_ZONES
+  DWORD thread_id;
+  struct profile_buffer_s *next;
+} profile_buffer_t;
+
+profile_zone_t begin_profile_zone(const char *);
+void end_profile_zone(profile_zone_t *);
+void write_profile_trace(const char *);
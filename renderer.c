@@ -1,8 +1,14 @@
 #include <stdio.h>
+#include <float.h>
+#include <io.h>
+#include <zlib125/zlib.h>
 #include "renderer.h"
 #include "window.h"
 #include "log.h"
 #include "heap.h"
+#include "shaders.h"
+#include "initgraph.h"
+#include "profiler.h"
 
 vk_env_t vk_env = { VE_OK };
 
@@ -116,7 +122,15 @@ const char *VK_ERRORS[] = {
   "No physical devices available",
   "No physical device with rasterization support available",
   "Could not open shader file",
-  "Could not read shader file"
+  "Could not read shader file",
+  "No surface formats available",
+  "No suitable surface format available",
+  "No presentation modes available",
+  "No suitable presentation mode available",
+  "No suitable depth format available",
+  "No suitable texture format available",
+  "Shader not embedded in executable",
+  "Could not load texture image"
 };
 
 #ifdef _DEBUG
@@ -140,6 +154,20 @@ const char *device_extensions[] = {
 };
 const uint32_t device_extension_count = ARRAY_COUNT(device_extensions);
 
+// Enabled together with GPU_SUPPORT_PRESENT_WAIT
+const char *present_wait_extensions[] = {
+  VK_KHR_PRESENT_ID_EXTENSION_NAME,
+  VK_KHR_PRESENT_WAIT_EXTENSION_NAME
+};
+
+// Indexed by LATENCY_MODE. Low latency keeps one frame in flight on a double-buffered FIFO
+// swapchain and paces it; throughput lets the CPU run as far ahead as the swapchain allows
+const latency_mode_t latency_modes[] = {
+  { "low", { VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_KHR }, 2, 1, true },
+  { "balanced", { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_KHR }, 3, 2, false },
+  { "throughput", { VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_KHR }, 3, 3, false }
+};
+
 #ifdef _DEBUG
 void log_vk_error(const char *file, long line, const char *function, VkResult error) {
   log_console_error("VULKAN ERROR: '%s', line %ld, '%s' - VkResult: %d", file, line, function, error);
@@ -149,19 +177,26 @@ VkBool32 VKAPI_CALL debug_messenger_callback(VkDebugUtilsMessageSeverityFlagBits
                                              VkDebugUtilsMessageTypeFlagsEXT messageTypes,
                                              const VkDebugUtilsMessengerCallbackDataEXT *pCallbackData,
                                              void *pUserData) {
+  char name[VALIDATION_NAME_STRLEN];
+  uint32_t count = count_validation_message(&vk_env.validation, messageSeverity, pCallbackData, name);
+  if (!count || count > VALIDATION_REPEATS)
+    return VK_FALSE;
   switch (messageSeverity) {
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT:
-      log_console_error(pCallbackData->pMessage);
+      log_console_error("%s", pCallbackData->pMessage);
       break;
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT:
-      log_console_warning(pCallbackData->pMessage);
+      log_console_warning("%s", pCallbackData->pMessage);
       break;
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT:
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT:
     default:
-      log_console_info(pCallbackData->pMessage);
+      log_console_info("%s", pCallbackData->pMessage);
       break;
   }
+  if (count == VALIDATION_REPEATS)
+    log_console_info("Validation message %s logged %d times, further copies are summarized every %d ms",
+                     name, count, VALIDATION_SUMMARY_MS);
   return VK_FALSE;
 }
 
@@ -172,7 +207,9 @@ VULKAN_ERROR enum_validation_layers() {
   if (!num_layers)
     return VE_NO_INSTANCE_LAYERS;
   VULKAN_ERROR ve = VE_OK;
-  VkLayerProperties *layer_properties = halloc_type(VkLayerProperties, num_layers);
+  arena_t *scratch = scratch_arena();
+  size_t mark = arena_mark(scratch);
+  VkLayerProperties *layer_properties = arena_alloc_type(scratch, VkLayerProperties, num_layers);
   VK_CALL(vkEnumerateInstanceLayerProperties(&num_layers, layer_properties));
   for (i = 0; i < validation_layer_count; i++) {
     for (j = 0;
@@ -182,7 +219,7 @@ VULKAN_ERROR enum_validation_layers() {
     if (j == num_layers)
       ve = VE_INSTANCE_LAYER_UNAVAILABLE;
   }
-  hfree(layer_properties);
+  arena_reset(scratch, mark);
   return ve;
 }
 #endif
@@ -194,7 +231,9 @@ VULKAN_ERROR enum_instance_extensions() {
   if (!num_extensions)
     return VE_NO_INSTANCE_EXTENSIONS;
   VULKAN_ERROR ve = VE_OK;
-  VkExtensionProperties *extensions = halloc_type(VkExtensionProperties, num_extensions);
+  arena_t *scratch = scratch_arena();
+  size_t mark = arena_mark(scratch);
+  VkExtensionProperties *extensions = arena_alloc_type(scratch, VkExtensionProperties, num_extensions);
   VK_CALL(vkEnumerateInstanceExtensionProperties(NULL, &num_extensions, extensions));
   for (i = 0; i < instance_extension_count; i++) {
     for (j = 0;
@@ -204,17 +243,27 @@ VULKAN_ERROR enum_instance_extensions() {
     if (j == num_extensions)
       ve = VE_INSTANCE_EXTENSION_UNAVAILABLE;
   }
-  hfree(extensions);
+  arena_reset(scratch, mark);
   return ve;
 }
 
+double elapsed_ms(LARGE_INTEGER start) {
+  LARGE_INTEGER now, frequency;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&frequency);
+  return (now.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+}
+
 void push_create(void (*create)(), void (*destroy)()) {
   cds_entry_t *cs_entry = halloc_type(cds_entry_t, 1);
   cs_entry->destroy = destroy;
   cs_entry->next = vk_env.cd_stack;
   vk_env.cd_stack = cs_entry;
-  if (create)
+  if (create) {
+    PROFILE_BEGIN(zone, "push_create");
     create();
+    PROFILE_END(zone);
+  }
 }
 
 void pop_destroy() {
@@ -234,6 +283,7 @@ void create_instance() {
   debug_messenger_create_info.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY;
   debug_messenger_create_info.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE;
   debug_messenger_create_info.pfnUserCallback = debug_messenger_callback;
+  init_validation_filter(&vk_env.validation, vk_env.validation_severity);
 #endif
   VkApplicationInfo app_info = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
   app_info.pApplicationName = APP_NAME;
@@ -265,6 +315,9 @@ void destroy_instance() {
   VK_CALL_EXT_VOID(vkDestroyDebugUtilsMessengerEXT, vk_env.instance, vk_env.debug_messenger, NULL);
 #endif
   vkDestroyInstance(vk_env.instance, NULL);
+#ifdef _DEBUG
+  destroy_validation_filter(&vk_env.validation);
+#endif
 
   LOG_DEBUG_INFO("End destroy_instance()");
 }
@@ -289,7 +342,9 @@ VULKAN_ERROR select_surface_format(VkPhysicalDevice physical_device, VkSurfaceKH
     return VE_NO_SURFACE_FORMATS;
 
   VULKAN_ERROR ve = VE_OK;
-  VkSurfaceFormatKHR *surface_formats = halloc_type(VkSurfaceFormatKHR, num_formats);
+  arena_t *scratch = scratch_arena();
+  size_t mark = arena_mark(scratch);
+  VkSurfaceFormatKHR *surface_formats = arena_alloc_type(scratch, VkSurfaceFormatKHR, num_formats);
   VK_CALL(vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &num_formats, surface_formats));
 
   if (num_formats == 1 && surface_formats[0].format == VK_FORMAT_UNDEFINED) {
@@ -311,7 +366,7 @@ VULKAN_ERROR select_surface_format(VkPhysicalDevice physical_device, VkSurfaceKH
   else
     ve = VE_NO_SUITABLE_SURFACE_FORMAT;
 
-  hfree(surface_formats);
+  arena_reset(scratch, mark);
   return ve;
 }
 
@@ -326,30 +381,43 @@ VkBool32 set_num_buffers(VkPhysicalDevice physical_device, VkSurfaceKHR surface,
   return gpu->num_buffers == num_requested;
 }
 
-VkBool32 set_num_aa_samples(VkPhysicalDevice physical_device, GPU *gpu, uint32_t num_requested) {
+// The highest power of two at or below the request that both the surface and depth formats
+// support, so an unsupported -samples value lowers the quality rather than ruling the device out
+void set_num_aa_samples(VkPhysicalDevice physical_device, GPU *gpu, uint32_t num_requested) {
   LOG_DEBUG_INFO("%d antialiasing samples requested", num_requested);
-  gpu->num_aa_samples = num_requested;
-  if (num_requested < VK_SAMPLE_COUNT_1_BIT || num_requested > VK_SAMPLE_COUNT_16_BIT)
-    return VK_FALSE;
-  if (num_requested == VK_SAMPLE_COUNT_1_BIT) // Always supported
-    return VK_TRUE;
-  VkImageFormatProperties image_format_props;
+  gpu->num_aa_samples = VK_SAMPLE_COUNT_1_BIT; // Always supported
+  if (num_requested <= VK_SAMPLE_COUNT_1_BIT)
+    return;
+  VkImageFormatProperties colour_props, depth_props;
   VK_CALL(vkGetPhysicalDeviceImageFormatProperties(
     physical_device,
     gpu->surface_format.format,
     VK_IMAGE_TYPE_2D,
     VK_IMAGE_TILING_OPTIMAL,
     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-    0, &image_format_props
+    0, &colour_props
   ));
+  VK_CALL(vkGetPhysicalDeviceImageFormatProperties(
+    physical_device,
+    gpu->depth_format,
+    VK_IMAGE_TYPE_2D,
+    VK_IMAGE_TILING_OPTIMAL,
+    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+    0, &depth_props
+  ));
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  VkSampleCountFlags supported = colour_props.sampleCounts & depth_props.sampleCounts &
+                                 properties.limits.framebufferColorSampleCounts &
+                                 properties.limits.framebufferDepthSampleCounts;
   VkSampleCountFlagBits count;
   for (
     count = VK_SAMPLE_COUNT_16_BIT;
-    count >= VK_SAMPLE_COUNT_2_BIT &&
-    (gpu->num_aa_samples < count || !FLAGGED(image_format_props.sampleCounts, count));
+    count > VK_SAMPLE_COUNT_1_BIT &&
+    (num_requested < count || !FLAGGED(supported, count));
     count >>= 1
     );
-  return count == num_requested;
+  gpu->num_aa_samples = count;
 }
 
 VkBool32 set_present_mode(VkPresentModeKHR *present_modes, uint32_t num_modes,
@@ -368,20 +436,23 @@ VkBool32 set_present_mode(VkPresentModeKHR *present_modes, uint32_t num_modes,
 }
 
 VULKAN_ERROR select_present_mode(VkPhysicalDevice physical_device, VkSurfaceKHR surface, VkPresentModeKHR *present_mode) {
+  const latency_mode_t *mode = &latency_modes[vk_env.latency_mode];
   uint32_t num_modes;
   VK_CALL(vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &num_modes, NULL));
   if (!num_modes)
     return VE_NO_PRESENT_MODES;
 
   VULKAN_ERROR ve = VE_OK;
-  VkPresentModeKHR *present_modes = halloc_type(VkPresentModeKHR, num_modes);
+  arena_t *scratch = scratch_arena();
+  size_t mark = arena_mark(scratch);
+  VkPresentModeKHR *present_modes = arena_alloc_type(scratch, VkPresentModeKHR, num_modes);
   VK_CALL(vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &num_modes, present_modes));
-  // Ideal: VK_PRESENT_MODE_MAILBOX_KHR
-  // Fallback: VK_PRESENT_MODE_FIFO_KHR (required to be supported)
-  if (!(set_present_mode(present_modes, num_modes, VK_PRESENT_MODE_MAILBOX_KHR, present_mode) ||
+  // The latency mode's preference, falling back to VK_PRESENT_MODE_FIFO_KHR (required to be supported)
+  if (!(set_present_mode(present_modes, num_modes, mode->present_modes[0], present_mode) ||
+        set_present_mode(present_modes, num_modes, mode->present_modes[1], present_mode) ||
         set_present_mode(present_modes, num_modes, VK_PRESENT_MODE_FIFO_KHR, present_mode)))
     ve = VE_NO_SUITABLE_PRESENT_MODE;
-  hfree(present_modes);
+  arena_reset(scratch, mark);
 
   return ve;
 }
@@ -395,8 +466,8 @@ VULKAN_ERROR select_texture_format(VkPhysicalDevice physical_device, VkFormat *t
   VkFormatProperties format_properties;
   for (uint32_t i = 0; i < num_formats; i++) {
     vkGetPhysicalDeviceFormatProperties(physical_device, formats[i], &format_properties);
-    if (FLAGGED(format_properties.linearTilingFeatures,
-                VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+    if (FLAGGED(format_properties.optimalTilingFeatures,
+                VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT)) {
       *texture_format = formats[i];
       LOG_DEBUG_INFO("Selected texture format: %d", formats[i]);
       return VE_OK;
@@ -407,7 +478,9 @@ VULKAN_ERROR select_texture_format(VkPhysicalDevice physical_device, VkFormat *t
 
 VULKAN_ERROR select_depth_format(VkPhysicalDevice physical_device, VkFormat *depth_format) {
   const VkFormat formats[] = {
-    // Need stencil bits, so choose one of these two
+    // Nothing uses stencil, so depth-only formats come first
+    VK_FORMAT_D32_SFLOAT,
+    VK_FORMAT_D16_UNORM,
     VK_FORMAT_D32_SFLOAT_S8_UINT,
     VK_FORMAT_D24_UNORM_S8_UINT
   };
@@ -416,9 +489,7 @@ VULKAN_ERROR select_depth_format(VkPhysicalDevice physical_device, VkFormat *dep
 
   for (uint32_t i = 0; i < num_formats; i++) {
     vkGetPhysicalDeviceFormatProperties(physical_device, formats[i], &format_properties);
-    if (FLAGGED(format_properties.linearTilingFeatures |
-                format_properties.optimalTilingFeatures,
-                VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)) {
+    if (FLAGGED(format_properties.optimalTilingFeatures, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)) {
       *depth_format = formats[i];
       LOG_DEBUG_INFO("Selected depth format: %d", formats[i]);
       return VE_OK;
@@ -434,13 +505,16 @@ VULKAN_ERROR select_physical_device(uint32_t num_buffers, uint32_t num_aa_sample
   VK_CALL(vkEnumeratePhysicalDevices(vk_env.instance, &num_gpus, NULL));
   if (!num_gpus)
     return VE_NO_PHYSICAL_DEVICES;
-  VkPhysicalDevice *physical_devices = halloc_type(VkPhysicalDevice, num_gpus);
+  // Per device arrays are released along with these at the end
+  arena_t *scratch = scratch_arena();
+  size_t mark = arena_mark(scratch);
+  VkPhysicalDevice *physical_devices = arena_alloc_type(scratch, VkPhysicalDevice, num_gpus);
   VK_CALL(vkEnumeratePhysicalDevices(vk_env.instance, &num_gpus, physical_devices));
-  GPU *gpus = halloc_type(GPU, num_gpus);
+  GPU *gpus = arena_alloc_type(scratch, GPU, num_gpus);
+  bool *suitable = arena_alloc_clear_type(scratch, bool, num_gpus);
+  uint32_t num_suitable = 0;
 
-  VkPhysicalDeviceProperties properties;
   VkPhysicalDeviceFeatures features;
-  GPU_SUPPORT best = GPU_SUPPORT_NONE;
   int selected = -1;
   VULKAN_ERROR ve = VE_NO_SUPPORTED_PHYSICAL_DEVICE;
   for (i = 0; i < num_gpus; i++) {
@@ -450,7 +524,7 @@ VULKAN_ERROR select_physical_device(uint32_t num_buffers, uint32_t num_aa_sample
       continue;
     gpus[i].graphics_qfi = UINT32_MAX;
     gpus[i].present_qfi = UINT32_MAX;
-    VkQueueFamilyProperties *queue_families = halloc_type(VkQueueFamilyProperties, num_queue_families);
+    VkQueueFamilyProperties *queue_families = arena_alloc_type(scratch, VkQueueFamilyProperties, num_queue_families);
     vkGetPhysicalDeviceQueueFamilyProperties(physical_devices[i], &num_queue_families, queue_families);
     for (j = 0; j < num_queue_families; j++) {
       if (gpus[i].graphics_qfi == UINT32_MAX &&
@@ -464,7 +538,6 @@ VULKAN_ERROR select_physical_device(uint32_t num_buffers, uint32_t num_aa_sample
           gpus[i].present_qfi = j;
       }
     }
-    hfree(queue_families);
     if (gpus[i].graphics_qfi == UINT32_MAX || gpus[i].present_qfi == UINT32_MAX)
       continue;
 
@@ -472,39 +545,106 @@ VULKAN_ERROR select_physical_device(uint32_t num_buffers, uint32_t num_aa_sample
     VK_CALL(vkEnumerateDeviceExtensionProperties(physical_devices[i], NULL, &num_extensions, NULL));
     if (!num_extensions)
       continue;
-    VkExtensionProperties *extensions = halloc_type(VkExtensionProperties, num_extensions);
+    VkExtensionProperties *extensions = arena_alloc_type(scratch, VkExtensionProperties, num_extensions);
     VK_CALL(vkEnumerateDeviceExtensionProperties(physical_devices[i], NULL, &num_extensions, extensions));
+    uint32_t num_present_wait_extensions = 0;
+    bool synchronization2_extension = false;
     for (j = 0; j < num_extensions; j++) {
       if (!strcmp(VK_KHR_SWAPCHAIN_EXTENSION_NAME, extensions[j].extensionName))
         gpus[i].support |= GPU_SUPPORT_RASTERIZATION;
       else if (!strcmp(VK_NV_RAY_TRACING_EXTENSION_NAME, extensions[j].extensionName))
         gpus[i].support |= GPU_SUPPORT_RAYTRACING;
+      else if (!strcmp(VK_KHR_PRESENT_ID_EXTENSION_NAME, extensions[j].extensionName) ||
+               !strcmp(VK_KHR_PRESENT_WAIT_EXTENSION_NAME, extensions[j].extensionName))
+        num_present_wait_extensions++;
+      else if (!strcmp(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME, extensions[j].extensionName))
+        synchronization2_extension = true;
+      else if (!strcmp(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, extensions[j].extensionName))
+        gpus[i].support |= GPU_SUPPORT_MEMORY_BUDGET;
+      else if (!strcmp(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME, extensions[j].extensionName))
+        gpus[i].support |= GPU_SUPPORT_CREATION_FEEDBACK;
     }
-    hfree(extensions);
 
     if (select_surface_format(physical_devices[i], vk_env.surface, &gpus[i].surface_format) ||
         !set_num_buffers(physical_devices[i], vk_env.surface, &gpus[i], num_buffers) ||
-        !set_num_aa_samples(physical_devices[i], &gpus[i], num_aa_samples) ||
         select_present_mode(physical_devices[i], vk_env.surface, &gpus[i].present_mode) ||
         select_texture_format(physical_devices[i], &gpus[i].texture_format) ||
         select_depth_format(physical_devices[i], &gpus[i].depth_format))
       continue;
-
-    vkGetPhysicalDeviceFeatures(physical_devices[i], &features);
+    set_num_aa_samples(physical_devices[i], &gpus[i], num_aa_samples);
+
+    vkGetPhysicalDeviceProperties(physical_devices[i], &gpus[i].properties);
+    gpus[i].name = gpus[i].properties.deviceName;
+
+    VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR };
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR };
+    VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR };
+    VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+    if (gpus[i].properties.apiVersion >= VK_API_VERSION_1_2)
+      features2.pNext = &features12;
+    if (num_present_wait_extensions == ARRAY_COUNT(present_wait_extensions)) {
+      present_id_features.pNext = features2.pNext;
+      present_wait_features.pNext = &present_id_features;
+      features2.pNext = &present_wait_features;
+    }
+    if (synchronization2_extension) {
+      synchronization2_features.pNext = features2.pNext;
+      features2.pNext = &synchronization2_features;
+    }
+    vkGetPhysicalDeviceFeatures2(physical_devices[i], &features2);
+    features = features2.features;
     if (features.textureCompressionBC)
       gpus[i].support |= GPU_SUPPORT_TEXTURE_COMPRESSION;
     if (features.samplerAnisotropy)
       gpus[i].support |= GPU_SUPPORT_ANISTROPIC_FILTERING;
     if (features.sampleRateShading)
       gpus[i].support |= GPU_SUPPORT_SAMPLE_SHADING;
+    if (features.multiDrawIndirect && features.drawIndirectFirstInstance)
+      gpus[i].support |= GPU_SUPPORT_MULTI_DRAW_INDIRECT;
+    if (features12.drawIndirectCount)
+      gpus[i].support |= GPU_SUPPORT_DRAW_INDIRECT_COUNT;
+    if (present_id_features.presentId && present_wait_features.presentWait)
+      gpus[i].support |= GPU_SUPPORT_PRESENT_WAIT;
+    if (synchronization2_features.synchronization2)
+      gpus[i].support |= GPU_SUPPORT_SYNCHRONIZATION2;
+    if (features12.runtimeDescriptorArray &&
+        features12.descriptorBindingPartiallyBound &&
+        features12.descriptorBindingSampledImageUpdateAfterBind &&
+        features12.descriptorBindingUpdateUnusedWhilePending &&
+        features12.shaderSampledImageArrayNonUniformIndexing)
+      gpus[i].support |= GPU_SUPPORT_DESCRIPTOR_INDEXING;
+
+    // Presenting needs the swapchain extension
+    if (!FLAGGED(gpus[i].support, GPU_SUPPORT_RASTERIZATION))
+      continue;
+    score_gpu(physical_devices[i], &gpus[i].properties, gpus[i].support, &gpus[i].score);
+    suitable[i] = true;
+    num_suitable++;
+  }
 
-    vkGetPhysicalDeviceProperties(physical_devices[i], &properties);
-    gpus[i].name = properties.deviceName;
-
-    if (gpus[i].support > best) {
-      best = gpus[i].support;
+  // A device named by -gpu wins outright; otherwise devices are compared by type, then by the
+  // benchmark when it's enabled and there's a choice to make, then by score
+  if (vk_env.gpu_selector[0]) {
+    for (i = 0; i < num_gpus && selected < 0; i++)
+      if (suitable[i] && match_gpu(gpus[i].name, &gpus[i].score, vk_env.gpu_selector))
+        selected = i;
+    if (selected < 0)
+      log_console_warning("No suitable physical device matches '%s', selecting by score", vk_env.gpu_selector);
+  }
+  bool overridden = selected >= 0;
+  for (i = 0; i < num_gpus; i++) {
+    if (!suitable[i])
+      continue;
+    if (vk_env.benchmark_gpus && num_suitable > 1 && !overridden)
+      benchmark_gpu(physical_devices[i], gpus[i].graphics_qfi, &gpus[i].score);
+    char uuid[GPU_UUID_STRLEN];
+    format_gpu_uuid(gpus[i].score.uuid, uuid);
+    log_console_info("Physical device %s (%s): type %d, %.0f MB device local, score %.1f, %.1f GB/s copied",
+                     gpus[i].name, uuid, gpus[i].score.type, gpus[i].score.device_local_size / 1048576.0,
+                     gpus[i].score.score, gpus[i].score.bandwidth);
+    if (!overridden && (selected < 0 || compare_gpus(&gpus[i].score, &gpus[selected].score) > 0))
       selected = i;
-    }
   }
 
   if (selected >= 0) {
@@ -514,24 +654,41 @@ VULKAN_ERROR select_physical_device(uint32_t num_buffers, uint32_t num_aa_sample
     vk_env.gpu.name = _strdup(gpu->name);
     if (gpu->graphics_qfi != gpu->present_qfi)
       vk_env.distinct_qfi = true;
-    LOG_DEBUG_INFO("Selected physical device: %s", gpu->name);
+    log_console_info("Selected physical device: %s%s", gpu->name, overridden ? ", overridden by -gpu" : "");
     ve = VE_OK;
   }
 
-  hfree(gpus);
-  hfree(physical_devices);
+  arena_reset(scratch, mark);
 
   LOG_DEBUG_INFO("End select_physical_device()");
   return ve;
 }
 
+// Init step wrapping select_physical_device, which needs the surface
+void select_gpu() {
+  const latency_mode_t *latency_mode = &latency_modes[vk_env.latency_mode];
+  vk_env.gpu.num_aa_samples = vk_env.aa.mode == AA_MODE_FXAA ? VK_SAMPLE_COUNT_1_BIT : vk_env.aa.samples;
+  if ((vk_env.error = select_physical_device(latency_mode->num_buffers, vk_env.gpu.num_aa_samples)))
+    return;
+  if (vk_env.aa.mode == AA_MODE_MSAA && vk_env.gpu.num_aa_samples != vk_env.aa.samples) {
+    log_console_warning("%d MSAA samples unsupported, using %d", vk_env.aa.samples, vk_env.gpu.num_aa_samples);
+    vk_env.aa.samples = vk_env.gpu.num_aa_samples;
+  }
+  if (vk_env.bindless.enabled && !FLAGGED(vk_env.gpu.support, GPU_SUPPORT_DESCRIPTOR_INDEXING)) {
+    vk_env.bindless.enabled = false;
+    log_console_info("Bindless textures need descriptor indexing, using per-image texture descriptors");
+  }
+}
+
 void create_logical_device() {
   LOG_DEBUG_INFO("Begin create_logical_device()");
 
   // Number of queues will be 1 or 2 depending on whether or not graphics_qfi == present_qfi
   uint32_t num_queues = 1 + vk_env.distinct_qfi;
   const float queue_priorities[1] = { 1.0f };
-  VkDeviceQueueCreateInfo *queue_create_info = halloc_clear_type(VkDeviceQueueCreateInfo, num_queues);
+  arena_t *scratch = scratch_arena();
+  size_t mark = arena_mark(scratch);
+  VkDeviceQueueCreateInfo *queue_create_info = arena_alloc_clear_type(scratch, VkDeviceQueueCreateInfo, num_queues);
   for (uint32_t i = 0; i < num_queues; i++) {
     queue_create_info[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
     queue_create_info[i].queueFamilyIndex = i ? vk_env.gpu.present_qfi : vk_env.gpu.graphics_qfi;
@@ -543,14 +700,58 @@ void create_logical_device() {
   device_features.textureCompressionBC = VK_TRUE;
   device_features.samplerAnisotropy = VK_TRUE;
   device_features.sampleRateShading = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_SAMPLE_SHADING);
-
+  device_features.multiDrawIndirect = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_MULTI_DRAW_INDIRECT);
+  device_features.drawIndirectFirstInstance = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_MULTI_DRAW_INDIRECT);
+  VkPhysicalDeviceVulkan12Features device_features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+  device_features12.drawIndirectCount = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_DRAW_INDIRECT_COUNT);
+  device_features12.runtimeDescriptorArray = vk_env.bindless.enabled;
+  device_features12.descriptorBindingPartiallyBound = vk_env.bindless.enabled;
+  device_features12.descriptorBindingSampledImageUpdateAfterBind = vk_env.bindless.enabled;
+  device_features12.descriptorBindingUpdateUnusedWhilePending = vk_env.bindless.enabled;
+  device_features12.shaderSampledImageArrayNonUniformIndexing = vk_env.bindless.enabled;
+  VkPhysicalDevicePresentIdFeaturesKHR present_id_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR };
+  present_id_features.presentId = VK_TRUE;
+  VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR };
+  present_wait_features.presentWait = VK_TRUE;
+  present_wait_features.pNext = &present_id_features;
+  VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR };
+  synchronization2_features.synchronization2 = VK_TRUE;
+
+  const char *extensions[ARRAY_COUNT(device_extensions) + ARRAY_COUNT(present_wait_extensions) + 3];
+  uint32_t num_extensions = device_extension_count;
+  memcpy(extensions, device_extensions, sizeof device_extensions);
   VkDeviceCreateInfo device_info = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
   device_info.queueCreateInfoCount = num_queues;
   device_info.pQueueCreateInfos = queue_create_info;
-  device_info.enabledExtensionCount = device_extension_count;
-  device_info.ppEnabledExtensionNames = device_extensions;
+  device_info.ppEnabledExtensionNames = extensions;
   device_info.pEnabledFeatures = &device_features;
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_DRAW_INDIRECT_COUNT) || vk_env.bindless.enabled)
+    device_info.pNext = &device_features12;
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_PRESENT_WAIT)) {
+    memcpy(&extensions[num_extensions], present_wait_extensions, sizeof present_wait_extensions);
+    num_extensions += ARRAY_COUNT(present_wait_extensions);
+    present_id_features.pNext = (void *)device_info.pNext;
+    device_info.pNext = &present_wait_features;
+  }
+  // The frame graph's barriers fall back to vkCmdPipelineBarrier without it
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_SYNCHRONIZATION2)) {
+    extensions[num_extensions++] = VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME;
+    synchronization2_features.pNext = (void *)device_info.pNext;
+    device_info.pNext = &synchronization2_features;
+  }
+  // Texture streaming fits within the configured budget alone without it
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_MEMORY_BUDGET))
+    extensions[num_extensions++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+  // Only reports whether pipelines hit the cache
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_CREATION_FEEDBACK))
+    extensions[num_extensions++] = VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME;
+  device_info.enabledExtensionCount = num_extensions;
   VK_CALL(vkCreateDevice(vk_env.gpu.device, &device_info, NULL, &vk_env.device));
+  init_memory_tracker(&vk_env.memory, vk_env.gpu.device, FLAGGED(vk_env.gpu.support, GPU_SUPPORT_MEMORY_BUDGET));
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_PRESENT_WAIT))
+    vk_env.wait_for_present = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(vk_env.device, "vkWaitForPresentKHR");
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_SYNCHRONIZATION2))
+    vk_env.pipeline_barrier2 = (PFN_vkCmdPipelineBarrier2KHR)vkGetDeviceProcAddr(vk_env.device, "vkCmdPipelineBarrier2KHR");
 
   vkGetDeviceQueue(vk_env.device, vk_env.gpu.graphics_qfi, 0, &vk_env.graphics_queue);
   if (vk_env.distinct_qfi)
@@ -558,13 +759,37 @@ void create_logical_device() {
   else
     vk_env.present_queue = vk_env.graphics_queue;
 
-  hfree(queue_create_info);
+  arena_reset(scratch, mark);
 
   LOG_DEBUG_INFO("End create_logical_device()");
 }
 
+void create_deletion_queue() {
+  init_deletion_queue(&vk_env.deletion, vk_env.device);
+}
+
+void destroy_deletion_queue_final() {
+  destroy_deletion_queue(&vk_env.deletion);
+  LOG_DEBUG_INFO("Destroyed deletion queue");
+}
+
+// Destroy the object once the frames that may be using it complete, rather than idling the device
+void defer_destroy(VkObjectType type, uint64_t handle) {
+  queue_deletion(&vk_env.deletion, type, handle, vk_env.frame_count);
+}
+
+// The frame fence waited on at the start of frame n belongs to frame n - frame_lag, and fences
+// signal in submission order, so every frame up to that one has completed
+void release_deferred() {
+  if (vk_env.frame_count >= vk_env.frame_lag)
+    release_deletions(&vk_env.deletion, vk_env.frame_count - vk_env.frame_lag);
+}
+
 void destroy_logical_device() {
   LOG_DEBUG_INFO("Begin destroy_logical_device()");
+  if (vk_env.memory.num_allocations)
+    log_console_warning("%d device memory allocations were not freed", vk_env.memory.num_allocations);
+  destroy_memory_tracker(&vk_env.memory);
   vkDestroyDevice(vk_env.device, NULL);
   LOG_DEBUG_INFO("End destroy_logical_device()");
 }
@@ -587,28 +812,65 @@ void create_command_buffers() {
   allocate_info.commandPool = vk_env.command_pool;
   allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
   allocate_info.commandBufferCount = vk_env.gpu.num_buffers;
-  vk_env.command_buffers = halloc_type(VkCommandBuffer, vk_env.gpu.num_buffers);
+  vk_env.command_buffers = arena_alloc_type(&vk_env.arena, VkCommandBuffer, vk_env.gpu.num_buffers);
+  vk_env.commands_stale = arena_alloc_clear_type(&vk_env.arena, bool, vk_env.gpu.num_buffers);
   VK_CALL(vkAllocateCommandBuffers(vk_env.device, &allocate_info, vk_env.command_buffers));
   LOG_DEBUG_INFO("Created %d command buffers", vk_env.gpu.num_buffers);
 }
 
 void destroy_command_buffers() {
   vkFreeCommandBuffers(vk_env.device, vk_env.command_pool, vk_env.gpu.num_buffers, vk_env.command_buffers);
-  hfree(vk_env.command_buffers);
   LOG_DEBUG_INFO("Destroyed %d command buffers", vk_env.gpu.num_buffers);
 }
 
+// Command pools are externally synchronized, so every worker thread records from its own
+// pool for each swapchain image
+void create_recorders() {
+  if (!vk_env.threaded_recording)
+    return;
+  vk_env.num_recorders = vk_env.task_pool.num_threads;
+  uint32_t count = vk_env.gpu.num_buffers * vk_env.num_recorders;
+  vk_env.recorders = arena_alloc_type(&vk_env.arena, secondary_recorder_t, count);
+  vk_env.secondary_command_buffers = arena_alloc_type(&vk_env.arena, VkCommandBuffer, count);
+  VkCommandPoolCreateInfo create_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+  create_info.queueFamilyIndex = vk_env.gpu.graphics_qfi;
+  VkCommandBufferAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  allocate_info.commandBufferCount = 1;
+  for (uint32_t i = 0; i < count; i++) {
+    vk_env.recorders[i].image = i / vk_env.num_recorders;
+    VK_CALL(vkCreateCommandPool(vk_env.device, &create_info, NULL, &vk_env.recorders[i].command_pool));
+    allocate_info.commandPool = vk_env.recorders[i].command_pool;
+    VK_CALL(vkAllocateCommandBuffers(vk_env.device, &allocate_info, &vk_env.secondary_command_buffers[i]));
+  }
+  LOG_DEBUG_INFO("Created %d secondary command pools and buffers", count);
+}
+
+void destroy_recorders() {
+  if (!vk_env.recorders)
+    return;
+  uint32_t count = vk_env.gpu.num_buffers * vk_env.num_recorders;
+  // Destroying a pool frees its command buffers
+  for (uint32_t i = 0; i < count; i++)
+    vkDestroyCommandPool(vk_env.device, vk_env.recorders[i].command_pool, NULL);
+  vk_env.recorders = NULL;
+  LOG_DEBUG_INFO("Destroyed %d secondary command pools and buffers", count);
+}
+
 void create_sync_objects() {
   VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
   fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
   VkSemaphoreCreateInfo semaphore_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
-  // Allow maximum of (num_buffers - 1) concurrent frames
-  vk_env.frame_lag = vk_env.gpu.num_buffers - 1;
-  vk_env.fences = halloc_type(VkFence, vk_env.frame_lag);
-  vk_env.image_acquired_semaphores = halloc_type(VkSemaphore, vk_env.frame_lag);
-  vk_env.draw_complete_semaphores = halloc_type(VkSemaphore, vk_env.frame_lag);
+  // Frames in flight for the latency mode, never more than there are swapchain images
+  vk_env.frame_lag = latency_modes[vk_env.latency_mode].frames_in_flight;
+  CLAMP(vk_env.frame_lag, 1, vk_env.gpu.num_buffers);
+  vk_env.fences = arena_alloc_type(&vk_env.arena, VkFence, vk_env.frame_lag);
+  vk_env.frame_present_ids = arena_alloc_clear_type(&vk_env.arena, uint64_t, vk_env.frame_lag);
+  vk_env.image_fences = arena_alloc_clear_type(&vk_env.arena, VkFence, vk_env.gpu.num_buffers);
+  vk_env.image_acquired_semaphores = arena_alloc_type(&vk_env.arena, VkSemaphore, vk_env.frame_lag);
+  vk_env.draw_complete_semaphores = arena_alloc_type(&vk_env.arena, VkSemaphore, vk_env.frame_lag);
   if (vk_env.distinct_qfi)
-    vk_env.image_ownership_semaphores = halloc_type(VkSemaphore, vk_env.frame_lag);
+    vk_env.image_ownership_semaphores = arena_alloc_type(&vk_env.arena, VkSemaphore, vk_env.frame_lag);
   uint32_t i;
   for (i = 0; i < vk_env.frame_lag; i++) {
     VK_CALL(vkCreateFence(vk_env.device, &fence_info, NULL, &vk_env.fences[i]));
@@ -630,25 +892,36 @@ void destroy_sync_objects() {
     if (vk_env.distinct_qfi)
       vkDestroySemaphore(vk_env.device, vk_env.image_ownership_semaphores[i], NULL);
   }
-  hfree(vk_env.fences);
-  hfree(vk_env.image_acquired_semaphores);
-  hfree(vk_env.draw_complete_semaphores);
-  if (vk_env.distinct_qfi)
-    hfree(vk_env.image_ownership_semaphores);
   LOG_DEBUG_INFO("Destroyed %d fences and %d semaphores", i, i * (2 + vk_env.distinct_qfi));
 }
 
+// Wait until no frame is in flight, without idling the whole device
+void wait_frames() {
+  VK_CALL(vkWaitForFences(vk_env.device, vk_env.frame_lag, vk_env.fences, VK_TRUE, UINT64_MAX));
+}
+
+// A multisampled scene is resolved into the swapchain image by the render pass. A single-sample
+// one is drawn straight into it instead, unless FXAA reads it first
+bool resolve_scene() {
+  return vk_env.aa.mode == AA_MODE_MSAA && vk_env.gpu.num_aa_samples > VK_SAMPLE_COUNT_1_BIT;
+}
+
+// The frame graph transitions the attachments before and after the render pass, so they start
+// and end it in their attachment layouts
 void create_render_pass() {
   LOG_DEBUG_INFO("Begin create_render_pass()");
 
+  bool resolve = resolve_scene();
   VkAttachmentDescription colour_desc = { 0 };
   colour_desc.format = vk_env.gpu.surface_format.format;
   colour_desc.samples = vk_env.gpu.num_aa_samples;
   colour_desc.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  colour_desc.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  // With MSAA only the resolved image is kept; with FXAA the post-process pass reads the scene,
+  // and with a single sample it is the swapchain image
+  colour_desc.storeOp = resolve ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
   colour_desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   colour_desc.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  colour_desc.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  colour_desc.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
   colour_desc.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
   const VkAttachmentReference colour_attachment = {
     0, // attachment
@@ -660,9 +933,9 @@ void create_render_pass() {
   depth_desc.samples = vk_env.gpu.num_aa_samples;
   depth_desc.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
   depth_desc.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  depth_desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  depth_desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   depth_desc.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  depth_desc.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  depth_desc.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
   depth_desc.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
   const VkAttachmentReference depth_attachment = {
     1, // attachment
@@ -676,8 +949,8 @@ void create_render_pass() {
   resolve_desc.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
   resolve_desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   resolve_desc.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  resolve_desc.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  resolve_desc.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  resolve_desc.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  resolve_desc.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
   const VkAttachmentReference resolve_attachment = {
     2, // attachment
     VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL // layout
@@ -690,10 +963,11 @@ void create_render_pass() {
   subpass.colorAttachmentCount = 1;
   subpass.pColorAttachments = &colour_attachment;
   subpass.pDepthStencilAttachment = &depth_attachment;
-  subpass.pResolveAttachments = &resolve_attachment;
+  subpass.pResolveAttachments = resolve ? &resolve_attachment : NULL;
 
   VkRenderPassCreateInfo create_info = { VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO };
-  create_info.attachmentCount = ARRAY_COUNT(attachments);
+  // The resolve attachment is last so it can be left out
+  create_info.attachmentCount = resolve ? ARRAY_COUNT(attachments) : ARRAY_COUNT(attachments) - 1;
   create_info.pAttachments = attachments;
   create_info.subpassCount = 1;
   create_info.pSubpasses = &subpass;
@@ -707,100 +981,323 @@ void destroy_render_pass() {
   LOG_DEBUG_INFO("Destroyed render pass");
 }
 
-VULKAN_ERROR create_shader_module(const char *stage) {
+#ifdef _DEBUG
+// Development override: a compiled module in shaders\spv takes precedence over the embedded copy
+VULKAN_ERROR load_shader_file(const char *name, uint32_t **code, size_t *size) {
   char path[64];
-  snprintf(path, 64, "shaders\\spv\\%s.%s.spv", SHADER_NAME, stage);
-  LOG_DEBUG_INFO("Loading shader '%s'...", path);
+  snprintf(path, 64, "shaders\\spv\\%s.spv", name);
 
   FILE *fp;
   if (fopen_s(&fp, path, "rb"))
     return VE_SHADER_FILE_OPEN;
+  LOG_DEBUG_INFO("Loading shader override '%s'...", path);
   long length = -1;
   if (!fseek(fp, 0, SEEK_END)) {
     length = ftell(fp);
     rewind(fp);
   }
   VULKAN_ERROR ve = VE_OK;
-  uint32_t *code = NULL;
+  *code = NULL;
   if (length <= 0 || (length % 4))
     ve = VE_SHADER_FILE_READ;
   else {
-    code = (uint32_t *)halloc(length);
-    if (fread(code, length, 1, fp) != 1)
+    *code = (uint32_t *)halloc(length);
+    *size = (size_t)length;
+    if (fread(*code, length, 1, fp) != 1) {
+      hfree(*code);
+      *code = NULL;
       ve = VE_SHADER_FILE_READ;
+    }
   }
   fclose(fp);
+  return ve;
+}
+#endif
 
-  if (code) {
-    if (!ve) {
-      VkShaderModuleCreateInfo shader_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
-      shader_info.codeSize = (size_t)length;
-      shader_info.pCode = code;
-      VK_CALL(vkCreateShaderModule(
-        vk_env.device, &shader_info, NULL,
-        *stage == 'v' ? &vk_env.vertex_shader : &vk_env.fragment_shader
-      ));
-      LOG_DEBUG_INFO("Created shader module: %s.%s", SHADER_NAME, stage);
-    }
-    hfree(code);
+VULKAN_ERROR create_shader_module(const char *name, VkShaderModule *shader_module) {
+  VkShaderModuleCreateInfo shader_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+  uint32_t *file_code = NULL;
+#ifdef _DEBUG
+  VULKAN_ERROR ve = load_shader_file(name, &file_code, &shader_info.codeSize);
+  if (ve && ve != VE_SHADER_FILE_OPEN)
+    return ve;
+  shader_info.pCode = file_code;
+#endif
+  if (!file_code) {
+    const embedded_shader_t *shader = find_embedded_shader(name);
+    if (!shader)
+      return VE_SHADER_NOT_EMBEDDED;
+    shader_info.codeSize = shader->size;
+    shader_info.pCode = shader->code;
   }
 
-  return ve;
+  VK_CALL(vkCreateShaderModule(vk_env.device, &shader_info, NULL, shader_module));
+  LOG_DEBUG_INFO("Created shader module: %s (%s)", name, file_code ? "file" : "embedded");
+  if (file_code)
+    hfree(file_code);
+
+  return VE_OK;
 }
 
-void destroy_shader_module(const char *stage) {
-  vkDestroyShaderModule(vk_env.device, *stage == 'v' ? vk_env.vertex_shader : vk_env.fragment_shader, NULL);
-  LOG_DEBUG_INFO("Destroyed shader module: %s.%s", SHADER_NAME, stage);
+void destroy_shader_module(const char *name, VkShaderModule shader_module) {
+  vkDestroyShaderModule(vk_env.device, shader_module, NULL);
+  LOG_DEBUG_INFO("Destroyed shader module: %s", name);
 }
 
 void create_shader_modules() {
-  (vk_env.error = create_shader_module("vert")) ||
-  (vk_env.error = create_shader_module("frag"));
+  (vk_env.error = create_shader_module(SHADER_NAME ".vert", &vk_env.vertex_shader)) ||
+  (vk_env.error = create_shader_module(SHADER_NAME ".frag", &vk_env.fragment_shader)) ||
+  (vk_env.bindless.enabled && (vk_env.error = create_shader_module(BINDLESS_SHADER_NAME ".frag", &vk_env.bindless_shader))) ||
+  (vk_env.error = create_shader_module(CULL_SHADER_NAME ".comp", &vk_env.cull_shader)) ||
+  (vk_env.error = create_shader_module(POST_SHADER_NAME ".comp", &vk_env.post_shader));
 }
 
 void destroy_shader_modules() {
-  destroy_shader_module("vert");
-  destroy_shader_module("frag");
+  destroy_shader_module(SHADER_NAME ".vert", vk_env.vertex_shader);
+  destroy_shader_module(SHADER_NAME ".frag", vk_env.fragment_shader);
+  if (vk_env.bindless.enabled)
+    destroy_shader_module(BINDLESS_SHADER_NAME ".frag", vk_env.bindless_shader);
+  destroy_shader_module(CULL_SHADER_NAME ".comp", vk_env.cull_shader);
+  destroy_shader_module(POST_SHADER_NAME ".comp", vk_env.post_shader);
 }
 
-void alloc_device_memory(VkMemoryRequirements requirements, VkFlags flags, VkDeviceMemory *device_memory) {
-  VkMemoryAllocateInfo mem_alloc_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
-  mem_alloc_info.allocationSize = requirements.size;
+// First memory type allowed by type_bits with all of flags, or VK_MAX_MEMORY_TYPES
+uint32_t find_memory_type(uint32_t type_bits, VkFlags flags) {
   uint32_t index;
   for (
     index = 0;
     index < VK_MAX_MEMORY_TYPES &&
-    !(FLAGGED(requirements.memoryTypeBits, 1 << index) &&
+    !(FLAGGED(type_bits, 1 << index) &&
       FLAGGED(vk_env.gpu.memory_properties.memoryTypes[index].propertyFlags, flags));
     index++
     );
-  mem_alloc_info.memoryTypeIndex = index;
-  VK_CALL(vkAllocateMemory(vk_env.device, &mem_alloc_info, NULL, device_memory));
-  LOG_DEBUG_INFO("Allocated %llu bytes of device memory", requirements.size);
+  return index;
+}
+
+// Write the memory tracker's live totals, high-water marks and heap budgets as JSON
+void report_memory() {
+  FILE *fp;
+  if (fopen_s(&fp, MEMORY_REPORT_PATH, "w")) {
+    log_console_warning("Could not create memory report '%s'", MEMORY_REPORT_PATH);
+    return;
+  }
+  write_memory_json(&vk_env.memory, fp);
+  fclose(fp);
+  log_console_info("Device memory: %.1f MB in %d allocations, %.1f MB peak, written to '%s'",
+                   vk_env.memory.total.size / 1048576.0, vk_env.memory.total.count,
+                   vk_env.memory.total.peak / 1048576.0, MEMORY_REPORT_PATH);
 }
 
+// Every allocation is tracked under its category until free_device_memory. A failed allocation
+// writes the memory report, so an out of memory error shows what the memory was spent on
+VkResult alloc_device_memory(VkMemoryRequirements requirements, VkFlags flags, MEMORY_CATEGORY category, VkDeviceMemory *device_memory) {
+  VkMemoryAllocateInfo mem_alloc_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+  mem_alloc_info.allocationSize = requirements.size;
+  mem_alloc_info.memoryTypeIndex = find_memory_type(requirements.memoryTypeBits, flags);
+  VkResult result = vkAllocateMemory(vk_env.device, &mem_alloc_info, NULL, device_memory);
+  if (result) {
+    track_memory_failure(&vk_env.memory);
+    log_console_error("Could not allocate %llu bytes of %s memory (%d)",
+                      requirements.size, MEMORY_CATEGORY_NAMES[category], result);
+    report_memory();
+    return result;
+  }
+  track_memory_alloc(&vk_env.memory, *device_memory, requirements.size, mem_alloc_info.memoryTypeIndex, category);
+  LOG_DEBUG_INFO("Allocated %llu bytes of %s device memory", requirements.size, MEMORY_CATEGORY_NAMES[category]);
+  return result;
+}
+
+void free_device_memory(VkDeviceMemory device_memory) {
+  if (!device_memory)
+    return;
+  track_memory_free(&vk_env.memory, device_memory);
+  vkFreeMemory(vk_env.device, device_memory, NULL);
+}
+
+// Interleave the model's primitives straight from the file mapping into the mapped vertex buffer
+float write_model_vertices(model_t *model, vertex_t *vertices) {
+  float radius_squared = 0.0f;
+  for (uint32_t i = 0; i < model->num_primitives; i++) {
+    const gltf_primitive_t *primitive = &model->primitives[i];
+    for (uint32_t j = 0; j < primitive->position.count; j++) {
+      vertex_t vertex = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f }, { 0.0f, 0.0f } };
+      read_accessor(&primitive->position, j, &vertex.position.x, 3);
+      if (primitive->colour.count)
+        read_accessor(&primitive->colour, j, &vertex.colour.x, 3);
+      if (primitive->texel.count)
+        read_accessor(&primitive->texel, j, &vertex.uv.x, 2);
+      *vertices++ = vertex;
+      float length_squared = vertex.position.x * vertex.position.x +
+                             vertex.position.y * vertex.position.y +
+                             vertex.position.z * vertex.position.z;
+      if (length_squared > radius_squared)
+        radius_squared = length_squared;
+    }
+  }
+  return sqrtf(radius_squared);
+}
+
+// Rebase each primitive's indices onto its vertices' position in the shared vertex buffer,
+// so the whole model is a single indexed draw
+void write_model_indices(model_t *model, uint32_t *indices) {
+  uint32_t base_vertex = 0;
+  for (uint32_t i = 0; i < model->num_primitives; i++) {
+    copy_indices(&model->primitives[i], base_vertex, indices);
+    indices += model->primitives[i].num_indices;
+    base_vertex += model->primitives[i].position.count;
+  }
+}
+
+float bounding_radius(const vertex_t *vertices, uint32_t num_vertices) {
+  float radius_squared = 0.0f;
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    const vec3_t *p = &vertices[i].position;
+    float length_squared = p->x * p->x + p->y * p->y + p->z * p->z;
+    if (length_squared > radius_squared)
+      radius_squared = length_squared;
+  }
+  return sqrtf(radius_squared);
+}
+
+// Split the finest LOD into meshlets and log how well they would cluster and cone-cull, from
+// a camera on each axis at a few mesh radii. Nothing draws per meshlet without mesh shaders yet
+void report_meshlets(const mesh_t *mesh) {
+  // build_meshlets allocates per triangle, so there must be one
+  if (vk_env.lods[0].index_count < 3)
+    return;
+  meshlet_data_t data;
+  uint32_t num_meshlets = build_meshlets(mesh, vk_env.lods[0].first_index, vk_env.lods[0].index_count, &data);
+  if (!num_meshlets) {
+    destroy_meshlets(&data);
+    return;
+  }
+  uint32_t num_vertices = 0,
+           num_triangles = 0,
+           num_culled = 0;
+  float distance = 4.0f * bounding_radius(mesh->vertices, mesh->num_vertices);
+  const vec3_t cameras[] = {
+    { distance, 0.0f, 0.0f }, { -distance, 0.0f, 0.0f },
+    { 0.0f, distance, 0.0f }, { 0.0f, -distance, 0.0f },
+    { 0.0f, 0.0f, distance }, { 0.0f, 0.0f, -distance }
+  };
+  for (uint32_t i = 0; i < num_meshlets; i++) {
+    num_vertices += data.meshlets[i].vertex_count;
+    num_triangles += data.meshlets[i].triangle_count;
+    for (uint32_t j = 0; j < ARRAY_COUNT(cameras); j++)
+      num_culled += meshlet_backfacing(&data.meshlets[i], &cameras[j]);
+  }
+  log_console_info("Built %d meshlets averaging %.1f vertices and %.1f triangles, %.1f%% cone-culled per axis view",
+                   num_meshlets, (float)num_vertices / num_meshlets, (float)num_triangles / num_meshlets,
+                   100.0f * num_culled / (num_meshlets * ARRAY_COUNT(cameras)));
+  destroy_meshlets(&data);
+}
+
+// Optimizing, simplifying and quantizing need the mesh in heap memory, so the model is staged
+// there instead of being written straight into the vertex and index buffers
+void create_staged_mesh() {
+  if (!vk_env.optimize_mesh && !vk_env.build_lods && vk_env.vertex_format != VERTEX_FORMAT_PACKED)
+    return;
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
+  mesh_t *mesh = &vk_env.mesh;
+  if (vk_env.model) {
+    mesh->num_vertices = vk_env.model->num_vertices;
+    mesh->num_indices = vk_env.model->num_indices;
+    mesh->vertices = halloc_type(vertex_t, mesh->num_vertices);
+    mesh->indices = halloc_type(uint32_t, mesh->num_indices);
+    write_model_vertices(vk_env.model, mesh->vertices);
+    write_model_indices(vk_env.model, mesh->indices);
+  }
+  else {
+    mesh->num_vertices = ARRAY_COUNT(cube_vertices);
+    mesh->num_indices = ARRAY_COUNT(cube_indices);
+    mesh->vertices = halloc_type(vertex_t, mesh->num_vertices);
+    mesh->indices = halloc_type(uint32_t, mesh->num_indices);
+    memcpy(mesh->vertices, cube_vertices, sizeof cube_vertices);
+    for (uint32_t i = 0; i < mesh->num_indices; i++)
+      mesh->indices[i] = cube_indices[i];
+  }
+  if (vk_env.optimize_mesh)
+    optimize_mesh(mesh);
+  if (vk_env.build_lods) {
+    vk_env.num_lods = build_lod_chain(mesh, vk_env.lods);
+    for (uint32_t i = 0; i < vk_env.num_lods; i++)
+      log_console_info("LOD %d: %d triangles, error %.5f", i, vk_env.lods[i].index_count / 3, vk_env.lods[i].error);
+    report_meshlets(mesh);
+  }
+  LOG_DEBUG_INFO("Staged mesh in %.3f ms", elapsed_ms(start));
+}
+
+void destroy_staged_mesh() {
+  destroy_mesh(&vk_env.mesh);
+}
+
+// Vertex input for each VERTEX_FORMAT, in attribute location order
+const vertex_layout_t vertex_layouts[] = {
+  {
+    sizeof (vertex_t),
+    {
+      { VK_FORMAT_R32G32B32_SFLOAT, offsetof(vertex_t, position) },
+      { VK_FORMAT_R32G32B32_SFLOAT, offsetof(vertex_t, colour) },
+      { VK_FORMAT_R32G32_SFLOAT, offsetof(vertex_t, uv) }
+    }
+  },
+  {
+    sizeof (packed_vertex_t),
+    {
+      { VK_FORMAT_R16G16B16A16_SNORM, offsetof(packed_vertex_t, position) },
+      { VK_FORMAT_R8G8B8A8_UNORM, offsetof(packed_vertex_t, colour) },
+      { VK_FORMAT_R16G16_SFLOAT, offsetof(packed_vertex_t, uv) }
+    }
+  }
+};
+
 void create_vertex_buffer() {
   LOG_DEBUG_INFO("Begin create_vertex_buffer()");
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
 
+  uint32_t num_vertices = vk_env.mesh.vertices ? vk_env.mesh.num_vertices
+                        : vk_env.model ? vk_env.model->num_vertices
+                        : ARRAY_COUNT(cube_vertices);
+  VkDeviceSize size = vertex_layouts[vk_env.vertex_format].stride * num_vertices;
   VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-  buffer_info.size = sizeof cube_vertices;
+  buffer_info.size = size;
   buffer_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-  VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, &vk_env.cube_vb.buffer));
+  VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, &vk_env.mesh_vb.buffer));
   LOG_DEBUG_INFO("Created vertex buffer");
 
   VkMemoryRequirements memory_requirements;
-  vkGetBufferMemoryRequirements(vk_env.device, vk_env.cube_vb.buffer, &memory_requirements);
+  vkGetBufferMemoryRequirements(vk_env.device, vk_env.mesh_vb.buffer, &memory_requirements);
   alloc_device_memory(
     memory_requirements,
     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-    &vk_env.cube_vb.device_memory
+    MEMORY_CATEGORY_VERTEX,
+    &vk_env.mesh_vb.device_memory
   );
-  VK_CALL(vkBindBufferMemory(vk_env.device, vk_env.cube_vb.buffer, vk_env.cube_vb.device_memory, 0));
+  VK_CALL(vkBindBufferMemory(vk_env.device, vk_env.mesh_vb.buffer, vk_env.mesh_vb.device_memory, 0));
   void *data;
-  VK_CALL(vkMapMemory(vk_env.device, vk_env.cube_vb.device_memory, 0, sizeof cube_vertices, 0, &data));
-  memcpy(data, cube_vertices, sizeof cube_vertices);
-  vkUnmapMemory(vk_env.device, vk_env.cube_vb.device_memory);
-  LOG_DEBUG_INFO("Loaded vertex buffer into device memory");
+  VK_CALL(vkMapMemory(vk_env.device, vk_env.mesh_vb.device_memory, 0, size, 0, &data));
+  // Float vertices dequantize with the identity
+  const quantization_t identity = { { 0.0f, 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f, 1.0f } };
+  vk_env.quantization = identity;
+  if (vk_env.vertex_format == VERTEX_FORMAT_PACKED) {
+    compute_quantization(vk_env.mesh.vertices, vk_env.mesh.num_vertices, &vk_env.quantization);
+    quantize_vertices(vk_env.mesh.vertices, vk_env.mesh.num_vertices, &vk_env.quantization, (packed_vertex_t *)data);
+    vk_env.mesh_radius = bounding_radius(vk_env.mesh.vertices, vk_env.mesh.num_vertices);
+  }
+  else if (vk_env.mesh.vertices) {
+    memcpy(data, vk_env.mesh.vertices, (size_t)size);
+    vk_env.mesh_radius = bounding_radius(vk_env.mesh.vertices, vk_env.mesh.num_vertices);
+  }
+  else if (vk_env.model)
+    vk_env.mesh_radius = write_model_vertices(vk_env.model, (vertex_t *)data);
+  else {
+    memcpy(data, cube_vertices, sizeof cube_vertices);
+    vk_env.mesh_radius = bounding_radius(cube_vertices, ARRAY_COUNT(cube_vertices));
+  }
+  vkUnmapMemory(vk_env.device, vk_env.mesh_vb.device_memory);
+  LOG_DEBUG_INFO("Loaded %llu bytes of vertices into device memory in %.3f ms", size, elapsed_ms(start));
 
   LOG_DEBUG_INFO("End create_vertex_buffer()");
 }
@@ -808,56 +1305,119 @@ void create_vertex_buffer() {
 void destroy_vertex_buffer() {
   LOG_DEBUG_INFO("Begin destroy_vertex_buffer()");
 
-  vkFreeMemory(vk_env.device, vk_env.cube_vb.device_memory, NULL);
+  free_device_memory(vk_env.mesh_vb.device_memory);
   LOG_DEBUG_INFO("Freed vertex buffer device memory");
-  vkDestroyBuffer(vk_env.device, vk_env.cube_vb.buffer, NULL);
+  vkDestroyBuffer(vk_env.device, vk_env.mesh_vb.buffer, NULL);
   LOG_DEBUG_INFO("Destroyed vertex buffer");
 
   LOG_DEBUG_INFO("End destroy_vertex_buffer()");
 }
 
+// Models and optimized meshes use 32-bit indices; the cube keeps 16-bit ones
 void create_index_buffer() {
-  LOG_DEBUG_INFO("Begin create_vertex_buffer()");
-
+  LOG_DEBUG_INFO("Begin create_index_buffer()");
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
+
+  uint32_t num_indices;
+  if (vk_env.mesh.indices || vk_env.model) {
+    num_indices = vk_env.mesh.indices ? vk_env.mesh.num_indices : vk_env.model->num_indices;
+    vk_env.index_type = VK_INDEX_TYPE_UINT32;
+  }
+  else {
+    num_indices = ARRAY_COUNT(cube_indices);
+    vk_env.index_type = VK_INDEX_TYPE_UINT16;
+  }
+  // Without a LOD chain the whole buffer is the only LOD
+  if (!vk_env.num_lods) {
+    vk_env.lods[0].first_index = 0;
+    vk_env.lods[0].index_count = num_indices;
+    vk_env.lods[0].error = 0.0f;
+    vk_env.num_lods = 1;
+  }
+  vk_env.num_indices = vk_env.lods[0].index_count;
+  VkDeviceSize size = vk_env.index_type == VK_INDEX_TYPE_UINT32 ? sizeof (uint32_t) * num_indices
+                                                                 : sizeof cube_indices;
   VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-  buffer_info.size = sizeof cube_indices;
+  buffer_info.size = size;
   buffer_info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-  VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, &vk_env.cube_ib.buffer));
+  VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, &vk_env.mesh_ib.buffer));
   LOG_DEBUG_INFO("Created index buffer");
 
   VkMemoryRequirements memory_requirements;
-  vkGetBufferMemoryRequirements(vk_env.device, vk_env.cube_ib.buffer, &memory_requirements);
+  vkGetBufferMemoryRequirements(vk_env.device, vk_env.mesh_ib.buffer, &memory_requirements);
   alloc_device_memory(
     memory_requirements,
     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-    &vk_env.cube_ib.device_memory
+    MEMORY_CATEGORY_INDEX,
+    &vk_env.mesh_ib.device_memory
   );
-  VK_CALL(vkBindBufferMemory(vk_env.device, vk_env.cube_ib.buffer, vk_env.cube_ib.device_memory, 0));
+  VK_CALL(vkBindBufferMemory(vk_env.device, vk_env.mesh_ib.buffer, vk_env.mesh_ib.device_memory, 0));
   void *data;
-  VK_CALL(vkMapMemory(vk_env.device, vk_env.cube_ib.device_memory, 0, sizeof cube_indices, 0, &data));
-  memcpy(data, cube_indices, sizeof cube_indices);
-  vkUnmapMemory(vk_env.device, vk_env.cube_ib.device_memory);
-  LOG_DEBUG_INFO("Loaded index buffer into device memory");
+  VK_CALL(vkMapMemory(vk_env.device, vk_env.mesh_ib.device_memory, 0, size, 0, &data));
+  if (vk_env.mesh.indices)
+    memcpy(data, vk_env.mesh.indices, (size_t)size);
+  else if (vk_env.model)
+    write_model_indices(vk_env.model, (uint32_t *)data);
+  else
+    memcpy(data, cube_indices, sizeof cube_indices);
+  vkUnmapMemory(vk_env.device, vk_env.mesh_ib.device_memory);
+  LOG_DEBUG_INFO("Loaded %llu bytes of indices into device memory in %.3f ms", size, elapsed_ms(start));
 
-  LOG_DEBUG_INFO("End create_vertex_buffer()");
+  LOG_DEBUG_INFO("End create_index_buffer()");
 }
 
 void destroy_index_buffer() {
   LOG_DEBUG_INFO("Begin destroy_index_buffer()");
 
-  vkFreeMemory(vk_env.device, vk_env.cube_ib.device_memory, NULL);
+  free_device_memory(vk_env.mesh_ib.device_memory);
   LOG_DEBUG_INFO("Freed index buffer device memory");
-  vkDestroyBuffer(vk_env.device, vk_env.cube_ib.buffer, NULL);
+  vkDestroyBuffer(vk_env.device, vk_env.mesh_ib.buffer, NULL);
   LOG_DEBUG_INFO("Destroyed index buffer");
+  vk_env.num_lods = 0;
 
   LOG_DEBUG_INFO("End destroy_index_buffer()");
 }
 
+// LOD index ranges and errors for the cull pass to choose from
+void create_lod_buffer() {
+  VkDeviceSize size = sizeof (mesh_lod_t) * vk_env.num_lods;
+  VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+  buffer_info.size = size;
+  buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, &vk_env.lod_buffer));
+  VkMemoryRequirements memory_requirements;
+  vkGetBufferMemoryRequirements(vk_env.device, vk_env.lod_buffer, &memory_requirements);
+  alloc_device_memory(
+    memory_requirements,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    MEMORY_CATEGORY_DRAW,
+    &vk_env.lod_memory
+  );
+  VK_CALL(vkBindBufferMemory(vk_env.device, vk_env.lod_buffer, vk_env.lod_memory, 0));
+  void *data;
+  VK_CALL(vkMapMemory(vk_env.device, vk_env.lod_memory, 0, size, 0, &data));
+  memcpy(data, vk_env.lods, (size_t)size);
+  vkUnmapMemory(vk_env.device, vk_env.lod_memory);
+  LOG_DEBUG_INFO("Created LOD buffer for %d LODs", vk_env.num_lods);
+}
+
+void destroy_lod_buffer() {
+  free_device_memory(vk_env.lod_memory);
+  vkDestroyBuffer(vk_env.device, vk_env.lod_buffer, NULL);
+  LOG_DEBUG_INFO("Destroyed LOD buffer");
+}
+
+// Each swapchain image reads its own slice, so the next frame's matrix can be written while
+// earlier frames are still in flight
 void create_uniform_buffer() {
   LOG_DEBUG_INFO("Begin create_uniform_buffer()");
 
+  VkDeviceSize alignment = vk_env.gpu.properties.limits.minUniformBufferOffsetAlignment;
+  vk_env.mvp_stride = (sizeof mvp + alignment - 1) & ~(alignment - 1);
+  VkDeviceSize size = vk_env.mvp_stride * vk_env.gpu.num_buffers;
   VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-  buffer_info.size = sizeof mvp;
+  buffer_info.size = size;
   buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
   VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, &vk_env.mvp_ub.buffer));
   LOG_DEBUG_INFO("Created uniform buffer");
@@ -867,10 +1427,11 @@ void create_uniform_buffer() {
   alloc_device_memory(
     memory_requirements,
     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    MEMORY_CATEGORY_UNIFORM,
     &vk_env.mvp_ub.device_memory
   );
   VK_CALL(vkBindBufferMemory(vk_env.device, vk_env.mvp_ub.buffer, vk_env.mvp_ub.device_memory, 0));
-  VK_CALL(vkMapMemory(vk_env.device, vk_env.mvp_ub.device_memory, 0, sizeof mvp, 0, &vk_env.mvp_ub.mem_ptr));
+  VK_CALL(vkMapMemory(vk_env.device, vk_env.mvp_ub.device_memory, 0, size, 0, &vk_env.mvp_ub.mem_ptr));
   LOG_DEBUG_INFO("Mapped uniform buffer to device memory");
 
   LOG_DEBUG_INFO("End create_uniform_buffer()");
@@ -881,7 +1442,7 @@ void destroy_uniform_buffer() {
 
   vkUnmapMemory(vk_env.device, vk_env.mvp_ub.device_memory);
   LOG_DEBUG_INFO("Unmapped uniform buffer pointer");
-  vkFreeMemory(vk_env.device, vk_env.mvp_ub.device_memory, NULL);
+  free_device_memory(vk_env.mvp_ub.device_memory);
   LOG_DEBUG_INFO("Freed uniform buffer device memory");
   vkDestroyBuffer(vk_env.device, vk_env.mvp_ub.buffer, NULL);
   LOG_DEBUG_INFO("Destroyed uniform buffer");
@@ -889,6 +1450,108 @@ void destroy_uniform_buffer() {
   LOG_DEBUG_INFO("End destroy_uniform_buffer()");
 }
 
+void create_device_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer *buffer, VkDeviceMemory *device_memory) {
+  VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+  buffer_info.size = size;
+  buffer_info.usage = usage;
+  VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, buffer));
+  VkMemoryRequirements memory_requirements;
+  vkGetBufferMemoryRequirements(vk_env.device, *buffer, &memory_requirements);
+  alloc_device_memory(memory_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_CATEGORY_DRAW, device_memory);
+  VK_CALL(vkBindBufferMemory(vk_env.device, *buffer, *device_memory, 0));
+}
+
+void create_instance_buffer(VkInstanceBuffer *instance_buffer, uint32_t capacity) {
+  VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+  buffer_info.size = sizeof (instance_t) * capacity;
+  buffer_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  VK_CALL(vkCreateBuffer(vk_env.device, &buffer_info, NULL, &instance_buffer->buffer));
+
+  VkMemoryRequirements memory_requirements;
+  vkGetBufferMemoryRequirements(vk_env.device, instance_buffer->buffer, &memory_requirements);
+  alloc_device_memory(
+    memory_requirements,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    MEMORY_CATEGORY_DRAW,
+    &instance_buffer->device_memory
+  );
+  VK_CALL(vkBindBufferMemory(vk_env.device, instance_buffer->buffer, instance_buffer->device_memory, 0));
+  VK_CALL(vkMapMemory(vk_env.device, instance_buffer->device_memory, 0, buffer_info.size, 0, &instance_buffer->mem_ptr));
+  instance_buffer->capacity = capacity;
+
+  // Written by the cull pass, read by the indirect draw
+  create_device_buffer(
+    sizeof (VkDrawIndexedIndirectCommand) * capacity,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+    &instance_buffer->draw_buffer,
+    &instance_buffer->draw_memory
+  );
+  create_device_buffer(
+    sizeof (uint32_t),
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    &instance_buffer->count_buffer,
+    &instance_buffer->count_memory
+  );
+}
+
+void destroy_instance_buffer(VkInstanceBuffer *instance_buffer) {
+  free_device_memory(instance_buffer->count_memory);
+  vkDestroyBuffer(vk_env.device, instance_buffer->count_buffer, NULL);
+  free_device_memory(instance_buffer->draw_memory);
+  vkDestroyBuffer(vk_env.device, instance_buffer->draw_buffer, NULL);
+  vkUnmapMemory(vk_env.device, instance_buffer->device_memory);
+  free_device_memory(instance_buffer->device_memory);
+  vkDestroyBuffer(vk_env.device, instance_buffer->buffer, NULL);
+}
+
+void create_instance_buffers() {
+  if (!vk_env.num_instances)
+    vk_env.num_instances = NUM_INSTANCES;
+  CLAMP(vk_env.num_instances, 1, MAX_INSTANCES);
+  vk_env.instance_buffers = arena_alloc_type(&vk_env.arena, VkInstanceBuffer, vk_env.gpu.num_buffers);
+  for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++)
+    create_instance_buffer(&vk_env.instance_buffers[i], vk_env.num_instances);
+  LOG_DEBUG_INFO("Created %d instance buffers for %d instances", vk_env.gpu.num_buffers, vk_env.num_instances);
+}
+
+void destroy_instance_buffers() {
+  for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++)
+    destroy_instance_buffer(&vk_env.instance_buffers[i]);
+  LOG_DEBUG_INFO("Destroyed %d instance buffers", vk_env.gpu.num_buffers);
+}
+
+// Lay instances out on a cube-shaped grid centred on the origin, each spinning about its own Y axis
+void update_instances(VkInstanceBuffer *instance_buffer) {
+  instance_t *instances = (instance_t *)instance_buffer->mem_ptr;
+  uint32_t side = (uint32_t)ceilf(cbrtf((float)vk_env.num_instances));
+  float offset = (side - 1) * INSTANCE_SPACING / 2.0f;
+  float time = vk_env.frame_count * 0.01f;
+  for (uint32_t i = 0; i < vk_env.num_instances; i++) {
+    float angle = time + i * 0.1f,
+          s = sinf(angle),
+          c = cosf(angle);
+    instance_t *instance = &instances[i];
+    instance->transform[0] = c;
+    instance->transform[1] = 0.0f;
+    instance->transform[2] = s;
+    instance->transform[3] = (i % side) * INSTANCE_SPACING - offset;
+    instance->transform[4] = 0.0f;
+    instance->transform[5] = 1.0f;
+    instance->transform[6] = 0.0f;
+    instance->transform[7] = (i / side % side) * INSTANCE_SPACING - offset;
+    instance->transform[8] = -s;
+    instance->transform[9] = 0.0f;
+    instance->transform[10] = c;
+    instance->transform[11] = (i / (side * side)) * INSTANCE_SPACING - offset;
+    instance->radius = vk_env.mesh_radius;
+    instance->texture = stream_slot(&vk_env.streamer, vk_env.texture.id);
+    // Single instance keeps the mesh's own colours
+    instance->colour = vk_env.num_instances == 1
+                     ? 0xffffffff
+                     : 0xff000000 | (i * 0x9e3779b1) >> 8;
+  }
+}
+
 VkResult create_image(VkDevice device, VkFormat format,
                       uint32_t width, uint32_t height,
                       VkSampleCountFlagBits samples, VkImageTiling tiling,
@@ -919,66 +1582,25 @@ VkResult create_image_view(VkDevice device, VkImage image, VkFormat format, VkIm
   return vkCreateImageView(device, &create_info, NULL, image_view);
 }
 
-void create_texture() {
-  LOG_DEBUG_INFO("Begin create_texture()");
+// Decoded on the task pool alongside instance and device creation
+void load_texture_image() {
+  PROFILE_BEGIN(zone, "load_png");
+  IMAGE_ERROR ie = load_png(TEXTURE_IMAGE_PATH, vk_env.image);
+  PROFILE_END(zone);
+  if (ie) {
+    log_console_error("Could not load %s: %s", TEXTURE_IMAGE_PATH, IMAGE_ERRORS[ie]);
+    vk_env.error = VE_TEXTURE_IMAGE_LOAD;
+  }
+}
 
-  VK_CALL(create_image(
-    vk_env.device,
-    vk_env.gpu.texture_format, // VK_FORMAT_R8G8B8A8_UNORM
-    vk_env.image->width,
-    vk_env.image->height,
-    VK_SAMPLE_COUNT_1_BIT,
-    VK_IMAGE_TILING_LINEAR,
-    VK_IMAGE_USAGE_SAMPLED_BIT,
-    &vk_env.texture.image
-  ));
-  LOG_DEBUG_INFO("Created texture image");
+void destroy_texture_image() {
+  destroy_image(vk_env.image);
+}
 
-  // Load image into device memory
-  VkMemoryRequirements memory_requirements;
-  vkGetImageMemoryRequirements(vk_env.device, vk_env.texture.image, &memory_requirements);
-  alloc_device_memory(
-    memory_requirements,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-    &vk_env.texture.device_memory
-  );
-  VK_CALL(vkBindImageMemory(vk_env.device, vk_env.texture.image, vk_env.texture.device_memory, 0));
-
-  // Get image row pitch
-  VkImageSubresource subresource = { VK_IMAGE_ASPECT_COLOR_BIT };
-  VkSubresourceLayout layout;
-  vkGetImageSubresourceLayout(vk_env.device, vk_env.texture.image, &subresource, &layout);
-
-  // Copy image into device memory
-  byte *data;
-  VK_CALL(vkMapMemory(vk_env.device, vk_env.texture.device_memory, 0, vk_env.image->data_length, 0, &data));
-  if (vk_env.image->bpp == 24) {
-    // Copy RGB image
-    for (uint32_t i = 0; i < vk_env.image->height; i++) {
-      for (uint32_t j = 0; j < vk_env.image->width; j++) {
-        uint32_t p = i * (uint32_t)layout.rowPitch + j * 4;
-        memcpy(&data[p], &vk_env.image->data[i * vk_env.image->byte_width + j * 3], 3);
-        data[p + 3] = 0xff; // Alpha = opaque
-      }
-    }
-  }
-  else {
-    // Copy RGBA image
-    for (uint32_t i = 0; i < vk_env.image->height; i++)
-      memcpy(&data[i * (uint32_t)layout.rowPitch], &vk_env.image->data[i * vk_env.image->byte_width], vk_env.image->byte_width);
-  }
-  vkUnmapMemory(vk_env.device, vk_env.texture.device_memory);
-  LOG_DEBUG_INFO("Loaded texture into device memory");
-
-  VK_CALL(create_image_view(
-    vk_env.device,
-    vk_env.texture.image,
-    vk_env.gpu.texture_format,
-    VK_IMAGE_ASPECT_COLOR_BIT,
-    &vk_env.texture.view)
-  );
-  LOG_DEBUG_INFO("Created texture image view");
+void create_texture() {
+  LOG_DEBUG_INFO("Begin create_texture()");
 
+  // Resident levels vary, so the sampler doesn't clamp the LOD
   VkSamplerCreateInfo sampler_info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
   sampler_info.magFilter = VK_FILTER_NEAREST;
   sampler_info.minFilter = VK_FILTER_NEAREST;
@@ -987,27 +1609,132 @@ void create_texture() {
   sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
   sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
   sampler_info.maxAnisotropy = 1;
+  sampler_info.maxLod = VK_LOD_CLAMP_NONE;
   VK_CALL(vkCreateSampler(vk_env.device, &sampler_info, NULL, &vk_env.texture.sampler));
   LOG_DEBUG_INFO("Created texture sampler");
 
+  stream_init(&vk_env.streamer, vk_env.device, vk_env.gpu.device, vk_env.graphics_queue,
+              vk_env.gpu.graphics_qfi, &vk_env.task_pool, vk_env.gpu.texture_format,
+              vk_env.bindless.enabled, FLAGGED(vk_env.gpu.support, GPU_SUPPORT_MEMORY_BUDGET),
+              vk_env.texture_budget);
+  // Only the coarsest levels are resident until the first frame requests more
+  vk_env.texture.id = stream_add_texture(&vk_env.streamer, vk_env.image, vk_env.texture.sampler);
+  LOG_DEBUG_INFO("Added streamed texture");
+
   LOG_DEBUG_INFO("End create_texture()");
 }
 
 void destroy_texture() {
   LOG_DEBUG_INFO("Begin destroy_texture()");
 
+  stream_destroy(&vk_env.streamer);
+  LOG_DEBUG_INFO("Destroyed texture streamer");
   vkDestroySampler(vk_env.device, vk_env.texture.sampler, NULL);
   LOG_DEBUG_INFO("Destroyed texture sampler");
-  vkDestroyImageView(vk_env.device, vk_env.texture.view, NULL);
-  LOG_DEBUG_INFO("Destroyed texture image view");
-  vkFreeMemory(vk_env.device, vk_env.texture.device_memory, NULL);
-  LOG_DEBUG_INFO("Freed texture device memory");
-  vkDestroyImage(vk_env.device, vk_env.texture.image, NULL);
-  LOG_DEBUG_INFO("Destroyed texture image");
 
   LOG_DEBUG_INFO("End destroy_texture()");
 }
 
+// Writes the texture into the lowest free slot of the bindless array and returns it, or
+// UINT32_MAX when the array is full
+uint32_t register_texture(VkImageView view, VkSampler sampler) {
+  EnterCriticalSection(&vk_env.bindless.lock);
+  uint32_t slot = UINT32_MAX;
+  if (vk_env.bindless.num_free) {
+    slot = vk_env.bindless.free_slots[--vk_env.bindless.num_free];
+    const VkDescriptorImageInfo image_info = { sampler, view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+    VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+    write.dstSet = vk_env.bindless.set;
+    write.dstArrayElement = slot;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &image_info;
+    vkUpdateDescriptorSets(vk_env.device, 1, &write, 0, NULL);
+  }
+  LeaveCriticalSection(&vk_env.bindless.lock);
+  return slot;
+}
+
+// The slot is left written, but must no longer be read by instances in frames still to complete
+void unregister_texture(uint32_t slot) {
+  EnterCriticalSection(&vk_env.bindless.lock);
+  vk_env.bindless.free_slots[vk_env.bindless.num_free++] = slot;
+  LeaveCriticalSection(&vk_env.bindless.lock);
+}
+
+void create_bindless_textures() {
+  if (!vk_env.bindless.enabled)
+    return;
+  LOG_DEBUG_INFO("Begin create_bindless_textures()");
+
+  // Every slot counts against the update-after-bind limits, whether or not it's written
+  VkPhysicalDeviceDescriptorIndexingProperties indexing_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES };
+  VkPhysicalDeviceProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+  properties2.pNext = &indexing_properties;
+  vkGetPhysicalDeviceProperties2(vk_env.gpu.device, &properties2);
+  uint32_t capacity = MAX_BINDLESS_TEXTURES;
+  CLAMP(capacity, 1, indexing_properties.maxPerStageDescriptorUpdateAfterBindSampledImages);
+  CLAMP(capacity, 1, indexing_properties.maxPerStageDescriptorUpdateAfterBindSamplers);
+  CLAMP(capacity, 1, indexing_properties.maxDescriptorSetUpdateAfterBindSampledImages);
+  CLAMP(capacity, 1, indexing_properties.maxDescriptorSetUpdateAfterBindSamplers);
+  vk_env.bindless.capacity = capacity;
+
+  VkDescriptorSetLayoutBinding texture_binding = { 0 };
+  texture_binding.binding = 0;
+  texture_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  texture_binding.descriptorCount = capacity;
+  texture_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  const VkDescriptorBindingFlags binding_flags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+                                                 VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+                                                 VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+  VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO };
+  binding_flags_info.bindingCount = 1;
+  binding_flags_info.pBindingFlags = &binding_flags;
+  VkDescriptorSetLayoutCreateInfo layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+  layout_info.pNext = &binding_flags_info;
+  layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+  layout_info.bindingCount = 1;
+  layout_info.pBindings = &texture_binding;
+  VK_CALL(vkCreateDescriptorSetLayout(vk_env.device, &layout_info, NULL, &vk_env.bindless.layout));
+
+  const VkDescriptorPoolSize pool_size = { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, capacity };
+  VkDescriptorPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+  pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = 1;
+  pool_info.pPoolSizes = &pool_size;
+  VK_CALL(vkCreateDescriptorPool(vk_env.device, &pool_info, NULL, &vk_env.bindless.pool));
+
+  VkDescriptorSetAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+  allocate_info.descriptorPool = vk_env.bindless.pool;
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &vk_env.bindless.layout;
+  VK_CALL(vkAllocateDescriptorSets(vk_env.device, &allocate_info, &vk_env.bindless.set));
+  LOG_DEBUG_INFO("Created bindless descriptor set with %d texture slots", capacity);
+
+  InitializeCriticalSection(&vk_env.bindless.lock);
+  vk_env.bindless.free_slots = arena_alloc_type(&vk_env.arena, uint32_t, capacity);
+  for (uint32_t i = 0; i < capacity; i++)
+    vk_env.bindless.free_slots[i] = capacity - 1 - i;
+  vk_env.bindless.num_free = capacity;
+
+  LOG_DEBUG_INFO("End create_bindless_textures()");
+}
+
+void destroy_bindless_textures() {
+  if (!vk_env.bindless.enabled)
+    return;
+  LOG_DEBUG_INFO("Begin destroy_bindless_textures()");
+
+  DeleteCriticalSection(&vk_env.bindless.lock);
+  // Frees the set with it
+  vkDestroyDescriptorPool(vk_env.device, vk_env.bindless.pool, NULL);
+  vkDestroyDescriptorSetLayout(vk_env.device, vk_env.bindless.layout, NULL);
+  LOG_DEBUG_INFO("Destroyed bindless descriptor set");
+
+  LOG_DEBUG_INFO("End destroy_bindless_textures()");
+}
+
 void create_layouts() {
   // Descriptor set layout
   VkDescriptorSetLayoutBinding ubo_binding = { 0 };
@@ -1022,21 +1749,91 @@ void create_layouts() {
   texture_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
   VkDescriptorSetLayoutBinding bindings[] = { ubo_binding, texture_binding };
 
+  // Bindless draws sample the texture array in set 1 instead
   VkDescriptorSetLayoutCreateInfo descriptor_set_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
-  descriptor_set_info.bindingCount = ARRAY_COUNT(bindings);
+  descriptor_set_info.bindingCount = vk_env.bindless.enabled ? 1 : ARRAY_COUNT(bindings);
   descriptor_set_info.pBindings = bindings;
   VK_CALL(vkCreateDescriptorSetLayout(vk_env.device, &descriptor_set_info, NULL, &vk_env.descriptor_set_layout));
   LOG_DEBUG_INFO("Created descriptor set layout");
 
-  // Pipeline layout
+  // Pipeline layout, with the vertex dequantization constants
+  const VkPushConstantRange quantization_range = {
+    VK_SHADER_STAGE_VERTEX_BIT, // stageFlags
+    0, // offset
+    sizeof (quantization_t) // size
+  };
+  const VkDescriptorSetLayout set_layouts[] = { vk_env.descriptor_set_layout, vk_env.bindless.layout };
   VkPipelineLayoutCreateInfo pipeline_layout_info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
-  pipeline_layout_info.setLayoutCount = 1;
-  pipeline_layout_info.pSetLayouts = &vk_env.descriptor_set_layout;
+  pipeline_layout_info.setLayoutCount = vk_env.bindless.enabled ? 2 : 1;
+  pipeline_layout_info.pSetLayouts = set_layouts;
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &quantization_range;
   VK_CALL(vkCreatePipelineLayout(vk_env.device, &pipeline_layout_info, NULL, &vk_env.pipeline_layout));
   LOG_DEBUG_INFO("Created pipeline layout");
+  pipeline_layout_info.setLayoutCount = 1;
+
+  // Cull pass: instances, draws and draw count storage buffers, the MVP matrix for the frustum
+  // and the LODs storage buffer
+  VkDescriptorSetLayoutBinding cull_bindings[5] = { 0 };
+  for (uint32_t i = 0; i < ARRAY_COUNT(cull_bindings); i++) {
+    cull_bindings[i].binding = i;
+    cull_bindings[i].descriptorType = i != 3 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    cull_bindings[i].descriptorCount = 1;
+    cull_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  descriptor_set_info.bindingCount = ARRAY_COUNT(cull_bindings);
+  descriptor_set_info.pBindings = cull_bindings;
+  VK_CALL(vkCreateDescriptorSetLayout(vk_env.device, &descriptor_set_info, NULL, &vk_env.cull_descriptor_set_layout));
+  const VkPushConstantRange push_constant_range = {
+    VK_SHADER_STAGE_COMPUTE_BIT, // stageFlags
+    0, // offset
+    sizeof (cull_constants_t) // size
+  };
+  pipeline_layout_info.pSetLayouts = &vk_env.cull_descriptor_set_layout;
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+  VK_CALL(vkCreatePipelineLayout(vk_env.device, &pipeline_layout_info, NULL, &vk_env.cull_pipeline_layout));
+  LOG_DEBUG_INFO("Created cull descriptor set and pipeline layouts");
+
+  // Post-process pass: the scene, filtered at fractional offsets along edges, and the output
+  VkSamplerCreateInfo sampler_info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  VK_CALL(vkCreateSampler(vk_env.device, &sampler_info, NULL, &vk_env.post_sampler));
+  VkDescriptorSetLayoutBinding post_bindings[2] = { 0 };
+  for (uint32_t i = 0; i < ARRAY_COUNT(post_bindings); i++) {
+    post_bindings[i].binding = i;
+    post_bindings[i].descriptorType = i ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    post_bindings[i].descriptorCount = 1;
+    post_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  post_bindings[0].pImmutableSamplers = &vk_env.post_sampler;
+  descriptor_set_info.bindingCount = ARRAY_COUNT(post_bindings);
+  descriptor_set_info.pBindings = post_bindings;
+  VK_CALL(vkCreateDescriptorSetLayout(vk_env.device, &descriptor_set_info, NULL, &vk_env.post_descriptor_set_layout));
+  const VkPushConstantRange post_constant_range = {
+    VK_SHADER_STAGE_COMPUTE_BIT, // stageFlags
+    0, // offset
+    sizeof (post_constants_t) // size
+  };
+  pipeline_layout_info.pSetLayouts = &vk_env.post_descriptor_set_layout;
+  pipeline_layout_info.pPushConstantRanges = &post_constant_range;
+  VK_CALL(vkCreatePipelineLayout(vk_env.device, &pipeline_layout_info, NULL, &vk_env.post_pipeline_layout));
+  LOG_DEBUG_INFO("Created post-process sampler, descriptor set and pipeline layouts");
 }
 
 void destroy_layouts() {
+  vkDestroyPipelineLayout(vk_env.device, vk_env.post_pipeline_layout, NULL);
+  vkDestroyDescriptorSetLayout(vk_env.device, vk_env.post_descriptor_set_layout, NULL);
+  vkDestroySampler(vk_env.device, vk_env.post_sampler, NULL);
+  LOG_DEBUG_INFO("Destroyed post-process sampler, descriptor set and pipeline layouts");
+  vkDestroyPipelineLayout(vk_env.device, vk_env.cull_pipeline_layout, NULL);
+  vkDestroyDescriptorSetLayout(vk_env.device, vk_env.cull_descriptor_set_layout, NULL);
+  LOG_DEBUG_INFO("Destroyed cull descriptor set and pipeline layouts");
   vkDestroyPipelineLayout(vk_env.device, vk_env.pipeline_layout, NULL);
   LOG_DEBUG_INFO("Destroyed pipeline layout");
   vkDestroyDescriptorSetLayout(vk_env.device, vk_env.descriptor_set_layout, NULL);
@@ -1044,13 +1841,17 @@ void destroy_layouts() {
 }
 
 void create_descriptor_pool() {
+  // Draw, cull and post-process descriptor sets for each swapchain image; bindless draw sets
+  // have no texture
   const VkDescriptorPoolSize pool_sizes[] = {
-    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
-    { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 }
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * vk_env.gpu.num_buffers },
+    { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, (vk_env.bindless.enabled ? 1 : 2) * vk_env.gpu.num_buffers },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * vk_env.gpu.num_buffers },
+    { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, vk_env.gpu.num_buffers }
   };
   VkDescriptorPoolCreateInfo create_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
   create_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-  create_info.maxSets = vk_env.gpu.num_buffers;
+  create_info.maxSets = 3 * vk_env.gpu.num_buffers;
   create_info.poolSizeCount = ARRAY_COUNT(pool_sizes);
   create_info.pPoolSizes = pool_sizes;
   VK_CALL(vkCreateDescriptorPool(vk_env.device, &create_info, NULL, &vk_env.descriptor_pool));
@@ -1063,6 +1864,64 @@ void destroy_descriptor_pool() {
   LOG_DEBUG_INFO("Destroyed descriptor pool");
 }
 
+void write_cull_descriptor_set(uint32_t image) {
+  VkInstanceBuffer *instance_buffer = &vk_env.instance_buffers[image];
+  const VkDescriptorBufferInfo buffer_infos[] = {
+    { instance_buffer->buffer, 0, VK_WHOLE_SIZE },
+    { instance_buffer->draw_buffer, 0, VK_WHOLE_SIZE },
+    { instance_buffer->count_buffer, 0, VK_WHOLE_SIZE },
+    { vk_env.mvp_ub.buffer, image * vk_env.mvp_stride, sizeof mvp },
+    { vk_env.lod_buffer, 0, VK_WHOLE_SIZE }
+  };
+  VkWriteDescriptorSet writes[ARRAY_COUNT(buffer_infos)] = { 0 };
+  for (uint32_t i = 0; i < ARRAY_COUNT(writes); i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = instance_buffer->cull_descriptor_set;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = i != 3 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writes[i].pBufferInfo = &buffer_infos[i];
+  }
+  vkUpdateDescriptorSets(vk_env.device, ARRAY_COUNT(writes), writes, 0, NULL);
+}
+
+// Points the image's post-process set at the current scene and output images. Done as its
+// commands are recorded, once no pending frame uses the set
+void write_post_descriptor_set(uint32_t image) {
+  const VkDescriptorImageInfo image_infos[] = {
+    // Layouts of FG_USAGE_COMPUTE_SAMPLED and FG_USAGE_COMPUTE_WRITE
+    { VK_NULL_HANDLE, fg_view(&vk_env.frame_graph, vk_env.frame_handles.scene), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+    { VK_NULL_HANDLE, fg_view(&vk_env.frame_graph, vk_env.frame_handles.post), VK_IMAGE_LAYOUT_GENERAL }
+  };
+  VkWriteDescriptorSet writes[ARRAY_COUNT(image_infos)] = { 0 };
+  for (uint32_t i = 0; i < ARRAY_COUNT(writes); i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = vk_env.post_descriptor_sets[image];
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = i ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writes[i].pImageInfo = &image_infos[i];
+  }
+  vkUpdateDescriptorSets(vk_env.device, ARRAY_COUNT(writes), writes, 0, NULL);
+}
+
+// Points the image's draw set at the streamed texture's current view. Without bindless this is
+// done as each image is acquired, once no pending frame uses its set
+void write_texture_descriptor(uint32_t image) {
+  VkDescriptorImageInfo image_info = { 0 };
+  image_info.sampler = vk_env.texture.sampler;
+  image_info.imageView = stream_view(&vk_env.streamer, vk_env.texture.id);
+  image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+  write.dstSet = vk_env.descriptor_sets[image];
+  write.dstBinding = 1;
+  write.descriptorCount = 1;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  write.pImageInfo = &image_info;
+  vkUpdateDescriptorSets(vk_env.device, 1, &write, 0, NULL);
+  vk_env.texture.views[image] = image_info.imageView;
+}
+
 void alloc_descriptor_sets() {
   VkDescriptorSetAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
   allocate_info.descriptorPool = vk_env.descriptor_pool;
@@ -1071,285 +1930,585 @@ void alloc_descriptor_sets() {
   VkDescriptorBufferInfo buffer_info = { 0 };
   buffer_info.buffer = vk_env.mvp_ub.buffer;
   buffer_info.range = sizeof mvp;
-  VkDescriptorImageInfo image_info = { 0 };
-  image_info.sampler = vk_env.texture.sampler;
-  image_info.imageView = vk_env.texture.view;
-  image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  VkWriteDescriptorSet writes[] = {
-    { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET },
-    { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET }
-  };
-  writes[0].descriptorCount = 1;
-  writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  writes[0].pBufferInfo = &buffer_info;
-  writes[1].dstBinding = 1;
-  writes[1].descriptorCount = 1;
-  writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  writes[1].pImageInfo = &image_info;
-  vk_env.descriptor_sets = halloc_type(VkDescriptorSet, vk_env.gpu.num_buffers);
+  VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+  write.descriptorCount = 1;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  write.pBufferInfo = &buffer_info;
+  vk_env.descriptor_sets = arena_alloc_type(&vk_env.arena, VkDescriptorSet, vk_env.gpu.num_buffers);
+  vk_env.texture.views = arena_alloc_clear_type(&vk_env.arena, VkImageView, vk_env.gpu.num_buffers);
   for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++) {
     VK_CALL(vkAllocateDescriptorSets(vk_env.device, &allocate_info, &vk_env.descriptor_sets[i]));
-    writes[0].dstSet = vk_env.descriptor_sets[i];
-    writes[1].dstSet = vk_env.descriptor_sets[i];
-    vkUpdateDescriptorSets(vk_env.device, ARRAY_COUNT(writes), writes, 0, NULL);
+    buffer_info.offset = i * vk_env.mvp_stride;
+    write.dstSet = vk_env.descriptor_sets[i];
+    vkUpdateDescriptorSets(vk_env.device, 1, &write, 0, NULL);
+    if (!vk_env.bindless.enabled)
+      write_texture_descriptor(i);
+  }
+  LOG_DEBUG_INFO("Allocated %d uniform buffer%s descriptor sets", vk_env.gpu.num_buffers,
+                 vk_env.bindless.enabled ? "" : " and texture sampler");
+
+  allocate_info.pSetLayouts = &vk_env.cull_descriptor_set_layout;
+  for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++) {
+    VK_CALL(vkAllocateDescriptorSets(vk_env.device, &allocate_info, &vk_env.instance_buffers[i].cull_descriptor_set));
+    write_cull_descriptor_set(i);
   }
-  LOG_DEBUG_INFO("Allocated %d uniform buffer and texture sampler descriptor sets", vk_env.gpu.num_buffers);
+  LOG_DEBUG_INFO("Allocated %d cull descriptor sets", vk_env.gpu.num_buffers);
+
+  // Written once the swapchain has sized the images
+  allocate_info.pSetLayouts = &vk_env.post_descriptor_set_layout;
+  vk_env.post_descriptor_sets = arena_alloc_type(&vk_env.arena, VkDescriptorSet, vk_env.gpu.num_buffers);
+  for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++)
+    VK_CALL(vkAllocateDescriptorSets(vk_env.device, &allocate_info, &vk_env.post_descriptor_sets[i]));
+  LOG_DEBUG_INFO("Allocated %d post-process descriptor sets", vk_env.gpu.num_buffers);
 }
 
 void free_descriptor_sets() {
+  VK_CALL(vkFreeDescriptorSets(vk_env.device, vk_env.descriptor_pool, vk_env.gpu.num_buffers, vk_env.post_descriptor_sets));
+  LOG_DEBUG_INFO("Freed %d post-process descriptor sets", vk_env.gpu.num_buffers);
+  for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++)
+    VK_CALL(vkFreeDescriptorSets(vk_env.device, vk_env.descriptor_pool, 1, &vk_env.instance_buffers[i].cull_descriptor_set));
+  LOG_DEBUG_INFO("Freed %d cull descriptor sets", vk_env.gpu.num_buffers);
   VK_CALL(vkFreeDescriptorSets(vk_env.device, vk_env.descriptor_pool, vk_env.gpu.num_buffers, vk_env.descriptor_sets));
-  hfree(vk_env.descriptor_sets);
   LOG_DEBUG_INFO("Freed %d uniform buffer and texture sampler descriptor sets", vk_env.gpu.num_buffers);
 }
 
+// Check that the Vulkan header at the start of the cache data was written by this driver and device
+bool validate_pipeline_cache_data(const void *data, size_t size) {
+  if (size < sizeof (VkPipelineCacheHeaderVersionOne))
+    return false;
+  const VkPipelineCacheHeaderVersionOne *header = (const VkPipelineCacheHeaderVersionOne *)data;
+  return header->headerSize >= sizeof (VkPipelineCacheHeaderVersionOne) &&
+         header->headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         header->vendorID == vk_env.gpu.properties.vendorID &&
+         header->deviceID == vk_env.gpu.properties.deviceID &&
+         !memcmp(header->pipelineCacheUUID, vk_env.gpu.properties.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+// Returns cache data read from PIPELINE_CACHE_PATH, or NULL if the file is missing, corrupt or stale
+void *load_pipeline_cache_data(size_t *size) {
+  FILE *fp;
+  if (fopen_s(&fp, PIPELINE_CACHE_PATH, "rb")) {
+    LOG_DEBUG_INFO("No pipeline cache file '%s'", PIPELINE_CACHE_PATH);
+    return NULL;
+  }
+  pipeline_cache_file_header_t file_header;
+  void *data = NULL;
+  long file_size = -1;
+  if (!fseek(fp, 0, SEEK_END)) {
+    file_size = ftell(fp);
+    rewind(fp);
+  }
+  if (fread(&file_header, sizeof file_header, 1, fp) != 1 ||
+      file_header.magic != PIPELINE_CACHE_MAGIC ||
+      file_header.version != PIPELINE_CACHE_VERSION ||
+      !file_header.data_size)
+    LOG_DEBUG_WARNING("Pipeline cache file '%s' has an invalid header", PIPELINE_CACHE_PATH);
+  // Checked before allocating, so a truncated or corrupt size can't request a huge buffer
+  else if (file_size < 0 || file_header.data_size > (uint64_t)file_size - sizeof file_header)
+    LOG_DEBUG_WARNING("Pipeline cache file '%s' is shorter than its header says", PIPELINE_CACHE_PATH);
+  else {
+    data = halloc(file_header.data_size);
+    if (fread(data, file_header.data_size, 1, fp) != 1 ||
+        crc32(0L, data, file_header.data_size) != file_header.data_crc) {
+      LOG_DEBUG_WARNING("Pipeline cache file '%s' failed checksum", PIPELINE_CACHE_PATH);
+      hfree(data);
+      data = NULL;
+    }
+    else if (!validate_pipeline_cache_data(data, file_header.data_size)) {
+      LOG_DEBUG_WARNING("Pipeline cache file '%s' was created by a different device or driver", PIPELINE_CACHE_PATH);
+      hfree(data);
+      data = NULL;
+    }
+    else
+      *size = file_header.data_size;
+  }
+  fclose(fp);
+  return data;
+}
+
+// Write to a temporary file and rename it over the old cache so a crash can never leave a partial file
+void save_pipeline_cache_data(const void *data, size_t size) {
+  char tmp_path[MAX_PATH];
+  snprintf(tmp_path, MAX_PATH, "%s.tmp", PIPELINE_CACHE_PATH);
+  FILE *fp;
+  if (fopen_s(&fp, tmp_path, "wb")) {
+    LOG_DEBUG_WARNING("Could not create pipeline cache file '%s'", tmp_path);
+    return;
+  }
+  pipeline_cache_file_header_t file_header = {
+    PIPELINE_CACHE_MAGIC,
+    PIPELINE_CACHE_VERSION,
+    (uint32_t)size,
+    crc32(0L, data, (uInt)size)
+  };
+  bool written = fwrite(&file_header, sizeof file_header, 1, fp) == 1 &&
+                 fwrite(data, size, 1, fp) == 1 &&
+                 !fflush(fp) &&
+                 !_commit(_fileno(fp));
+  fclose(fp);
+  if (written && MoveFileEx(tmp_path, PIPELINE_CACHE_PATH, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    LOG_DEBUG_INFO("Saved %zu bytes of pipeline cache data to '%s'", size, PIPELINE_CACHE_PATH);
+  else {
+    LOG_DEBUG_WARNING("Could not save pipeline cache file '%s'", PIPELINE_CACHE_PATH);
+    DeleteFile(tmp_path);
+  }
+}
+
 void create_pipeline_cache() {
+  size_t size = 0;
+  void *data = load_pipeline_cache_data(&size);
   VkPipelineCacheCreateInfo pipeline_cache_create_info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+  pipeline_cache_create_info.initialDataSize = size;
+  pipeline_cache_create_info.pInitialData = data;
   VK_CALL(vkCreatePipelineCache(vk_env.device, &pipeline_cache_create_info, NULL, &vk_env.pipeline_cache));
-  LOG_DEBUG_INFO("Created pipeline cache");
+  vk_env.pipeline_cache_loaded = data != NULL;
+  if (data)
+    hfree(data);
+  LOG_DEBUG_INFO("Created pipeline cache (%zu bytes loaded)", size);
 }
 
 void destroy_pipeline_cache() {
+  size_t size = 0;
+  VK_CALL(vkGetPipelineCacheData(vk_env.device, vk_env.pipeline_cache, &size, NULL));
+  if (size) {
+    void *data = halloc(size);
+    VK_CALL(vkGetPipelineCacheData(vk_env.device, vk_env.pipeline_cache, &size, data));
+    save_pipeline_cache_data(data, size);
+    hfree(data);
+  }
   vkDestroyPipelineCache(vk_env.device, vk_env.pipeline_cache, NULL);
   LOG_DEBUG_INFO("Destroyed pipeline cache");
 }
 
+// Arrays that live as long as the device, released together at shutdown
+void create_arenas() {
+  create_arena(&vk_env.arena, DEVICE_ARENA_SIZE);
+}
+
+void destroy_arenas() {
+  LOG_DEBUG_INFO("Device arena used %zu of %zu bytes", arena_mark(&vk_env.arena), vk_env.arena.size);
+  destroy_arena(&vk_env.arena);
+}
+
+// The swapchain's image, view and framebuffer arrays, so recreating it doesn't touch the heap.
+// Blocks hold as many images as the surface allows, since the driver may create more than requested
+void create_swapchain_pool() {
+  VkSurfaceCapabilitiesKHR surface_capabilities;
+  VK_CALL(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vk_env.gpu.device, vk_env.surface, &surface_capabilities));
+  vk_env.swapchain_capacity = surface_capabilities.maxImageCount ? surface_capabilities.maxImageCount
+                                                                 : MAX_SWAPCHAIN_IMAGES;
+  if (vk_env.swapchain_capacity < vk_env.gpu.num_buffers)
+    vk_env.swapchain_capacity = vk_env.gpu.num_buffers;
+  create_block_pool(&vk_env.swapchain_pool, sizeof (uint64_t) * vk_env.swapchain_capacity, SWAPCHAIN_ARRAYS);
+}
+
+void destroy_swapchain_pool() {
+  destroy_block_pool(&vk_env.swapchain_pool);
+}
+
+void create_worker_pool() {
+  create_task_pool(&vk_env.task_pool, num_worker_threads());
+}
+
+void destroy_worker_pool() {
+  destroy_task_pool(&vk_env.task_pool);
+}
+
+// A loaded cache file doesn't mean the pipeline was in it, so hits are only reported when the
+// driver's creation feedback says so
+void on_pipeline_ready(pipeline_t *pipeline) {
+  const char *source = vk_env.pipeline_cache_loaded ? "pipeline cache loaded" : "cold compile";
+  if (FLAGGED(pipeline->feedback.flags, VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT))
+    source = FLAGGED(pipeline->feedback.flags, VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT)
+           ? "pipeline cache hit" : "pipeline cache miss";
+  log_console_info("Built pipeline in %.3f ms (%s)", pipeline->build_ms, source);
+  InterlockedExchange(&vk_env.commands_dirty, 1);
+}
+
+// Depends on the render pass and sample count, so it's rebuilt when the AA mode changes
+void build_graphics_pipeline() {
+  pipeline_desc_t *desc = &vk_env.pipeline.desc;
+  memset(desc, 0, sizeof (pipeline_desc_t));
+  desc->vertex_shader = vk_env.vertex_shader;
+  desc->fragment_shader = vk_env.bindless.enabled ? vk_env.bindless_shader : vk_env.fragment_shader;
+
+  // Vertex input state, generated from the vertex format's layout
+  const vertex_layout_t *layout = &vertex_layouts[vk_env.vertex_format];
+  desc->num_bindings = 1;
+  desc->bindings[0].binding = 0;
+  desc->bindings[0].stride = layout->stride;
+  desc->bindings[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+  desc->num_attributes = VERTEX_ATTRIBUTES;
+  for (uint32_t i = 0; i < VERTEX_ATTRIBUTES; i++) {
+    desc->attributes[i].location = i;
+    desc->attributes[i].format = layout->attributes[i].format;
+    desc->attributes[i].offset = layout->attributes[i].offset;
+  }
+  // Per-instance model matrix rows, colour and bindless texture slot
+  desc->num_bindings = 2;
+  desc->bindings[1].binding = 1;
+  desc->bindings[1].stride = sizeof (instance_t);
+  desc->bindings[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+  desc->num_attributes = 8;
+  for (uint32_t i = 0; i < 3; i++) {
+    desc->attributes[3 + i].location = 3 + i;
+    desc->attributes[3 + i].binding = 1;
+    desc->attributes[3 + i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    desc->attributes[3 + i].offset = offsetof(instance_t, transform) + i * 4 * sizeof (float);
+  }
+  desc->attributes[6].location = 6;
+  desc->attributes[6].binding = 1;
+  desc->attributes[6].format = VK_FORMAT_R8G8B8A8_UNORM;
+  desc->attributes[6].offset = offsetof(instance_t, colour);
+  desc->attributes[7].location = 7;
+  desc->attributes[7].binding = 1;
+  desc->attributes[7].format = VK_FORMAT_R32_UINT;
+  desc->attributes[7].offset = offsetof(instance_t, texture);
+
+  desc->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  desc->cull_mode = VK_CULL_MODE_BACK_BIT;
+  desc->samples = vk_env.gpu.num_aa_samples;
+  // Shading every sample multiplies the fragment cost by the sample count
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_SAMPLE_SHADING) && desc->samples > VK_SAMPLE_COUNT_1_BIT)
+    desc->min_sample_shading = vk_env.aa.min_sample_shading;
+  desc->depth_test = true;
+  desc->layout = vk_env.pipeline_layout;
+  desc->render_pass = vk_env.render_pass;
+  desc->creation_feedback = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_CREATION_FEEDBACK);
+  vk_env.pipeline.on_ready = on_pipeline_ready;
+
+  // Compiled on the task pool; draws are skipped until it's ready
+  build_pipelines(&vk_env.task_pool, vk_env.device, vk_env.pipeline_cache, &vk_env.pipeline, 1);
+}
+
 void create_pipeline() {
   LOG_DEBUG_INFO("Begin create_pipeline()");
 
-  // Shader stages
-  VkPipelineShaderStageCreateInfo shader_stages[] = {
-    { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO },
-    { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO }
-  };
-  shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-  shader_stages[0].module = vk_env.vertex_shader;
-  shader_stages[0].pName = SHADER_ENTRY_POINT_NAME;
-  shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  shader_stages[1].module = vk_env.fragment_shader;
-  shader_stages[1].pName = SHADER_ENTRY_POINT_NAME;
-
-  // Vertex input state
-  VkVertexInputBindingDescription binding_description = { 0 };
-  binding_description.binding = 0;
-  binding_description.stride = sizeof (vertex_t);
-  binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-  VkVertexInputAttributeDescription position_attribute = { 0 };
-  position_attribute.location = 0;
-  position_attribute.format = VK_FORMAT_R32G32B32_SFLOAT;
-  position_attribute.offset = offsetof(vertex_t, position);
-  VkVertexInputAttributeDescription colour_attribute = { 0 };
-  colour_attribute.location = 1;
-  colour_attribute.format = VK_FORMAT_R32G32B32_SFLOAT;
-  colour_attribute.offset = offsetof(vertex_t, colour);
-  VkVertexInputAttributeDescription uv_attribute = { 0 };
-  uv_attribute.location = 2;
-  uv_attribute.format = VK_FORMAT_R32G32_SFLOAT;
-  uv_attribute.offset = offsetof(vertex_t, uv);
-  VkVertexInputAttributeDescription attribute_descriptions[] = { position_attribute, colour_attribute, uv_attribute };
-  VkPipelineVertexInputStateCreateInfo vertex_input_state = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
-  vertex_input_state.vertexBindingDescriptionCount = 1;
-  vertex_input_state.pVertexBindingDescriptions = &binding_description;
-  vertex_input_state.vertexAttributeDescriptionCount = ARRAY_COUNT(attribute_descriptions);
-  vertex_input_state.pVertexAttributeDescriptions = attribute_descriptions;
-
-  // Input assembly state
-  VkPipelineInputAssemblyStateCreateInfo input_assembly_state = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
-  input_assembly_state.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-
-  // Viewport state (dynamic)
-  VkPipelineViewportStateCreateInfo viewport_state = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
-  viewport_state.viewportCount = 1;
-  viewport_state.scissorCount = 1;
-
-  // Rasterization state
-  VkPipelineRasterizationStateCreateInfo rasterization_state = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
-  rasterization_state.polygonMode = VK_POLYGON_MODE_FILL;
-  rasterization_state.cullMode = VK_CULL_MODE_BACK_BIT;
-  //rasterization_state.cullMode = VK_CULL_MODE_NONE;
-  rasterization_state.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-  rasterization_state.depthBiasEnable = VK_FALSE;
-  rasterization_state.lineWidth = 1.0f;
-
-  // Multisample state
-  VkPipelineMultisampleStateCreateInfo multisample_state = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
-  multisample_state.rasterizationSamples = vk_env.gpu.num_aa_samples;
-  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_SAMPLE_SHADING)) {
-    multisample_state.sampleShadingEnable = VK_TRUE;
-    multisample_state.minSampleShading = 1.0f;
-  }
-
-  //const VkSampleMask *pSampleMask;
-  //VkBool32                                 alphaToCoverageEnable;
-  //VkBool32                                 alphaToOneEnable;
-
-  // Depth stencil
-  VkPipelineDepthStencilStateCreateInfo depth_stencil_state = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
-  depth_stencil_state.depthTestEnable = VK_TRUE;
-  depth_stencil_state.depthWriteEnable = VK_TRUE;
-  depth_stencil_state.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-  depth_stencil_state.depthBoundsTestEnable = VK_FALSE;
-  depth_stencil_state.stencilTestEnable = VK_FALSE;
-  depth_stencil_state.front.failOp = VK_STENCIL_OP_KEEP;
-  depth_stencil_state.front.passOp = VK_STENCIL_OP_KEEP;
-  depth_stencil_state.front.depthFailOp = VK_STENCIL_OP_KEEP;
-  depth_stencil_state.front.compareOp = VK_COMPARE_OP_ALWAYS;
-  depth_stencil_state.front.compareMask = 0;
-  depth_stencil_state.front.writeMask = UINT32_MAX; // 0xffffffff;
-  depth_stencil_state.front.reference = 0;
-  depth_stencil_state.back = depth_stencil_state.front;
-  depth_stencil_state.minDepthBounds = 0.0f;
-  depth_stencil_state.maxDepthBounds = 1.0f;
-
-  // Colour blending
-  VkPipelineColorBlendAttachmentState colour_blend_attachment_state = { 0 };
-  colour_blend_attachment_state.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
-                                                 VK_COLOR_COMPONENT_G_BIT |
-                                                 VK_COLOR_COMPONENT_B_BIT |
-                                                 VK_COLOR_COMPONENT_A_BIT;
-  VkPipelineColorBlendStateCreateInfo colour_blend_state = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
-  colour_blend_state.attachmentCount = 1;
-  colour_blend_state.pAttachments = &colour_blend_attachment_state;
-
-  // Dynamic states
-  const VkDynamicState dynamic_states[] = {
-    VK_DYNAMIC_STATE_VIEWPORT,
-    VK_DYNAMIC_STATE_SCISSOR
-  };
-  VkPipelineDynamicStateCreateInfo dynamic_state = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
-  dynamic_state.dynamicStateCount = ARRAY_COUNT(dynamic_states);
-  dynamic_state.pDynamicStates = dynamic_states;
-
-  VkGraphicsPipelineCreateInfo create_info = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
-  create_info.stageCount = ARRAY_COUNT(shader_stages);
-  create_info.pStages = shader_stages;
-  create_info.pVertexInputState = &vertex_input_state;
-  create_info.pInputAssemblyState = &input_assembly_state;
-  create_info.pViewportState = &viewport_state;
-  create_info.pRasterizationState = &rasterization_state;
-  create_info.pMultisampleState = &multisample_state;
-  create_info.pDepthStencilState = &depth_stencil_state;
-  create_info.pColorBlendState = &colour_blend_state;
-  create_info.pDynamicState = &dynamic_state;
-  create_info.layout = vk_env.pipeline_layout;
-  create_info.renderPass = vk_env.render_pass;
-  VK_CALL(vkCreateGraphicsPipelines(vk_env.device, vk_env.pipeline_cache, 1, &create_info, NULL, &vk_env.pipeline));
+  build_graphics_pipeline();
+
+  // Cull pass; instances are drawn without culling until it's ready
+  memset(&vk_env.cull_pipeline.desc, 0, sizeof (pipeline_desc_t));
+  vk_env.cull_pipeline.desc.compute_shader = vk_env.cull_shader;
+  vk_env.cull_pipeline.desc.layout = vk_env.cull_pipeline_layout;
+  vk_env.cull_pipeline.desc.creation_feedback = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_CREATION_FEEDBACK);
+  vk_env.cull_pipeline.on_ready = on_pipeline_ready;
+  if (FLAGGED(vk_env.gpu.support, GPU_SUPPORT_MULTI_DRAW_INDIRECT))
+    build_pipelines(&vk_env.task_pool, vk_env.device, vk_env.pipeline_cache, &vk_env.cull_pipeline, 1);
+
+  // FXAA pass, built whatever the AA mode so switching to it is quick; the scene is copied
+  // unfiltered until it's ready
+  memset(&vk_env.post_pipeline.desc, 0, sizeof (pipeline_desc_t));
+  vk_env.post_pipeline.desc.compute_shader = vk_env.post_shader;
+  vk_env.post_pipeline.desc.layout = vk_env.post_pipeline_layout;
+  vk_env.post_pipeline.desc.creation_feedback = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_CREATION_FEEDBACK);
+  vk_env.post_pipeline.on_ready = on_pipeline_ready;
+  build_pipelines(&vk_env.task_pool, vk_env.device, vk_env.pipeline_cache, &vk_env.post_pipeline, 1);
 
   LOG_DEBUG_INFO("End create_pipeline()");
 }
 
 void destroy_pipeline() {
-  vkDestroyPipeline(vk_env.device, vk_env.pipeline, NULL);
-  LOG_DEBUG_INFO("Destroyed pipeline");
+  wait_pipelines(&vk_env.post_pipeline, 1);
+  wait_pipelines(&vk_env.cull_pipeline, 1);
+  wait_pipelines(&vk_env.pipeline, 1);
+  destroy_pipelines(&vk_env.post_pipeline, 1);
+  destroy_pipelines(&vk_env.cull_pipeline, 1);
+  destroy_pipelines(&vk_env.pipeline, 1);
+}
+
+// Attachment memory needed for common resolutions with the selected formats and sample count
+void report_attachment_memory() {
+  const VkExtent2D extents[] = { { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 } };
+  for (uint32_t i = 0; i < ARRAY_COUNT(extents); i++) {
+    VkImage colour, depth;
+    VkMemoryRequirements colour_requirements, depth_requirements;
+    VK_CALL(create_image(vk_env.device, vk_env.gpu.surface_format.format, extents[i].width, extents[i].height,
+                         vk_env.gpu.num_aa_samples, VK_IMAGE_TILING_OPTIMAL,
+                         VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, &colour));
+    VK_CALL(create_image(vk_env.device, vk_env.gpu.depth_format, extents[i].width, extents[i].height,
+                         vk_env.gpu.num_aa_samples, VK_IMAGE_TILING_OPTIMAL,
+                         VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, &depth));
+    vkGetImageMemoryRequirements(vk_env.device, colour, &colour_requirements);
+    vkGetImageMemoryRequirements(vk_env.device, depth, &depth_requirements);
+    vkDestroyImage(vk_env.device, colour, NULL);
+    vkDestroyImage(vk_env.device, depth, NULL);
+    log_console_info("Attachment memory at %dx%d, %dx MSAA: %.1f MB colour, %.1f MB depth",
+                     extents[i].width, extents[i].height, vk_env.gpu.num_aa_samples,
+                     colour_requirements.size / 1048576.0, depth_requirements.size / 1048576.0);
+  }
 }
 
-void create_depth_buffer() {
-  LOG_DEBUG_INFO("Begin create_depth_buffer()");
-
-  VK_CALL(create_image(
-    vk_env.device,
-    vk_env.gpu.depth_format,
-    vk_env.window->width,
-    vk_env.window->height,
-    vk_env.gpu.num_aa_samples,
-    VK_IMAGE_TILING_OPTIMAL,
-    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-    &vk_env.depth_buffer.image
-  ));
-  LOG_DEBUG_INFO("Created depth buffer image");
-
-  VkMemoryRequirements memory_requirements;
-  vkGetImageMemoryRequirements(vk_env.device, vk_env.depth_buffer.image, &memory_requirements); // 1665 = 11010000001 // size = 8847360, alignment = 32
-  alloc_device_memory(
-    memory_requirements,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    &vk_env.depth_buffer.device_memory
-  );
-  VK_CALL(vkBindImageMemory(vk_env.device, vk_env.depth_buffer.image, vk_env.depth_buffer.device_memory, 0));
-
-  VK_CALL(create_image_view(
-    vk_env.device,
-    vk_env.depth_buffer.image,
-    vk_env.gpu.depth_format,
-    VK_IMAGE_ASPECT_DEPTH_BIT,
-    &vk_env.depth_buffer.view
-  ));
-  LOG_DEBUG_INFO("Created depth buffer image view");
-
-  LOG_DEBUG_INFO("End create_depth_buffer()");
+void record_clear_pass(VkCommandBuffer command_buffer, void *context) {
+  const frame_context_t *frame = (const frame_context_t *)context;
+  vkCmdFillBuffer(command_buffer, vk_env.instance_buffers[frame->image].count_buffer, 0, sizeof (uint32_t), 0);
 }
 
-void destroy_depth_buffer() {
-  LOG_DEBUG_INFO("Begin destroy_depth_buffer()");
+// Cull instances against the frustum on the GPU, writing the indirect draws
+void record_cull_pass(VkCommandBuffer command_buffer, void *context) {
+  const frame_context_t *frame = (const frame_context_t *)context;
+  // Projected size in pixels of a unit length at clip space w = 1
+  const cull_constants_t constants = {
+    vk_env.num_instances,
+    vk_env.num_lods,
+    frame->compact,
+    vk_env.window->height / (2.0f * tanf(FIELD_OF_VIEW / 2.0f) * LOD_PIXEL_ERROR)
+  };
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, vk_env.cull_pipeline.pipeline);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          vk_env.cull_pipeline_layout, 0, 1,
+                          &vk_env.instance_buffers[frame->image].cull_descriptor_set, 0, NULL);
+  vkCmdPushConstants(command_buffer, vk_env.cull_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+                     0, sizeof constants, &constants);
+  vkCmdDispatch(command_buffer, (vk_env.num_instances + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+}
+
+// Bind state and draw instances [first_instance, first_instance + num_instances) inside the render pass
+void buffer_draw_commands(VkCommandBuffer command_buffer, VkDescriptorSet *descriptor_set,
+                          VkInstanceBuffer *instance_buffer, uint32_t first_instance,
+                          uint32_t num_instances, bool gpu_culling, bool compact) {
+  // Skip drawing until the pipeline has finished compiling
+  if (!num_instances || !pipeline_ready(&vk_env.pipeline))
+    return;
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_env.pipeline.pipeline);
+  // Vertex and instance buffers
+  const VkBuffer vertex_buffers[] = { vk_env.mesh_vb.buffer, instance_buffer->buffer };
+  const VkDeviceSize offsets[] = { 0, 0 };
+  vkCmdBindVertexBuffers(command_buffer, 0, ARRAY_COUNT(vertex_buffers), vertex_buffers, offsets);
+  // Index buffer
+  vkCmdBindIndexBuffer(command_buffer, vk_env.mesh_ib.buffer, 0, vk_env.index_type);
+  // Uniform buffer, and every texture when bindless, so draws never rebind sets
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          vk_env.pipeline_layout, 0, 1,
+                          descriptor_set, 0, NULL);
+  if (vk_env.bindless.enabled)
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            vk_env.pipeline_layout, 1, 1,
+                            &vk_env.bindless.set, 0, NULL);
+  vkCmdPushConstants(command_buffer, vk_env.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT,
+                     0, sizeof (quantization_t), &vk_env.quantization);
 
-  vkDestroyImageView(vk_env.device, vk_env.depth_buffer.view, NULL);
-  LOG_DEBUG_INFO("Destroyed depth buffer image view");
-  vkFreeMemory(vk_env.device, vk_env.depth_buffer.device_memory, NULL);
-  LOG_DEBUG_INFO("Freed depth buffer device memory");
-  vkDestroyImage(vk_env.device, vk_env.depth_buffer.image, NULL);
-  LOG_DEBUG_INFO("Destroyed depth buffer image");
+  // Viewport
+  VkViewport viewport = { 0 };
+  float viewport_dimension;
+  if (vk_env.window->width > vk_env.window->height) {
+    viewport_dimension = (float)vk_env.window->height;
+    viewport.x = (vk_env.window->width - vk_env.window->height) / 2.0f;
+  }
+  else {
+    viewport_dimension = (float)vk_env.window->width;
+    viewport.y = (vk_env.window->height - vk_env.window->width) / 2.0f;
+  }
+  viewport.width = viewport_dimension;
+  viewport.height = -viewport_dimension;
+  viewport.y += viewport_dimension;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+  // Scissor
+  const VkRect2D scissor = {
+    { 0, 0 }, // offset
+    { vk_env.window->width, vk_env.window->height } // extent
+  };
+  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
 
-  LOG_DEBUG_INFO("End destroy_depth_buffer()");
+  if (gpu_culling && compact)
+    vkCmdDrawIndexedIndirectCount(command_buffer, instance_buffer->draw_buffer, 0,
+                                  instance_buffer->count_buffer, 0, num_instances,
+                                  sizeof (VkDrawIndexedIndirectCommand));
+  else if (gpu_culling)
+    // Culled draws have instanceCount 0
+    vkCmdDrawIndexedIndirect(command_buffer, instance_buffer->draw_buffer,
+                             first_instance * sizeof (VkDrawIndexedIndirectCommand),
+                             num_instances, sizeof (VkDrawIndexedIndirectCommand));
+  else
+    vkCmdDrawIndexed(command_buffer, vk_env.num_indices, num_instances, 0, 0, first_instance);
 }
 
-void create_resolve_buffer() {
-  LOG_DEBUG_INFO("Begin create_resolve_buffer()");
+// With recorders the draws were already recorded into secondary command buffers, which are
+// executed in slice order
+void record_scene_pass(VkCommandBuffer command_buffer, void *context) {
+  const frame_context_t *frame = (const frame_context_t *)context;
+  VkRenderPassBeginInfo rp_begin_info = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
+  rp_begin_info.renderPass = vk_env.render_pass;
+  rp_begin_info.framebuffer = vk_env.framebuffers[frame->image];
+  rp_begin_info.renderArea.extent.width = vk_env.window->width;
+  rp_begin_info.renderArea.extent.height = vk_env.window->height;
+  const VkClearValue clear_values[] = {
+    { { 0.0f, 0.0f, 0.1f, 1.0f } }, // color
+    { { 1.0f, 0 } } // depthStencil
+  };
+  rp_begin_info.clearValueCount = ARRAY_COUNT(clear_values);
+  rp_begin_info.pClearValues = clear_values;
+  if (frame->secondary_command_buffers) {
+    vkCmdBeginRenderPass(command_buffer, &rp_begin_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    vkCmdExecuteCommands(command_buffer, vk_env.num_recorders, frame->secondary_command_buffers);
+  }
+  else {
+    vkCmdBeginRenderPass(command_buffer, &rp_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    buffer_draw_commands(command_buffer, &vk_env.descriptor_sets[frame->image], &vk_env.instance_buffers[frame->image],
+                         0, vk_env.num_instances, frame->gpu_culling, frame->compact);
+  }
+  vkCmdEndRenderPass(command_buffer);
+}
 
-  VK_CALL(create_image(
-    vk_env.device,
-    vk_env.gpu.surface_format.format,
+// FXAA the scene into the post-process image
+void record_fxaa_pass(VkCommandBuffer command_buffer, void *context) {
+  const frame_context_t *frame = (const frame_context_t *)context;
+  const post_constants_t constants = {
     vk_env.window->width,
     vk_env.window->height,
-    vk_env.gpu.num_aa_samples,
-    VK_IMAGE_TILING_OPTIMAL,
-    VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-    &vk_env.resolve_buffer.image
-  ));
-  LOG_DEBUG_INFO("Created resolve buffer image");
-
-  VkMemoryRequirements memory_requirements;
-  vkGetImageMemoryRequirements(vk_env.device, vk_env.resolve_buffer.image, &memory_requirements); // 1665 = 11010000001 // size = 8847360, alignment = 32
-  alloc_device_memory(
-    memory_requirements,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    &vk_env.resolve_buffer.device_memory
-  );
-  VK_CALL(vkBindImageMemory(vk_env.device, vk_env.resolve_buffer.image, vk_env.resolve_buffer.device_memory, 0));
-
-  VK_CALL(create_image_view(
-    vk_env.device,
-    vk_env.resolve_buffer.image,
-    vk_env.gpu.surface_format.format,
-    VK_IMAGE_ASPECT_COLOR_BIT,
-    &vk_env.resolve_buffer.view
-  ));
-  LOG_DEBUG_INFO("Created resolve buffer image view");
-
-  LOG_DEBUG_INFO("End create_resolve_buffer()");
+    { 1.0f / vk_env.attachment_extent.width, 1.0f / vk_env.attachment_extent.height }
+  };
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, vk_env.post_pipeline.pipeline);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          vk_env.post_pipeline_layout, 0, 1,
+                          &vk_env.post_descriptor_sets[frame->image], 0, NULL);
+  vkCmdPushConstants(command_buffer, vk_env.post_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+                     0, sizeof constants, &constants);
+  vkCmdDispatch(command_buffer,
+                (vk_env.window->width + POST_GROUP_SIZE - 1) / POST_GROUP_SIZE,
+                (vk_env.window->height + POST_GROUP_SIZE - 1) / POST_GROUP_SIZE, 1);
+}
+
+// The blit converts to the swapchain's format
+void blit_to_swapchain(VkCommandBuffer command_buffer, VkImage source, uint32_t image) {
+  VkImageBlit region = { 0 };
+  region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.srcSubresource.layerCount = 1;
+  region.srcOffsets[1].x = vk_env.window->width;
+  region.srcOffsets[1].y = vk_env.window->height;
+  region.srcOffsets[1].z = 1;
+  region.dstSubresource = region.srcSubresource;
+  region.dstOffsets[1] = region.srcOffsets[1];
+  vkCmdBlitImage(command_buffer,
+                 source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                 vk_env.swapchain_images[image], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                 1, &region, VK_FILTER_NEAREST);
+}
+
+void record_present_post_pass(VkCommandBuffer command_buffer, void *context) {
+  const frame_context_t *frame = (const frame_context_t *)context;
+  blit_to_swapchain(command_buffer, fg_image(&vk_env.frame_graph, vk_env.frame_handles.post), frame->image);
+}
+
+void record_present_scene_pass(VkCommandBuffer command_buffer, void *context) {
+  const frame_context_t *frame = (const frame_context_t *)context;
+  blit_to_swapchain(command_buffer, fg_image(&vk_env.frame_graph, vk_env.frame_handles.scene), frame->image);
+}
+
+// Passes in recording order, declaring how they use each resource so the graph can place the
+// barriers between them. With FXAA the scene reaches the swapchain through one of two present
+// passes; while the FXAA pipeline compiles the other is enabled, and the FXAA pass, with
+// nothing reading its output, is culled. Images whose uses don't overlap share memory
+void create_frame_graph() {
+  frame_graph_t *graph = &vk_env.frame_graph;
+  frame_handles_t *handles = &vk_env.frame_handles;
+  bool fxaa = vk_env.aa.mode == AA_MODE_FXAA;
+  fg_init(graph, vk_env.device, vk_env.pipeline_barrier2);
+
+  // Without FXAA or a resolve the scene is drawn into the swapchain image
+  bool direct = !fxaa && !resolve_scene();
+  handles->scene = direct ? FG_NONE
+                          : fg_create_image(graph, "scene", vk_env.gpu.surface_format.format, vk_env.attachment_extent,
+                                            vk_env.gpu.num_aa_samples, VK_IMAGE_ASPECT_COLOR_BIT);
+  handles->depth = fg_create_image(graph, "depth", vk_env.gpu.depth_format, vk_env.attachment_extent,
+                                   vk_env.gpu.num_aa_samples, VK_IMAGE_ASPECT_DEPTH_BIT);
+  handles->post = fxaa ? fg_create_image(graph, "post", POST_FORMAT, vk_env.attachment_extent,
+                                         VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_ASPECT_COLOR_BIT)
+                       : FG_NONE;
+  // Its first use chains after the stage end_render waits on the image acquired semaphore at
+  const fg_state_t acquired = {
+    fxaa ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, // stage
+    0, // access
+    VK_IMAGE_LAYOUT_UNDEFINED // layout
+  };
+  handles->swapchain = fg_import_image(graph, "swapchain", VK_IMAGE_ASPECT_COLOR_BIT, &acquired);
+  fg_export(graph, handles->swapchain, FG_USAGE_PRESENT);
+  handles->draws = fg_import_buffer(graph, "draws");
+  handles->draw_count = fg_import_buffer(graph, "draw count");
+
+  handles->clear_pass = fg_add_pass(graph, "clear draw count", record_clear_pass);
+  fg_use(graph, handles->clear_pass, handles->draw_count, FG_USAGE_TRANSFER_DST);
+  handles->cull_pass = fg_add_pass(graph, "cull", record_cull_pass);
+  fg_use(graph, handles->cull_pass, handles->draw_count, FG_USAGE_COMPUTE_READ_WRITE);
+  fg_use(graph, handles->cull_pass, handles->draws, FG_USAGE_COMPUTE_WRITE);
+  uint32_t scene_pass = fg_add_pass(graph, "scene", record_scene_pass);
+  fg_use(graph, scene_pass, handles->draws, FG_USAGE_INDIRECT);
+  fg_use(graph, scene_pass, handles->draw_count, FG_USAGE_INDIRECT);
+  if (!direct)
+    fg_use(graph, scene_pass, handles->scene, FG_USAGE_COLOUR_ATTACHMENT);
+  fg_use(graph, scene_pass, handles->depth, FG_USAGE_DEPTH_ATTACHMENT);
+  handles->fxaa_pass = FG_NONE;
+  handles->present_post_pass = FG_NONE;
+  handles->present_scene_pass = FG_NONE;
+  if (!fxaa)
+    // Resolved or drawn into the swapchain image
+    fg_use(graph, scene_pass, handles->swapchain, FG_USAGE_COLOUR_ATTACHMENT);
+  else {
+    handles->fxaa_pass = fg_add_pass(graph, "fxaa", record_fxaa_pass);
+    fg_use(graph, handles->fxaa_pass, handles->scene, FG_USAGE_COMPUTE_SAMPLED);
+    fg_use(graph, handles->fxaa_pass, handles->post, FG_USAGE_COMPUTE_WRITE);
+    handles->present_post_pass = fg_add_pass(graph, "present post", record_present_post_pass);
+    fg_use(graph, handles->present_post_pass, handles->post, FG_USAGE_TRANSFER_SRC);
+    fg_use(graph, handles->present_post_pass, handles->swapchain, FG_USAGE_TRANSFER_DST);
+    handles->present_scene_pass = fg_add_pass(graph, "present scene", record_present_scene_pass);
+    fg_use(graph, handles->present_scene_pass, handles->scene, FG_USAGE_TRANSFER_SRC);
+    fg_use(graph, handles->present_scene_pass, handles->swapchain, FG_USAGE_TRANSFER_DST);
+  }
+  fg_compile(graph);
 }
 
-void destroy_resolve_buffer() {
-  LOG_DEBUG_INFO("Begin destroy_resolve_buffer()");
-
-  vkDestroyImageView(vk_env.device, vk_env.resolve_buffer.view, NULL);
-  LOG_DEBUG_INFO("Destroyed resolve buffer image view");
-  vkFreeMemory(vk_env.device, vk_env.resolve_buffer.device_memory, NULL);
-  LOG_DEBUG_INFO("Freed resolve buffer device memory");
-  vkDestroyImage(vk_env.device, vk_env.resolve_buffer.image, NULL);
-  LOG_DEBUG_INFO("Destroyed resolve buffer image");
-
-  LOG_DEBUG_INFO("End destroy_resolve_buffer()");
+void destroy_frame_graph() {
+  fg_destroy(&vk_env.frame_graph);
 }
 
-void destroy_swapchain(VkSwapchainKHR swapchain) {
+// Frames in flight may still be presenting from the old swapchain, so it and its views and
+// framebuffers are destroyed once those frames complete
+void retire_swapchain(VkSwapchainKHR swapchain) {
   for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++) {
-    vkDestroyFramebuffer(vk_env.device, vk_env.framebuffers[i], NULL);
-    vkDestroyImageView(vk_env.device, vk_env.swapchain_views[i], NULL);
+    defer_destroy(VK_OBJECT_TYPE_FRAMEBUFFER, (uint64_t)vk_env.framebuffers[i]);
+    defer_destroy(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)vk_env.swapchain_views[i]);
+  }
+  defer_destroy(VK_OBJECT_TYPE_SWAPCHAIN_KHR, (uint64_t)swapchain);
+  pool_free(&vk_env.swapchain_pool, vk_env.framebuffers);
+  pool_free(&vk_env.swapchain_pool, vk_env.swapchain_views);
+  pool_free(&vk_env.swapchain_pool, vk_env.swapchain_images);
+  vk_env.framebuffers = NULL;
+  vk_env.swapchain_views = NULL;
+  vk_env.swapchain_images = NULL;
+}
+
+// Keep the frame graph's images while the window fits in them and isn't under half their size
+// in both dimensions; framebuffers may be smaller than their attachments
+void fit_attachments() {
+  uint32_t width = vk_env.window->width,
+           height = vk_env.window->height;
+  VkExtent2D *extent = &vk_env.attachment_extent;
+  frame_graph_t *graph = &vk_env.frame_graph;
+  if (graph->compiled &&
+      width <= extent->width && height <= extent->height &&
+      (width > extent->width / 2 || height > extent->height / 2))
+    return;
+  // Frames in flight may still be rendering to them, so their destruction is deferred
+  if (graph->compiled)
+    destroy_frame_graph();
+  extent->width = (width + ATTACHMENT_GRANULARITY - 1) / ATTACHMENT_GRANULARITY * ATTACHMENT_GRANULARITY;
+  extent->height = (height + ATTACHMENT_GRANULARITY - 1) / ATTACHMENT_GRANULARITY * ATTACHMENT_GRANULARITY;
+  CLAMP(extent->width, width, vk_env.gpu.properties.limits.maxFramebufferWidth);
+  CLAMP(extent->height, height, vk_env.gpu.properties.limits.maxFramebufferHeight);
+  create_frame_graph();
+  // Lazily allocated memory is only committed as the GPU needs it
+  VkDeviceSize committed = graph->allocated_size - graph->lazy_size, size;
+  for (uint32_t i = 0; i < graph->num_resources; i++) {
+    if (graph->resources[i].lazy) {
+      vkGetDeviceMemoryCommitment(vk_env.device, graph->resources[i].memory, &size);
+      committed += size;
+    }
   }
-  hfree(vk_env.framebuffers);
-  hfree(vk_env.swapchain_views);
-  hfree(vk_env.swapchain_images);
-  LOG_DEBUG_INFO("Destroyed %d swapchain images, views and framebuffers", vk_env.gpu.num_buffers);
-  vkDestroySwapchainKHR(vk_env.device, swapchain, NULL);
+  log_console_info("Allocated (%d, %d) attachments for a (%d, %d) window: %.1f MB for %.1f MB of images, %.1f MB lazy, %.1f MB committed",
+                   extent->width, extent->height, width, height,
+                   graph->allocated_size / 1048576.0, graph->transient_size / 1048576.0,
+                   graph->lazy_size / 1048576.0, committed / 1048576.0);
 }
 
 void create_swapchain() {
@@ -1429,22 +2588,42 @@ void create_swapchain() {
   LOG_DEBUG_INFO("Created new swapchain");
 
   if (old_swapchain) {
-    destroy_swapchain(old_swapchain);
-    LOG_DEBUG_INFO("Destroyed old swapchain");
+    retire_swapchain(old_swapchain);
+    // Presents to the old swapchain can't be waited on through the new one
+    vk_env.pacer.observed_id = vk_env.present_id;
+    LOG_DEBUG_INFO("Retired old swapchain");
   }
 
   // Have to call vkGetSwapchainImagesKHR twice, although we already know the value of num_buffers,
   // to prevent UNASSIGNED-CoreValidation-SwapchainInvalidCount
   VK_CALL(vkGetSwapchainImagesKHR(vk_env.device, vk_env.swapchain, &vk_env.gpu.num_buffers, NULL));
-  vk_env.swapchain_images = halloc_type(VkImage, vk_env.gpu.num_buffers);
+  // Asked for no more than a pool block holds, so a larger swapchain is VK_INCOMPLETE rather than an overrun
+  vk_env.gpu.num_buffers = vk_env.swapchain_capacity;
+  vk_env.swapchain_images = (VkImage *)pool_alloc(&vk_env.swapchain_pool);
   VK_CALL(vkGetSwapchainImagesKHR(vk_env.device, vk_env.swapchain, &vk_env.gpu.num_buffers, vk_env.swapchain_images));
-  vk_env.swapchain_views = halloc_type(VkImageView, vk_env.gpu.num_buffers);
-  vk_env.framebuffers = halloc_type(VkFramebuffer, vk_env.gpu.num_buffers);
-
-  VkImageView attachments[] = { vk_env.resolve_buffer.view, vk_env.depth_buffer.view, VK_NULL_HANDLE };
+  // The driver allocates the images, so estimate them as 4 bytes a texel in device local memory
+  track_external_memory(
+    &vk_env.memory,
+    MEMORY_CATEGORY_SWAPCHAIN,
+    vk_env.gpu.memory_properties.memoryTypes[find_memory_type(UINT32_MAX, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)].heapIndex,
+    (VkDeviceSize)swapchain_extent.width * swapchain_extent.height * 4 * vk_env.gpu.num_buffers
+  );
+  vk_env.swapchain_views = (VkImageView *)pool_alloc(&vk_env.swapchain_pool);
+  vk_env.framebuffers = (VkFramebuffer *)pool_alloc(&vk_env.swapchain_pool);
+
+  fit_attachments();
+  bool resolve = resolve_scene(),
+       direct = vk_env.aa.mode != AA_MODE_FXAA && !resolve;
+  VkImageView attachments[] = {
+    direct ? VK_NULL_HANDLE : fg_view(&vk_env.frame_graph, vk_env.frame_handles.scene),
+    fg_view(&vk_env.frame_graph, vk_env.frame_handles.depth),
+    VK_NULL_HANDLE
+  };
   VkFramebufferCreateInfo create_info = { VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO };
   create_info.renderPass = vk_env.render_pass;
-  create_info.attachmentCount = ARRAY_COUNT(attachments);
+  // With FXAA the swapchain image is written by a blit, and with a single sample it's the colour
+  // attachment, so only a resolve needs the third attachment
+  create_info.attachmentCount = resolve ? ARRAY_COUNT(attachments) : ARRAY_COUNT(attachments) - 1;
   create_info.pAttachments = attachments;
   create_info.width = vk_env.window->width;
   create_info.height = vk_env.window->height;
@@ -1457,143 +2636,300 @@ void create_swapchain() {
       VK_IMAGE_ASPECT_COLOR_BIT,
       &vk_env.swapchain_views[i]
     ));
-    attachments[2] = vk_env.swapchain_views[i];
+    attachments[direct ? 0 : 2] = vk_env.swapchain_views[i];
     VK_CALL(vkCreateFramebuffer(vk_env.device, &create_info, NULL, &vk_env.framebuffers[i]));
     // ERROR Validation Error : [VUID - VkFramebufferCreateInfo - width - 00885]
     // Object 0 : handle = 0x1ddce66c638, type = VK_OBJECT_TYPE_DEVICE; | MessageID = 0xb6981526 |
     // vkCreateFramebuffer() : Requested VkFramebufferCreateInfo width must be greater than zero.
   }
-  vk_env.frame_index = 0;
   LOG_DEBUG_INFO("Created %d swapchain images, views and framebuffers", vk_env.gpu.num_buffers);
 
   LOG_DEBUG_INFO("End create_swapchain()");
 }
 
+// Destroyed with the deletion queue, after everything else using the device
 void destroy_swapchain_final() {
-  destroy_swapchain(vk_env.swapchain);
+  if (vk_env.swapchain)
+    retire_swapchain(vk_env.swapchain);
+  track_external_memory(&vk_env.memory, MEMORY_CATEGORY_SWAPCHAIN, 0, 0);
   LOG_DEBUG_INFO("Destroyed swapchain");
 }
 
-void buffer_commands(VkCommandBuffer command_buffer, VkFramebuffer framebuffer, VkDescriptorSet *descriptor_set) {
+
+// Record the primary command buffer for a swapchain image by running the frame graph with its
+// swapchain image and instance buffer bound
+void buffer_commands(VkCommandBuffer command_buffer, frame_context_t *frame) {
   VkCommandBufferBeginInfo cmd_begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
   cmd_begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
   vkResetCommandBuffer(command_buffer, 0);
   VK_CALL(vkBeginCommandBuffer(command_buffer, &cmd_begin_info));
 
-  VkRenderPassBeginInfo rp_begin_info = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
-  rp_begin_info.renderPass = vk_env.render_pass;
-  rp_begin_info.framebuffer = framebuffer;
-  rp_begin_info.renderArea.extent.width = vk_env.window->width;
-  rp_begin_info.renderArea.extent.height = vk_env.window->height;
-  const VkClearValue clear_values[] = {
-    { { 0.0f, 0.0f, 0.1f, 1.0f } }, // color
-    { { 1.0f, 0 } } // depthStencil
-  };
-  rp_begin_info.clearValueCount = ARRAY_COUNT(clear_values);
-  rp_begin_info.pClearValues = clear_values;
-  vkCmdBeginRenderPass(command_buffer, &rp_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+  frame_graph_t *graph = &vk_env.frame_graph;
+  const frame_handles_t *handles = &vk_env.frame_handles;
+  VkInstanceBuffer *instance_buffer = &vk_env.instance_buffers[frame->image];
+  fg_bind_image(graph, handles->swapchain, vk_env.swapchain_images[frame->image]);
+  fg_bind_buffer(graph, handles->draws, instance_buffer->draw_buffer);
+  fg_bind_buffer(graph, handles->draw_count, instance_buffer->count_buffer);
+  fg_enable_pass(graph, handles->clear_pass, frame->gpu_culling);
+  fg_enable_pass(graph, handles->cull_pass, frame->gpu_culling);
+  // The scene is copied unfiltered until the FXAA pass has compiled
+  bool filter = pipeline_ready(&vk_env.post_pipeline);
+  fg_enable_pass(graph, handles->present_post_pass, filter);
+  fg_enable_pass(graph, handles->present_scene_pass, !filter);
+  fg_execute(graph, command_buffer, frame);
+  VK_CALL(vkEndCommandBuffer(command_buffer));
+}
 
-  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_env.pipeline);
-  // Vertex buffer
-  VkDeviceSize offset = 0;
-  vkCmdBindVertexBuffers(command_buffer, 0, 1, &vk_env.cube_vb.buffer, &offset);
-  // Index buffer
-  vkCmdBindIndexBuffer(command_buffer, vk_env.cube_ib.buffer, 0, VK_INDEX_TYPE_UINT16);
-  // Uniform buffer
-  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          vk_env.pipeline_layout, 0, 1,
-                          descriptor_set, 0, NULL);
+// Task pool entry point: re-record a recorder's secondary command buffer from its own pool
+void record_secondary_command_buffer(void *data) {
+  secondary_recorder_t *recorder = (secondary_recorder_t *)data;
+  VkCommandBuffer command_buffer = vk_env.secondary_command_buffers[recorder - vk_env.recorders];
+  VK_CALL(vkResetCommandPool(vk_env.device, recorder->command_pool, 0));
 
-  // Viewport
-  VkViewport viewport = { 0 };
-  float viewport_dimension;
-  if (vk_env.window->width > vk_env.window->height) {
-    viewport_dimension = (float)vk_env.window->height;
-    viewport.x = (vk_env.window->width - vk_env.window->height) / 2.0f;
+  VkCommandBufferInheritanceInfo inheritance_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+  inheritance_info.renderPass = vk_env.render_pass;
+  inheritance_info.subpass = 0;
+  inheritance_info.framebuffer = vk_env.framebuffers[recorder->image];
+  VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+                     VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+  begin_info.pInheritanceInfo = &inheritance_info;
+  VK_CALL(vkBeginCommandBuffer(command_buffer, &begin_info));
+  buffer_draw_commands(
+    command_buffer,
+    &vk_env.descriptor_sets[recorder->image],
+    &vk_env.instance_buffers[recorder->image],
+    recorder->first_instance,
+    recorder->num_instances,
+    recorder->gpu_culling,
+    false
+  );
+  VK_CALL(vkEndCommandBuffer(command_buffer));
+}
+
+// Record count images' command buffers from first, with their draws split between the recorders
+// on worker threads when threaded recording is on
+void record_image_commands(uint32_t first, uint32_t count) {
+  bool gpu_culling = pipeline_ready(&vk_env.cull_pipeline) &&
+                     vk_env.num_instances <= vk_env.gpu.properties.limits.maxDrawIndirectCount;
+  // A compacted draw count can't be split between secondary command buffers
+  bool compact = FLAGGED(vk_env.gpu.support, GPU_SUPPORT_DRAW_INDIRECT_COUNT) && !vk_env.recorders;
+  if (vk_env.aa.mode == AA_MODE_FXAA) {
+    for (uint32_t i = first; i < first + count; i++)
+      write_post_descriptor_set(i);
   }
-  else {
-    viewport_dimension = (float)vk_env.window->width;
-    viewport.y = (vk_env.window->height - vk_env.window->width) / 2.0f;
+
+  if (vk_env.recorders) {
+    // Split each image's instances evenly between the recorders
+    uint32_t slice = (vk_env.num_instances + vk_env.num_recorders - 1) / vk_env.num_recorders;
+    task_group_t group = { 0 };
+    for (uint32_t i = first * vk_env.num_recorders; i < (first + count) * vk_env.num_recorders; i++) {
+      secondary_recorder_t *recorder = &vk_env.recorders[i];
+      uint32_t slice_first = i % vk_env.num_recorders * slice;
+      uint32_t remaining = slice_first < vk_env.num_instances ? vk_env.num_instances - slice_first : 0;
+      recorder->first_instance = slice_first;
+      recorder->num_instances = remaining < slice ? remaining : slice;
+      recorder->gpu_culling = gpu_culling;
+      submit_group_task(&vk_env.task_pool, &group, record_secondary_command_buffer, recorder);
+    }
+    wait_task_group(&vk_env.task_pool, &group);
   }
-  viewport.width = viewport_dimension;
-  viewport.height = -viewport_dimension;
-  viewport.y += viewport_dimension;
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
-  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
-  // Scissor
-  const VkRect2D scissor = {
-    { 0, 0 }, // offset
-    { vk_env.window->width, vk_env.window->height } // extent
-  };
-  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
 
-  vkCmdDrawIndexed(command_buffer, ARRAY_COUNT(cube_indices), 1, 0, 0, 0);
+  for (uint32_t i = first; i < first + count; i++) {
+    frame_context_t frame = {
+      i, // image
+      gpu_culling,
+      compact,
+      vk_env.recorders ? &vk_env.secondary_command_buffers[i * vk_env.num_recorders] : NULL
+    };
+    buffer_commands(vk_env.command_buffers[i], &frame);
+    vk_env.commands_stale[i] = false;
+  }
+}
 
-  // Note that ending the renderpass changes the image's layout from
-  // COLOR_ATTACHMENT_OPTIMAL to VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
-  vkCmdEndRenderPass(command_buffer);
-  VK_CALL(vkEndCommandBuffer(command_buffer));
+void record_command_buffers() {
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
+  InterlockedExchange(&vk_env.commands_dirty, 0);
+  record_image_commands(0, vk_env.gpu.num_buffers);
+  log_console_info("Recorded %d command buffers in %.3f ms (%s): %d frame graph passes culled, %d barriers",
+                   vk_env.gpu.num_buffers, elapsed_ms(start),
+                   vk_env.recorders ? "secondary command buffers on worker threads" : "inline",
+                   vk_env.frame_graph.num_culled, vk_env.frame_graph.num_barriers);
 }
 
 void prepare_command_buffers() {
   LOG_DEBUG_INFO("Begin prepare_command_buffers()");
 
-  VkCommandBuffer init_cmd_buf; // Buffer for initialization commands
-  VkCommandBufferAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-  alloc_info.commandPool = vk_env.command_pool;
-  alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  alloc_info.commandBufferCount = 1;
-  VK_CALL(vkAllocateCommandBuffers(vk_env.device, &alloc_info, &init_cmd_buf));
+  // Streamed textures are left in their read-only layout by their uploads
+  record_command_buffers();
 
-  VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-  VK_CALL(vkBeginCommandBuffer(init_cmd_buf, &begin_info));
-
-  VkImageMemoryBarrier image_memory_barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
-  image_memory_barrier.srcAccessMask = 0;
-  image_memory_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
-  image_memory_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  image_memory_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  image_memory_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  image_memory_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  image_memory_barrier.image = vk_env.texture.image;
-  image_memory_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  image_memory_barrier.subresourceRange.levelCount = 1;
-  image_memory_barrier.subresourceRange.layerCount = 1;
-  vkCmdPipelineBarrier(
-    init_cmd_buf,
-    VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-    0, 0, NULL, 0, NULL, 1, &image_memory_barrier
-  );
-  vkEndCommandBuffer(init_cmd_buf);
+  LOG_DEBUG_INFO("End prepare_command_buffers()");
+}
 
-  for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++) {
-    buffer_commands(
-      vk_env.command_buffers[i],
-      vk_env.framebuffers[i],
-      &vk_env.descriptor_sets[i]
-    );
+// Grow the instance buffers if needed; command buffers are re-recorded before the next frame
+void set_num_instances(uint32_t num_instances) {
+  CLAMP(num_instances, 1, MAX_INSTANCES);
+  if (num_instances > vk_env.instance_buffers[0].capacity) {
+    uint32_t capacity = vk_env.instance_buffers[0].capacity * 2;
+    if (capacity < num_instances)
+      capacity = num_instances;
+    CLAMP(capacity, 1, MAX_INSTANCES);
+    wait_frames();
+    for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++) {
+      destroy_instance_buffer(&vk_env.instance_buffers[i]);
+      create_instance_buffer(&vk_env.instance_buffers[i], capacity);
+      write_cull_descriptor_set(i);
+    }
+    LOG_DEBUG_INFO("Resized instance buffers to %d instances", capacity);
   }
+  vk_env.num_instances = num_instances;
+  InterlockedExchange(&vk_env.commands_dirty, 1);
+}
 
-  VkFence fence;
-  VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
-  VK_CALL(vkCreateFence(vk_env.device, &fence_info, NULL, &fence));
-  VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-  submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers = &init_cmd_buf;
-  VK_CALL(vkQueueSubmit(vk_env.graphics_queue, 1, &submit_info, fence));
-  VK_CALL(vkWaitForFences(vk_env.device, 1, &fence, VK_TRUE, UINT64_MAX));
-  vkFreeCommandBuffers(vk_env.device, vk_env.command_pool, 1, &init_cmd_buf);
-  vkDestroyFence(vk_env.device, fence, NULL);
+// Replace the swapchain without idling the device: the old one is retired until its frames
+// complete, attachments are reused when they still fit, and each image's command buffer is
+// re-recorded when it's next acquired, after its own previous frame is done with it
+void apply_resize() {
+  vk_env.resize_pending = false;
+  if (!vk_env.initialized)
+    return;
+  bool first = !vk_env.swapchain;
+  create_swapchain();
+  if (vk_env.window->minimized)
+    return;
+  if (first)
+    prepare_command_buffers();
+  else {
+    for (uint32_t i = 0; i < vk_env.gpu.num_buffers; i++)
+      vk_env.commands_stale[i] = true;
+  }
+}
 
-  LOG_DEBUG_INFO("End prepare_command_buffers()");
+// e.g. "FXAA" or "8x MSAA, 0.25 sample shading"
+void format_aa(const aa_config_t *aa, char *text, size_t size) {
+  if (aa->mode == AA_MODE_FXAA)
+    snprintf(text, size, "FXAA");
+  else
+    snprintf(text, size, "%dx MSAA, %.2f sample shading", aa->samples, aa->min_sample_shading);
+}
+
+bool aa_supported(const aa_config_t *aa) {
+  VkSampleCountFlags counts = vk_env.gpu.properties.limits.framebufferColorSampleCounts &
+                              vk_env.gpu.properties.limits.framebufferDepthSampleCounts;
+  return aa->mode == AA_MODE_FXAA || FLAGGED(counts, aa->samples);
+}
+
+// Switch anti-aliasing between frames. The render pass and graphics pipeline depend on the
+// sample count, so they're rebuilt now, and the attachments and framebuffers by a resize. The old
+// ones are destroyed once the frames in flight complete; only the pipeline's compilation is waited on
+void set_aa(const aa_config_t *aa) {
+  wait_pipelines(&vk_env.pipeline, 1);
+  defer_destroy(VK_OBJECT_TYPE_PIPELINE, (uint64_t)vk_env.pipeline.pipeline);
+  vk_env.pipeline.pipeline = VK_NULL_HANDLE;
+  defer_destroy(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)vk_env.render_pass);
+  vk_env.aa = *aa;
+  vk_env.gpu.num_aa_samples = aa->mode == AA_MODE_FXAA ? VK_SAMPLE_COUNT_1_BIT : aa->samples;
+  create_render_pass();
+  build_graphics_pipeline();
+  // No longer the right kind, so the next swapchain reallocates them
+  vk_env.attachment_extent.width = 0;
+  vk_env.attachment_extent.height = 0;
+  if (vk_env.swapchain)
+    apply_resize();
+  char text[64];
+  format_aa(aa, text, sizeof text);
+  LOG_DEBUG_INFO("Switched anti-aliasing to %s", text);
+}
+
+const uint32_t benchmark_instance_counts[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+// Post-process AA against MSAA with and without per-sample shading
+const aa_config_t benchmark_aa_configs[] = {
+  { AA_MODE_FXAA, 1, 0.0f },
+  { AA_MODE_MSAA, 2, 0.0f },
+  { AA_MODE_MSAA, 4, 0.0f },
+  { AA_MODE_MSAA, 8, 0.0f },
+  { AA_MODE_MSAA, 4, 1.0f },
+  { AA_MODE_MSAA, 8, 1.0f }
+};
+
+// Set up the benchmark's current step, skipping AA configurations the GPU can't do. Returns
+// false when there are no steps left
+bool apply_benchmark_step() {
+  benchmark_t *benchmark = &vk_env.benchmark;
+  if (!benchmark->aa) {
+    if (benchmark->step == ARRAY_COUNT(benchmark_instance_counts))
+      return false;
+    set_num_instances(benchmark_instance_counts[benchmark->step]);
+    return true;
+  }
+  while (benchmark->step < ARRAY_COUNT(benchmark_aa_configs) &&
+         !aa_supported(&benchmark_aa_configs[benchmark->step]))
+    benchmark->step++;
+  if (benchmark->step == ARRAY_COUNT(benchmark_aa_configs))
+    return false;
+  set_aa(&benchmark_aa_configs[benchmark->step]);
+  return true;
+}
+
+void start_benchmark() {
+  benchmark_t *benchmark = &vk_env.benchmark;
+  benchmark->running = true;
+  benchmark->step = 0;
+  benchmark->frame = 0;
+  benchmark->saved_num_instances = vk_env.num_instances;
+  benchmark->saved_aa = vk_env.aa;
+  log_console_info("%s benchmark started", benchmark->aa ? "Anti-aliasing" : "Instancing");
+  apply_benchmark_step();
+}
+
+// Average frame time over BENCHMARK_FRAMES at each instance count or AA configuration, after
+// a warm-up
+void step_benchmark() {
+  benchmark_t *benchmark = &vk_env.benchmark;
+  // Frames drawn while the pipeline compiles aren't representative
+  if (!benchmark->running || !pipeline_ready(&vk_env.pipeline))
+    return;
+  if (benchmark->frame == BENCHMARK_WARMUP_FRAMES)
+    QueryPerformanceCounter(&benchmark->start);
+  else if (benchmark->frame == BENCHMARK_WARMUP_FRAMES + BENCHMARK_FRAMES) {
+    double frame_ms = elapsed_ms(benchmark->start) / BENCHMARK_FRAMES;
+    if (benchmark->aa) {
+      char text[64];
+      format_aa(&vk_env.aa, text, sizeof text);
+      log_console_info("Anti-aliasing benchmark: %-30s - %8.3f ms/frame at (%d, %d)",
+                       text, frame_ms, vk_env.window->width, vk_env.window->height);
+    }
+    else
+      log_console_info("Instancing benchmark: %7d instances - %8.3f ms/frame", vk_env.num_instances, frame_ms);
+    benchmark->frame = 0;
+    benchmark->step++;
+    if (!apply_benchmark_step()) {
+      benchmark->running = false;
+      if (benchmark->aa)
+        set_aa(&benchmark->saved_aa);
+      else
+        set_num_instances(benchmark->saved_num_instances);
+      log_console_info("%s benchmark finished", benchmark->aa ? "Anti-aliasing" : "Instancing");
+    }
+    return;
+  }
+  benchmark->frame++;
+}
+
+// Steps still to start are skipped once one has failed
+bool init_failed() {
+  return vk_env.error != VE_OK;
 }
 
 void init_vulkan() {
   LOG_DEBUG_INFO("Begin init_vulkan()");
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
 
   float projection_matrix[16] = { 0.0f };
-  load_projection(PI / 4.0f, 0.1f, 100.0f, projection_matrix);
+  load_projection(FIELD_OF_VIEW, 0.1f, 100.0f, projection_matrix);
   vec3_t origin = { 0.0f, 0.0f, 0.0f };
   vec3_t eye = { -2.0f, 3.0f, 4.0f };
   vec3_t up = { 0.0f, 1.0f, 0.0f };
@@ -1601,6 +2937,7 @@ void init_vulkan() {
   load_view(&origin, &eye, &up, view_matrix);
   mult_mat4(projection_matrix, view_matrix, mvp);
 
+  const latency_mode_t *latency_mode = &latency_modes[vk_env.latency_mode];
   if (
 #ifdef _DEBUG
     (vk_env.error = enum_validation_layers()) ||
@@ -1611,34 +2948,74 @@ void init_vulkan() {
     return;
   }
 
-  push_create(create_instance, destroy_instance);
-  push_create(create_surface, destroy_surface);
-
-  if ((vk_env.error = select_physical_device(NUM_BUFFERS, NUM_AA_SAMPLES))) {
+  // Created first so it's destroyed last, after every step that may have submitted to it
+  push_create(create_worker_pool, destroy_worker_pool);
+  push_create(create_arenas, destroy_arenas);
+  init_graph_t graph = { 0 };
+  uint32_t image = add_init_step(&graph, "texture image", load_texture_image, destroy_texture_image, 0);
+  uint32_t staged_mesh = add_init_step(&graph, "staged mesh", create_staged_mesh, destroy_staged_mesh, 0);
+  uint32_t instance = add_init_step(&graph, "instance", create_instance, destroy_instance, 0);
+  uint32_t surface = add_init_step(&graph, "surface", create_surface, destroy_surface, 1, instance);
+  uint32_t gpu = add_init_step(&graph, "physical device", select_gpu, NULL, 1, surface);
+  uint32_t device = add_init_step(&graph, "logical device", create_logical_device, destroy_logical_device, 1, gpu);
+  add_init_step(&graph, "swapchain pool", create_swapchain_pool, destroy_swapchain_pool, 1, gpu);
+  add_init_step(&graph, "deletion queue", create_deletion_queue, destroy_deletion_queue_final, 1, device);
+  uint32_t command_pool = add_init_step(&graph, "command pool", create_command_pool, destroy_command_pool, 1, device);
+  add_init_step(&graph, "command buffers", create_command_buffers, destroy_command_buffers, 1, command_pool);
+  add_init_step(&graph, "recorders", create_recorders, destroy_recorders, 1, device);
+  add_init_step(&graph, "sync objects", create_sync_objects, destroy_sync_objects, 1, device);
+  uint32_t render_pass = add_init_step(&graph, "render pass", create_render_pass, destroy_render_pass, 1, device);
+  uint32_t shaders = add_init_step(&graph, "shader modules", create_shader_modules, destroy_shader_modules, 1, device);
+  add_init_step(&graph, "vertex buffer", create_vertex_buffer, destroy_vertex_buffer, 2, device, staged_mesh);
+  uint32_t index_buffer = add_init_step(&graph, "index buffer", create_index_buffer, destroy_index_buffer, 2,
+                                        device, staged_mesh);
+  uint32_t lod_buffer = add_init_step(&graph, "LOD buffer", create_lod_buffer, destroy_lod_buffer, 1, index_buffer);
+  uint32_t uniform_buffer = add_init_step(&graph, "uniform buffer", create_uniform_buffer, destroy_uniform_buffer,
+                                          1, device);
+  uint32_t instance_buffers = add_init_step(&graph, "instance buffers", create_instance_buffers,
+                                            destroy_instance_buffers, 1, device);
+  uint32_t bindless = add_init_step(&graph, "bindless textures", create_bindless_textures,
+                                    destroy_bindless_textures, 1, device);
+  uint32_t texture = add_init_step(&graph, "texture", create_texture, destroy_texture, 2, bindless, image);
+  uint32_t layouts = add_init_step(&graph, "layouts", create_layouts, destroy_layouts, 1, bindless);
+  uint32_t descriptor_pool = add_init_step(&graph, "descriptor pool", create_descriptor_pool,
+                                           destroy_descriptor_pool, 1, device);
+  add_init_step(&graph, "descriptor sets", alloc_descriptor_sets, free_descriptor_sets, 6, descriptor_pool, layouts,
+                uniform_buffer, instance_buffers, lod_buffer, texture);
+  uint32_t pipeline_cache = add_init_step(&graph, "pipeline cache", create_pipeline_cache, destroy_pipeline_cache,
+                                          1, device);
+  add_init_step(&graph, "pipeline", create_pipeline, destroy_pipeline, 4, pipeline_cache, layouts, render_pass,
+                shaders);
+  run_init_graph(&graph, &vk_env.task_pool, init_failed);
+  for (uint32_t i = 0; i < graph.num_completed; i++) {
+    const init_step_t *step = &graph.steps[graph.order[i]];
+    if (step->created)
+      push_create(NULL, step->destroy);
+  }
+  if (vk_env.error) {
     LOG_DEBUG_ERROR(VK_ERRORS[vk_env.error]);
     return;
   }
+  LOG_DEBUG_INFO("Ran %d init steps in %.3f ms, %.3f ms of work", graph.num_steps, graph.ms, graph.work_ms);
 
-  push_create(create_logical_device, destroy_logical_device);
-  push_create(create_command_pool, destroy_command_pool);
-  push_create(create_command_buffers, destroy_command_buffers);
-  push_create(create_sync_objects, destroy_sync_objects);
-  push_create(create_render_pass, destroy_render_pass);
-  push_create(create_shader_modules, destroy_shader_modules);
-  push_create(create_vertex_buffer, destroy_vertex_buffer);
-  push_create(create_index_buffer, destroy_index_buffer);
-  push_create(create_uniform_buffer, destroy_uniform_buffer);
-  push_create(create_texture, destroy_texture);
-  push_create(create_layouts, destroy_layouts);
-  push_create(create_descriptor_pool, destroy_descriptor_pool);
-  push_create(alloc_descriptor_sets, free_descriptor_sets);
-  push_create(create_pipeline_cache, destroy_pipeline_cache);
-  push_create(create_pipeline, destroy_pipeline);
-  push_create(NULL, destroy_depth_buffer);
-  push_create(NULL, destroy_resolve_buffer);
+  // Pacing needs present timing
+  init_pacer(&vk_env.pacer, latency_mode->paced && vk_env.wait_for_present);
+  push_create(NULL, destroy_frame_graph);
   push_create(NULL, destroy_swapchain_final);
 
   vk_env.initialized = true;
+  log_console_info("Initialized Vulkan in %.3f ms", elapsed_ms(start));
+  char aa_text[64];
+  format_aa(&vk_env.aa, aa_text, sizeof aa_text);
+  log_console_info("Anti-aliasing: %s", aa_text);
+  if (vk_env.bindless.enabled)
+    log_console_info("Bindless textures: %d slots, %d free", vk_env.bindless.capacity, vk_env.bindless.num_free);
+  report_attachment_memory();
+  log_console_info("Latency mode %s: present mode %d, %d images, %d frames in flight%s", latency_mode->name,
+                   vk_env.gpu.present_mode, vk_env.gpu.num_buffers, vk_env.frame_lag,
+                   !latency_mode->paced ? "" : vk_env.wait_for_present ? ", paced" : ", unpaced without present wait");
+  if (vk_env.run_benchmark)
+    start_benchmark();
 
   LOG_DEBUG_INFO("End init_vulkan()");
 }
@@ -1651,22 +3028,15 @@ void cleanup_vulkan() {
     pop_destroy();
   if (vk_env.gpu.name)
     hfree(vk_env.gpu.name);
+  // The worker pool is gone, so no other thread is still recording
+  PROFILE_WRITE(PROFILE_TRACE_PATH);
 
   LOG_DEBUG_INFO("End cleanup_vulkan()");
 }
 
+// WM_SIZE arrives many times a second during a drag, so only note it and resize once per frame
 void resize() {
-  if (!vk_env.initialized)
-    return;
-  VK_CALL(vkDeviceWaitIdle(vk_env.device));
-  if (vk_env.resolve_buffer.image)
-    destroy_resolve_buffer();
-  if (vk_env.depth_buffer.image)
-    destroy_depth_buffer();
-  create_resolve_buffer();
-  create_depth_buffer();
-  create_swapchain();
-  prepare_command_buffers(vk_env);
+  vk_env.resize_pending = true;
 }
 
 void move(int x, int y) {
@@ -1678,7 +3048,7 @@ VkResult handle_swapchain_result(VkResult ve) {
   switch (ve) {
     case VK_ERROR_OUT_OF_DATE_KHR:
       // Window was resized
-      resize();
+      apply_resize();
       break;
     case VK_SUCCESS:
       // Swapchain is all good
@@ -1688,7 +3058,7 @@ VkResult handle_swapchain_result(VkResult ve) {
     case VK_ERROR_SURFACE_LOST_KHR:
       vkDestroySurfaceKHR(vk_env.instance, vk_env.surface, NULL);
       create_surface();
-      resize();
+      apply_resize();
       break;
 #ifdef _DEBUG
     default:
@@ -1698,24 +3068,127 @@ VkResult handle_swapchain_result(VkResult ve) {
   return ve;
 }
 
+// Requests the texture's levels for the nearest instance's projected size. The clip space w of
+// the instance centres is linear in their position, so it's smallest at a corner of the grid
+void stream_textures() {
+  uint32_t side = (uint32_t)ceilf(cbrtf((float)vk_env.num_instances));
+  float offset = (side - 1) * INSTANCE_SPACING / 2.0f,
+        nearest = FLT_MAX;
+  for (uint32_t i = 0; i < 8; i++) {
+    float x = i & 1 ? offset : -offset,
+          y = i & 2 ? offset : -offset,
+          z = i & 4 ? offset : -offset,
+          w = mvp[3] * x + mvp[7] * y + mvp[11] * z + mvp[15];
+    if (w < nearest)
+      nearest = w;
+  }
+  nearest -= vk_env.mesh_radius;
+  if (nearest < 0.1f)
+    nearest = 0.1f; // Near plane
+  uint32_t viewport = vk_env.window->width < vk_env.window->height ? vk_env.window->width : vk_env.window->height;
+  float size = 2.0f * vk_env.mesh_radius / tanf(FIELD_OF_VIEW / 2.0f) * viewport / 2.0f / nearest;
+  stream_request(&vk_env.streamer, vk_env.texture.id, size);
+
+  streamer_t *streamer = &vk_env.streamer;
+  if (stream_update(streamer, vk_env.frame_count, vk_env.frame_lag))
+    LOG_DEBUG_INFO("Texture streaming: %d mip levels resident, %d requested, %.1f MB of %.1f MB budget, %d loads, %d evictions",
+                   streamer->resident_levels, streamer->requested_levels,
+                   streamer->resident_size / 1048576.0, streamer->budget / 1048576.0,
+                   streamer->num_loads, streamer->num_evictions);
+}
+
+// Latency samples end when a frame's present completes. Paced frames block on it, as pacing
+// needs its time; otherwise completed presents are polled, so a sample may run up to a frame
+// late. Without VK_KHR_present_wait samples end at GPU completion instead
+void observe_frames(bool wait) {
+  pacer_t *pacer = &vk_env.pacer;
+  while (pacer->observed_id < vk_env.present_id) {
+    uint64_t id = pacer->observed_id + 1;
+    LARGE_INTEGER done, presented;
+    QueryPerformanceCounter(&done);
+    if (!vk_env.wait_for_present) {
+      // Only the frame whose fence was just waited on is known to be done
+      uint64_t slot_id = vk_env.frame_present_ids[vk_env.frame_index];
+      if (slot_id >= id)
+        pacer_end_frame(pacer, slot_id, done, NULL);
+      return;
+    }
+    VkResult result = vk_env.wait_for_present(vk_env.device, vk_env.swapchain, id, wait ? PRESENT_WAIT_TIMEOUT : 0);
+    if (result != VK_SUCCESS) {
+      if (result != VK_TIMEOUT)
+        pacer->observed_id = id; // Out of date or lost, the frame won't be seen
+      return;
+    }
+    QueryPerformanceCounter(&presented);
+    pacer_end_frame(pacer, id, done, &presented);
+  }
+}
+
+// Called from the message loop when it's idle. In a paced latency mode this waits for the last
+// frame to finish and be presented, then returns how many ms the loop should keep handling
+// input before calling render()
+DWORD pace_frame() {
+  if (vk_env.initialized && !vk_env.window->minimized && vk_env.pacer.paced &&
+      vk_env.pacer.observed_id < vk_env.present_id) {
+    uint32_t last = (vk_env.frame_index + vk_env.frame_lag - 1) % vk_env.frame_lag;
+    VK_CALL(vkWaitForFences(vk_env.device, 1, &vk_env.fences[last], VK_TRUE, UINT64_MAX));
+    observe_frames(true);
+  }
+  return pacer_delay_ms(&vk_env.pacer);
+}
+
 void begin_render() {
-  VK_CALL(vkDeviceWaitIdle(vk_env.device));
+  PROFILE_BEGIN(zone, "begin_render");
   // Ensure no more than FRAME_LAG renderings are outstanding
-  vkWaitForFences(vk_env.device, 1, &vk_env.fences[vk_env.frame_index], VK_TRUE, UINT64_MAX);
-  vkResetFences(vk_env.device, 1, &vk_env.fences[vk_env.frame_index]);
+  VkFence fence = vk_env.fences[vk_env.frame_index];
+  PROFILE_BEGIN(fence_zone, "vkWaitForFences");
+  vkWaitForFences(vk_env.device, 1, &fence, VK_TRUE, UINT64_MAX);
+  PROFILE_END(fence_zone);
+  release_deferred();
+  stream_textures();
+  observe_frames(false);
 
   // Get index of next available swapchain image
+  PROFILE_BEGIN(acquire_zone, "vkAcquireNextImageKHR");
   while (handle_swapchain_result(vkAcquireNextImageKHR(
     vk_env.device, vk_env.swapchain, UINT64_MAX,
     vk_env.image_acquired_semaphores[vk_env.frame_index],
     VK_NULL_HANDLE, &vk_env.current_buffer)
   ));
+  PROFILE_END(acquire_zone);
+
+  // Images can be acquired out of order, so the last frame to use this image's command and
+  // instance buffers may not be the one waited on above. The fence is reset only now so a
+  // resize during acquisition never waits on an unsubmitted fence
+  VkFence *image_fence = &vk_env.image_fences[vk_env.current_buffer];
+  if (*image_fence && *image_fence != fence) {
+    PROFILE_BEGIN(image_fence_zone, "vkWaitForFences");
+    vkWaitForFences(vk_env.device, 1, image_fence, VK_TRUE, UINT64_MAX);
+    PROFILE_END(image_fence_zone);
+  }
+  *image_fence = fence;
+  vkResetFences(vk_env.device, 1, &fence);
+
+  bool view_changed = !vk_env.bindless.enabled &&
+    vk_env.texture.views[vk_env.current_buffer] != stream_view(&vk_env.streamer, vk_env.texture.id);
+  if (view_changed)
+    write_texture_descriptor(vk_env.current_buffer);
+  if (view_changed || vk_env.commands_stale[vk_env.current_buffer]) {
+    record_image_commands(vk_env.current_buffer, 1);
+    LOG_DEBUG_INFO("Re-recorded command buffer %d after %s", vk_env.current_buffer,
+                   view_changed ? "a streamed texture view change" : "resize");
+  }
+  PROFILE_END(zone);
 }
 
 void end_render() {
+  PROFILE_BEGIN(zone, "end_render");
   // Wait for image acquired semaphore to be signaled
   // Then submit image to graphics queue
-  VkPipelineStageFlags pipeline_stage_mask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  // With FXAA the swapchain image is first written by the blit
+  VkPipelineStageFlags pipeline_stage_mask = vk_env.aa.mode == AA_MODE_FXAA
+                                           ? VK_PIPELINE_STAGE_TRANSFER_BIT
+                                           : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
   VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
   submit_info.waitSemaphoreCount = 1;
   submit_info.pWaitSemaphores = &vk_env.image_acquired_semaphores[vk_env.frame_index];
@@ -1735,15 +3208,58 @@ void end_render() {
   present_info.swapchainCount = 1;
   present_info.pSwapchains = &vk_env.swapchain;
   present_info.pImageIndices = &vk_env.current_buffer;
+  vk_env.frame_present_ids[vk_env.frame_index] = ++vk_env.present_id;
+  VkPresentIdKHR present_id = { VK_STRUCTURE_TYPE_PRESENT_ID_KHR };
+  present_id.swapchainCount = 1;
+  present_id.pPresentIds = &vk_env.present_id;
+  if (vk_env.wait_for_present)
+    present_info.pNext = &present_id;
+  PROFILE_BEGIN(present_zone, "vkQueuePresentKHR");
   handle_swapchain_result(vkQueuePresentKHR(vk_env.present_queue, &present_info));
+  PROFILE_END(present_zone);
   vk_env.frame_index = (vk_env.frame_index + 1) % vk_env.frame_lag;
+  PROFILE_END(zone);
+}
+
+// Raises the least severe validation message logged, wrapping from error back to verbose
+void cycle_validation_severity() {
+#ifdef _DEBUG
+  VkDebugUtilsMessageSeverityFlagBitsEXT severity = vk_env.validation.min_severity;
+  severity = severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT
+           ? VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT
+           : severity < VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT
+           ? VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT
+           : severity << 4;
+  vk_env.validation.min_severity = severity;
+  log_console_info("Logging validation messages of severity %s and above", validation_severity_name(severity));
+#else
+  log_console_info("Validation is only enabled in debug builds");
+#endif
 }
 
 void render() {
+  if (vk_env.resize_pending)
+    apply_resize();
   if (vk_env.window->minimized)
     return;
+  PROFILE_BEGIN(zone, "render");
+  // Input handled up to now is what this frame shows
+  pacer_begin_frame(&vk_env.pacer, vk_env.present_id + 1);
+  step_benchmark();
+  if (InterlockedCompareExchange(&vk_env.commands_dirty, 0, 0)) {
+    // A pipeline finished compiling or the instance count changed
+    wait_frames();
+    record_command_buffers();
+  }
   begin_render(vk_env);
-  rotate_y(PI / 5000.0f, mvp, vk_env.mvp_ub.mem_ptr);
-  memcpy(mvp, vk_env.mvp_ub.mem_ptr, sizeof mvp);
+  float *image_mvp = (float *)((char *)vk_env.mvp_ub.mem_ptr + vk_env.current_buffer * vk_env.mvp_stride);
+  rotate_y(PI / 5000.0f, mvp, image_mvp);
+  memcpy(mvp, image_mvp, sizeof mvp);
+  update_instances(&vk_env.instance_buffers[vk_env.current_buffer]);
   end_render(vk_env);
+  vk_env.frame_count++;
+#ifdef _DEBUG
+  summarize_validation_messages(&vk_env.validation, false);
+#endif
+  PROFILE_END(zone);
 }
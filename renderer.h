@@ -4,15 +4,54 @@
 #include <stdbool.h>
 #include "maths.h"
 #include "image.h"
+#include "gltf.h"
+#include "mesh.h"
+#include "simplify.h"
+#include "meshlet.h"
+#include "tasks.h"
+#include "pacing.h"
+#include "pipeline.h"
+#include "framegraph.h"
+#include "streamer.h"
+#include "gpumem.h"
+#include "deletion.h"
+#include "gpuscore.h"
+#include "validation.h"
+#include "heap.h"
 
 #define APP_NAME "VulkanDemo"
 #define APP_VERSION VK_MAKE_VERSION(1, 0, 0)
 #define ENGINE_NAME "TestEngine"
 #define ENGINE_VERSION VK_MAKE_VERSION(1, 0, 0)
 #define SHADER_NAME "shader"
+#define CULL_SHADER_NAME "cull"
+#define CULL_GROUP_SIZE 64 // Must match local_size_x in cull.comp.glsl
+#define BINDLESS_SHADER_NAME "bindless" // Fragment shader sampling the bindless texture array
+#define POST_SHADER_NAME "fxaa"
+#define POST_GROUP_SIZE 8 // Must match local_size_x and local_size_y in fxaa.comp.glsl
+#define POST_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT // Post-process output, blitted to the swapchain image
 #define SHADER_ENTRY_POINT_NAME "main"
-#define NUM_BUFFERS 3 // Triple buffering
-#define NUM_AA_SAMPLES 8 // 8 Anti-aliasing samples
+#define PIPELINE_CACHE_PATH "pipeline.cache"
+#define MEMORY_REPORT_PATH "memory.json" // Written on M and whenever a device memory allocation fails
+#define PIPELINE_CACHE_MAGIC 0x43504456 // 'VDPC'
+#define PIPELINE_CACHE_VERSION 1
+#define PRESENT_WAIT_TIMEOUT 100000000 // 100 ms in ns, so a present that never completes can't hang pacing
+#define NUM_AA_SAMPLES 8 // Default MSAA samples, override with -samples <n>
+#define MIN_SAMPLE_SHADING 0.0f // Default fraction of MSAA samples shaded, override with -sample-shading <rate>
+#define NUM_INSTANCES 1 // Default instance count, override with -instances <n>
+#define MAX_INSTANCES 1000000
+#define INSTANCE_SPACING 3.0f
+#define FIELD_OF_VIEW (PI / 4.0f)
+#define LOD_PIXEL_ERROR 1.0f // Screen space error allowed when the cull pass picks an instance's LOD
+#define ATTACHMENT_GRANULARITY 256 // Frame graph images round up to this so most resizes reuse them
+#define TEXTURE_IMAGE_PATH "VulkanDemo.png"
+#define DEVICE_ARENA_SIZE (256 << 10) // Arrays sized at init, such as per image and per frame handles
+#define SWAPCHAIN_ARRAYS 3 // Images, views and framebuffers
+#define MAX_SWAPCHAIN_IMAGES 8 // Swapchain pool block capacity when the surface has no maximum image count
+#define TEXTURE_BUDGET_MB 256 // Default device memory for streamed textures, override with -texture-budget <MB>
+#define MAX_BINDLESS_TEXTURES 4096 // Clamped to the device's update-after-bind descriptor limits
+#define BENCHMARK_WARMUP_FRAMES 30
+#define BENCHMARK_FRAMES 300
 
 #define ARRAY_COUNT(a) (sizeof (a) / sizeof (a[0]))
 #define CLAMP(V, MIN, MAX) if (V < MIN) V = MIN; else if (MAX && V > MAX) V = MAX
@@ -75,7 +114,9 @@ typedef enum {
   VE_NO_PRESENT_MODES,
   VE_NO_SUITABLE_PRESENT_MODE,
   VE_NO_SUITABLE_DEPTH_FORMAT,
-  VE_NO_SUITABLE_TEXTURE_FORMAT
+  VE_NO_SUITABLE_TEXTURE_FORMAT,
+  VE_SHADER_NOT_EMBEDDED,
+  VE_TEXTURE_IMAGE_LOAD
 } VULKAN_ERROR;
 
 typedef struct cds_entry_s cds_entry_t;
@@ -92,9 +133,43 @@ typedef enum {
   GPU_SUPPORT_RAYTRACING = 2,
   GPU_SUPPORT_TEXTURE_COMPRESSION = 4,
   GPU_SUPPORT_ANISTROPIC_FILTERING = 8,
-  GPU_SUPPORT_SAMPLE_SHADING = 16
+  GPU_SUPPORT_SAMPLE_SHADING = 16,
+  GPU_SUPPORT_MULTI_DRAW_INDIRECT = 32, // Including non-zero firstInstance
+  GPU_SUPPORT_DRAW_INDIRECT_COUNT = 64,
+  GPU_SUPPORT_PRESENT_WAIT = 128, // VK_KHR_present_id and VK_KHR_present_wait
+  GPU_SUPPORT_SYNCHRONIZATION2 = 256, // VK_KHR_synchronization2
+  GPU_SUPPORT_DESCRIPTOR_INDEXING = 512, // Partially bound, update-after-bind sampled image arrays
+  GPU_SUPPORT_MEMORY_BUDGET = 1024, // VK_EXT_memory_budget
+  GPU_SUPPORT_CREATION_FEEDBACK = 2048 // VK_EXT_pipeline_creation_feedback
 } GPU_SUPPORT;
 
+typedef enum {
+  LATENCY_MODE_LOW,
+  LATENCY_MODE_BALANCED,
+  LATENCY_MODE_THROUGHPUT
+} LATENCY_MODE;
+
+typedef enum {
+  AA_MODE_MSAA, // Multisampled render pass, resolved into the swapchain image
+  AA_MODE_FXAA // Single-sample render pass, then a compute FXAA pass
+} AA_MODE;
+
+// Anti-aliasing, chosen with -aa msaa|fxaa, -samples <n> and -sample-shading <rate>
+typedef struct {
+  AA_MODE mode;
+  uint32_t samples; // MSAA only
+  float min_sample_shading; // MSAA only; 1 shades every sample, 0 once per pixel
+} aa_config_t;
+
+// Trade-off between input latency and GPU utilization, chosen with -latency <name>
+typedef struct {
+  const char *name;
+  VkPresentModeKHR present_modes[2]; // In order of preference, FIFO is always supported
+  uint32_t num_buffers; // Swapchain images
+  uint32_t frames_in_flight;
+  bool paced; // Delay each frame's start so it finishes just before the refresh
+} latency_mode_t;
+
 typedef struct {
   VkPhysicalDevice device;
   char *name;
@@ -107,9 +182,19 @@ typedef struct {
   VkPresentModeKHR present_mode;
   VkFormat depth_format;
   VkFormat texture_format;
+  VkPhysicalDeviceProperties properties;
   VkPhysicalDeviceMemoryProperties memory_properties;
+  gpu_score_t score;
 } GPU;
 
+// Header written in front of the serialized VkPipelineCache data
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t data_size;
+  uint32_t data_crc;
+} pipeline_cache_file_header_t;
+
 typedef struct {
   VkBuffer buffer;
   VkDeviceMemory device_memory;
@@ -126,24 +211,111 @@ typedef struct {
   void *mem_ptr;
 } VkUniformBuffer;
 
+typedef enum {
+  VERTEX_FORMAT_FLOAT, // vertex_t
+  VERTEX_FORMAT_PACKED // packed_vertex_t
+} VERTEX_FORMAT;
+
+#define VERTEX_ATTRIBUTES 3 // Position, colour and UV
+
+typedef struct {
+  uint32_t stride;
+  struct {
+    VkFormat format;
+    uint32_t offset;
+  } attributes[VERTEX_ATTRIBUTES];
+} vertex_layout_t;
+
+// Instance data plus the indirect draws the cull pass generates from it
 typedef struct {
-  VkImage image;
+  VkBuffer buffer;
   VkDeviceMemory device_memory;
-  VkImageView view;
+  void *mem_ptr;
+  uint32_t capacity; // Instances
+  VkBuffer draw_buffer; // VkDrawIndexedIndirectCommand per instance
+  VkDeviceMemory draw_memory;
+  VkBuffer count_buffer; // Number of compacted draws
+  VkDeviceMemory count_memory;
+  VkDescriptorSet cull_descriptor_set;
+} VkInstanceBuffer;
+
+// Cull pass push constants
+typedef struct {
+  uint32_t num_instances;
+  uint32_t num_lods;
+  uint32_t compact; // Compact visible draws and count them, or write instanceCount 0 for culled ones
+  float lod_scale; // Converts a LOD's error over clip space w to pixels, divided by LOD_PIXEL_ERROR
+} cull_constants_t;
+
+// Post-process pass push constants
+typedef struct {
+  uint32_t width; // Window, the part of the scene image drawn to
+  uint32_t height;
+  float texel[2]; // Scene image texel size in UV units
+} post_constants_t;
+
+typedef struct {
+  uint32_t id; // In the streamer
   VkSampler sampler;
+  VkImageView *views; // Per swapchain image, the view its draw set was last written with
 } VkTexture;
 
+// One large, partially bound array of combined image samplers, bound once per command buffer and
+// indexed by each instance's texture slot. Slots are written as textures are registered, even
+// while command buffers that bind the set are pending, as long as those don't read them
 typedef struct {
-  VkImage image;
-  VkImageView view;
-  VkDeviceMemory device_memory;
-} VkDepthBuffer;
+  bool enabled; // Requested with -bindless, cleared without GPU_SUPPORT_DESCRIPTOR_INDEXING
+  VkDescriptorSetLayout layout;
+  VkDescriptorPool pool;
+  VkDescriptorSet set;
+  uint32_t capacity;
+  uint32_t *free_slots; // Stack, lowest slot on top
+  uint32_t num_free;
+  CRITICAL_SECTION lock; // Textures may be registered from worker threads
+} bindless_t;
 
+// Frame graph resources and passes; passes the current AA mode doesn't have are FG_NONE
 typedef struct {
-  VkImage image;
-  VkImageView view;
-  VkDeviceMemory device_memory;
-} VkResolveBuffer;
+  uint32_t scene; // Multisampled colour, or the single-sample scene with FXAA
+  uint32_t depth;
+  uint32_t post; // FXAA output
+  uint32_t swapchain;
+  uint32_t draws; // The image's instance buffer's indirect draws and count
+  uint32_t draw_count;
+  uint32_t clear_pass;
+  uint32_t cull_pass;
+  uint32_t fxaa_pass;
+  uint32_t present_post_pass; // Blits the FXAA output to the swapchain image
+  uint32_t present_scene_pass; // Blits the scene instead while the FXAA pass compiles
+} frame_handles_t;
+
+// Passed to the pass record callbacks for the swapchain image being recorded
+typedef struct {
+  uint32_t image;
+  bool gpu_culling;
+  bool compact;
+  VkCommandBuffer *secondary_command_buffers; // Draws already recorded on worker threads, or NULL
+} frame_context_t;
+
+// Records one slice of the draw list into a secondary command buffer on a worker thread.
+// Each has its own command pool, so no two threads ever record from the same pool.
+typedef struct {
+  VkCommandPool command_pool;
+  uint32_t image; // Swapchain image the slice is recorded for
+  uint32_t first_instance;
+  uint32_t num_instances;
+  bool gpu_culling;
+} secondary_recorder_t;
+
+typedef struct {
+  bool running;
+  bool aa; // Step through AA configurations rather than instance counts
+  uint32_t step;
+  uint32_t frame;
+  uint32_t saved_num_instances;
+  aa_config_t saved_aa;
+  LARGE_INTEGER start;
+} benchmark_t;
 
 typedef struct vk_env_s {
   VULKAN_ERROR error;
@@ -152,6 +324,7 @@ typedef struct vk_env_s {
   VkInstance instance;
 #ifdef _DEBUG
   VkDebugUtilsMessengerEXT debug_messenger;
+  validation_filter_t validation;
 #endif
   window_t *window;
   VkSurfaceKHR surface;
@@ -160,47 +333,120 @@ typedef struct vk_env_s {
   VkQueue present_queue;
   bool distinct_qfi;
   VkDevice device;
+  task_pool_t task_pool;
+  arena_t arena; // Arrays sized at init that live as long as the device
   VkCommandPool command_pool;
   VkCommandBuffer *command_buffers;
+  bool threaded_recording; // Record draws into secondary command buffers on the task pool
+  uint32_t num_recorders; // Per swapchain image
+  secondary_recorder_t *recorders; // num_recorders per swapchain image
+  VkCommandBuffer *secondary_command_buffers; // Parallel to recorders
   VkFence *fences;
+  VkFence *image_fences; // Per image, fence of the last frame that used its command and instance buffers
+  bool *commands_stale; // Per image, re-recorded when the image is next acquired
   VkSemaphore *image_acquired_semaphores;
   VkSemaphore *image_ownership_semaphores;
   VkSemaphore *draw_complete_semaphores;
-  uint32_t frame_lag;
+  uint32_t frame_lag; // Frames in flight
   uint32_t frame_index;
+  uint64_t *frame_present_ids; // Per frame_lag slot, present id of the frame last submitted with it
+  LATENCY_MODE latency_mode;
+  pacer_t pacer;
+  uint64_t present_id; // Of the latest frame presented, counting from 1
+  PFN_vkWaitForPresentKHR wait_for_present; // Set with GPU_SUPPORT_PRESENT_WAIT
+  PFN_vkCmdPipelineBarrier2KHR pipeline_barrier2; // Set with GPU_SUPPORT_SYNCHRONIZATION2
   uint32_t current_buffer;
   VkRenderPass render_pass;
   VkShaderModule vertex_shader;
   VkShaderModule fragment_shader;
+  VkShaderModule bindless_shader; // Replaces fragment_shader when bindless.enabled
+  VkShaderModule cull_shader;
+  VkShaderModule post_shader;
   VkDescriptorPool descriptor_pool;
   VkDescriptorSet *descriptor_sets;
   VkDescriptorSetLayout descriptor_set_layout;
   VkPipelineLayout pipeline_layout;
   VkPipelineCache pipeline_cache;
-  VkPipeline pipeline;
+  bool pipeline_cache_loaded;
+  pipeline_t pipeline;
+  VkDescriptorSetLayout cull_descriptor_set_layout;
+  VkPipelineLayout cull_pipeline_layout;
+  pipeline_t cull_pipeline;
+  VkSampler post_sampler; // Immutable in the post-process descriptor set layout
+  VkDescriptorSetLayout post_descriptor_set_layout;
+  VkPipelineLayout post_pipeline_layout;
+  VkDescriptorSet *post_descriptor_sets; // One per swapchain image, written as its commands are recorded
+  pipeline_t post_pipeline;
+  aa_config_t aa;
+  volatile LONG commands_dirty; // Command buffers need re-recording
+  bool resize_pending; // WM_SIZE arrived since the last frame
   VkSwapchainKHR swapchain;
   VkImage *swapchain_images;
   VkImageView *swapchain_views;
   VkFramebuffer *framebuffers;
-  VkVertexBuffer cube_vb;
-  VkIndexBuffer cube_ib;
-  VkUniformBuffer mvp_ub;
-  image_t *image;
+  block_pool_t swapchain_pool; // Blocks for swapchain_images, swapchain_views and framebuffers
+  uint32_t swapchain_capacity; // Images a swapchain_pool block holds
+  deletion_queue_t deletion; // Objects replaced at runtime, destroyed once their frames complete
+  char gpu_selector[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE]; // Part of a device name or its UUID, overrides scoring
+  bool benchmark_gpus; // Rank devices of the same type by a cached copy benchmark
+  VkDebugUtilsMessageSeverityFlagBitsEXT validation_severity; // Least severe message logged at startup
+  model_t *model; // Drawn instead of the cube when set
+  bool optimize_mesh; // Reorder the cube or model for the vertex cache, overdraw and fetches before upload
+  mesh_t mesh; // Heap copy for optimizing, simplifying or quantizing, uploaded instead when set
+  bool build_lods; // Simplify the mesh into a LOD chain the cull pass chooses from per instance
+  mesh_lod_t lods[MAX_LODS]; // Index ranges, finest first; a single LOD covers the whole mesh
+  uint32_t num_lods;
+  VkBuffer lod_buffer; // lods, read by the cull pass
+  VkDeviceMemory lod_memory;
+  VERTEX_FORMAT vertex_format;
+  quantization_t quantization; // Pushed to the vertex shader to dequantize positions
+  VkVertexBuffer mesh_vb;
+  VkIndexBuffer mesh_ib;
+  uint32_t num_indices; // Of the finest LOD
+  VkIndexType index_type;
+  VkUniformBuffer mvp_ub; // A slice per swapchain image
+  VkDeviceSize mvp_stride;
+  VkInstanceBuffer *instance_buffers; // One per swapchain image
+  uint32_t num_instances;
+  float mesh_radius; // Bounding sphere radius of the mesh about its origin
+  uint64_t frame_count;
+  bool run_benchmark;
+  benchmark_t benchmark;
+  image_t *image; // Loaded from TEXTURE_IMAGE_PATH during init
   VkTexture texture;
-  VkDepthBuffer depth_buffer;
-  VkResolveBuffer resolve_buffer;
+  streamer_t streamer;
+  VkDeviceSize texture_budget;
+  bindless_t bindless;
+  frame_graph_t frame_graph; // Passes from culling to present, and the attachments they use
+  frame_handles_t frame_handles;
+  VkExtent2D attachment_extent; // Allocated size of the frame graph's images, at least the window's
+  memory_tracker_t memory; // Device memory by category and heap, from alloc_device_memory
 } vk_env_t;
 
 vk_env_t vk_env;
 
+// Per-instance vertex attributes - 64 bytes
 typedef struct {
-  vec3_t position;
-  vec3_t colour;
-  vec2_t uv;
-} vertex_t;
+  float transform[12]; // Rows of a 3x4 affine model matrix
+  uint32_t colour; // RGBA8, multiplied with the vertex colour
+  float radius; // Bounding sphere radius, centred on the translation
+  uint32_t texture; // Bindless texture slot
+  uint32_t pad;
+} instance_t;
 
+uint32_t find_memory_type(uint32_t, VkFlags);
+VkResult alloc_device_memory(VkMemoryRequirements, VkFlags, MEMORY_CATEGORY, VkDeviceMemory *);
+void free_device_memory(VkDeviceMemory);
+void defer_destroy(VkObjectType, uint64_t);
+VkResult create_image(VkDevice, VkFormat, uint32_t, uint32_t, VkSampleCountFlagBits, VkImageTiling, VkImageUsageFlags, VkImage *);
+VkResult create_image_view(VkDevice, VkImage, VkFormat, VkImageAspectFlags, VkImageView *);
+uint32_t register_texture(VkImageView, VkSampler);
+void unregister_texture(uint32_t);
 void init_vulkan();
 void cleanup_vulkan();
 void resize();
 void move(int, int);
+void report_memory();
+void cycle_validation_severity();
 void render();
+DWORD pace_frame();
@@ -0,0 +1,12 @@
+#include <string.h>
+#include "shaders.h"
+#include "renderer.h"
+// Generated from shaders\spv\*.spv by shaders\embed-shaders.ps1 at build time
+#include "shaders/spv/embedded_shaders.h"
+
+const embedded_shader_t *find_embedded_shader(const char *name) {
+  for (uint32_t i = 0; i < ARRAY_COUNT(embedded_shaders); i++)
+    if (!strcmp(embedded_shaders[i].name, name))
+      return &embedded_shaders[i];
+  return NULL;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+  const char *name; // <shader>.<stage>, e.g. "shader.vert"
+  const uint32_t *code;
+  size_t size; // Bytes
+} embedded_shader_t;
+
+const embedded_shader_t *find_embedded_shader(const char *);
@@ -1,7 +1,22 @@
 @echo off
 echo Compiling shaders...
+if not exist spv mkdir spv
 echo "glsl/shader.vert.glsl => spv/shader.vert.spv"
 glslc.exe -fshader-stage=vert glsl/shader.vert.glsl -o spv/shader.vert.spv
+if errorlevel 1 exit /b 1
 echo "glsl/shader.frag.glsl => spv/shader.frag.spv"
 glslc.exe -fshader-stage=frag glsl/shader.frag.glsl -o spv/shader.frag.spv
+if errorlevel 1 exit /b 1
+echo "glsl/bindless.frag.glsl => spv/bindless.frag.spv"
+glslc.exe -fshader-stage=frag glsl/bindless.frag.glsl -o spv/bindless.frag.spv
+if errorlevel 1 exit /b 1
+echo "glsl/cull.comp.glsl => spv/cull.comp.spv"
+glslc.exe -fshader-stage=comp glsl/cull.comp.glsl -o spv/cull.comp.spv
+if errorlevel 1 exit /b 1
+echo "glsl/fxaa.comp.glsl => spv/fxaa.comp.spv"
+glslc.exe -fshader-stage=comp glsl/fxaa.comp.glsl -o spv/fxaa.comp.spv
+if errorlevel 1 exit /b 1
+echo "spv/*.spv => spv/embedded_shaders.h"
+powershell.exe -NoProfile -ExecutionPolicy Bypass -File embed-shaders.ps1
+if errorlevel 1 exit /b 1
 echo Done!
@@ -0,0 +1,32 @@
+# Embed every compiled SPIR-V module in spv\ as an aligned uint32_t array
+# with a name lookup table, written to spv\embedded_shaders.h
+$ErrorActionPreference = "Stop"
+$nl = "`n"
+$out = New-Object System.Text.StringBuilder
+[void]$out.Append("// Generated by embed-shaders.ps1 from shaders\spv\*.spv - do not edit$nl")
+$entries = @()
+foreach ($file in Get-ChildItem -Path "spv" -Filter "*.spv" | Sort-Object Name) {
+  $bytes = [System.IO.File]::ReadAllBytes($file.FullName)
+  if (!$bytes.Length -or $bytes.Length % 4) {
+    throw "$($file.Name) is not a whole, non-zero number of 32-bit words"
+  }
+  $name = [System.IO.Path]::GetFileNameWithoutExtension($file.Name)
+  $ident = ($name -replace "[^A-Za-z0-9]", "_") + "_spv"
+  [void]$out.Append("${nl}__declspec(align(16)) static const uint32_t $ident[] = {$nl")
+  for ($i = 0; $i -lt $bytes.Length; $i += 32) {
+    $words = @()
+    for ($j = $i; $j -lt [Math]::Min($i + 32, $bytes.Length); $j += 4) {
+      $words += "0x{0:x8}" -f [BitConverter]::ToUInt32($bytes, $j)
+    }
+    [void]$out.Append("  " + ($words -join ", ") + ",$nl")
+  }
+  [void]$out.Append("};$nl")
+  $entries += "  { `"$name`", $ident, sizeof $ident }"
+}
+# An empty initializer isn't valid C, and would fail the build with an unrelated error
+if (!$entries.Count) {
+  throw "No SPIR-V modules found in spv\, compile the shaders first"
+}
+[void]$out.Append("${nl}static const embedded_shader_t embedded_shaders[] = {$nl")
+[void]$out.Append(($entries -join ",$nl") + "$nl};$nl")
+[System.IO.File]::WriteAllText((Join-Path (Get-Location) "spv\embedded_shaders.h"), $out.ToString())
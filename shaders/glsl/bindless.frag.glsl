@@ -0,0 +1,17 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+// Every registered texture; partially bound, so only slots instances refer to are written
+layout (set = 1, binding = 0) uniform sampler2D textures[];
+
+layout (location = 0) in vec3 in_Colour;
+layout (location = 1) in vec2 in_TexCoord;
+layout (location = 2) flat in uint in_Texture;
+
+layout (location = 0) out vec4 out_Colour;
+
+void main() {
+  // Instances in a draw may use different textures, so the index isn't dynamically uniform
+  vec4 tex = texture(textures[nonuniformEXT(in_Texture)], in_TexCoord);
+  out_Colour = tex * vec4(in_Colour, 1.0f);
+}
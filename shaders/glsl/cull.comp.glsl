@@ -0,0 +1,95 @@
+#version 450
+
+// Must match CULL_GROUP_SIZE in renderer.h
+layout (local_size_x = 64) in;
+
+struct Instance {
+  vec4 transform[3]; // Rows of a 3x4 model matrix
+  uint colour;
+  float radius;
+  uint texture;
+  uint pad;
+};
+
+struct Lod {
+  uint first_index;
+  uint index_count;
+  float error; // Mesh space
+  uint pad;
+};
+
+struct DrawIndexedIndirectCommand {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+};
+
+layout (std430, binding = 0) readonly buffer Instances {
+  Instance instances[];
+};
+
+layout (std430, binding = 1) writeonly buffer Draws {
+  DrawIndexedIndirectCommand draws[];
+};
+
+layout (std430, binding = 2) buffer DrawCount {
+  uint draw_count;
+};
+
+layout (binding = 3) uniform Matrices {
+  mat4 mvp;
+};
+
+// Finest first, errors increasing
+layout (std430, binding = 4) readonly buffer Lods {
+  Lod lods[];
+};
+
+layout (push_constant) uniform Constants {
+  uint num_instances;
+  uint num_lods;
+  uint compact;
+  float lod_scale;
+};
+
+vec4 mvp_row(int r) {
+  return vec4(mvp[0][r], mvp[1][r], mvp[2][r], mvp[3][r]);
+}
+
+void main() {
+  uint i = gl_GlobalInvocationID.x;
+  if (i >= num_instances)
+    return;
+
+  // Frustum planes from the clip space bounds -w <= x, y <= w and 0 <= z <= w
+  vec4 planes[6] = vec4[6](
+    mvp_row(3) + mvp_row(0),
+    mvp_row(3) - mvp_row(0),
+    mvp_row(3) + mvp_row(1),
+    mvp_row(3) - mvp_row(1),
+    mvp_row(2),
+    mvp_row(3) - mvp_row(2)
+  );
+  Instance instance = instances[i];
+  vec3 centre = vec3(instance.transform[0].w, instance.transform[1].w, instance.transform[2].w);
+  bool visible = true;
+  for (int p = 0; p < 6; p++)
+    visible = visible && dot(planes[p].xyz, centre) + planes[p].w > -instance.radius * length(planes[p].xyz);
+
+  // Coarsest LOD whose error projects to no more than LOD_PIXEL_ERROR at the instance's depth
+  float w = max(dot(mvp_row(3), vec4(centre, 1.0)), 1e-4);
+  uint lod = 0;
+  while (lod + 1 < num_lods && lods[lod + 1].error * lod_scale <= w)
+    lod++;
+  uint index_count = lods[lod].index_count,
+       first_index = lods[lod].first_index;
+
+  if (compact != 0) {
+    if (visible)
+      draws[atomicAdd(draw_count, 1)] = DrawIndexedIndirectCommand(index_count, 1, first_index, 0, i);
+  }
+  else
+    draws[i] = DrawIndexedIndirectCommand(index_count, visible ? 1 : 0, first_index, 0, i);
+}
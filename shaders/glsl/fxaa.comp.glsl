@@ -0,0 +1,65 @@
+#version 450
+
+// Must match POST_GROUP_SIZE in renderer.h
+layout (local_size_x = 8, local_size_y = 8) in;
+
+// Filtered with an immutable linear, clamp to edge sampler
+layout (binding = 0) uniform sampler2D scene;
+
+layout (binding = 1, rgba16f) uniform writeonly image2D result;
+
+layout (push_constant) uniform Constants {
+  uvec2 size; // Window, the part of the scene that was drawn
+  vec2 texel; // Scene texel size in UV units
+};
+
+#define EDGE_THRESHOLD (1.0 / 8.0) // Local contrast, relative to the brightest neighbour, needed to filter
+#define EDGE_THRESHOLD_MIN (1.0 / 16.0) // Contrast always left alone, so dark noise isn't smeared
+#define REDUCE_MUL (1.0 / 8.0)
+#define REDUCE_MIN (1.0 / 128.0)
+#define SPAN_MAX 8.0 // Texels searched along an edge
+
+// The scene image may be larger than the window, so stay inside the drawn area
+vec3 fetch(vec2 uv) {
+  return textureLod(scene, clamp(uv, texel * 0.5, (vec2(size) - 0.5) * texel), 0.0).rgb;
+}
+
+float luma(vec3 rgb) {
+  return dot(rgb, vec3(0.299, 0.587, 0.114));
+}
+
+void main() {
+  uvec2 pixel = gl_GlobalInvocationID.xy;
+  if (any(greaterThanEqual(pixel, size)))
+    return;
+  vec2 uv = (vec2(pixel) + 0.5) * texel;
+
+  vec3 rgb_m = fetch(uv);
+  float luma_nw = luma(fetch(uv + vec2(-1.0, -1.0) * texel)),
+        luma_ne = luma(fetch(uv + vec2(1.0, -1.0) * texel)),
+        luma_sw = luma(fetch(uv + vec2(-1.0, 1.0) * texel)),
+        luma_se = luma(fetch(uv + vec2(1.0, 1.0) * texel)),
+        luma_m = luma(rgb_m);
+  float luma_min = min(luma_m, min(min(luma_nw, luma_ne), min(luma_sw, luma_se))),
+        luma_max = max(luma_m, max(max(luma_nw, luma_ne), max(luma_sw, luma_se)));
+  if (luma_max - luma_min < max(EDGE_THRESHOLD_MIN, luma_max * EDGE_THRESHOLD)) {
+    imageStore(result, ivec2(pixel), vec4(rgb_m, 1.0));
+    return;
+  }
+
+  // Blur along the edge, perpendicular to the luma gradient
+  vec2 direction = vec2(-((luma_nw + luma_ne) - (luma_sw + luma_se)),
+                        (luma_nw + luma_sw) - (luma_ne + luma_se));
+  float reduce = max((luma_nw + luma_ne + luma_sw + luma_se) * 0.25 * REDUCE_MUL, REDUCE_MIN);
+  float scale = 1.0 / (min(abs(direction.x), abs(direction.y)) + reduce);
+  direction = clamp(direction * scale, -SPAN_MAX, SPAN_MAX) * texel;
+
+  vec3 rgb_a = 0.5 * (fetch(uv + direction * (1.0 / 3.0 - 0.5)) +
+                      fetch(uv + direction * (2.0 / 3.0 - 0.5)));
+  vec3 rgb_b = rgb_a * 0.5 + 0.25 * (fetch(uv - direction * 0.5) +
+                                     fetch(uv + direction * 0.5));
+  // The wider sample crossed another edge if it left the local luma range
+  float luma_b = luma(rgb_b);
+  vec3 rgb = luma_b < luma_min || luma_b > luma_max ? rgb_a : rgb_b;
+  imageStore(result, ivec2(pixel), vec4(rgb, 1.0));
+}
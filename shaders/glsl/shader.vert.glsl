@@ -6,15 +6,34 @@ layout (binding = 0) uniform Matrices {
 
 layout (binding = 1) uniform sampler2D tex_Sampler;
 
+// Packed positions are snorm16 within the mesh's bounding box; float ones use the identity
+layout (push_constant) uniform Quantization {
+  vec4 quant_Centre;
+  vec4 quant_Extent;
+};
+
 layout (location = 0) in vec3 in_Position;
 layout (location = 1) in vec3 in_Color;
 layout (location = 2) in vec2 in_TexCoord;
 
+// Per-instance rows of the 3x4 model matrix, colour and bindless texture slot
+layout (location = 3) in vec4 in_Transform0;
+layout (location = 4) in vec4 in_Transform1;
+layout (location = 5) in vec4 in_Transform2;
+layout (location = 6) in vec4 in_InstanceColour;
+layout (location = 7) in uint in_Texture;
+
 layout (location = 0) out vec3 out_Colour;
 layout (location = 1) out vec2 out_TexCoord;
+layout (location = 2) flat out uint out_Texture;
 
 void main() {
-  gl_Position = mvp * vec4(in_Position, 1.0f);
-  out_Colour = in_Color;
+  vec4 position = vec4(quant_Centre.xyz + in_Position * quant_Extent.xyz, 1.0f);
+  vec3 world = vec3(dot(in_Transform0, position),
+                    dot(in_Transform1, position),
+                    dot(in_Transform2, position));
+  gl_Position = mvp * vec4(world, 1.0f);
+  out_Colour = in_Color * in_InstanceColour.rgb;
   out_TexCoord = in_TexCoord;
+  out_Texture = in_Texture;
 }
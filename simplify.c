@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include "simplify.h"
+#include "heap.h"
+#include "log.h"
+
+void add_quadric(quadric_t *q, const quadric_t *r) {
+  q->a2 += r->a2; q->ab += r->ab; q->ac += r->ac; q->ad += r->ad;
+  q->b2 += r->b2; q->bc += r->bc; q->bd += r->bd;
+  q->c2 += r->c2; q->cd += r->cd;
+  q->d2 += r->d2;
+  q->weight += r->weight;
+}
+
+// Mean squared distance to the quadric's planes, weighted by their areas
+double quadric_error(const quadric_t *q, const vec3_t *p) {
+  if (q->weight <= 0.0)
+    return 0.0;
+  double x = p->x, y = p->y, z = p->z;
+  double error = q->a2 * x * x + 2.0 * q->ab * x * y + 2.0 * q->ac * x * z + 2.0 * q->ad * x +
+                 q->b2 * y * y + 2.0 * q->bc * y * z + 2.0 * q->bd * y +
+                 q->c2 * z * z + 2.0 * q->cd * z +
+                 q->d2;
+  return error > 0.0 ? error / q->weight : 0.0;
+}
+
+vec3_t triangle_normal(const vec3_t *p0, const vec3_t *p1, const vec3_t *p2) {
+  vec3_t e1 = { p1->x - p0->x, p1->y - p0->y, p1->z - p0->z },
+         e2 = { p2->x - p0->x, p2->y - p0->y, p2->z - p0->z },
+         n = {
+           e1.y * e2.z - e1.z * e2.y,
+           e1.z * e2.x - e1.x * e2.z,
+           e1.x * e2.y - e1.y * e2.x
+         };
+  return n;
+}
+
+// Edges used by a single triangle, in either direction, are on a border or an attribute seam.
+// Their vertices are locked so simplification neither opens holes nor smears seams.
+void lock_border_vertices(const uint32_t *indices, uint32_t num_indices, uint8_t *locked) {
+  uint32_t table_size = 1;
+  while (table_size < num_indices * 2)
+    table_size <<= 1;
+  uint64_t *keys = halloc_type(uint64_t, table_size);
+  uint32_t *counts = halloc_clear_type(uint32_t, table_size);
+  memset(keys, 0xff, sizeof (uint64_t) * table_size);
+  for (uint32_t i = 0; i < num_indices; i++) {
+    uint32_t a = indices[i],
+             b = indices[i % 3 == 2 ? i - 2 : i + 1];
+    uint64_t key = a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+    uint32_t slot = (uint32_t)(key * 0x9E3779B97F4A7C15ull >> 32) & (table_size - 1);
+    while (keys[slot] != UINT64_MAX && keys[slot] != key)
+      slot = (slot + 1) & (table_size - 1);
+    keys[slot] = key;
+    counts[slot]++;
+  }
+  for (uint32_t slot = 0; slot < table_size; slot++) {
+    if (keys[slot] != UINT64_MAX && counts[slot] == 1) {
+      locked[keys[slot] >> 32] = 1;
+      locked[keys[slot] & UINT32_MAX] = 1;
+    }
+  }
+  hfree(counts);
+  hfree(keys);
+}
+
+typedef struct {
+  uint32_t from;
+  uint32_t to;
+  double error;
+} collapse_t;
+
+int compare_collapses(const void *a, const void *b) {
+  double ea = ((const collapse_t *)a)->error,
+         eb = ((const collapse_t *)b)->error;
+  return (ea > eb) - (ea < eb);
+}
+
+// Would moving from onto to flip any of from's triangles that survive the collapse?
+bool collapse_flips(const mesh_t *mesh, const adjacency_t *adjacency, uint32_t from, uint32_t to) {
+  const vec3_t *target = &mesh->vertices[to].position;
+  for (uint32_t i = adjacency->offsets[from]; i < adjacency->offsets[from + 1]; i++) {
+    const uint32_t *triangle = &mesh->indices[adjacency->triangles[i] * 3];
+    if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+      continue; // Collapses to nothing
+    const vec3_t *p[3], *q[3];
+    for (uint32_t j = 0; j < 3; j++) {
+      p[j] = &mesh->vertices[triangle[j]].position;
+      q[j] = triangle[j] == from ? target : p[j];
+    }
+    vec3_t before = triangle_normal(p[0], p[1], p[2]),
+           after = triangle_normal(q[0], q[1], q[2]);
+    if (before.x * after.x + before.y * after.y + before.z * after.z <= 0.0f)
+      return true;
+  }
+  return false;
+}
+
+// Garland-Heckbert quadric edge collapse, restricted to collapsing a vertex onto one of its
+// neighbours so the result indexes the original vertex buffer. Collapses run in passes of
+// independent, cheapest-first edges until the target index count or error is reached.
+// target_error is relative to the mesh's extent; result_error is the largest distance moved.
+uint32_t simplify_mesh(const mesh_t *mesh, uint32_t target_index_count, float target_error,
+                       uint32_t *indices, float *result_error) {
+  uint32_t num_indices = mesh->num_indices;
+  memcpy(indices, mesh->indices, sizeof (uint32_t) * num_indices);
+  *result_error = 0.0f;
+
+  // Extent of the referenced vertices, so errors are independent of the mesh's size
+  vec3_t min = mesh->vertices[indices[0]].position,
+         max = min;
+  for (uint32_t i = 1; i < num_indices; i++) {
+    const vec3_t *p = &mesh->vertices[indices[i]].position;
+    if (p->x < min.x) min.x = p->x;
+    if (p->y < min.y) min.y = p->y;
+    if (p->z < min.z) min.z = p->z;
+    if (p->x > max.x) max.x = p->x;
+    if (p->y > max.y) max.y = p->y;
+    if (p->z > max.z) max.z = p->z;
+  }
+  double scale = max.x - min.x;
+  if (max.y - min.y > scale) scale = max.y - min.y;
+  if (max.z - min.z > scale) scale = max.z - min.z;
+  if (scale <= 0.0)
+    return num_indices;
+  double error_limit = target_error * scale * target_error * scale,
+         max_error = 0.0;
+
+  quadric_t *quadrics = halloc_clear_type(quadric_t, mesh->num_vertices);
+  for (uint32_t i = 0; i < num_indices; i += 3) {
+    const vec3_t *p0 = &mesh->vertices[indices[i]].position,
+                 *p1 = &mesh->vertices[indices[i + 1]].position,
+                 *p2 = &mesh->vertices[indices[i + 2]].position;
+    vec3_t n = triangle_normal(p0, p1, p2);
+    double length = sqrt((double)n.x * n.x + (double)n.y * n.y + (double)n.z * n.z);
+    if (length == 0.0)
+      continue;
+    // Area weighting is half the cross product's length
+    double area = length / 2.0,
+           a = n.x / length, b = n.y / length, c = n.z / length,
+           d = -(a * p0->x + b * p0->y + c * p0->z);
+    quadric_t plane = {
+      area * a * a, area * a * b, area * a * c, area * a * d,
+      area * b * b, area * b * c, area * b * d,
+      area * c * c, area * c * d,
+      area * d * d,
+      area
+    };
+    for (uint32_t j = 0; j < 3; j++)
+      add_quadric(&quadrics[indices[i + j]], &plane);
+  }
+  uint8_t *locked = halloc_clear_type(uint8_t, mesh->num_vertices),
+          *touched = halloc_type(uint8_t, mesh->num_vertices);
+  lock_border_vertices(indices, num_indices, locked);
+  uint32_t *remap = halloc_type(uint32_t, mesh->num_vertices);
+  collapse_t *collapses = halloc_type(collapse_t, num_indices * 2);
+
+  while (num_indices > target_index_count) {
+    mesh_t current = { mesh->vertices, mesh->num_vertices, indices, num_indices };
+    adjacency_t adjacency;
+    build_adjacency(&current, &adjacency);
+
+    uint32_t num_collapses = 0;
+    for (uint32_t i = 0; i < num_indices; i++) {
+      // Both directions of each edge
+      uint32_t edge[2] = { indices[i], indices[i % 3 == 2 ? i - 2 : i + 1] };
+      for (uint32_t k = 0; k < 2; k++) {
+        uint32_t from = edge[k],
+                 to = edge[1 - k];
+        if (locked[from])
+          continue;
+        quadric_t q = quadrics[from];
+        add_quadric(&q, &quadrics[to]);
+        collapses[num_collapses].from = from;
+        collapses[num_collapses].to = to;
+        collapses[num_collapses].error = quadric_error(&q, &mesh->vertices[to].position);
+        num_collapses++;
+      }
+    }
+    qsort(collapses, num_collapses, sizeof (collapse_t), compare_collapses);
+
+    // Each collapse locks the neighbourhood it changes for the rest of the pass
+    for (uint32_t v = 0; v < mesh->num_vertices; v++)
+      remap[v] = v;
+    memset(touched, 0, mesh->num_vertices);
+    uint32_t collapsed = 0,
+             remaining = num_indices;
+    for (uint32_t i = 0; i < num_collapses && remaining > target_index_count; i++) {
+      collapse_t *collapse = &collapses[i];
+      if (collapse->error > error_limit)
+        break;
+      if (touched[collapse->from] || touched[collapse->to] ||
+          collapse_flips(&current, &adjacency, collapse->from, collapse->to))
+        continue;
+      for (uint32_t j = adjacency.offsets[collapse->from]; j < adjacency.offsets[collapse->from + 1]; j++) {
+        const uint32_t *triangle = &indices[adjacency.triangles[j] * 3];
+        if (triangle[0] == collapse->to || triangle[1] == collapse->to || triangle[2] == collapse->to)
+          remaining -= 3;
+        touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+      }
+      remap[collapse->from] = collapse->to;
+      add_quadric(&quadrics[collapse->to], &quadrics[collapse->from]);
+      if (collapse->error > max_error)
+        max_error = collapse->error;
+      collapsed++;
+    }
+    destroy_adjacency(&adjacency);
+    if (!collapsed)
+      break;
+
+    // Apply the pass, dropping triangles that became degenerate
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < num_indices; i += 3) {
+      uint32_t a = remap[indices[i]],
+               b = remap[indices[i + 1]],
+               c = remap[indices[i + 2]];
+      if (a != b && b != c && c != a) {
+        indices[kept++] = a;
+        indices[kept++] = b;
+        indices[kept++] = c;
+      }
+    }
+    num_indices = kept;
+  }
+
+  hfree(collapses);
+  hfree(remap);
+  hfree(touched);
+  hfree(locked);
+  hfree(quadrics);
+  *result_error = (float)sqrt(max_error);
+  return num_indices;
+}
+
+// Append successively simplified LODs to the mesh's index buffer, each built from the one
+// before. LOD 0 is the mesh as is. Returns the number of LODs.
+uint32_t build_lod_chain(mesh_t *mesh, mesh_lod_t *lods) {
+  lods[0].first_index = 0;
+  lods[0].index_count = mesh->num_indices;
+  lods[0].error = 0.0f;
+  lods[0].pad = 0;
+
+  // Every LOD is at most as big as LOD 0
+  uint32_t *indices = halloc_type(uint32_t, mesh->num_indices * MAX_LODS);
+  memcpy(indices, mesh->indices, sizeof (uint32_t) * mesh->num_indices);
+  uint32_t num_lods = 1,
+           num_indices = mesh->num_indices;
+  while (num_lods < MAX_LODS) {
+    mesh_lod_t *previous = &lods[num_lods - 1];
+    mesh_t source = { mesh->vertices, mesh->num_vertices, &indices[previous->first_index], previous->index_count };
+    uint32_t target = (uint32_t)(previous->index_count * LOD_REDUCTION) / 3 * 3;
+    float error;
+    uint32_t count = simplify_mesh(&source, target, LOD_MAX_ERROR, &indices[num_indices], &error);
+    if (!count || count > previous->index_count * LOD_MIN_REDUCTION)
+      break;
+
+    // Simplified triangles come out in collapse order, so restore cache locality
+    mesh_t lod = { mesh->vertices, mesh->num_vertices, &indices[num_indices], count };
+    optimize_vertex_cache(&lod, VERTEX_CACHE_SIZE);
+
+    // Errors add up along the chain
+    lods[num_lods].first_index = num_indices;
+    lods[num_lods].index_count = count;
+    lods[num_lods].error = previous->error + error;
+    lods[num_lods].pad = 0;
+    LOG_DEBUG_INFO("LOD %d: %d triangles, error %f", num_lods, count / 3, lods[num_lods].error);
+    num_indices += count;
+    num_lods++;
+  }
+
+  hfree(mesh->indices);
+  mesh->indices = indices;
+  mesh->num_indices = num_indices;
+  return num_lods;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "mesh.h"
+
+#define MAX_LODS 8
+#define LOD_REDUCTION 0.5f // Target index count of each LOD relative to the previous one
+#define LOD_MIN_REDUCTION 0.9f // Stop once a LOD keeps more than this much of the previous one
+#define LOD_MAX_ERROR 0.05f // Per LOD, relative to the mesh's extent
+
+// A range of the mesh's index buffer; every LOD shares the full vertex buffer
+typedef struct {
+  uint32_t first_index;
+  uint32_t index_count;
+  float error; // Mesh space distance the surface may have moved, accumulated over the chain
+  uint32_t pad;
+} mesh_lod_t;
+
+typedef struct {
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2; // Symmetric 4x4 plane quadric
+  double weight; // Total area of the planes
+} quadric_t;
+
+uint32_t simplify_mesh(const mesh_t *, uint32_t, float, uint32_t *, float *);
+uint32_t build_lod_chain(mesh_t *, mesh_lod_t *);
@@ -0,0 +1,427 @@
+#include <string.h>
+#include "streamer.h"
+#include "renderer.h"
+#include "heap.h"
+#include "log.h"
+
+void stream_level_extent(const stream_texture_t *texture, uint32_t level, uint32_t *width, uint32_t *height) {
+  *width = texture->width >> level ? texture->width >> level : 1;
+  *height = texture->height >> level ? texture->height >> level : 1;
+}
+
+// RGBA8 bytes of levels [base, num_levels)
+VkDeviceSize stream_range_size(const stream_texture_t *texture, uint32_t base) {
+  VkDeviceSize size = 0;
+  uint32_t width, height;
+  for (uint32_t level = base; level < texture->num_levels; level++) {
+    stream_level_extent(texture, level, &width, &height);
+    size += (VkDeviceSize)width * height * 4;
+  }
+  return size;
+}
+
+// Box filters the source down to the level, each texel averaging the source texels it covers
+void stream_write_level(const stream_texture_t *texture, uint32_t level, byte *data) {
+  uint32_t width, height;
+  stream_level_extent(texture, level, &width, &height);
+  if (!level) {
+    memcpy(data, texture->pixels, (size_t)width * height * 4);
+    return;
+  }
+  for (uint32_t y = 0; y < height; y++) {
+    uint32_t y0 = (uint32_t)((uint64_t)y * texture->height / height),
+             y1 = (uint32_t)((uint64_t)(y + 1) * texture->height / height);
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t x0 = (uint32_t)((uint64_t)x * texture->width / width),
+               x1 = (uint32_t)((uint64_t)(x + 1) * texture->width / width);
+      uint32_t sum[4] = { 0 };
+      for (uint32_t sy = y0; sy < y1; sy++) {
+        const byte *row = &texture->pixels[((size_t)sy * texture->width + x0) * 4];
+        for (uint32_t sx = x0; sx < x1; sx++, row += 4)
+          for (uint32_t c = 0; c < 4; c++)
+            sum[c] += row[c];
+      }
+      uint32_t count = (y1 - y0) * (x1 - x0);
+      for (uint32_t c = 0; c < 4; c++)
+        *data++ = (byte)((sum[c] + count / 2) / count);
+    }
+  }
+}
+
+// Writes the pending levels, finest first, into the mapped staging buffer
+void stream_load(void *data) {
+  stream_texture_t *texture = (stream_texture_t *)data;
+  byte *staging = texture->staging_data;
+  uint32_t width, height;
+  for (uint32_t level = texture->pending.base; level < texture->num_levels; level++) {
+    stream_write_level(texture, level, staging);
+    stream_level_extent(texture, level, &width, &height);
+    staging += (size_t)width * height * 4;
+  }
+  InterlockedExchange(&texture->loaded, 1);
+}
+
+void stream_destroy_residency(streamer_t *streamer, stream_residency_t *residency) {
+  if (residency->slot != UINT32_MAX)
+    unregister_texture(residency->slot);
+  vkDestroyImageView(streamer->device, residency->view, NULL);
+  vkDestroyImage(streamer->device, residency->image, NULL);
+  free_device_memory(residency->memory);
+  streamer->resident_size -= residency->size;
+}
+
+void stream_release_retired(streamer_t *streamer, uint64_t frame, uint32_t frame_lag) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < streamer->num_retired; i++) {
+    stream_retired_t *retired = &streamer->retired[i];
+    if (retired->last_frame + frame_lag <= frame)
+      stream_destroy_residency(streamer, &retired->residency);
+    else
+      streamer->retired[kept++] = *retired;
+  }
+  streamer->num_retired = kept;
+}
+
+// Creates the image for levels [base, num_levels) and starts loading them
+void stream_begin(streamer_t *streamer, stream_texture_t *texture, uint32_t base, bool async) {
+  uint32_t width, height;
+  stream_level_extent(texture, base, &width, &height);
+  stream_residency_t *pending = &texture->pending;
+  memset(pending, 0, sizeof (stream_residency_t));
+  pending->base = base;
+  pending->slot = UINT32_MAX;
+  VkImageCreateInfo image_info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = streamer->format;
+  image_info.extent.width = width;
+  image_info.extent.height = height;
+  image_info.extent.depth = 1;
+  image_info.mipLevels = texture->num_levels - base;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VK_CALL(vkCreateImage(streamer->device, &image_info, NULL, &pending->image));
+  VkMemoryRequirements requirements;
+  vkGetImageMemoryRequirements(streamer->device, pending->image, &requirements);
+  alloc_device_memory(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_CATEGORY_TEXTURE, &pending->memory);
+  VK_CALL(vkBindImageMemory(streamer->device, pending->image, pending->memory, 0));
+  pending->size = requirements.size;
+  streamer->resident_size += requirements.size;
+
+  VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+  buffer_info.size = stream_range_size(texture, base);
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VK_CALL(vkCreateBuffer(streamer->device, &buffer_info, NULL, &texture->staging));
+  vkGetBufferMemoryRequirements(streamer->device, texture->staging, &requirements);
+  alloc_device_memory(requirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                      MEMORY_CATEGORY_STAGING, &texture->staging_memory);
+  VK_CALL(vkBindBufferMemory(streamer->device, texture->staging, texture->staging_memory, 0));
+  VK_CALL(vkMapMemory(streamer->device, texture->staging_memory, 0, VK_WHOLE_SIZE, 0, &texture->staging_data));
+
+  texture->state = STREAM_LOADING;
+  texture->loaded = 0;
+  if (async)
+    submit_group_task(streamer->task_pool, &texture->group, stream_load, texture);
+  else
+    stream_load(texture);
+}
+
+// Records and submits the copies from the staging buffer into every level of the pending image
+void stream_submit(streamer_t *streamer, stream_texture_t *texture) {
+  VkCommandBuffer command_buffer = texture->command_buffer;
+  VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CALL(vkBeginCommandBuffer(command_buffer, &begin_info));
+
+  uint32_t num_levels = texture->num_levels - texture->pending.base;
+  VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = texture->pending.image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.levelCount = num_levels;
+  barrier.subresourceRange.layerCount = 1;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 0, NULL, 0, NULL, 1, &barrier);
+
+  VkBufferImageCopy regions[STREAM_MAX_LEVELS] = { 0 };
+  VkDeviceSize offset = 0;
+  for (uint32_t i = 0; i < num_levels; i++) {
+    uint32_t width, height;
+    stream_level_extent(texture, texture->pending.base + i, &width, &height);
+    regions[i].bufferOffset = offset;
+    regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    regions[i].imageSubresource.mipLevel = i;
+    regions[i].imageSubresource.layerCount = 1;
+    regions[i].imageExtent.width = width;
+    regions[i].imageExtent.height = height;
+    regions[i].imageExtent.depth = 1;
+    offset += (VkDeviceSize)width * height * 4;
+  }
+  vkCmdCopyBufferToImage(command_buffer, texture->staging, texture->pending.image,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, num_levels, regions);
+
+  // Frames submitted later sample it
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       0, 0, NULL, 0, NULL, 1, &barrier);
+  VK_CALL(vkEndCommandBuffer(command_buffer));
+
+  VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &command_buffer;
+  VK_CALL(vkResetFences(streamer->device, 1, &texture->fence));
+  VK_CALL(vkQueueSubmit(streamer->queue, 1, &submit_info, texture->fence));
+  texture->state = STREAM_UPLOADING;
+}
+
+// Replaces the resident image with the uploaded one, retiring it until frames that may sample
+// it have completed
+void stream_finish(streamer_t *streamer, stream_texture_t *texture, uint64_t frame) {
+  vkUnmapMemory(streamer->device, texture->staging_memory);
+  vkDestroyBuffer(streamer->device, texture->staging, NULL);
+  free_device_memory(texture->staging_memory);
+
+  stream_residency_t *pending = &texture->pending;
+  VkImageViewCreateInfo view_info = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+  view_info.image = pending->image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = streamer->format;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = texture->num_levels - pending->base;
+  view_info.subresourceRange.layerCount = 1;
+  VK_CALL(vkCreateImageView(streamer->device, &view_info, NULL, &pending->view));
+  if (streamer->bindless)
+    pending->slot = register_texture(pending->view, texture->sampler);
+
+  if (texture->resident.image) {
+    if (streamer->num_retired == streamer->retired_capacity) {
+      // Only reached with many textures changing at once. Growing beats idling the queue
+      stream_retired_t *retired = halloc_type(stream_retired_t, streamer->retired_capacity * 2);
+      memcpy(retired, streamer->retired, streamer->num_retired * sizeof (stream_retired_t));
+      hfree(streamer->retired);
+      streamer->retired = retired;
+      streamer->retired_capacity *= 2;
+    }
+    stream_retired_t *retired = &streamer->retired[streamer->num_retired++];
+    retired->residency = texture->resident;
+    retired->last_frame = frame;
+  }
+  texture->resident = *pending;
+  texture->state = STREAM_IDLE;
+  LOG_DEBUG_INFO("Streamed texture levels %d-%d resident", pending->base, texture->num_levels - 1);
+}
+
+// The configured budget, or less if VK_EXT_memory_budget says other allocations on the heap,
+// including other processes', leave less than that
+VkDeviceSize stream_budget(const streamer_t *streamer) {
+  VkDeviceSize budget = streamer->configured_budget;
+  if (streamer->memory_budget) {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT };
+    VkPhysicalDeviceMemoryProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2 };
+    properties2.pNext = &budget_properties;
+    vkGetPhysicalDeviceMemoryProperties2(streamer->physical_device, &properties2);
+    VkDeviceSize usage = budget_properties.heapUsage[streamer->heap],
+                 others = usage > streamer->resident_size ? usage - streamer->resident_size : 0,
+                 heap_budget = budget_properties.heapBudget[streamer->heap],
+                 available = heap_budget > others ? heap_budget - others : 0;
+    if (available < budget)
+      budget = available;
+  }
+  return budget;
+}
+
+// Targets start at the requested levels, then the finest level of any texture is evicted until
+// they fit. The always resident tails are never evicted
+void stream_fit_budget(streamer_t *streamer) {
+  VkDeviceSize total = 0;
+  for (uint32_t i = 0; i < streamer->num_textures; i++) {
+    stream_texture_t *texture = &streamer->textures[i];
+    texture->target = texture->requested;
+    total += stream_range_size(texture, texture->target);
+  }
+  while (total > streamer->budget) {
+    stream_texture_t *finest = NULL;
+    VkDeviceSize finest_size = 0;
+    for (uint32_t i = 0; i < streamer->num_textures; i++) {
+      stream_texture_t *texture = &streamer->textures[i];
+      if (texture->target >= texture->tail)
+        continue;
+      VkDeviceSize size = stream_range_size(texture, texture->target) - stream_range_size(texture, texture->target + 1);
+      if (size > finest_size) {
+        finest = texture;
+        finest_size = size;
+      }
+    }
+    if (!finest)
+      break;
+    finest->target++;
+    total -= finest_size;
+  }
+}
+
+void stream_init(streamer_t *streamer, VkDevice device, VkPhysicalDevice physical_device, VkQueue queue,
+                 uint32_t queue_family_index, task_pool_t *task_pool, VkFormat format, bool bindless,
+                 bool memory_budget, VkDeviceSize budget) {
+  memset(streamer, 0, sizeof (streamer_t));
+  streamer->device = device;
+  streamer->physical_device = physical_device;
+  streamer->queue = queue;
+  streamer->task_pool = task_pool;
+  streamer->format = format;
+  streamer->bindless = bindless;
+  streamer->memory_budget = memory_budget;
+  streamer->configured_budget = budget;
+  streamer->budget = budget;
+  streamer->retired_capacity = STREAM_RETIRED_CAPACITY;
+  streamer->retired = halloc_type(stream_retired_t, streamer->retired_capacity);
+
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+  for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+    if (FLAGGED(memory_properties.memoryTypes[i].propertyFlags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+      streamer->heap = memory_properties.memoryTypes[i].heapIndex;
+      break;
+    }
+
+  VkCommandPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = queue_family_index;
+  VK_CALL(vkCreateCommandPool(device, &pool_info, NULL, &streamer->command_pool));
+}
+
+// Copies the image's pixels and uploads its tail, waiting for that to complete. Returns the
+// texture's id, or UINT32_MAX if the streamer is full
+uint32_t stream_add_texture(streamer_t *streamer, const image_t *image, VkSampler sampler) {
+  if (streamer->num_textures == STREAM_MAX_TEXTURES)
+    return UINT32_MAX;
+  uint32_t id = streamer->num_textures++;
+  stream_texture_t *texture = &streamer->textures[id];
+  memset(texture, 0, sizeof (stream_texture_t));
+  texture->width = image->width;
+  texture->height = image->height;
+  texture->sampler = sampler;
+  texture->resident.slot = UINT32_MAX;
+  texture->pixels = halloc((size_t)image->width * image->height * 4);
+  for (uint32_t y = 0; y < image->height; y++) {
+    const byte *src = &image->data[y * image->byte_width];
+    byte *dst = &texture->pixels[(size_t)y * image->width * 4];
+    if (image->bpp == 24) {
+      for (uint32_t x = 0; x < image->width; x++, src += 3, dst += 4) {
+        memcpy(dst, src, 3);
+        dst[3] = 0xff; // Alpha = opaque
+      }
+    }
+    else
+      memcpy(dst, src, (size_t)image->width * 4);
+  }
+
+  uint32_t size = image->width > image->height ? image->width : image->height;
+  while (texture->num_levels < STREAM_MAX_LEVELS && size >> texture->num_levels)
+    texture->num_levels++;
+  while (texture->tail + 1 < texture->num_levels &&
+         (image->width >> texture->tail > STREAM_TAIL_SIZE || image->height >> texture->tail > STREAM_TAIL_SIZE))
+    texture->tail++;
+  texture->requested = texture->tail;
+  texture->target = texture->tail;
+
+  VkCommandBufferAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+  allocate_info.commandPool = streamer->command_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  VK_CALL(vkAllocateCommandBuffers(streamer->device, &allocate_info, &texture->command_buffer));
+  VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+  VK_CALL(vkCreateFence(streamer->device, &fence_info, NULL, &texture->fence));
+
+  stream_begin(streamer, texture, texture->tail, false);
+  stream_submit(streamer, texture);
+  VK_CALL(vkWaitForFences(streamer->device, 1, &texture->fence, VK_TRUE, UINT64_MAX));
+  stream_finish(streamer, texture, 0);
+  LOG_DEBUG_INFO("Added streamed texture %d: %dx%d, %d levels, tail from level %d",
+                 id, image->width, image->height, texture->num_levels, texture->tail);
+  return id;
+}
+
+// Requests the levels needed to draw the texture at most size pixels across
+void stream_request(streamer_t *streamer, uint32_t id, float size) {
+  stream_texture_t *texture = &streamer->textures[id];
+  uint32_t texels = texture->width > texture->height ? texture->width : texture->height;
+  uint32_t level = 0;
+  while (level < texture->tail && (float)(texels >> (level + 1)) >= size)
+    level++;
+  texture->requested = level;
+}
+
+// Called once per frame after the frame's fence has been waited on. Completes finished loads
+// and uploads, releases images no frame in flight can sample, and starts loading or evicting
+// levels to meet the requests within the budget. Returns whether any texture's view changed
+bool stream_update(streamer_t *streamer, uint64_t frame, uint32_t frame_lag) {
+  bool changed = false;
+  for (uint32_t i = 0; i < streamer->num_textures; i++) {
+    stream_texture_t *texture = &streamer->textures[i];
+    if (texture->state == STREAM_LOADING && InterlockedCompareExchange(&texture->loaded, 0, 0))
+      stream_submit(streamer, texture);
+    else if (texture->state == STREAM_UPLOADING && vkGetFenceStatus(streamer->device, texture->fence) == VK_SUCCESS) {
+      stream_finish(streamer, texture, frame);
+      changed = true;
+    }
+  }
+  stream_release_retired(streamer, frame, frame_lag);
+
+  streamer->budget = stream_budget(streamer);
+  stream_fit_budget(streamer);
+  streamer->requested_levels = 0;
+  streamer->resident_levels = 0;
+  for (uint32_t i = 0; i < streamer->num_textures; i++) {
+    stream_texture_t *texture = &streamer->textures[i];
+    if (texture->state == STREAM_IDLE && texture->target != texture->resident.base) {
+      if (texture->target < texture->resident.base)
+        streamer->num_loads++;
+      else
+        streamer->num_evictions++;
+      stream_begin(streamer, texture, texture->target, true);
+    }
+    streamer->requested_levels += texture->num_levels - texture->requested;
+    streamer->resident_levels += texture->num_levels - texture->resident.base;
+  }
+  return changed;
+}
+
+VkImageView stream_view(const streamer_t *streamer, uint32_t id) {
+  return streamer->textures[id].resident.view;
+}
+
+uint32_t stream_slot(const streamer_t *streamer, uint32_t id) {
+  return streamer->textures[id].resident.slot;
+}
+
+// The device must be idle
+void stream_destroy(streamer_t *streamer) {
+  for (uint32_t i = 0; i < streamer->num_textures; i++) {
+    stream_texture_t *texture = &streamer->textures[i];
+    wait_task_group(streamer->task_pool, &texture->group);
+    if (texture->state != STREAM_IDLE) {
+      vkUnmapMemory(streamer->device, texture->staging_memory);
+      vkDestroyBuffer(streamer->device, texture->staging, NULL);
+      free_device_memory(texture->staging_memory);
+      stream_destroy_residency(streamer, &texture->pending);
+    }
+    stream_destroy_residency(streamer, &texture->resident);
+    vkDestroyFence(streamer->device, texture->fence, NULL);
+    hfree(texture->pixels);
+  }
+  stream_release_retired(streamer, UINT64_MAX, 0);
+  hfree(streamer->retired);
+  vkDestroyCommandPool(streamer->device, streamer->command_pool, NULL);
+  memset(streamer, 0, sizeof (streamer_t));
+}
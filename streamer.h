@@ -0,0 +1,95 @@
+#pragma once
+
+#include <windows.h>
+#include <vulkan/vulkan.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "image.h"
+#include "tasks.h"
+
+#define STREAM_MAX_TEXTURES 64
+#define STREAM_MAX_LEVELS 16 // Mip levels, enough for 32768 texel textures
+#define STREAM_RETIRED_CAPACITY 16 // Initial, doubled as needed
+#define STREAM_TAIL_SIZE 64 // Levels no larger than this on either side are always resident
+
+typedef enum {
+  STREAM_IDLE,
+  STREAM_LOADING, // Staging data is being written on the task pool
+  STREAM_UPLOADING // Copies submitted, waiting on the fence
+} STREAM_STATE;
+
+// An image holding levels [base, num_levels) of a texture's mip chain
+typedef struct {
+  VkImage image;
+  VkDeviceMemory memory;
+  VkImageView view;
+  VkDeviceSize size;
+  uint32_t base;
+  uint32_t slot; // In the bindless texture array, or UINT32_MAX
+} stream_residency_t;
+
+typedef struct {
+  byte *pixels; // RGBA8 source in system memory, the finest level
+  uint32_t width;
+  uint32_t height;
+  uint32_t num_levels;
+  uint32_t tail; // Finest level of the always resident tail
+  VkSampler sampler;
+  uint32_t requested; // Finest level needed for the texture's projected screen size
+  uint32_t target; // requested, or coarser to fit the budget
+  stream_residency_t resident;
+  STREAM_STATE state;
+  stream_residency_t pending; // Being loaded or uploaded
+  VkBuffer staging;
+  VkDeviceMemory staging_memory;
+  byte *staging_data;
+  volatile LONG loaded; // Set by the load task once the staging data is written
+  task_group_t group;
+  VkCommandBuffer command_buffer;
+  VkFence fence;
+} stream_texture_t;
+
+// Replaced residency, destroyed once the frames that may sample it have completed
+typedef struct {
+  stream_residency_t residency;
+  uint64_t last_frame;
+} stream_retired_t;
+
+// Keeps each texture's mip levels resident down to those its projected screen size needs, within
+// a device memory budget. Finer levels are loaded on the task pool and uploaded into a new image
+// that replaces the old one once the copies complete; over budget, the finest levels of all
+// textures are evicted first. Levels are always re-uploaded from system memory rather than copied
+// from the replaced image, so that can keep being sampled in its read-only layout meanwhile
+typedef struct {
+  VkDevice device;
+  VkPhysicalDevice physical_device;
+  VkQueue queue;
+  VkCommandPool command_pool;
+  task_pool_t *task_pool;
+  VkFormat format;
+  bool bindless; // Register each residency's view with register_texture
+  bool memory_budget; // VK_EXT_memory_budget is enabled
+  uint32_t heap; // Device local heap the images are allocated from
+  VkDeviceSize configured_budget;
+  stream_texture_t textures[STREAM_MAX_TEXTURES];
+  uint32_t num_textures;
+  stream_retired_t *retired;
+  uint32_t num_retired;
+  uint32_t retired_capacity;
+  // Metrics, updated by stream_update
+  VkDeviceSize budget; // configured_budget, less what other allocations leave of the heap's budget
+  VkDeviceSize resident_size; // Including pending and retired images
+  uint32_t requested_levels; // Over all textures
+  uint32_t resident_levels;
+  uint32_t num_loads;
+  uint32_t num_evictions;
+} streamer_t;
+
+void stream_init(streamer_t *, VkDevice, VkPhysicalDevice, VkQueue, uint32_t, task_pool_t *,
+                 VkFormat, bool, bool, VkDeviceSize);
+uint32_t stream_add_texture(streamer_t *, const image_t *, VkSampler);
+void stream_request(streamer_t *, uint32_t, float);
+bool stream_update(streamer_t *, uint64_t, uint32_t);
+VkImageView stream_view(const streamer_t *, uint32_t);
+uint32_t stream_slot(const streamer_t *, uint32_t);
+void stream_destroy(streamer_t *);
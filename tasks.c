@@ -0,0 +1,110 @@
+#include "tasks.h"
+#include "heap.h"
+#include "log.h"
+
+DWORD WINAPI worker_thread(LPVOID param) {
+  task_pool_t *pool = (task_pool_t *)param;
+  task_t task;
+  EnterCriticalSection(&pool->lock);
+  for (;;) {
+    while (!pool->count && !pool->stopping)
+      SleepConditionVariableCS(&pool->task_available, &pool->lock, INFINITE);
+    if (!pool->count)
+      break; // Stopping and queue drained
+    task = pool->queue[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+    LeaveCriticalSection(&pool->lock);
+
+    task.func(task.data);
+
+    EnterCriticalSection(&pool->lock);
+    bool group_done = task.group && !--task.group->pending;
+    if (!--pool->pending || group_done)
+      WakeAllConditionVariable(&pool->all_done);
+  }
+  LeaveCriticalSection(&pool->lock);
+  return 0;
+}
+
+// One worker per logical processor, leaving one for the main thread
+uint32_t num_worker_threads() {
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  return system_info.dwNumberOfProcessors > 1 ? system_info.dwNumberOfProcessors - 1 : 1;
+}
+
+void create_task_pool(task_pool_t *pool, uint32_t num_threads) {
+  pool->num_threads = num_threads;
+  pool->threads = halloc_type(HANDLE, num_threads);
+  pool->capacity = TASK_QUEUE_SIZE;
+  pool->queue = halloc_type(task_t, pool->capacity);
+  pool->head = 0;
+  pool->count = 0;
+  pool->pending = 0;
+  pool->stopping = false;
+  InitializeCriticalSection(&pool->lock);
+  InitializeConditionVariable(&pool->task_available);
+  InitializeConditionVariable(&pool->all_done);
+  for (uint32_t i = 0; i < num_threads; i++)
+    pool->threads[i] = CreateThread(NULL, 0, worker_thread, pool, 0, NULL);
+  LOG_DEBUG_INFO("Created task pool with %d worker threads", num_threads);
+}
+
+void submit_task(task_pool_t *pool, task_func_t func, void *data) {
+  submit_group_task(pool, NULL, func, data);
+}
+
+void submit_group_task(task_pool_t *pool, task_group_t *group, task_func_t func, void *data) {
+  EnterCriticalSection(&pool->lock);
+  if (pool->count == pool->capacity) {
+    // Unwrap the ring into a queue twice the size
+    task_t *queue = halloc_type(task_t, pool->capacity * 2);
+    for (uint32_t i = 0; i < pool->count; i++)
+      queue[i] = pool->queue[(pool->head + i) % pool->capacity];
+    hfree(pool->queue);
+    pool->queue = queue;
+    pool->head = 0;
+    pool->capacity *= 2;
+  }
+  task_t *task = &pool->queue[(pool->head + pool->count) % pool->capacity];
+  task->func = func;
+  task->data = data;
+  task->group = group;
+  if (group)
+    group->pending++;
+  pool->count++;
+  pool->pending++;
+  LeaveCriticalSection(&pool->lock);
+  WakeConditionVariable(&pool->task_available);
+}
+
+void wait_tasks(task_pool_t *pool) {
+  EnterCriticalSection(&pool->lock);
+  while (pool->pending)
+    SleepConditionVariableCS(&pool->all_done, &pool->lock, INFINITE);
+  LeaveCriticalSection(&pool->lock);
+}
+
+// Wait for just the group's tasks, leaving the rest of the pool running
+void wait_task_group(task_pool_t *pool, task_group_t *group) {
+  EnterCriticalSection(&pool->lock);
+  while (group->pending)
+    SleepConditionVariableCS(&pool->all_done, &pool->lock, INFINITE);
+  LeaveCriticalSection(&pool->lock);
+}
+
+void destroy_task_pool(task_pool_t *pool) {
+  EnterCriticalSection(&pool->lock);
+  pool->stopping = true;
+  LeaveCriticalSection(&pool->lock);
+  WakeAllConditionVariable(&pool->task_available);
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    WaitForSingleObject(pool->threads[i], INFINITE);
+    CloseHandle(pool->threads[i]);
+  }
+  DeleteCriticalSection(&pool->lock);
+  hfree(pool->threads);
+  hfree(pool->queue);
+  LOG_DEBUG_INFO("Destroyed task pool with %d worker threads", pool->num_threads);
+}
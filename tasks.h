@@ -0,0 +1,42 @@
+#pragma once
+
+#include <windows.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TASK_QUEUE_SIZE 64 // Initial queue capacity, grows as required
+
+typedef void (*task_func_t)(void *);
+
+// Tasks submitted together that can be waited on independently of the rest of the pool
+typedef struct {
+  uint32_t pending; // Guarded by the pool lock
+} task_group_t;
+
+typedef struct {
+  task_func_t func;
+  void *data;
+  task_group_t *group;
+} task_t;
+
+typedef struct {
+  HANDLE *threads;
+  uint32_t num_threads;
+  task_t *queue;
+  uint32_t capacity;
+  uint32_t head;
+  uint32_t count;
+  uint32_t pending; // Queued plus running
+  bool stopping;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE task_available;
+  CONDITION_VARIABLE all_done;
+} task_pool_t;
+
+uint32_t num_worker_threads();
+void create_task_pool(task_pool_t *, uint32_t);
+void submit_task(task_pool_t *, task_func_t, void *);
+void submit_group_task(task_pool_t *, task_group_t *, task_func_t, void *);
+void wait_tasks(task_pool_t *);
+void wait_task_group(task_pool_t *, task_group_t *);
+void destroy_task_pool(task_pool_t *);
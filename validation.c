@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include "validation.h"
+#include "heap.h"
+#include "log.h"
+
+// Messages without an id number, such as the loader's, are told apart by their text
+uint32_t validation_message_key(const VkDebugUtilsMessengerCallbackDataEXT *data) {
+  uint32_t key = (uint32_t)data->messageIdNumber;
+  if (!key && data->pMessage) {
+    key = 2166136261u; // FNV-1a
+    for (const char *c = data->pMessage; *c; c++)
+      key = (key ^ (uint8_t)*c) * 16777619u;
+  }
+  return key ? key : 1;
+}
+
+validation_message_t *find_validation_message(validation_message_t *messages, uint32_t capacity, uint32_t key) {
+  uint32_t i = key * 2654435769u & (capacity - 1);
+  while (messages[i].key && messages[i].key != key)
+    i = (i + 1) & (capacity - 1);
+  return &messages[i];
+}
+
+// Kept at most half full, so probes stay short
+void grow_validation_filter(validation_filter_t *filter) {
+  uint32_t capacity = filter->capacity * 2;
+  validation_message_t *messages = halloc_clear_type(validation_message_t, capacity);
+  for (uint32_t i = 0; i < filter->capacity; i++)
+    if (filter->messages[i].key)
+      *find_validation_message(messages, capacity, filter->messages[i].key) = filter->messages[i];
+  hfree(filter->messages);
+  filter->messages = messages;
+  filter->capacity = capacity;
+}
+
+void init_validation_filter(validation_filter_t *filter, VkDebugUtilsMessageSeverityFlagBitsEXT min_severity) {
+  filter->capacity = VALIDATION_FILTER_CAPACITY;
+  filter->messages = halloc_clear_type(validation_message_t, filter->capacity);
+  filter->num_messages = 0;
+  filter->min_severity = min_severity;
+  QueryPerformanceCounter(&filter->last_summary);
+  InitializeCriticalSection(&filter->lock);
+}
+
+// Returns how many times the message has now been seen, or 0 if it's below the minimum severity.
+// Only the first VALIDATION_REPEATS copies are worth logging. The name it's counted under is
+// copied to name, VALIDATION_NAME_STRLEN characters, since the table may move once unlocked
+uint32_t count_validation_message(validation_filter_t *filter, VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+                                  const VkDebugUtilsMessengerCallbackDataEXT *data, char *name) {
+  if (severity < filter->min_severity)
+    return 0;
+  uint32_t key = validation_message_key(data);
+  EnterCriticalSection(&filter->lock);
+  if ((filter->num_messages + 1) * 2 > filter->capacity)
+    grow_validation_filter(filter);
+  validation_message_t *message = find_validation_message(filter->messages, filter->capacity, key);
+  if (!message->key) {
+    message->key = key;
+    // pMessageIdName is optional, so fall back to the id number
+    if (data->pMessageIdName && data->pMessageIdName[0])
+      strncpy_s(message->name, sizeof message->name, data->pMessageIdName, _TRUNCATE);
+    else
+      snprintf(message->name, sizeof message->name, "0x%08x", (uint32_t)data->messageIdNumber);
+    filter->num_messages++;
+  }
+  if (severity > message->severity)
+    message->severity = severity;
+  uint32_t count = ++message->count;
+  if (count > VALIDATION_REPEATS)
+    message->suppressed++;
+  memcpy(name, message->name, sizeof message->name);
+  LeaveCriticalSection(&filter->lock);
+  return count;
+}
+
+// Logs the copies counted since the last summary, at most every VALIDATION_SUMMARY_MS unless forced
+void summarize_validation_messages(validation_filter_t *filter, bool force) {
+  LARGE_INTEGER now, frequency;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&frequency);
+  if (!force && (now.QuadPart - filter->last_summary.QuadPart) * 1000 < VALIDATION_SUMMARY_MS * frequency.QuadPart)
+    return;
+  EnterCriticalSection(&filter->lock);
+  filter->last_summary = now;
+  for (uint32_t i = 0; i < filter->capacity; i++) {
+    validation_message_t *message = &filter->messages[i];
+    if (!message->suppressed)
+      continue;
+    if (message->severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT)
+      log_console_warning("Validation message %s (0x%08x): %d more copies, %d in total",
+                          message->name, message->key, message->suppressed, message->count);
+    else
+      log_console_info("Validation message %s (0x%08x): %d more copies, %d in total",
+                       message->name, message->key, message->suppressed, message->count);
+    message->suppressed = 0;
+  }
+  LeaveCriticalSection(&filter->lock);
+}
+
+const char *validation_severity_name(VkDebugUtilsMessageSeverityFlagBitsEXT severity) {
+  switch (severity) {
+    case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT:
+      return "verbose";
+    case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT:
+      return "info";
+    case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT:
+      return "warning";
+    case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT:
+      return "error";
+    default:
+      return "unknown";
+  }
+}
+
+void destroy_validation_filter(validation_filter_t *filter) {
+  summarize_validation_messages(filter, true);
+  DeleteCriticalSection(&filter->lock);
+  hfree(filter->messages);
+  filter->messages = NULL;
+  filter->capacity = 0;
+}
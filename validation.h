@@ -0,0 +1,37 @@
+#pragma once
+
+#include <windows.h>
+#include <vulkan/vulkan.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VALIDATION_REPEATS 3 // Copies of each message logged before it's only counted
+#define VALIDATION_SUMMARY_MS 5000 // Between summaries of the copies counted since the last
+#define VALIDATION_FILTER_CAPACITY 64 // Initial distinct messages, grows as required
+#define VALIDATION_NAME_STRLEN 64
+
+typedef struct {
+  uint32_t key; // messageIdNumber, or a hash of the text if that's 0; 0 if the slot is empty
+  char name[VALIDATION_NAME_STRLEN]; // messageIdName truncated, or messageIdNumber in hex without one
+  VkDebugUtilsMessageSeverityFlagBitsEXT severity;
+  uint32_t count;
+  uint32_t suppressed; // Copies counted since the last summary
+} validation_message_t;
+
+// Counts debug messenger messages by id, so a message repeated every frame is logged a few
+// times and then summarized periodically rather than formatted and written each time
+typedef struct {
+  validation_message_t *messages; // Open addressed on key
+  uint32_t capacity; // A power of 2
+  uint32_t num_messages;
+  volatile VkDebugUtilsMessageSeverityFlagBitsEXT min_severity; // Lower severities are dropped uncounted
+  LARGE_INTEGER last_summary;
+  CRITICAL_SECTION lock;
+} validation_filter_t;
+
+void init_validation_filter(validation_filter_t *, VkDebugUtilsMessageSeverityFlagBitsEXT);
+uint32_t count_validation_message(validation_filter_t *, VkDebugUtilsMessageSeverityFlagBitsEXT,
+                                  const VkDebugUtilsMessengerCallbackDataEXT *, char *);
+void summarize_validation_messages(validation_filter_t *, bool);
+const char *validation_severity_name(VkDebugUtilsMessageSeverityFlagBitsEXT);
+void destroy_validation_filter(validation_filter_t *);
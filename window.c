@@ -49,6 +49,12 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
         case 'S':
           window->on_move(0, -1);
           break;
+        case 'M':
+          window->on_report();
+          break;
+        case 'V':
+          window->on_validation();
+          break;
       }
       break;
     default:
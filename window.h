@@ -22,6 +22,8 @@ typedef struct window_s {
   void (*on_size)();
   void (*on_paint)();
   void (*on_move)(int, int);
+  void (*on_report)();
+  void (*on_validation)();
 } window_t;
 
 WIN_ERROR create_window(window_t *);